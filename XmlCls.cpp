@@ -1,6 +1,24 @@
 #include "XmlCls.h"
 #include "base64.h"
 
+#include <libxml/xmlsave.h>
+#include <openssl/evp.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <deque>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+
 /**
  * @brief Convert the current libxml2 global/thread error into XmlCls error state.
  *
@@ -27,6 +45,300 @@ Error* SetXmlError(const std::string& context) {
     return err;
 }
 
+/**
+ * @brief Recover the canonical XmlDoc stored in xmlDoc::_private.
+ */
+static XmlDoc* OwnerOf(xmlDocPtr doc)
+{
+    return doc ? static_cast<XmlDoc*>(doc->_private) : nullptr;
+}
+
+/**
+ * @brief Take the owning XmlDoc's mutation lock in shared mode.
+ *
+ * Mutations hold the lock for their whole DOM update so that a concurrent
+ * SaveAsync() snapshot never observes a half-applied change.
+ */
+static void InstallNodeInfoHooks();
+
+static std::shared_lock<std::shared_mutex> MutationLock(xmlDocPtr doc)
+{
+    InstallNodeInfoHooks();     // mutations may free nodes carrying XmlNodeInfo
+
+    XmlDoc* owner = OwnerOf(doc);
+    if (!owner) return {};
+    return std::shared_lock<std::shared_mutex>(owner->mutation_lock);
+}
+
+/* -------------------------------------------------------------------------
+ * Per-node side storage
+ *
+ * XmlCls hangs an XmlNodeInfo off xmlNode::_private of element nodes in the
+ * documents it wraps.  The structure is created on demand and released by a
+ * libxml2 deregistration callback when the node itself is freed, so it can
+ * never outlive its xmlNodePtr or be inherited by a later reuse of the address.
+ * ------------------------------------------------------------------------- */
+
+struct XmlNodeInfo {
+    uint64_t hash = 0;           ///< Merkle content hash of the element subtree.
+    bool hash_valid = false;     ///< False once the subtree changed after @ref hash was computed.
+    bool jid_valid = false;      ///< True once @ref jid holds the node's JID attribute value.
+    uint64_t jid = 0;            ///< Cached JID; see ReadJID().
+};
+
+static void FreeNodeInfo(xmlNodePtr node)
+{
+    if (node->type != XML_ELEMENT_NODE || !node->_private) return;
+
+    // Only documents wrapped by an XmlDoc carry XmlCls node storage.
+    if (!node->doc || !node->doc->_private) return;
+
+    delete static_cast<XmlNodeInfo*>(node->_private);
+    node->_private = nullptr;
+}
+
+/**
+ * @brief Register FreeNodeInfo() for the calling thread and for new threads.
+ *
+ * libxml2 keeps the deregistration callback in per-thread global state.
+ */
+static void InstallNodeInfoHooks()
+{
+    static std::once_flag once;
+    std::call_once(once, [] { xmlThrDefDeregisterNodeDefault(FreeNodeInfo); });
+
+    thread_local bool installed = false;
+    if (!installed) {
+        xmlDeregisterNodeDefault(FreeNodeInfo);
+        installed = true;
+    }
+}
+
+static XmlNodeInfo* NodeInfo(xmlNodePtr node)
+{
+    return static_cast<XmlNodeInfo*>(node->_private);
+}
+
+static XmlNodeInfo& NodeInfoFor(xmlNodePtr node)
+{
+    if (!node->_private) {
+        InstallNodeInfoHooks();
+        node->_private = new XmlNodeInfo();
+    }
+    return *NodeInfo(node);
+}
+
+/* -------------------------------------------------------------------------
+ * Merkle content hashing
+ *
+ * An element hash combines its namespace and name, an order-independent sum
+ * of its attributes, and the ordered hashes of its children.  JID attributes
+ * are journal identity rather than content and are excluded, so assigning
+ * JIDs never changes a hash.  Element hashes are cached in XmlNodeInfo and
+ * invalidated along the ancestor path by every XmlCls mutation.
+ * ------------------------------------------------------------------------- */
+
+static const uint64_t kHashSeed = 0xcbf29ce484222325ULL;
+
+static uint64_t HashBytes(uint64_t h, const xmlChar* s)
+{
+    if (s) for (; *s; ++s) { h ^= *s; h *= 0x100000001b3ULL; }
+    return h;
+}
+
+static uint64_t HashMix(uint64_t h, uint64_t v)
+{
+    uint64_t z = h ^ (v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static bool IsJIDAttr(xmlAttrPtr attr)
+{
+    return !attr->ns && xmlStrEqual(attr->name, BAD_CAST "JID");
+}
+
+static uint64_t AttrHash(xmlNodePtr node)
+{
+    uint64_t sum = 0;
+
+    for (xmlAttrPtr a = node->properties; a; a = a->next) {
+        if (IsJIDAttr(a)) continue;
+
+        uint64_t name = HashMix(HashBytes(kHashSeed, a->ns ? a->ns->href : nullptr),
+                                HashBytes(kHashSeed, a->name));
+        uint64_t value = kHashSeed;
+        for (xmlNodePtr t = a->children; t; t = t->next) value = HashBytes(value, t->content);
+
+        sum += HashMix(name, value);
+    }
+    return sum;
+}
+
+static uint64_t LeafHash(xmlNodePtr node)
+{
+    uint64_t h = HashMix(kHashSeed, node->type);
+    if (node->type == XML_PI_NODE || node->type == XML_ENTITY_REF_NODE)
+        h = HashMix(h, HashBytes(kHashSeed, node->name));
+    return HashMix(h, HashBytes(kHashSeed, node->content));
+}
+
+/**
+ * @brief Hash of an element's name and attributes, the start of its subtree hash.
+ */
+static uint64_t ElementHash(xmlNodePtr node)
+{
+    uint64_t h = HashMix(HashBytes(kHashSeed, node->ns ? node->ns->href : nullptr),
+                         HashBytes(kHashSeed, node->name));
+    return HashMix(h, AttrHash(node));
+}
+
+/**
+ * @brief Merkle hash of @p node's subtree.
+ * @param cache Store the hashes computed for elements in their XmlNodeInfo.
+ *
+ * Hashes already cached are used either way; @p cache = false avoids
+ * allocating side storage for a subtree hashed only once.
+ */
+static uint64_t SubtreeHash(xmlNodePtr node, bool cache = true)
+{
+    if (node->type != XML_ELEMENT_NODE) return LeafHash(node);
+
+    XmlNodeInfo* info = cache ? &NodeInfoFor(node) : NodeInfo(node);
+    if (info && info->hash_valid) return info->hash;
+
+    uint64_t h = ElementHash(node);
+    for (xmlNodePtr c = node->children; c; c = c->next)
+        h = HashMix(h, SubtreeHash(c, cache));
+
+    if (cache) {
+        info->hash = h;
+        info->hash_valid = true;
+    }
+    return h;
+}
+
+/**
+ * @brief Invalidate cached hashes from @p node up to the root.
+ *
+ * A valid hash implies valid hashes throughout its subtree, so the walk stops
+ * at the first element that has no valid hash.
+ */
+static void InvalidateHash(xmlNodePtr node)
+{
+    for (; node && node->type == XML_ELEMENT_NODE; node = node->parent) {
+        XmlNodeInfo* info = NodeInfo(node);
+        if (!info || !info->hash_valid) return;
+        info->hash_valid = false;
+    }
+}
+
+/**
+ * @brief Record a successful mutation of @p container's attributes or children.
+ *
+ * Invalidates the cached hashes above the change and marks the owning XmlDoc
+ * dirty.  For insertions, removals, and replacements @p container is the
+ * parent of the affected node.
+ */
+static void Mutated(xmlNodePtr container)
+{
+    if (!container) return;
+    InvalidateHash(container);
+    if (XmlDoc* owner = OwnerOf(container->doc)) owner->MarkDirty();
+}
+
+/* -------------------------------------------------------------------------
+ * Canonical XML
+ *
+ * C14NWrite() runs the libxml2 canonicalizer into an I/O-callback output
+ * buffer, so canonical text reaches the sink in blocks as it is produced and
+ * is never held whole.  A subtree is selected as a C14N document subset
+ * through a visibility callback.
+ * ------------------------------------------------------------------------- */
+
+typedef std::function<bool(const char*, size_t)> C14NSink;
+
+static int C14NSinkWrite(void* context, const char* buffer, int len)
+{
+    return (*static_cast<C14NSink*>(context))(buffer, len) ? len : -1;
+}
+
+static int C14NInSubtree(void* apex, xmlNodePtr node, xmlNodePtr parent)
+{
+    // Namespace nodes are xmlNs structures; judge them by their element.
+    xmlNodePtr n = (node && node->type != XML_NAMESPACE_DECL) ? node : parent;
+
+    for (; n; n = n->parent)
+        if (n == apex) return 1;
+    return 0;
+}
+
+/**
+ * @brief Canonicalize a document, or the subtree at @p apex, into @p sink.
+ */
+static ErrorPtr C14NWrite(xmlDocPtr doc, xmlNodePtr apex, const C14NOptions& options, C14NSink sink)
+{
+    if (!doc) return new Error{lvl::ERR, "Cannot canonicalize: no document", ""};
+
+    std::vector<xmlChar*> prefixes;
+    for (const std::string& prefix : options.inclusive_prefixes)
+        prefixes.push_back((xmlChar*)prefix.c_str());
+    prefixes.push_back(nullptr);
+
+    bool use_prefixes = options.mode == XML_C14N_EXCLUSIVE_1_0 && !options.inclusive_prefixes.empty();
+
+    xmlOutputBufferPtr out = xmlOutputBufferCreateIO(C14NSinkWrite, nullptr, &sink, nullptr);
+    if (!out) return new Error{lvl::ERR, "Cannot create C14N output buffer", ""};
+
+    int written = xmlC14NExecute(doc, apex ? C14NInSubtree : nullptr, apex, options.mode,
+                                 use_prefixes ? prefixes.data() : nullptr, options.comments, out);
+    int closed = xmlOutputBufferClose(out);
+
+    if (written < 0 || closed < 0)
+        return SetXmlError(apex ? XmlNode(apex).GetPath() : std::string("C14N"));
+    return nullptr;
+}
+
+static std::string C14NText(xmlDocPtr doc, xmlNodePtr apex, const C14NOptions& options, ErrorPtr& err)
+{
+    std::string text;
+    err = C14NWrite(doc, apex, options, [&text](const char* buffer, size_t len) {
+        text.append(buffer, len);
+        return true;
+    });
+    return err ? std::string() : text;
+}
+
+static std::string C14NDigest(xmlDocPtr doc, xmlNodePtr apex, const C14NOptions& options, ErrorPtr& err)
+{
+    EVP_MD_CTX* md = EVP_MD_CTX_new();
+    if (!md || EVP_DigestInit_ex(md, EVP_sha256(), nullptr) != 1) {
+        EVP_MD_CTX_free(md);
+        err = new Error{lvl::ERR, "Cannot initialize SHA-256 digest", ""};
+        return {};
+    }
+
+    err = C14NWrite(doc, apex, options, [md](const char* buffer, size_t len) {
+        return EVP_DigestUpdate(md, buffer, len) == 1;
+    });
+
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int size = 0;
+    if (!err && EVP_DigestFinal_ex(md, digest, &size) != 1)
+        err = new Error{lvl::ERR, "Cannot finalize SHA-256 digest", ""};
+    EVP_MD_CTX_free(md);
+    if (err) return {};
+
+    std::string hex;
+    char byte[3];
+    for (unsigned int i = 0; i < size; ++i) {
+        std::snprintf(byte, sizeof(byte), "%02x", digest[i]);
+        hex += byte;
+    }
+    return hex;
+}
+
 XmlDoc::XmlDoc(const char *filename)
     : doc(xmlReadFile(filename, NULL, XML_PARSE_NOBLANKS))
 {
@@ -53,8 +365,10 @@ XmlDoc::XmlDoc(const std::string content)
 
 void XmlDoc::Save(const char* filename) {
     if (!doc || !filename) return;
+    const uint64_t saving = generation.load();
     bool rc = xmlSaveFormatFileEnc(filename, doc, "UTF-8", 1) >= 0;
     if (!rc) { err = SetXmlError(filename); return;}
+    saved_generation = saving;
     if (!doc->URL || strcmp((const char*)doc->URL, filename) != 0) {
         if (doc->URL) xmlFree((void*) doc->URL); 
         doc->URL = xmlStrdup(BAD_CAST filename);
@@ -69,6 +383,361 @@ void XmlDoc::Save() {
     Save(url);
 }
 
+/* -------------------------------------------------------------------------
+ * Parallel serialization
+ *
+ * ParallelXML() reproduces xmlDocDumpFormatMemory() output by serializing
+ * runs of root children concurrently.  Each run is temporarily relinked
+ * under a scratch element and saved with the document's own encoding and
+ * escaping, which keeps the children at indentation level 1; the scratch
+ * tags are then trimmed.  Everything outside the root's children is
+ * serialized once, with a placeholder comment standing in for them.
+ * ------------------------------------------------------------------------- */
+
+/**
+ * @brief True when the root's children can be serialized apart and stitched
+ *        back together byte for byte.
+ */
+static bool CanSplitRoot(xmlDocPtr doc, xmlNodePtr root)
+{
+    if (doc->type != XML_DOCUMENT_NODE) return false;
+
+    // The scratch tags and placeholder must encode as plain ASCII bytes.
+    switch (xmlParseCharEncoding((const char*)doc->encoding)) {
+    case XML_CHAR_ENCODING_NONE:
+    case XML_CHAR_ENCODING_UTF8:
+    case XML_CHAR_ENCODING_ASCII:
+    case XML_CHAR_ENCODING_8859_1: case XML_CHAR_ENCODING_8859_2:
+    case XML_CHAR_ENCODING_8859_3: case XML_CHAR_ENCODING_8859_4:
+    case XML_CHAR_ENCODING_8859_5: case XML_CHAR_ENCODING_8859_6:
+    case XML_CHAR_ENCODING_8859_7: case XML_CHAR_ENCODING_8859_8:
+    case XML_CHAR_ENCODING_8859_9:
+        break;
+    default:
+        return false;
+    }
+
+    // XHTML documents are written by a different libxml2 serializer.
+    xmlDtdPtr dtd = xmlGetIntSubset(doc);
+    if (dtd && xmlIsXHTML(dtd->SystemID, dtd->ExternalID) == 1) return false;
+
+    // Text beside the children turns formatting off for the whole level.
+    for (xmlNodePtr child = root->children; child; child = child->next)
+        if (child->type != XML_ELEMENT_NODE && child->type != XML_COMMENT_NODE && child->type != XML_PI_NODE)
+            return false;
+    return true;
+}
+
+std::string XmlDoc::ParallelXML(unsigned threads)
+{
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+    std::unique_lock<std::shared_mutex> exclusive(mutation_lock);
+
+    xmlNodePtr root = doc ? xmlDocGetRootElement(doc) : nullptr;
+    if (threads < 2 || !root || !root->children || root->children == root->last || !CanSplitRoot(doc, root))
+        return XML();
+
+    std::vector<xmlNodePtr> children;
+    for (xmlNodePtr child = root->children; child; child = child->next)
+        children.push_back(child);
+
+    // Several runs per thread so that uneven subtrees balance out.
+    size_t runs = std::min(children.size(), size_t(threads) * 4);
+    std::vector<xmlNodePtr> scratch(runs);
+    for (size_t r = 0; r < runs; ++r) {
+        size_t begin = children.size() * r / runs, end = children.size() * (r + 1) / runs;
+
+        scratch[r] = xmlNewDocNode(doc, nullptr, BAD_CAST "w", nullptr);
+        scratch[r]->children = children[begin];
+        scratch[r]->last = children[end - 1];
+        children[begin]->prev = nullptr;
+        children[end - 1]->next = nullptr;
+        for (size_t i = begin; i < end; ++i) children[i]->parent = scratch[r];
+    }
+
+    static thread_local std::mt19937_64 rng{std::random_device{}()};
+    char token[32];
+    std::snprintf(token, sizeof(token), "XmlCls-%016llx", static_cast<unsigned long long>(rng()));
+
+    xmlNodePtr placeholder = xmlNewDocComment(doc, BAD_CAST token);
+    placeholder->parent = root;
+    root->children = root->last = placeholder;
+
+    std::string frame = XML();
+
+    // libxml2 output settings are per thread; workers follow the caller's.
+    int indent = xmlIndentTreeOutput;
+    const char* indent_string = xmlTreeIndentString;
+    int no_empty = xmlSaveNoEmptyTags;
+
+    std::vector<std::string> parts(runs);
+    std::atomic<size_t> next{0};
+    std::atomic<bool> failed{false};
+
+    auto work = [&]() {
+        xmlIndentTreeOutput = indent;
+        xmlTreeIndentString = indent_string;
+        xmlSaveNoEmptyTags = no_empty;
+
+        for (size_t r; (r = next++) < runs; ) {
+            xmlBufferPtr buffer = xmlBufferCreate();
+            xmlSaveCtxtPtr save = xmlSaveToBuffer(buffer, (const char*)doc->encoding, XML_SAVE_FORMAT);
+            if (!save || xmlSaveTree(save, scratch[r]) < 0 || xmlSaveClose(save) < 0) failed = true;
+
+            // Trim the scratch element's "<w>\n" and "</w>".
+            std::string part((const char*)xmlBufferContent(buffer), xmlBufferLength(buffer));
+            if (part.size() >= 8 && part.compare(0, 4, "<w>\n") == 0 && part.compare(part.size() - 4, 4, "</w>") == 0)
+                parts[r] = part.substr(4, part.size() - 8);
+            else
+                failed = true;
+            xmlBufferFree(buffer);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < std::min<size_t>(threads, runs); ++t)
+        workers.emplace_back(work);
+    work();
+    for (std::thread& worker : workers)
+        worker.join();
+
+    // Restore the original child list.
+    root->children = children.front();
+    root->last = children.back();
+    for (size_t i = 0; i < children.size(); ++i) {
+        children[i]->parent = root;
+        children[i]->prev = i ? children[i - 1] : nullptr;
+        children[i]->next = i + 1 < children.size() ? children[i + 1] : nullptr;
+    }
+    for (xmlNodePtr s : scratch) {
+        s->children = s->last = nullptr;
+        xmlFreeNode(s);
+    }
+    placeholder->parent = nullptr;
+    xmlFreeNode(placeholder);
+
+    std::string marker = std::string("<!--") + token + "-->\n";
+    size_t at = frame.find(marker);
+    if (failed || at == std::string::npos)
+        return XML();
+
+    size_t line = frame.rfind('\n', at);
+    line = line == std::string::npos ? 0 : line + 1;
+
+    size_t size = line + (frame.size() - at - marker.size());
+    for (const std::string& part : parts) size += part.size();
+
+    std::string result;
+    result.reserve(size);
+    result.append(frame, 0, line);
+    for (const std::string& part : parts) result += part;
+    result.append(frame, at + marker.size(), std::string::npos);
+    return result;
+}
+
+/**
+ * @brief Background writer state for XmlDoc::SaveAsync().
+ *
+ * A single writer thread drains @ref pending in request order.  A snapshot
+ * queued while the writer is busy replaces the waiting one for the same
+ * file, so a burst of requests costs at most one additional write per file.
+ */
+struct XmlDoc::AsyncSave {
+    /// A snapshot waiting for the writer.
+    struct Pending {
+        std::string file;
+        xmlDocPtr snapshot;
+        uint64_t generation;                     ///< Owner generation captured with @ref snapshot.
+        std::promise<ErrorPtr> promise;
+        std::shared_future<ErrorPtr> future;
+    };
+
+    XmlDoc& owner;
+    std::mutex mtx;
+    std::thread writer;
+    bool running = false;
+
+    std::deque<Pending> pending;                 ///< Not yet taken by the writer; one per file.
+
+    AsyncSave(XmlDoc& o) : owner(o) {}
+
+    void Drain()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+
+        while (!pending.empty()) {
+            Pending next = std::move(pending.front());
+            pending.pop_front();
+
+            lock.unlock();
+
+            ErrorPtr result = nullptr;
+            if (xmlSaveFormatFileEnc(next.file.c_str(), next.snapshot, "UTF-8", 1) < 0)
+                result = SetXmlError(next.file);
+            else {
+                uint64_t saved = owner.saved_generation.load();
+                while (saved < next.generation && !owner.saved_generation.compare_exchange_weak(saved, next.generation)) {}
+            }
+            xmlFreeDoc(next.snapshot);
+            next.promise.set_value(result);
+
+            lock.lock();
+        }
+
+        running = false;
+    }
+};
+
+std::shared_future<ErrorPtr> XmlDoc::SaveAsync(const char* filename)
+{
+    std::promise<ErrorPtr> ready;
+
+    if (!doc || !filename) { ready.set_value(nullptr); return ready.get_future().share(); }
+
+    xmlDocPtr snapshot;
+    uint64_t snapshot_generation;
+    {
+        std::unique_lock<std::shared_mutex> exclusive(mutation_lock);
+        snapshot_generation = generation.load();
+        snapshot = xmlCopyDoc(doc, 1);
+    }
+    if (!snapshot) {
+        ready.set_value(new Error{lvl::ERR, "Could not snapshot document for background save", filename});
+        return ready.get_future().share();
+    }
+
+    if (!doc->URL || strcmp((const char*)doc->URL, filename) != 0) {
+        if (doc->URL) xmlFree((void*) doc->URL);
+        doc->URL = xmlStrdup(BAD_CAST filename);
+    }
+
+    if (!async_save) async_save = new AsyncSave(*this);
+    AsyncSave& state = *async_save;
+
+    std::lock_guard<std::mutex> lock(state.mtx);
+
+    auto waiting = std::find_if(state.pending.begin(), state.pending.end(),
+                                [filename](const AsyncSave::Pending& p) { return p.file == filename; });
+    if (waiting != state.pending.end()) {
+        xmlFreeDoc(waiting->snapshot);   // superseded by the newer snapshot of the same file
+        waiting->snapshot = snapshot;
+        waiting->generation = snapshot_generation;
+    } else {
+        AsyncSave::Pending request{filename, snapshot, snapshot_generation, std::promise<ErrorPtr>(), {}};
+        request.future = request.promise.get_future().share();
+        state.pending.push_back(std::move(request));
+        waiting = state.pending.end() - 1;
+    }
+    std::shared_future<ErrorPtr> result = waiting->future;
+
+    if (!state.running) {
+        if (state.writer.joinable()) state.writer.join();
+        state.running = true;
+        state.writer = std::thread(&AsyncSave::Drain, &state);
+    }
+
+    return result;
+}
+
+std::shared_future<ErrorPtr> XmlDoc::SaveAsync()
+{
+    const char* url = doc ? (const char*)doc->URL : nullptr;
+    if (!url || !*url) {
+        std::promise<ErrorPtr> ready;
+        ready.set_value(nullptr);
+        return ready.get_future().share();
+    }
+    return SaveAsync(url);
+}
+
+/**
+ * @brief Autosave worker state for XmlDoc::Autosave().
+ *
+ * MarkDirty() only counts the change and wakes the worker; the worker decides
+ * when the policy is satisfied and saves through SaveAsync(), waiting for each
+ * write so that changes made meanwhile are folded into the next one.
+ */
+struct XmlDoc::Autosaver {
+    using Clock = std::chrono::steady_clock;
+
+    XmlDoc& owner;
+    AutosavePolicy policy;
+
+    std::mutex mtx;
+    std::condition_variable wake;
+    std::thread worker;
+    bool stop = false;
+
+    unsigned unsaved = 0;                        ///< Changes since the last autosave began.
+    Clock::time_point last_change;
+
+    Autosaver(XmlDoc& o, AutosavePolicy p) : owner(o), policy(std::move(p)) {}
+
+    void Changed()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        ++unsaved;
+        last_change = Clock::now();
+        wake.notify_one();
+    }
+
+    void Run()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+
+        while (!stop) {
+            if (!unsaved) { wake.wait(lock); continue; }
+
+            bool due = policy.changes && unsaved >= policy.changes;
+
+            if (!due && policy.quiescence_ms) {
+                auto quiet_at = last_change + std::chrono::milliseconds(policy.quiescence_ms);
+                if (Clock::now() < quiet_at) { wake.wait_until(lock, quiet_at); continue; }
+                due = true;
+            }
+
+            if (!due) { wake.wait(lock); continue; }
+
+            unsaved = 0;
+            lock.unlock();
+            Save();
+            lock.lock();
+        }
+    }
+
+    void Save()
+    {
+        ErrorPtr result = owner.SaveAsync().get();
+        if (policy.report) policy.report(result);
+    }
+};
+
+void XmlDoc::MarkDirty()
+{
+    ++generation;
+    if (autosaver) autosaver->Changed();
+}
+
+void XmlDoc::Autosave(AutosavePolicy policy)
+{
+    if (autosaver) {
+        {
+            std::lock_guard<std::mutex> lock(autosaver->mtx);
+            autosaver->stop = true;
+            autosaver->wake.notify_one();
+        }
+        autosaver->worker.join();
+        delete autosaver;
+        autosaver = nullptr;
+    }
+
+    if (!policy.changes && !policy.quiescence_ms) return;
+
+    autosaver = new Autosaver(*this, std::move(policy));
+    autosaver->worker = std::thread(&Autosaver::Run, autosaver);
+}
+
 XmlDoc::~XmlDoc()
 {
     clear();
@@ -94,13 +763,53 @@ void XmlDoc::CreateJournal(const char* filename, std::string XML) {
     JRNL = new XmlJrnl(*this, XML);
 }
 
+void XmlDoc::OpenJournalWAL(const char* filename, WalOptions options) {
+    JournalWAL* log = new JournalWAL(filename, options);
+    if (log->err) { err = log->err; delete log; return; }
+
+    const bool fresh = log->records == 0;
+    if (fresh) {
+        CreateJournal(filename);
+    } else {
+        std::string xml = log->ExportXML();
+        if (log->err) { err = log->err; delete log; return; }
+        JRNL = new XmlJrnl(*this, xml);
+    }
+
+    if (!JRNL->doc || JRNL->err) {
+        err = JRNL->err;
+        delete JRNL;
+        JRNL = nullptr;
+        delete log;
+        return;
+    }
+
+    JRNL->AttachWAL(log, fresh);
+    if (JRNL->err) err = JRNL->err;
+}
+
 void XmlDoc::clear() {
+    if (autosaver) {
+        auto report = autosaver->policy.report;
+        Autosave(AutosavePolicy{});
+        if (IsDirty()) {
+            ErrorPtr result = SaveAsync().get();
+            if (report) report(result);
+        }
+    }
+    if (async_save) {
+        // The writer drains any pending snapshot before it exits.
+        if (async_save->writer.joinable()) async_save->writer.join();
+        delete async_save;
+        async_save = nullptr;
+    }
     if (ctxt) {
         xmlXPathFreeContext(ctxt);
         ctxt = nullptr;
     }
     if (doc) {
-        if (JRNL) { JRNL->Save(); delete JRNL; JRNL = nullptr; }
+        // A log-backed journal is already on disk record by record.
+        if (JRNL) { if (!JRNL->wal) JRNL->Save(); delete JRNL; JRNL = nullptr; }
         // xmlFreeDoc(doc);
         // doc = nullptr;
     }
@@ -240,6 +949,68 @@ std::vector<XmlNode> XmlDoc::XPath<std::vector<XmlNode>>(std::string query)
     return std::vector<XmlNode>();
 }
 
+uint64_t XmlDoc::Hash()
+{
+    xmlNodePtr root = doc ? xmlDocGetRootElement(doc) : nullptr;
+    return root ? SubtreeHash(root) : 0;
+}
+
+/**
+ * @brief True when two elements agree on everything except element children.
+ */
+static bool SameShape(xmlNodePtr a, xmlNodePtr b)
+{
+    if (!xmlStrEqual(a->name, b->name)) return false;
+    if (!xmlStrEqual(a->ns ? a->ns->href : nullptr, b->ns ? b->ns->href : nullptr)) return false;
+    if (AttrHash(a) != AttrHash(b)) return false;
+
+    xmlNodePtr x = a->children, y = b->children;
+    for (; x && y; x = x->next, y = y->next) {
+        if (x->type != y->type) return false;
+        if (x->type != XML_ELEMENT_NODE && LeafHash(x) != LeafHash(y)) return false;
+    }
+    return !x && !y;
+}
+
+static void DiffSubtrees(xmlNodePtr a, xmlNodePtr b, std::vector<XmlDiff>& diffs)
+{
+    if (SubtreeHash(a) == SubtreeHash(b)) return;
+
+    if (!SameShape(a, b)) {
+        diffs.push_back({XmlNode(a), XmlNode(b)});
+        return;
+    }
+
+    for (xmlNodePtr x = a->children, y = b->children; x; x = x->next, y = y->next)
+        if (x->type == XML_ELEMENT_NODE)
+            DiffSubtrees(x, y, diffs);
+}
+
+std::vector<XmlDiff> XmlDoc::Diff(XmlDoc& other)
+{
+    std::vector<XmlDiff> diffs;
+
+    xmlNodePtr a = doc ? xmlDocGetRootElement(doc) : nullptr;
+    xmlNodePtr b = other.doc ? xmlDocGetRootElement(other.doc) : nullptr;
+
+    if (a && b)
+        DiffSubtrees(a, b, diffs);
+    else if (a || b)
+        diffs.push_back({a ? XmlNode(a) : XmlNode(), b ? XmlNode(b) : XmlNode()});
+
+    return diffs;
+}
+
+std::string XmlDoc::C14N(const C14NOptions& options)
+{
+    return C14NText(doc, nullptr, options, err);
+}
+
+std::string XmlDoc::Digest(const C14NOptions& options)
+{
+    return C14NDigest(doc, nullptr, options, err);
+}
+
 xmlXPathContextPtr XmlDoc::XPathContext()
 {
     if (ctxt) return ctxt;
@@ -402,7 +1173,24 @@ std::vector<XmlNode> XmlNode::XPath<std::vector<XmlNode>>(std::string query)
     return std::vector<XmlNode>();
 }
 
-void XmlNode::parse(std::string XML)
+/**
+ * @brief Serialize a subtree exactly, for journal payloads.
+ *
+ * Unlike XmlNode::XML(), no indentation is added; formatting whitespace would
+ * otherwise be restored as additional text nodes by Undo().
+ */
+static std::string PayloadXML(xmlNodePtr node)
+{
+    xmlBufferPtr buffer = xmlBufferCreate();
+    xmlNodeDump(buffer, node->doc, node, 0, 0);
+    std::string result((const char*)buffer->content, buffer->use);
+    xmlBufferFree(buffer);
+    return result;
+}
+
+static void RemapJIDs(JidIndex& jid_map, xmlNodePtr subtree, bool live);
+
+void XmlNode::parse(std::string XML)
 {
     if (!node || !node->doc) return;
 
@@ -432,17 +1220,33 @@ void XmlNode::parse(std::string XML)
     xmlNodePtr oldNode = node;
     std::string jid;
 
+    auto lock = MutationLock(ownerDoc);
+
     if (JRNL) {
         jid = this->JID();  // Ensure the node has a JID before logging the modification
-        JRNL->LogModify(*this, oldNode ? this->XML() : std::string());
+        if (!jid.empty()) xmlSetProp(imported, BAD_CAST "JID", BAD_CAST jid.c_str());
+        if (ErrorPtr logged = JRNL->LogModify(*this, imported)) {
+            xmlFreeNode(imported);
+            err = logged;
+            return;
+        }
     }
 
     xmlReplaceNode(oldNode, imported);
+
+    // Entries under the old incarnation would dangle once it is freed.
+    if (JRNL) {
+        std::lock_guard<std::mutex> map(JRNL->map_lock);
+        RemapJIDs(JRNL->jid_map, oldNode, false);
+        RemapJIDs(JRNL->jid_map, imported, true);
+    }
     xmlFreeNode(oldNode);
 
     node = imported;
     if (JRNL)
         this->JID(jid);
+
+    Mutated(imported->parent);
 }
 
 static xmlNodePtr XmlNodeFromString(const std::string& XmlStr, xmlDocPtr ownerDoc, ErrorPtr& err)
@@ -486,6 +1290,8 @@ XmlNode XmlNode::AddChild(std::string XmlStr)
     xmlNodePtr imported = XmlNodeFromString(XmlStr, node->doc, err);
     if (!imported) return XmlNode();
 
+    auto lock = MutationLock(node->doc);
+
     xmlNodePtr added = xmlAddChild(node, imported);
     if (!added) {
         xmlFreeNode(imported);
@@ -496,8 +1302,9 @@ XmlNode XmlNode::AddChild(std::string XmlStr)
     XmlNode result(added);
 
     if (JRNL)
-        JRNL->LogAdd(result);
+        if (ErrorPtr logged = JRNL->LogAdd(result)) err = logged;
 
+    Mutated(added->parent);
     return result;
 }
 
@@ -515,6 +1322,8 @@ XmlNode XmlNode::AddBefore(std::string XmlStr)
     xmlNodePtr imported = XmlNodeFromString(XmlStr, node->doc, err);
     if (!imported) return XmlNode();
 
+    auto lock = MutationLock(node->doc);
+
     xmlNodePtr added = xmlAddPrevSibling(node, imported);
     if (!added) {
         xmlFreeNode(imported);
@@ -525,8 +1334,9 @@ XmlNode XmlNode::AddBefore(std::string XmlStr)
     XmlNode result(added);
 
     if (JRNL)
-        JRNL->LogAdd(result);
+        if (ErrorPtr logged = JRNL->LogAdd(result)) err = logged;
 
+    Mutated(added->parent);
     return result;
 }
 
@@ -544,6 +1354,8 @@ XmlNode XmlNode::AddAfter(std::string XmlStr)
     xmlNodePtr imported = XmlNodeFromString(XmlStr, node->doc, err);
     if (!imported) return XmlNode();
 
+    auto lock = MutationLock(node->doc);
+
     xmlNodePtr added = xmlAddNextSibling(node, imported);
     if (!added) {
         xmlFreeNode(imported);
@@ -554,38 +1366,98 @@ XmlNode XmlNode::AddAfter(std::string XmlStr)
     XmlNode result(added);
 
     if (JRNL)
-        JRNL->LogAdd(result);
+        if (ErrorPtr logged = JRNL->LogAdd(result)) err = logged;
 
+    Mutated(added->parent);
     return result;
 }
 
-std::string XmlNode::JID()
+/**
+ * @brief Read a node's JID, from the XmlNodeInfo cache when possible.
+ * @return 1 when found, 0 when the node has no JID, -1 when it is malformed.
+ *
+ * The attribute is parsed in place and the value cached beside the node, so
+ * repeated reads allocate nothing.  Every XmlCls path that writes a JID
+ * attribute refreshes the cache.
+ */
+static int ReadJID(xmlNodePtr node, uint64_t& key)
 {
-    if (!node) return {};
+    if (node->type != XML_ELEMENT_NODE) return 0;
 
-    xmlChar* value = xmlGetProp(node, BAD_CAST "JID");
+    XmlNodeInfo* info = NodeInfo(node);
+    if (info && info->jid_valid) { key = info->jid; return 1; }
 
-    if (value) {
-        std::string jid(reinterpret_cast<const char*>(value));
-        xmlFree(value);
-        return jid;
+    xmlAttrPtr attr = node->properties;
+    while (attr && !IsJIDAttr(attr)) attr = attr->next;
+    if (!attr) return 0;
+
+    xmlNodePtr text = attr->children;
+    if (!text || text->next || !text->content || !JidIndex::Key((const char*)text->content, key))
+        return -1;
+
+    // Only documents wrapped by an XmlDoc carry XmlCls node storage.
+    if (node->doc && node->doc->_private) {
+        XmlNodeInfo& cached = NodeInfoFor(node);
+        cached.jid = key;
+        cached.jid_valid = true;
+    }
+    return 1;
+}
+
+/**
+ * @brief Write a JID attribute and its cached value.
+ */
+static bool WriteJID(xmlNodePtr node, uint64_t key)
+{
+    if (!xmlSetProp(node, BAD_CAST "JID", BAD_CAST JidIndex::String(key).c_str()))
+        return false;
+
+    if (node->doc && node->doc->_private) {
+        XmlNodeInfo& cached = NodeInfoFor(node);
+        cached.jid = key;
+        cached.jid_valid = true;
+    }
+    return true;
+}
+
+bool XmlNode::JIDValue(uint64_t& value)
+{
+    if (!node) return false;
+
+    switch (ReadJID(node, value)) {
+    case 1:
+        return true;
+    case -1:
+        err = new Error{ lvl::ERR, "Malformed JID", GetPath() };
+        return false;
     }
 
     if (!JRNL) {
         err = new Error{ lvl::ERR, "Cannot create JID: node is not associated with a journal", GetPath() };
-        return {};
+        return false;
     }
 
-    std::string jid = JRNL->JID();
+    uint64_t key = JRNL->JIDKey();
 
-    if (!xmlSetProp(node, BAD_CAST "JID", BAD_CAST jid.c_str())) {
+    if (!WriteJID(node, key)) {
         err = new Error{ lvl::ERR, "Unable to assign JID", GetPath() };
-        return {};
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(JRNL->map_lock);
+        JRNL->jid_map[key] = node;
     }
+    if (XmlDoc* owner = OwnerOf(node->doc)) owner->MarkDirty();
 
-    JRNL->jid_map[jid] = node;
+    value = key;
+    return true;
+}
 
-    return jid;
+std::string XmlNode::JID()
+{
+    uint64_t value;
+    return JIDValue(value) ? JidIndex::String(value) : std::string();
 }
 
 void XmlNode::JID(std::string jid)
@@ -598,41 +1470,82 @@ void XmlNode::JID(std::string jid)
         return;
     }
 
-    if (!xmlSetProp(node, BAD_CAST "JID", BAD_CAST jid.c_str())) {
+    uint64_t key;
+    if (!JidIndex::Key(jid, key)) {
+        err = new Error{ lvl::ERR, "Malformed JID \"" + jid + "\"", GetPath() };
+        return;
+    }
+
+    if (!WriteJID(node, key)) {
         err = new Error{ lvl::ERR, "Unable to set JID \"" + jid + "\"", GetPath() };
         return;
     }
 
-    JRNL->jid_map[jid] = node;
+    {
+        std::lock_guard<std::mutex> lock(JRNL->map_lock);
+        JRNL->jid_map[key] = node;
+    }
+    if (XmlDoc* owner = OwnerOf(node->doc)) owner->MarkDirty();
 }
 
-void XmlNode::Delete()
+uint64_t XmlNode::Hash()
 {
-    if (!node) return;
-    std::string jid;
+    return node ? SubtreeHash(node) : 0;
+}
 
-    if (JRNL) {
-        auto parent = this->XPath<std::vector<XmlNode>>("..")[0];
-        (void) parent.JID();
-        if (parent.err) { err = parent.err; return; }
+std::string XmlNode::C14N(const C14NOptions& options)
+{
+    if (!node) { err = new Error{lvl::ERR, "Invalid/NULL node pointer", ""}; return {}; }
+    return C14NText(doc, node, options, err);
+}
+
+std::string XmlNode::Digest(const C14NOptions& options)
+{
+    if (!node) { err = new Error{lvl::ERR, "Invalid/NULL node pointer", ""}; return {}; }
+    return C14NDigest(doc, node, options, err);
+}
+
+/**
+ * @brief Point jid_map entries for JIDs in @p subtree at @p live, or null
+ *        them where they still refer to @p subtree's nodes.
+ */
+static void RemapJIDs(JidIndex& jid_map, xmlNodePtr subtree, bool live)
+{
+    uint64_t key;
+    if (ReadJID(subtree, key) == 1) {
+        if (live)
+            jid_map[key] = subtree;
+        else if (jid_map.contains(key) && jid_map[key] == subtree)
+            jid_map[key] = nullptr;
+    }
+    for (xmlNodePtr child = xmlFirstElementChild(subtree); child; child = xmlNextElementSibling(child))
+        RemapJIDs(jid_map, child, live);
+}
 
-        auto children = parent.XPath<std::vector<XmlNode>>("./*");
-        for (auto& child : children)
-            {(void) child.JID();
-                if (parent.err) { err = parent.err; return; }}
+void XmlNode::Delete()
+{
+    if (!node) return;
+    uint64_t jid;
 
+    xmlDocPtr ownerDoc = node->doc;
+    auto lock = MutationLock(ownerDoc);
 
-        jid = this->JID();
-        if (err) return;
+    if (JRNL) {
+        /*
+         * Only the parent and the nearest element siblings are given JIDs,
+         * by ActionDelete::Record(); the rest of the siblings are untouched.
+         */
+        if (!this->JIDValue(jid)) return;
 
-        JRNL->LogDelete(*this);
-        if (JRNL->err) { err = JRNL->err; return; }
-    }
+        if (ErrorPtr logged = JRNL->LogDelete(*this)) { err = logged; return; }
 
-    if (JRNL && !jid.empty())
+        std::lock_guard<std::mutex> map(JRNL->map_lock);
         JRNL->jid_map[jid] = nullptr;
+        RemapJIDs(JRNL->jid_map, node, false);
+    }
 
     xmlNodePtr doomed = node;
+    xmlNodePtr container = doomed->parent;
 
     node = nullptr;
     doc  = nullptr;
@@ -641,634 +1554,4321 @@ void XmlNode::Delete()
 
     xmlUnlinkNode(doomed);
     xmlFreeNode(doomed);
-}
-
-#define JRNL_CHECK_NODE(N)                                              \
-    do {                                                                \
-        if (!(N).node || (N).doc != source_doc.doc) {                  \
-            err = new Error{ lvl::ERR, "XmlNode does not belong to this journal's source DOM", (N).node ? (N).GetPath() : std::string() }; \
-            return;                                                     \
-        }                                                               \
-    } while (0)
 
-XmlJrnl::XmlJrnl(XmlDoc& source, const char* filename): XmlDoc(filename), source_doc(source) {
-    RefreshActiveRelease();
-    if (err) return;
-
-    BuildJIDMap();
+    Mutated(container);
 }
 
-XmlJrnl::XmlJrnl(XmlDoc& source, const std::string content) : XmlDoc(content), source_doc(source){
-    RefreshActiveRelease();
-    if (err) return;
+/**
+ * @brief Nearest element sibling of @p node in one direction, passing over @p skip.
+ */
+static xmlNodePtr ElementSibling(xmlNodePtr node, bool next, xmlNodePtr skip)
+{
+    do node = next ? xmlNextElementSibling(node) : xmlPreviousElementSibling(node);
+    while (node && node == skip);
+    return node;
+}
 
-    BuildJIDMap();
+/**
+ * @brief Unlink @p node and insert it at one child slot of @p parent.
+ *
+ * @p before is the element that will precede it and @p after the one that
+ * will follow; with neither it is appended.  Namespace references are
+ * reconciled because the new ancestors may not declare them.
+ */
+static void Relink(xmlNodePtr node, xmlNodePtr parent, xmlNodePtr before, xmlNodePtr after)
+{
+    xmlUnlinkNode(node);
+    if (after)
+        xmlAddPrevSibling(after, node);
+    else if (before)
+        xmlAddNextSibling(before, node);
+    else
+        xmlAddChild(parent, node);
+    xmlReconciliateNs(node->doc, node);
 }
 
-void XmlJrnl::LogAdd(XmlNode& node)
+void XmlNode::MoveTo(XmlNode& parent, XmlNode* before, XmlNode* after)
 {
-    JRNL_CHECK_NODE(node);
+    if (!node) return;
 
-    ActionAdd action(*this, node);
-    action.Record();
+    if (node->type != XML_ELEMENT_NODE || !node->parent || node->parent->type != XML_ELEMENT_NODE) {
+        err = new Error{lvl::ERR, "Only an element below the root element can be moved", GetPath()};
+        return;
+    }
+    if (!parent.node || parent.node->type != XML_ELEMENT_NODE || parent.node->doc != node->doc) {
+        err = new Error{lvl::ERR, "Move target is not an element of the same document", GetPath()};
+        return;
+    }
+    for (xmlNodePtr up = parent.node; up; up = up->parent)
+        if (up == node) {
+            err = new Error{lvl::ERR, "Cannot move a node below itself", parent.GetPath()};
+            return;
+        }
 
-    if (action.err)
-        err = action.err;
-}
+    XmlNode* sibling = before ? before : after;
+    if (sibling && (!sibling->node || sibling->node->parent != parent.node)) {
+        err = new Error{lvl::ERR, "Move sibling is not a child of the target parent", GetPath()};
+        return;
+    }
+    if (sibling && sibling->node == node) return;
+
+    // Destination neighbours as they will be once this node is unlinked.
+    xmlNodePtr prev = nullptr, next = nullptr;
+    if (before) {
+        next = before->node;
+        prev = ElementSibling(next, false, node);
+    } else if (after) {
+        prev = after->node;
+        next = ElementSibling(prev, true, node);
+    } else {
+        prev = xmlLastElementChild(parent.node);
+        if (prev == node) prev = ElementSibling(prev, false, node);
+    }
+    if (prev && prev->type != XML_ELEMENT_NODE) prev = nullptr;
+    if (next && next->type != XML_ELEMENT_NODE) next = nullptr;
 
-void XmlJrnl::LogModify(XmlNode& node, const std::string& oldXML)
-{
-    JRNL_CHECK_NODE(node);
+    auto lock = MutationLock(node->doc);
 
-    ActionModify action(*this, node, oldXML);
-    action.Record();
+    if (JRNL) {
+        if (ErrorPtr logged = JRNL->LogMove(*this, parent, prev, next)) { err = logged; return; }
+    }
 
-    if (action.err)
-        err = action.err;
+    xmlNodePtr container = node->parent;
+    if (before)
+        Relink(node, parent.node, nullptr, before->node);
+    else if (after)
+        Relink(node, parent.node, after->node, nullptr);
+    else
+        Relink(node, parent.node, nullptr, nullptr);
+
+    Mutated(container);
+    Mutated(parent.node);
 }
 
-void XmlJrnl::LogDelete(XmlNode& node)
+/**
+ * @brief Replace all children of @p node with one literal text node.
+ */
+static void ReplaceText(xmlNodePtr node, const std::string& text)
 {
-    JRNL_CHECK_NODE(node);
+    for (xmlNodePtr child = node->children; child;) {
+        xmlNodePtr next = child->next;
+        xmlUnlinkNode(child);
+        xmlFreeNode(child);
+        child = next;
+    }
+    if (!text.empty())
+        xmlAddChild(node, xmlNewDocTextLen(node->doc, BAD_CAST text.data(), int(text.size())));
+}
 
-    ActionDelete action(*this, node);
-    action.Record();
+/**
+ * @brief True when @p node has children other than text and CDATA.
+ */
+static bool HasNonTextChildren(xmlNodePtr node)
+{
+    for (xmlNodePtr child = node->children; child; child = child->next)
+        if (child->type != XML_TEXT_NODE && child->type != XML_CDATA_SECTION_NODE)
+            return true;
+    return false;
+}
 
-    if (action.err)
-        err = action.err;
+/**
+ * @brief Refuse in-place edits of non-elements and of the JID attribute.
+ */
+static ErrorPtr CheckAttrTarget(xmlNodePtr node, const std::string& name, const std::string& path)
+{
+    if (!node || node->type != XML_ELEMENT_NODE)
+        return new Error{lvl::ERR, "Attributes can only be changed on an element", path};
+    if (name == "JID")
+        return new Error{lvl::ERR, "The JID attribute is managed by the journal", path};
+    return nullptr;
 }
 
-void XmlJrnl::Undo()
+/**
+ * @brief The attribute @p name present on element @p node, without namespace.
+ *
+ * Unlike xmlHasProp(), never returns a DTD default's declaration, which is
+ * not part of the element and cannot be read or removed as an attribute.
+ */
+static xmlAttrPtr ElementAttr(xmlNodePtr node, const xmlChar* name)
 {
-    if (!active_release.node) {
-        err = new Error{ lvl::ERR, "Cannot undo: journal has no active release", "" };
-        return;
-    }
+    xmlAttrPtr attr = xmlHasNsProp(node, name, nullptr);
+    return attr && attr->type == XML_ATTRIBUTE_NODE ? attr : nullptr;
+}
 
-    auto actions = active_release.XPath<std::vector<XmlNode>>( "./Change[Reversed/@Value='false'][last()]" );
+void XmlNode::SetAttr(const std::string& name, const char* value)
+{
+    if (!node) return;
+    if ((err = CheckAttrTarget(node, name, GetPath()))) return;
 
-    if (active_release.err) {
-        err = active_release.err; return;
-    }
+    auto lock = MutationLock(node->doc);
 
-    if (actions.empty()) return;
+    if (JRNL) {
+        xmlAttrPtr attr = ElementAttr(node, BAD_CAST name.c_str());
+        xmlChar* old = attr ? xmlNodeListGetString(node->doc, attr->children, 1) : nullptr;
+        if (attr && !old) old = xmlStrdup(BAD_CAST "");
 
-    Undo(actions[0]);
-}
+        ErrorPtr logged = JRNL->LogSetAttr(*this, name, old);
+        xmlFree(old);
+        if (logged) { err = logged; return; }
+    }
 
-void XmlJrnl::Undo(XmlNode action_node)
-{
-    if (!action_node.node) {
-        err = new Error{lvl::ERR, "Cannot undo: invalid journal action node", ""};
+    if (!xmlSetProp(node, BAD_CAST name.c_str(), BAD_CAST value)) {
+        err = new Error{lvl::ERR, "Unable to set attribute \"" + name + "\"", GetPath()};
         return;
     }
+    Mutated(node);
+}
 
-    if (action_node.XPath<bool>("./Reversed[@Value='true']"))
-        return;
+void XmlNode::RemoveAttr(const std::string& name)
+{
+    if (!node) return;
+    if ((err = CheckAttrTarget(node, name, GetPath()))) return;
 
-    const std::string type = action_node.XPath<std::string>("@Type");
+    auto lock = MutationLock(node->doc);
 
-    if (type == "Modify") {
-        ActionModify action(*this, action_node);
-        action.Undo();
+    xmlAttrPtr attr = ElementAttr(node, BAD_CAST name.c_str());
+    if (!attr) return;
 
-        if (action.err)
-            err = action.err;
+    if (JRNL) {
+        xmlChar* old = xmlNodeListGetString(node->doc, attr->children, 1);
+
+        ErrorPtr logged = JRNL->LogSetAttr(*this, name, old ? old : BAD_CAST "");
+        xmlFree(old);
+        if (logged) { err = logged; return; }
+    }
 
+    xmlRemoveProp(attr);
+    Mutated(node);
+}
+
+void XmlNode::SetText(const std::string& text)
+{
+    if (!node) return;
+    if (node->type != XML_ELEMENT_NODE) {
+        err = new Error{lvl::ERR, "Text can only be set on an element", GetPath()};
         return;
     }
-    else if (type == "Deletion") {
-        ActionDelete action(*this, action_node, true);
-        action.Undo();
-        if (action.err) err = action.err;
+    if (HasNonTextChildren(node)) {
+        err = new Error{lvl::ERR, "SetText would discard child nodes", GetPath()};
         return;
     }
-    else if (type == "Add") {
-        ActionAdd action(*this, action_node, true);
-        action.Undo();
 
-        if (action.err)
-            err = action.err;
+    auto lock = MutationLock(node->doc);
 
-        return;
+    if (JRNL) {
+        xmlChar* old = xmlNodeGetContent(node);
+
+        ErrorPtr logged = JRNL->LogSetText(*this, old ? reinterpret_cast<const char*>(old) : "");
+        xmlFree(old);
+        if (logged) { err = logged; return; }
     }
 
-    err = new Error{lvl::ERR, "Undo currently implemented only for Modify transactions", action_node.GetPath()};
+    ReplaceText(node, text);
+    Mutated(node);
 }
 
-void XmlJrnl::Undo(std::vector<XmlNode> action_nodes) {
-    for (auto it = action_nodes.rbegin(); it != action_nodes.rend(); ++it) {
-        Undo(*it);
-        if (err) return;
-    }
-}
-void XmlJrnl::RefreshActiveRelease()
-{
-    rel_no.clear();
-    active_release = XmlNode();
+#define JRNL_CHECK_NODE(N)                                              \
+    do {                                                                \
+        if (!(N).node || (N).doc != source_doc.doc)                    \
+            return Report(new Error{ lvl::ERR, "XmlNode does not belong to this journal's source DOM", (N).node ? (N).GetPath() : std::string() }); \
+    } while (0)
 
-    auto roots = XPath<std::vector<XmlNode>>("/JRNL/Release[@Close='']");
-    if (roots.empty()) {
-        err = new Error{lvl::ERR, "No open root Release in journal", ""};
-        return;
-    }
+/* -------------------------------------------------------------------------
+ * JidIndex
+ *
+ * Linear probing over a power-of-two table kept at most 70% occupied,
+ * counting tombstones.  Keys are mixed before masking because JIDs need not
+ * be random; a rebuild leaves the table at most half full.
+ * ------------------------------------------------------------------------- */
 
-    active_release = FindActiveRelease(roots.back(), rel_no);
+static size_t JidSlotHash(uint64_t key)
+{
+    key ^= key >> 30; key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27; key *= 0x94d049bb133111ebULL;
+    return static_cast<size_t>(key ^ (key >> 31));
 }
 
-XmlNode XmlJrnl::FindActiveRelease(XmlNode current, std::vector<int>& path)
+bool JidIndex::Key(const char* jid, uint64_t& key)
 {
-    int n = current.XPath<int>("number(@Number)");
-    path.push_back(n);
-
-    auto children = current.XPath<std::vector<XmlNode>>("./Release[@Close='']");
+    uint64_t value = 0;
+    for (int i = 0; i < 16; ++i) {
+        char c = jid[i];
+        if (c >= '0' && c <= '9')      value = (value << 4) | uint64_t(c - '0');
+        else if (c >= 'a' && c <= 'f') value = (value << 4) | uint64_t(c - 'a' + 10);
+        else return false;
+    }
+    if (jid[16]) return false;
 
-    if (children.empty())
-        return current;
+    key = value;
+    return true;
+}
 
-    return FindActiveRelease(children.back(), path);
+bool JidIndex::Key(const std::string& jid, uint64_t& key)
+{
+    return jid.size() == 16 && Key(jid.c_str(), key);
 }
 
-void XmlJrnl::BuildJIDMap()
+std::string JidIndex::String(uint64_t key)
 {
-    jid_map.clear();
+    static const char digits[] = "0123456789abcdef";
 
-    auto nl = source_doc.XPath<std::vector<XmlNode>>("//*/@JID");
+    std::string jid(16, '0');
+    for (int i = 15; i >= 0; --i, key >>= 4)
+        jid[i] = digits[key & 0xf];
+    return jid;
+}
 
-    if (source_doc.err)
-        { err = source_doc.err; return; }
+JidIndex::Entry JidIndex::iterator::operator*() const
+{
+    Slot& s = index->slots[slot];
+    return Entry{String(s.key), s.node};
+}
 
-    for (auto n : nl) {
-        std::string jid = n.XPath<std::string>(".");
+JidIndex::iterator& JidIndex::iterator::operator++()
+{
+    while (++slot < index->slots.size() && index->slots[slot].state != FULL) {}
+    return *this;
+}
 
-        auto [it, inserted] = jid_map.emplace(jid, n.node->parent);
+JidIndex::iterator JidIndex::begin()
+{
+    size_t slot = 0;
+    while (slot < slots.size() && slots[slot].state != FULL) ++slot;
+    return iterator(this, slot);
+}
 
-        if (!inserted) { 
-            err = new Error{ lvl::ERR, "Duplicate JID \"" + jid + "\"", n.GetPath() };
-            return;
+/**
+ * @brief Locate @p key, or the slot where it would be inserted.
+ *
+ * Requires a non-empty table with at least one EMPTY slot.
+ */
+size_t JidIndex::Probe(uint64_t key, bool& found) const
+{
+    const size_t mask = slots.size() - 1;
+    size_t reuse = slots.size();
+
+    for (size_t i = JidSlotHash(key) & mask;; i = (i + 1) & mask) {
+        const Slot& s = slots[i];
+        if (s.state == EMPTY) {
+            found = false;
+            return reuse < slots.size() ? reuse : i;
+        }
+        if (s.state == TOMBSTONE) {
+            if (reuse == slots.size()) reuse = i;
+        }
+        else if (s.key == key) {
+            found = true;
+            return i;
         }
     }
 }
 
-std::string XmlJrnl::JID()
+void JidIndex::Rehash(size_t capacity)
 {
-    static thread_local std::mt19937_64 rng{std::random_device{}()};
-
-    for (;;) {
-        char buf[17];
+    size_t size = 16;
+    while (size < capacity * 2) size *= 2;
 
-        std::snprintf(
-            buf,
-            sizeof(buf),
-            "%016llx",
-            static_cast<unsigned long long>(rng())
-        );
+    std::vector<Slot> old(size, Slot{0, nullptr, EMPTY});
+    old.swap(slots);
+    used = count;
 
-        std::string jid(buf);
-
-        if (jid_map.find(jid) == jid_map.end())
-            return jid;
+    for (const Slot& s : old) {
+        if (s.state != FULL) continue;
+        bool found;
+        slots[Probe(s.key, found)] = s;
     }
 }
 
-/* -------------------------------------------------------------------------
- * Journal Action implementations
- *
- * Action::Record()/ReverseStamp()/Conflict() contain transaction mechanics
- * common to all actions.  ActionModify, ActionDelete, and ActionAdd contain
- * only the payload and inverse operation specific to their mutation type.
- * ------------------------------------------------------------------------- */
-
-ActionModify::ActionModify(XmlJrnl& j, XmlNode n, const std::string& old)
-    : Action(j), node(n), oldXML(old)
+size_t JidIndex::home_slot(uint64_t key) const
 {
-    type = "Modify";
-    jid = node.JID();
+    return JidSlotHash(key) & (slots.size() - 1);
+}
 
-    if (node.err)
-        err = node.err;
+bool JidIndex::contains(uint64_t key) const
+{
+    bool found = false;
+    if (!slots.empty()) Probe(key, found);
+    return found;
 }
 
-ActionModify::ActionModify(XmlJrnl& j, XmlNode action)
-    : Action(j, action)
+JidIndex::iterator JidIndex::find(uint64_t key)
 {
-    type = "Modify";
-    jid = action_node.XPath<std::string>("@JID");
+    bool found = false;
+    size_t slot = slots.empty() ? 0 : Probe(key, found);
+    return found ? iterator(this, slot) : end();
+}
 
-    if (action_node.err)
-        err = action_node.err;
+JidIndex::iterator JidIndex::find(const std::string& jid)
+{
+    uint64_t key;
+    return Key(jid, key) ? find(key) : end();
 }
 
-void Action::ReverseStamp()
+std::pair<JidIndex::iterator, bool> JidIndex::emplace(uint64_t key, xmlNodePtr node)
 {
-    auto reversed = action_node.XPath<std::vector<XmlNode>>("./Reversed");
+    if ((used + 1) * 10 > slots.size() * 7)
+        Rehash(count + 1);
 
-    if (reversed.size() != 1) {
-        err = new Error{lvl::ERR, "Journal action contains invalid Reversed state", action_node.GetPath()};
-        return;
-    }
+    bool found;
+    size_t slot = Probe(key, found);
+    if (found) return {iterator(this, slot), false};
 
-    xmlSetProp(reversed[0].node, BAD_CAST "Value", BAD_CAST "true");
+    if (slots[slot].state == EMPTY) ++used;
+    slots[slot] = Slot{key, node, FULL};
+    ++count;
+    return {iterator(this, slot), true};
+}
+
+xmlNodePtr& JidIndex::operator[](uint64_t key)
+{
+    return slots[emplace(key, nullptr).first.slot].node;
+}
+
+xmlNodePtr JidIndex::at(const std::string& jid) const
+{
+    uint64_t key;
+    bool found = false;
+    size_t slot = Key(jid, key) && !slots.empty() ? Probe(key, found) : 0;
+    return found ? slots[slot].node : nullptr;
+}
+
+size_t JidIndex::erase(uint64_t key)
+{
+    iterator it = find(key);
+    if (it == end()) return 0;
+
+    slots[it.slot].state = TOMBSTONE;
+    --count;
+    return 1;
+}
+
+size_t JidIndex::erase(const std::string& jid)
+{
+    uint64_t key;
+    return Key(jid, key) ? erase(key) : 0;
+}
+
+void JidIndex::clear()
+{
+    slots.clear();
+    count = used = 0;
+}
+
+void JidIndex::reserve(size_t n)
+{
+    if (n * 10 > slots.size() * 7)
+        Rehash(std::max(n, count));
+}
+
+/* -------------------------------------------------------------------------
+ * JournalWAL
+ *
+ * Integers in record bodies are LEB128 varints and strings are a varint
+ * length followed by the bytes.  A Change element is written as its name,
+ * attributes, concatenated text, and child elements, recursively, so the
+ * exporter reproduces it attribute for attribute.
+ * ------------------------------------------------------------------------- */
+
+static const char kWalMagic[8] = {'X', 'J', 'W', 'A', 'L', '\0', '\0', '\1'};
+static const size_t kWalFrame = 9;       // length, CRC, type
+static const int kWalMaxDepth = 64;      // element nesting accepted in a Change body
+
+static void WalPutU32(std::string& out, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i) out += char((v >> (8 * i)) & 0xff);
+}
+
+static uint32_t WalGetU32(const char* p)
+{
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) v |= uint32_t(uint8_t(p[i])) << (8 * i);
+    return v;
+}
+
+static void WalPutVarint(std::string& out, uint64_t v)
+{
+    while (v >= 0x80) { out += char(v | 0x80); v >>= 7; }
+    out += char(v);
+}
+
+static bool WalGetVarint(const char*& p, const char* end, uint64_t& v)
+{
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = uint8_t(*p++);
+        v |= uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+static void WalPutString(std::string& out, const xmlChar* s, size_t len)
+{
+    WalPutVarint(out, len);
+    out.append(reinterpret_cast<const char*>(s), len);
+}
+
+static void WalPutString(std::string& out, const std::string& s)
+{
+    WalPutString(out, BAD_CAST s.data(), s.size());
+}
+
+static bool WalGetString(const char*& p, const char* end, std::string& s)
+{
+    uint64_t len;
+    if (!WalGetVarint(p, end, len) || len > uint64_t(end - p)) return false;
+    s.assign(p, size_t(len));
+    p += len;
+    return true;
+}
+
+static uint32_t WalCRC(uint8_t type, const char* body, size_t len)
+{
+    uLong crc = crc32(0L, &type, 1);
+    return uint32_t(crc32(crc, reinterpret_cast<const Bytef*>(body), uInt(len)));
+}
+
+static void WalPutElement(std::string& out, xmlNodePtr node)
+{
+    WalPutString(out, node->name, xmlStrlen(node->name));
+
+    size_t attrs = 0;
+    for (xmlAttrPtr attr = node->properties; attr; attr = attr->next) ++attrs;
+    WalPutVarint(out, attrs);
+    for (xmlAttrPtr attr = node->properties; attr; attr = attr->next) {
+        xmlChar* value = xmlNodeListGetString(node->doc, attr->children, 1);
+        WalPutString(out, attr->name, xmlStrlen(attr->name));
+        WalPutString(out, value ? value : BAD_CAST "", xmlStrlen(value));
+        xmlFree(value);
+    }
+
+    std::string text;
+    size_t elements = 0;
+    for (xmlNodePtr child = node->children; child; child = child->next) {
+        if (child->type == XML_TEXT_NODE || child->type == XML_CDATA_SECTION_NODE)
+            text += reinterpret_cast<const char*>(child->content);
+        else if (child->type == XML_ELEMENT_NODE)
+            ++elements;
+    }
+    WalPutString(out, text);
+
+    WalPutVarint(out, elements);
+    for (xmlNodePtr child = node->children; child; child = child->next)
+        if (child->type == XML_ELEMENT_NODE) WalPutElement(out, child);
+}
+
+static xmlNodePtr WalGetElement(const char*& p, const char* end, xmlDocPtr doc, int depth)
+{
+    std::string name, text;
+    uint64_t attrs, elements;
+    if (depth > kWalMaxDepth || !WalGetString(p, end, name) || name.empty()) return nullptr;
+    if (!WalGetVarint(p, end, attrs)) return nullptr;
+
+    xmlNodePtr node = xmlNewDocNode(doc, nullptr, BAD_CAST name.c_str(), nullptr);
+    if (!node) return nullptr;
+
+    for (uint64_t i = 0; i < attrs; ++i) {
+        std::string attr, value;
+        if (!WalGetString(p, end, attr) || !WalGetString(p, end, value) ||
+            !xmlNewProp(node, BAD_CAST attr.c_str(), BAD_CAST value.c_str())) {
+            xmlFreeNode(node);
+            return nullptr;
+        }
+    }
+
+    if (!WalGetString(p, end, text) || !WalGetVarint(p, end, elements)) {
+        xmlFreeNode(node);
+        return nullptr;
+    }
+    if (!text.empty())
+        xmlAddChild(node, xmlNewDocTextLen(doc, BAD_CAST text.data(), int(text.size())));
+
+    for (uint64_t i = 0; i < elements; ++i) {
+        xmlNodePtr child = WalGetElement(p, end, doc, depth + 1);
+        if (!child) { xmlFreeNode(node); return nullptr; }
+        xmlAddChild(node, child);
+    }
+    return node;
+}
+
+static ErrorPtr WalError(const std::string& what, const std::string& path)
+{
+    return new Error{lvl::ERR, what + ": " + std::strerror(errno), path};
+}
+
+JournalWAL::JournalWAL(const char* filename, WalOptions opts)
+    : path(filename ? filename : ""), options(opts), last_sync(std::chrono::steady_clock::now())
+{
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) { err = WalError("Cannot open journal log", path); return; }
+
+    size_t valid = 0, size = 0;
+    xmlDocPtr recovered = Replay(valid, size);
+    if (err) return;
+    xmlFreeDoc(recovered);
+
+    if (valid == size && size >= sizeof(kWalMagic)) return;
+
+    // A torn tail from an interrupted append, or a header that was never
+    // completely written.
+    if (::ftruncate(fd, off_t(valid)) != 0) { err = WalError("Cannot truncate journal log", path); return; }
+    discarded = size - valid;
+
+    if (valid == 0 && ::write(fd, kWalMagic, sizeof(kWalMagic)) != ssize_t(sizeof(kWalMagic))) {
+        err = WalError("Cannot write journal log header", path);
+        return;
+    }
+    if (::fdatasync(fd) != 0) err = WalError("Cannot sync journal log", path);
+}
+
+JournalWAL::~JournalWAL()
+{
+    if (fd < 0) return;
+    Sync();
+    ::close(fd);
+}
+
+xmlDocPtr JournalWAL::Replay(size_t& valid, size_t& size)
+{
+    std::string bytes;
+    char buffer[1 << 16];
+    for (off_t offset = 0;;) {
+        ssize_t n = ::pread(fd, buffer, sizeof(buffer), offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) { err = WalError("Cannot read journal log", path); return nullptr; }
+        if (n == 0) break;
+        bytes.append(buffer, size_t(n));
+        offset += n;
+    }
+    size = bytes.size();
+    valid = 0;
+    records = 0;
+    changes = 0;
+
+    if (size >= sizeof(kWalMagic) && std::memcmp(bytes.data(), kWalMagic, sizeof(kWalMagic)) != 0) {
+        err = new Error{lvl::ERR, "Not a journal log", path};
+        return nullptr;
+    }
+
+    xmlDocPtr doc = xmlNewDoc(BAD_CAST "1.0");
+    xmlNodePtr root = xmlNewDocNode(doc, nullptr, BAD_CAST "JRNL", nullptr);
+    xmlDocSetRootElement(doc, root);
+    if (size < sizeof(kWalMagic)) return doc;
+
+    std::map<std::vector<int>, xmlNodePtr> releases;
+    std::vector<xmlNodePtr> ordinals;
+    xmlNodePtr current = nullptr;
+
+    const char* const begin = bytes.data();
+    const char* const end = begin + size;
+    const char* frame = begin + sizeof(kWalMagic);
+
+    // Each pass applies one intact record; the first frame that is short,
+    // fails its CRC, or does not decode ends the log.
+    for (; size_t(end - frame) >= kWalFrame; ++records) {
+        const uint32_t length = WalGetU32(frame);
+        const uint8_t type = uint8_t(frame[8]);
+        const char* p = frame + kWalFrame;
+        if (length > size_t(end - p) || WalGetU32(frame + 4) != WalCRC(type, p, length)) break;
+        const char* const next = p + length;
+
+        if (type == RELEASE || type == CLOSE) {
+            uint64_t depth, number;
+            std::vector<int> key;
+            std::string stamp;
+            bool ok = WalGetVarint(p, next, depth) && depth > 0 && depth <= size_t(next - p);
+            for (uint64_t i = 0; ok && i < depth; ++i) {
+                ok = WalGetVarint(p, next, number) && number <= INT_MAX;
+                key.push_back(int(number));
+            }
+            ok = ok && WalGetString(p, next, stamp) && p == next;
+
+            if (type == CLOSE) {
+                auto it = releases.find(key);
+                if (!ok || it == releases.end()) break;
+                xmlSetProp(it->second, BAD_CAST "Close", BAD_CAST stamp.c_str());
+                // Later Changes go to the enclosing Release.
+                current = key.size() > 1 ? releases[std::vector<int>(key.begin(), key.end() - 1)] : nullptr;
+                frame = next;
+                continue;
+            }
+            ok = ok && !releases.count(key);
+
+            xmlNodePtr parent = root;
+            if (ok && key.size() > 1) {
+                auto it = releases.find(std::vector<int>(key.begin(), key.end() - 1));
+                ok = it != releases.end();
+                if (ok) parent = it->second;
+            }
+            if (!ok) break;
+
+            current = xmlNewChild(parent, nullptr, BAD_CAST "Release", nullptr);
+            xmlNewProp(current, BAD_CAST "Number", BAD_CAST std::to_string(key.back()).c_str());
+            xmlNewProp(current, BAD_CAST "Open", BAD_CAST stamp.c_str());
+            xmlNewProp(current, BAD_CAST "Close", BAD_CAST "");
+            releases[key] = current;
+        }
+        else if ((type >= ADD && type <= DELETION) || type == CHANGE) {
+            if (!current) break;
+            xmlNodePtr change = WalGetElement(p, next, doc, 0);
+            if (!change || p != next || !xmlStrEqual(change->name, BAD_CAST "Change")) {
+                xmlFreeNode(change);
+                break;
+            }
+            xmlAddChild(current, change);
+            ordinals.push_back(change);
+        }
+        else if (type == NEXT_JID) {
+            uint64_t value;
+            if (!WalGetVarint(p, next, value) || p != next) break;
+            xmlSetProp(root, BAD_CAST "NextJID", BAD_CAST JidIndex::String(value).c_str());
+        }
+        else if (type == REVERSE) {
+            uint64_t ordinal;
+            std::string timestamp;
+            if (!WalGetVarint(p, next, ordinal) || !WalGetString(p, next, timestamp) ||
+                p != next || ordinal >= ordinals.size())
+                break;
+
+            xmlNodePtr reversed = ordinals[ordinal]->children;
+            while (reversed && !(reversed->type == XML_ELEMENT_NODE && xmlStrEqual(reversed->name, BAD_CAST "Reversed")))
+                reversed = reversed->next;
+            if (!reversed) break;
+
+            xmlSetProp(reversed, BAD_CAST "Value", BAD_CAST "true");
+            xmlSetProp(reversed, BAD_CAST "TimeStamp", BAD_CAST timestamp.c_str());
+
+            // A Transaction is reversed as a whole.
+            for (xmlNodePtr nested = xmlFirstElementChild(ordinals[ordinal]); nested; nested = xmlNextElementSibling(nested)) {
+                if (!xmlStrEqual(nested->name, BAD_CAST "Change")) continue;
+                for (xmlNodePtr r = xmlFirstElementChild(nested); r; r = xmlNextElementSibling(r))
+                    if (xmlStrEqual(r->name, BAD_CAST "Reversed")) {
+                        xmlSetProp(r, BAD_CAST "Value", BAD_CAST "true");
+                        xmlSetProp(r, BAD_CAST "TimeStamp", BAD_CAST timestamp.c_str());
+                        break;
+                    }
+            }
+        }
+        else break;
+
+        frame = next;
+    }
+
+    valid = size_t(frame - begin);
+    changes = ordinals.size();
+    return doc;
+}
+
+void JournalWAL::Append(RecordType type, const std::string& body)
+{
+    std::string record;
+    record.reserve(kWalFrame + body.size());
+    WalPutU32(record, uint32_t(body.size()));
+    WalPutU32(record, WalCRC(type, body.data(), body.size()));
+    record += char(type);
+    record += body;
+
+    std::lock_guard<std::mutex> lock(append_lock);
+    if (fd < 0) { err = new Error{lvl::ERR, "Journal log is not open", path}; return; }
+
+    const off_t start = ::lseek(fd, 0, SEEK_END);
+    for (size_t written = 0; written < record.size();) {
+        ssize_t n = ::write(fd, record.data() + written, record.size() - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            err = WalError("Cannot append to journal log", path);
+            // Leave no partial frame for the next append to follow.
+            if (start >= 0 && ::ftruncate(fd, start) != 0) {}
+            return;
+        }
+        written += size_t(n);
+    }
+    ++records;
+    ++pending;
+
+    const auto now = std::chrono::steady_clock::now();
+    if ((options.sync_records && pending >= options.sync_records) ||
+        (options.sync_ms && now - last_sync >= std::chrono::milliseconds(options.sync_ms))) {
+        if (::fdatasync(fd) != 0) { err = WalError("Cannot sync journal log", path); return; }
+        pending = 0;
+        last_sync = now;
+    }
+}
+
+void JournalWAL::AppendRelease(const std::vector<int>& number, const std::string& open)
+{
+    std::string body;
+    WalPutVarint(body, number.size());
+    for (int n : number) WalPutVarint(body, uint64_t(n));
+    WalPutString(body, open);
+    Append(RELEASE, body);
+}
+
+void JournalWAL::AppendClose(const std::vector<int>& number, const std::string& close)
+{
+    std::string body;
+    WalPutVarint(body, number.size());
+    for (int n : number) WalPutVarint(body, uint64_t(n));
+    WalPutString(body, close);
+    Append(CLOSE, body);
+}
+
+uint64_t JournalWAL::AppendChange(xmlNodePtr change)
+{
+    RecordType type = CHANGE;
+    xmlChar* kind = xmlGetProp(change, BAD_CAST "Type");
+    if (xmlStrEqual(kind, BAD_CAST "Add")) type = ADD;
+    else if (xmlStrEqual(kind, BAD_CAST "Modify")) type = MODIFY;
+    else if (xmlStrEqual(kind, BAD_CAST "Deletion")) type = DELETION;
+    xmlFree(kind);
+
+    std::string body;
+    WalPutElement(body, change);
+
+    const uint64_t before = records;
+    Append(type, body);
+    return records != before ? changes++ : changes;
+}
+
+void JournalWAL::AppendReverse(uint64_t ordinal, const std::string& timestamp)
+{
+    std::string body;
+    WalPutVarint(body, ordinal);
+    WalPutString(body, timestamp);
+    Append(REVERSE, body);
+}
+
+void JournalWAL::AppendNextJID(uint64_t next)
+{
+    std::string body;
+    WalPutVarint(body, next);
+    Append(NEXT_JID, body);
+}
+
+void JournalWAL::Sync()
+{
+    std::lock_guard<std::mutex> lock(append_lock);
+    if (fd < 0 || !pending) return;
+    if (::fdatasync(fd) != 0) { err = WalError("Cannot sync journal log", path); return; }
+    pending = 0;
+    last_sync = std::chrono::steady_clock::now();
+}
+
+size_t JournalWAL::Size()
+{
+    std::lock_guard<std::mutex> lock(append_lock);
+    if (fd < 0) return 0;
+    const off_t end = ::lseek(fd, 0, SEEK_END);
+    return end < 0 ? 0 : size_t(end);
+}
+
+void JournalWAL::Rewrite(xmlNodePtr root)
+{
+    const ErrorPtr before = err;
+    Sync();
+    if (err != before) return;
+
+    const std::string temp = path + ".compact";
+    const int out = ::open(temp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (out < 0) { err = WalError("Cannot create journal log checkpoint", temp); return; }
+    if (::write(out, kWalMagic, sizeof(kWalMagic)) != ssize_t(sizeof(kWalMagic))) {
+        err = WalError("Cannot write journal log header", temp);
+        ::close(out);
+        ::unlink(temp.c_str());
+        return;
+    }
+
+    // Append() writes to fd; point it at the new file and sync once at the end.
+    const int old = fd;
+    const WalOptions saved = options;
+    const uint64_t old_records = records, old_changes = changes;
+    {
+        std::lock_guard<std::mutex> lock(append_lock);
+        fd = out;
+    }
+    options = WalOptions{0, 0};
+    records = changes = 0;
+
+    std::vector<int> number;
+    std::function<void(xmlNodePtr)> release = [&](xmlNodePtr node) {
+        xmlChar* value = xmlGetProp(node, BAD_CAST "Number");
+        number.push_back(value ? std::atoi(reinterpret_cast<const char*>(value)) : 0);
+        xmlFree(value);
+        value = xmlGetProp(node, BAD_CAST "Open");
+        AppendRelease(number, value ? reinterpret_cast<const char*>(value) : "");
+        xmlFree(value);
+
+        for (xmlNodePtr child = xmlFirstElementChild(node); child && err == before; child = xmlNextElementSibling(child)) {
+            if (xmlStrEqual(child->name, BAD_CAST "Release")) release(child);
+            else if (xmlStrEqual(child->name, BAD_CAST "Change")) AppendChange(child);
+        }
+        value = xmlGetProp(node, BAD_CAST "Close");
+        if (err == before && value && *value) AppendClose(number, reinterpret_cast<const char*>(value));
+        xmlFree(value);
+        number.pop_back();
+    };
+    for (xmlNodePtr child = xmlFirstElementChild(root); child && err == before; child = xmlNextElementSibling(child))
+        if (xmlStrEqual(child->name, BAD_CAST "Release")) release(child);
+
+    uint64_t next;
+    xmlChar* value = xmlGetProp(root, BAD_CAST "NextJID");
+    if (err == before && value && JidIndex::Key(reinterpret_cast<const char*>(value), next)) AppendNextJID(next);
+    xmlFree(value);
+
+    options = saved;
+    if (err == before && (::fdatasync(out) != 0 || ::rename(temp.c_str(), path.c_str()) != 0))
+        err = WalError("Cannot replace journal log with its checkpoint", path);
+
+    std::lock_guard<std::mutex> lock(append_lock);
+    if (err != before) {
+        fd = old;
+        records = old_records;
+        changes = old_changes;
+        ::close(out);
+        ::unlink(temp.c_str());
+        return;
+    }
+    ::close(old);
+    pending = 0;
+    last_sync = std::chrono::steady_clock::now();
+}
+
+std::string JournalWAL::ExportXML()
+{
+    std::lock_guard<std::mutex> lock(append_lock);
+    size_t valid, size;
+    xmlDocPtr doc = Replay(valid, size);
+    if (!doc) return std::string();
+
+    xmlChar* buffer = nullptr;
+    int length = 0;
+    xmlDocDumpFormatMemory(doc, &buffer, &length, 1);
+    std::string xml(reinterpret_cast<const char*>(buffer), size_t(length));
+    xmlFree(buffer);
+    xmlFreeDoc(doc);
+    return xml;
+}
+
+/// Source of XmlJrnl::jid_serial; 0 is never issued.
+static std::atomic<uint64_t> journal_serials{0};
+
+XmlJrnl::XmlJrnl(XmlDoc& source, const char* filename)
+    : XmlDoc(filename), source_doc(source), jid_serial(++journal_serials) {
+    if (!doc) return;
+
+    RefreshActiveRelease();
+    if (err) return;
+
+    BuildJIDMap();
+    if (err) return;
+
+    BuildChangeIndex();
+    LoadJIDCounter();
+}
+
+XmlJrnl::XmlJrnl(XmlDoc& source, const std::string content)
+    : XmlDoc(content), source_doc(source), jid_serial(++journal_serials) {
+    if (!doc) return;
+
+    RefreshActiveRelease();
+    if (err) return;
+
+    BuildJIDMap();
+    if (err) return;
+
+    BuildChangeIndex();
+    LoadJIDCounter();
+}
+
+XmlJrnl::~XmlJrnl()
+{
+    StopWriter();
+    ClearSnapshots();
+    delete wal;
+}
+
+void XmlJrnl::AttachWAL(JournalWAL* log, bool fresh)
+{
+    wal = log;
+
+    if (fresh) {
+        // Seed releases, parents first, as the log's opening records.
+        for (auto& release : XPath<std::vector<XmlNode>>("//Release")) {
+            std::vector<int> number;
+            for (xmlNodePtr n = release.node; n && xmlStrEqual(n->name, BAD_CAST "Release"); n = n->parent)
+                number.insert(number.begin(), XmlNode(n).XPath<int>("number(@Number)"));
+            wal->AppendRelease(number, release.XPath<std::string>("string(@Open)"));
+            if (wal->err) { err = wal->err; return; }
+        }
+        return;
+    }
+
+    // Replay appends Change records in log order, which is document order.
+    // A Transaction's nested changes travel inside its record.
+    auto changes = XPath<std::vector<XmlNode>>("//Release/Change");
+    if (changes.size() != wal->changes) {
+        err = new Error{lvl::ERR, "Journal log and journal DOM disagree on the number of Change records", ""};
+        return;
+    }
+    for (uint64_t i = 0; i < changes.size(); ++i)
+        wal_changes[changes[i].node] = i;
+}
+
+/**
+ * @brief True when a Change node's Reversed/@Value is "true".
+ *
+ * Reads the Change's own children directly; used on every undo step.
+ */
+static bool IsReversed(xmlNodePtr change)
+{
+    for (xmlNodePtr child = change->children; child; child = child->next) {
+        if (child->type != XML_ELEMENT_NODE || !xmlStrEqual(child->name, BAD_CAST "Reversed"))
+            continue;
+
+        for (xmlAttrPtr attr = child->properties; attr; attr = attr->next)
+            if (!attr->ns && xmlStrEqual(attr->name, BAD_CAST "Value"))
+                return attr->children && xmlStrEqual(attr->children->content, BAD_CAST "true");
+        return false;
+    }
+    return false;
+}
+
+/**
+ * @brief True for a Change recorded inside a Transaction group.
+ */
+static bool IsNestedChange(xmlNodePtr change)
+{
+    return change->parent && change->parent->type == XML_ELEMENT_NODE &&
+           xmlStrEqual(change->parent->name, BAD_CAST "Change");
+}
+
+/**
+ * @brief Create a detached journal element with attributes and optional text.
+ */
+static xmlNodePtr NewRecordNode(xmlDocPtr doc, const char* name,
+                                std::initializer_list<std::pair<const char*, std::string>> attrs,
+                                const std::string& text = std::string())
+{
+    xmlNodePtr element = xmlNewDocNode(doc, nullptr, BAD_CAST name, nullptr);
+    if (!element) return nullptr;
+
+    for (const auto& [attr, value] : attrs) {
+        if (!xmlNewProp(element, BAD_CAST attr, BAD_CAST value.c_str())) {
+            xmlFreeNode(element);
+            return nullptr;
+        }
+    }
+
+    if (!text.empty()) {
+        xmlNodePtr content = xmlNewDocTextLen(doc, BAD_CAST text.data(), int(text.size()));
+        if (!content || !xmlAddChild(element, content)) {
+            xmlFreeNode(content);
+            xmlFreeNode(element);
+            return nullptr;
+        }
+    }
+    return element;
+}
+
+/**
+ * @brief Value of attribute @p name on @p node, or empty.
+ */
+static std::string RecordAttr(xmlNodePtr node, const char* name)
+{
+    xmlChar* value = xmlGetProp(node, BAD_CAST name);
+    if (!value) return std::string();
+    std::string out(reinterpret_cast<const char*>(value));
+    xmlFree(value);
+    return out;
+}
+
+/**
+ * @brief Nested Change elements of a Transaction group, in record order.
+ */
+static std::vector<xmlNodePtr> NestedChanges(xmlNodePtr group)
+{
+    std::vector<xmlNodePtr> nested;
+    for (xmlNodePtr child = xmlFirstElementChild(group); child; child = xmlNextElementSibling(child))
+        if (xmlStrEqual(child->name, BAD_CAST "Change"))
+            nested.push_back(child);
+    return nested;
+}
+
+/**
+ * @brief Collect the JIDs a Change refers to.
+ * @param change Change record.
+ * @param context Receives Parent/Before/After and Move From/To JIDs.
+ * @param slots Receives the parents whose child slots the Change adds to,
+ *        removes from, or relinks within.
+ */
+static void ChangeRefs(xmlNodePtr change, std::unordered_set<std::string>& context,
+                       std::unordered_set<std::string>& slots)
+{
+    const std::string type = RecordAttr(change, "Type");
+    for (xmlNodePtr child = xmlFirstElementChild(change); child; child = xmlNextElementSibling(child)) {
+        const bool move = xmlStrEqual(child->name, BAD_CAST "From") || xmlStrEqual(child->name, BAD_CAST "To");
+        if (move) {
+            for (const char* attr : {"Parent", "Before", "After"}) {
+                std::string jid = RecordAttr(child, attr);
+                if (!jid.empty()) context.insert(jid);
+            }
+            std::string parent = RecordAttr(child, "Parent");
+            if (!parent.empty()) slots.insert(parent);
+        }
+        else if (xmlStrEqual(child->name, BAD_CAST "Parent") || xmlStrEqual(child->name, BAD_CAST "Before") ||
+                 xmlStrEqual(child->name, BAD_CAST "After")) {
+            std::string jid = RecordAttr(child, "JID");
+            if (jid.empty()) continue;
+            context.insert(jid);
+            if (xmlStrEqual(child->name, BAD_CAST "Parent") && (type == "Add" || type == "Deletion"))
+                slots.insert(jid);
+        }
+    }
+}
+
+/// Element @p jid names, if it is attached to the source document through all its ancestors.
+static xmlNodePtr AttachedNode(XmlJrnl& jrnl, const std::string& jid)
+{
+    auto it = jrnl.jid_map.find(jid);
+    xmlNodePtr node = it != jrnl.jid_map.end() ? it->second : nullptr;
+    xmlNodePtr up = node;
+    while (up && up->type == XML_ELEMENT_NODE) up = up->parent;
+    return up && up == reinterpret_cast<xmlNodePtr>(jrnl.source_doc.doc) ? node : nullptr;
+}
+
+/// Reversed element of a Change, or null.
+static xmlNodePtr ReversedState(xmlNodePtr change)
+{
+    xmlNodePtr child = xmlFirstElementChild(change);
+    while (child && !xmlStrEqual(child->name, BAD_CAST "Reversed")) child = xmlNextElementSibling(child);
+    return child;
+}
+
+/**
+ * @brief State kept by XmlJrnl::UndoAll() until it succeeds or puts things back.
+ *
+ * Every undone step registers, through Action::Revert(), how to reverse it
+ * and what to free once it stands.  Nodes a step takes out stay allocated
+ * until then, so putting a step back relinks the same nodes and handles to
+ * them stay valid.
+ */
+struct XmlJrnl::UndoGuard {
+    XmlJrnl& jrnl;
+    std::vector<xmlNodePtr> changes;                             ///< Guarded Changes and their nested ones.
+    std::vector<std::pair<std::function<void()>, std::function<void()>>> steps;  ///< Restore and release, oldest first.
+    std::vector<std::pair<xmlNodePtr, std::string>> reversals;   ///< Held LogReverse() calls.
+
+    UndoGuard(XmlJrnl& j, const std::vector<xmlNodePtr>& guarded) : jrnl(j)
+    {
+        for (xmlNodePtr change : guarded) {
+            if (IsReversed(change)) continue;
+            changes.push_back(change);
+            if (RecordAttr(change, "Type") == "Transaction")
+                for (xmlNodePtr nested : NestedChanges(change)) changes.push_back(nested);
+        }
+        jrnl.undo_guard = this;
+    }
+
+    ~UndoGuard() { jrnl.undo_guard = nullptr; }
+
+    /// Reverse the undone steps newest first and mark the Changes unreversed again.
+    void Restore()
+    {
+        jrnl.undo_guard = nullptr;
+        for (auto it = steps.rbegin(); it != steps.rend(); ++it)
+            if (it->first) it->first();
+        steps.clear();
+
+        for (xmlNodePtr change : changes) {
+            xmlNodePtr reversed = ReversedState(change);
+            if (!reversed) continue;
+            {
+                auto lock = MutationLock(jrnl.doc);
+                xmlSetProp(reversed, BAD_CAST "Value", BAD_CAST "false");
+                xmlSetProp(reversed, BAD_CAST "TimeStamp", BAD_CAST "");
+            }
+            Mutated(reversed);
+        }
+        reversals.clear();
+    }
+
+    /// Free what the steps took out and log the held reversals; returns the log error, if any.
+    ErrorPtr Commit()
+    {
+        jrnl.undo_guard = nullptr;
+        for (auto& step : steps)
+            if (step.second) step.second();
+        steps.clear();
+
+        ErrorPtr failed = nullptr;
+        for (const auto& [change, timestamp] : reversals)
+            if (ErrorPtr logged = jrnl.LogReverse(change, timestamp); logged && !failed) failed = logged;
+        return failed;
+    }
+};
+
+bool Action::Guarded() const
+{
+    return jrnl.undo_guard != nullptr;
+}
+
+void Action::Revert(std::function<void()> restore, std::function<void()> release)
+{
+    if (jrnl.undo_guard)
+        jrnl.undo_guard->steps.emplace_back(std::move(restore), std::move(release));
+    else if (release)
+        release();
+}
+
+ErrorPtr XmlJrnl::LogWAL(xmlNodePtr change)
+{
+    // A Transaction is logged as one record when it commits.
+    if (!wal || IsNestedChange(change)) return nullptr;
+
+    const uint64_t ordinal = wal->AppendChange(change);
+    if (wal->err) return wal->err;
+
+    wal_changes[change] = ordinal;
+    return nullptr;
+}
+
+ErrorPtr XmlJrnl::LogReverse(xmlNodePtr change, const std::string& timestamp)
+{
+    // Replaying a Transaction's reversal reverses its nested changes.
+    if (!wal || IsNestedChange(change)) return nullptr;
+
+    // Held until the whole UndoAll() has succeeded.
+    if (undo_guard) {
+        undo_guard->reversals.emplace_back(change, timestamp);
+        return nullptr;
+    }
+
+    auto it = wal_changes.find(change);
+    if (it == wal_changes.end())
+        return new Error{lvl::ERR, "Reversed Change is not in the journal log", XmlNode(change).GetPath()};
+
+    wal->AppendReverse(it->second, timestamp);
+    return wal->err;
+}
+
+/* -------------------------------------------------------------------------
+ * Concurrent recording
+ *
+ * While the writer runs, Action::Record() leaves each Change detached and
+ * Submit() pushes it onto an intrusive multi-producer single-consumer list
+ * (Vyukov's): a producer swaps itself in as the head with one atomic
+ * exchange and then links its predecessor to it.  Only a push onto a list
+ * the writer has emptied takes the mutex, to wake it; the writer sleeps
+ * until then.  Only the writer thread pops, attaches, indexes, and logs.
+ * ------------------------------------------------------------------------- */
+
+/**
+ * @brief Background writer state for XmlJrnl::StartWriter().
+ *
+ * Records can arrive out of Seq order, since a thread that took a lower Seq
+ * may still be building its record; they are held in @ref pending until
+ * every lower Seq has been applied.  A Seq whose recording failed arrives
+ * with no Change so that the ones after it are not held back forever.
+ */
+struct XmlJrnl::Writer {
+    struct Record {
+        std::atomic<Record*> next{nullptr};
+        uint64_t seq = 0;
+        xmlNodePtr change = nullptr;      ///< Detached Change; null for a failed recording.
+        xmlNodePtr release = nullptr;     ///< Release active when it was recorded.
+        uint64_t next_jid = 0;            ///< NextJID to persist, for a record without a Seq.
+    };
+
+    XmlJrnl& jrnl;
+
+    Record stub;                          ///< Keeps the list non-empty.
+    std::atomic<Record*> head{&stub};     ///< Last pushed; producers exchange it.
+    Record* tail = &stub;                 ///< Oldest not yet popped; writer only.
+
+    std::map<uint64_t, Record*> pending;  ///< Popped records waiting for a lower Seq.
+    uint64_t next_seq;                    ///< Seq the journal needs next.
+
+    std::atomic<uint64_t> pushed{0};      ///< Records pushed.
+    std::atomic<uint64_t> popped{0};      ///< Records popped; the writer sleeps while it equals @ref pushed.
+    std::atomic<uint64_t> applied{0};     ///< Records applied or skipped.
+    std::atomic<bool> stop{false};
+
+    std::mutex mtx;
+    std::condition_variable wake;         ///< Push onto an empty list, Flush(), and shutdown -> writer.
+    std::condition_variable drained;      ///< Writer -> Flush().
+    ErrorPtr error = nullptr;             ///< First failure since the last Flush(); guarded by @ref mtx.
+
+    std::thread worker;
+
+    Writer(XmlJrnl& j) : jrnl(j), next_seq(j.next_seq) { worker = std::thread([this] { Run(); }); }
+
+    ~Writer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stop = true;
+            wake.notify_one();
+        }
+        worker.join();
+
+        // Only a Seq that was never submitted leaves records here.
+        for (auto& [seq, record] : pending) {
+            xmlFreeNode(record->change);
+            delete record;
+        }
+    }
+
+    void Push(uint64_t seq, xmlNodePtr change, xmlNodePtr release)
+    {
+        Record* record = new Record;
+        record->seq = seq;
+        record->change = change;
+        record->release = release;
+
+        Enqueue(record);
+    }
+
+    /**
+     * @brief Hand over a NextJID update.
+     *
+     * It is applied as soon as it is popped.  A thread reserves its JID block
+     * before it records a Change that uses one, and the list keeps each
+     * thread's pushes in order, so the update reaches the journal first.
+     */
+    void PushNextJID(uint64_t next)
+    {
+        Record* record = new Record;
+        record->next_jid = next;
+
+        Enqueue(record);
+    }
+
+    /// Keep @p failure for the next Flush() unless an earlier one is waiting.
+    void Fail(ErrorPtr failure)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!error) error = failure;
+    }
+
+    ErrorPtr Flush()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        wake.notify_one();
+        drained.wait(lock, [this] { return applied == pushed; });
+
+        ErrorPtr failed = error;
+        error = nullptr;
+        return failed;
+    }
+
+    /// Push @p record, waking the writer if the list was empty.
+    void Enqueue(Record* record)
+    {
+        const bool idle = pushed.fetch_add(1) == popped.load();
+        Link(record);
+        if (!idle) return;
+
+        std::lock_guard<std::mutex> lock(mtx);
+        wake.notify_one();
+    }
+
+    void Link(Record* record)
+    {
+        record->next.store(nullptr, std::memory_order_relaxed);
+        Record* prev = head.exchange(record, std::memory_order_acq_rel);
+        prev->next.store(record, std::memory_order_release);
+    }
+
+    /// Oldest pushed record, or null when there is none or a push is half-linked.
+    Record* Pop()
+    {
+        Record* first = tail;
+        Record* next = first->next.load(std::memory_order_acquire);
+
+        if (first == &stub) {
+            if (!next) return nullptr;
+            tail = first = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next) { tail = next; return first; }
+
+        if (first != head.load(std::memory_order_acquire)) return nullptr;
+
+        // first is the only record; put the stub behind it so it can be taken.
+        Link(&stub);
+        next = first->next.load(std::memory_order_acquire);
+        if (next) { tail = next; return first; }
+        return nullptr;
+    }
+
+    void Run()
+    {
+        for (;;) {
+            bool progressed = false;
+
+            while (Record* record = Pop()) {
+                ++popped;
+                if (record->seq) { pending.emplace(record->seq, record); continue; }
+
+                if (ErrorPtr logged = jrnl.WriteNextJID(record->next_jid)) Fail(logged);
+                delete record;
+                ++applied;
+                progressed = true;
+            }
+            while (!pending.empty() && pending.begin()->first <= next_seq) {
+                Record* record = pending.begin()->second;
+                pending.erase(pending.begin());
+                Apply(record);
+                next_seq = std::max(next_seq, record->seq + 1);
+                delete record;
+                ++applied;
+                progressed = true;
+            }
+
+            std::unique_lock<std::mutex> lock(mtx);
+            if (progressed) drained.notify_all();
+            if (stop && !progressed) return;
+
+            // A push counted but not yet linked is only moments away.
+            if (!progressed && pushed != popped) {
+                lock.unlock();
+                std::this_thread::yield();
+                continue;
+            }
+            wake.wait(lock, [this] { return stop || pushed != popped; });
+        }
+    }
+
+    void Apply(Record* record)
+    {
+        if (!record->change) return;
+
+        {
+            auto lock = MutationLock(jrnl.doc);
+
+            xmlAddChild(record->release, record->change);
+            Mutated(record->release);
+
+            auto info = jrnl.release_nodes.find(record->release);
+            if (info != jrnl.release_nodes.end()) ++info->second->changes;
+
+            std::lock_guard<std::mutex> map(jrnl.map_lock);
+            jrnl.IndexChange(record->change);
+        }
+
+        if (ErrorPtr logged = jrnl.LogWAL(record->change)) Fail(logged);
+    }
+};
+
+void XmlJrnl::StartWriter()
+{
+    if (writer) return;
+    if (transaction) {
+        err = new Error{lvl::ERR, "Cannot start the journal writer: a transaction is open", XmlNode(transaction).GetPath()};
+        return;
+    }
+
+    // Give every element its JID now, so recording only reads shared ancestors.
+    std::vector<xmlNodePtr> stack;
+    if (xmlNodePtr root = source_doc.doc ? xmlDocGetRootElement(source_doc.doc) : nullptr)
+        stack.push_back(root);
+    while (!stack.empty()) {
+        XmlNode element(stack.back());
+        stack.pop_back();
+
+        uint64_t key;
+        if (!element.JIDValue(key)) { err = element.err; return; }
+        for (xmlNodePtr child = xmlFirstElementChild(element.node); child; child = xmlNextElementSibling(child))
+            stack.push_back(child);
+    }
+
+    writer = new Writer(*this);
+}
+
+void XmlJrnl::StopWriter()
+{
+    if (!writer) return;
+
+    Flush();
+    delete writer;
+    writer = nullptr;
+}
+
+void XmlJrnl::Flush()
+{
+    if (!writer) return;
+    if (ErrorPtr failed = writer->Flush()) err = failed;
+}
+
+ErrorPtr XmlJrnl::Submit(Action& action)
+{
+    if (!writer) {
+        if (action.err) return Report(action.err);
+        if (ErrorPtr logged = LogWAL(action.action_node.node)) return Report(logged);
+        return nullptr;
+    }
+
+    // A record that failed part way is dropped, but its Seq still goes to
+    // the writer, which would otherwise wait for it.
+    if (action.err) {
+        xmlFreeNode(action.action_node.node);
+        action.action_node.node = nullptr;
+    }
+    if (action.seq) writer->Push(action.seq, action.action_node.node, action.release);
+    return action.err ? Report(action.err) : nullptr;
+}
+
+ErrorPtr XmlJrnl::Report(ErrorPtr failure)
+{
+    if (writer)
+        writer->Fail(failure);
+    else
+        err = failure;
+    return failure;
+}
+
+ErrorPtr XmlJrnl::LogAdd(XmlNode& node)
+{
+    JRNL_CHECK_NODE(node);
+
+    ActionAdd action(*this, node);
+    action.Record();
+    return Submit(action);
+}
+
+ErrorPtr XmlJrnl::LogModify(XmlNode& node, const std::string& oldXML)
+{
+    JRNL_CHECK_NODE(node);
+
+    ActionModify action(*this, node, oldXML);
+    action.Record();
+    return Submit(action);
+}
+
+ErrorPtr XmlJrnl::LogModify(XmlNode& node, xmlNodePtr replacement)
+{
+    JRNL_CHECK_NODE(node);
+
+    ActionModify action(*this, node, replacement);
+    action.Record();
+    return Submit(action);
+}
+
+ErrorPtr XmlJrnl::LogMove(XmlNode& node, XmlNode& parent, xmlNodePtr before, xmlNodePtr after)
+{
+    JRNL_CHECK_NODE(node);
+    JRNL_CHECK_NODE(parent);
+
+    ActionMove action(*this, node, parent, before, after);
+    action.Record();
+    return Submit(action);
+}
+
+ErrorPtr XmlJrnl::LogSetAttr(XmlNode& node, const std::string& name, const xmlChar* old)
+{
+    JRNL_CHECK_NODE(node);
+
+    ActionSetAttr action(*this, node, name, old);
+    action.Record();
+    return Submit(action);
+}
+
+ErrorPtr XmlJrnl::LogSetText(XmlNode& node, const std::string& old)
+{
+    JRNL_CHECK_NODE(node);
+
+    ActionSetText action(*this, node, old);
+    action.Record();
+    return Submit(action);
+}
+
+ErrorPtr XmlJrnl::LogDelete(XmlNode& node)
+{
+    JRNL_CHECK_NODE(node);
+
+    ActionDelete action(*this, node);
+    action.Record();
+    return Submit(action);
+}
+
+void XmlJrnl::Undo()
+{
+    Flush();
+
+    if (!active_release.node) {
+        err = new Error{ lvl::ERR, "Cannot undo: journal has no active release", "" };
+        return;
+    }
+    if (transaction) {
+        err = new Error{ lvl::ERR, "Cannot undo while a transaction is open", XmlNode(transaction).GetPath() };
+        return;
+    }
+
+    auto& stack = undo_stacks[active_release.node];
+
+    while (!stack.empty() && IsReversed(stack.back()))
+        stack.pop_back();
+
+    if (stack.empty()) return;
+
+    Undo(XmlNode(stack.back()));
+
+    if (IsReversed(stack.back()))
+        stack.pop_back();
+}
+
+void XmlJrnl::Undo(XmlNode action_node)
+{
+    Flush();
+
+    if (!action_node.node) {
+        err = new Error{lvl::ERR, "Cannot undo: invalid journal action node", ""};
+        return;
+    }
+
+    if (IsReversed(action_node.node))
+        return;
+
+    if (transaction) {
+        err = new Error{lvl::ERR, "Cannot undo while a transaction is open", XmlNode(transaction).GetPath()};
+        return;
+    }
+
+    if (IsNestedChange(action_node.node)) {
+        err = new Error{lvl::ERR, "Cannot undo a Change inside a Transaction on its own", action_node.GetPath()};
+        return;
+    }
+
+    auto lock = MutationLock(source_doc.doc);
+    UndoChange(action_node);
+}
+
+void XmlJrnl::UndoChange(XmlNode action_node)
+{
+    if (IsReversed(action_node.node))
+        return;
+
+    const std::string type = action_node.XPath<std::string>("@Type");
+
+    if (type == "Modify") {
+        ActionModify action(*this, action_node);
+        action.Undo();
+
+        if (action.err)
+            err = action.err;
+
+        return;
+    }
+    else if (type == "Deletion") {
+        ActionDelete action(*this, action_node, true);
+        action.Undo();
+        if (action.err) err = action.err;
+        return;
+    }
+    else if (type == "Add") {
+        ActionAdd action(*this, action_node, true);
+        action.Undo();
+
+        if (action.err)
+            err = action.err;
+
+        return;
+    }
+    else if (type == "Move") {
+        ActionMove action(*this, action_node, true);
+        action.Undo();
+        if (action.err) err = action.err;
+        return;
+    }
+    else if (type == "SetAttr") {
+        ActionSetAttr action(*this, action_node, true);
+        action.Undo();
+        if (action.err) err = action.err;
+        return;
+    }
+    else if (type == "SetText") {
+        ActionSetText action(*this, action_node, true);
+        action.Undo();
+        if (action.err) err = action.err;
+        return;
+    }
+
+    else if (type == "Transaction") {
+        ActionTransaction action(*this, action_node, true);
+        action.Undo();
+        if (action.err) err = action.err;
+        return;
+    }
+
+    err = new Error{lvl::ERR, "Cannot undo: unknown Change Type \"" + type + "\"", action_node.GetPath()};
+}
+
+void XmlJrnl::Undo(std::vector<XmlNode> action_nodes) {
+    for (auto it = action_nodes.rbegin(); it != action_nodes.rend(); ++it) {
+        Undo(*it);
+        if (err) return;
+    }
+}
+
+ErrorPtr XmlJrnl::UndoAll(const std::vector<xmlNodePtr>& changes)
+{
+    const ErrorPtr before = err;
+    auto undo = [&] {
+        for (auto it = changes.rbegin(); it != changes.rend() && err == before; ++it)
+            UndoChange(XmlNode(*it));
+        ErrorPtr failed = err != before ? err : nullptr;
+        err = before;
+        return failed;
+    };
+
+    // Within an outer UndoAll(), whose guard covers these Changes too, or
+    // a single Change, which checks everything before it alters the DOM.
+    if (undo_guard || (changes.size() == 1 && RecordAttr(changes[0], "Type") != "Transaction"))
+        return undo();
+
+    UndoGuard guard(*this, changes);
+    if (ErrorPtr failed = undo()) {
+        guard.Restore();
+        return failed;
+    }
+    return guard.Commit();
+}
+/**
+ * @brief Dotted form of a release-number path, e.g. "0.2.1".
+ */
+static std::string ReleaseName(const std::vector<int>& release)
+{
+    std::string name;
+    for (int n : release) name += (name.empty() ? "" : ".") + std::to_string(n);
+    return name;
+}
+
+void XmlJrnl::RefreshActiveRelease()
+{
+    Flush();
+
+    rel_no.clear();
+    active_release = XmlNode();
+    releases.clear();
+    release_nodes.clear();
+
+    xmlNodePtr root = doc ? xmlDocGetRootElement(doc) : nullptr;
+    std::vector<ReleaseInfo*> roots;
+    const ErrorPtr before = err;
+
+    std::function<void(xmlNodePtr, ReleaseInfo*)> index = [&](xmlNodePtr parent, ReleaseInfo* owner) {
+        for (xmlNodePtr child = xmlFirstElementChild(parent); child && err == before; child = xmlNextElementSibling(child)) {
+            if (xmlStrEqual(child->name, BAD_CAST "Change")) {
+                if (owner) ++owner->changes;
+                continue;
+            }
+            if (!xmlStrEqual(child->name, BAD_CAST "Release")) continue;
+
+            std::vector<int> number = owner ? owner->number : std::vector<int>();
+            const std::string value = RecordAttr(child, "Number");
+            number.push_back(std::atoi(value.c_str()));
+            if (releases.count(number)) {
+                err = new Error{lvl::ERR, "Duplicate Release number in journal", XmlNode(child).GetPath()};
+                return;
+            }
+
+            ReleaseInfo& info = releases[number];
+            info.node = child;
+            info.number = number;
+            info.open = RecordAttr(child, "Open");
+            info.close = RecordAttr(child, "Close");
+            info.parent = owner;
+            (owner ? owner->children : roots).push_back(&info);
+            if (owner && info.close.empty()) ++owner->open_children;
+            release_nodes[child] = &info;
+            index(child, &info);
+        }
+    };
+    if (root) index(root, nullptr);
+    if (err != before) return;
+
+    auto last_open = std::find_if(roots.rbegin(), roots.rend(), [](ReleaseInfo* r) { return r->close.empty(); });
+    if (last_open == roots.rend()) {
+        err = new Error{lvl::ERR, "No open root Release in journal", ""};
+        return;
+    }
+    ActivateRelease(*last_open);
+}
+
+void XmlJrnl::ActivateRelease(ReleaseInfo* release)
+{
+    while (release->open_children) {
+        auto child = std::find_if(release->children.rbegin(), release->children.rend(),
+                                  [](ReleaseInfo* r) { return r->close.empty(); });
+        release = *child;
+    }
+    active_release = XmlNode(release->node);
+    rel_no = release->number;
+}
+
+void XmlJrnl::OpenRelease()
+{
+    Flush();
+
+    if (transaction) {
+        err = new Error{lvl::ERR, "Cannot open a release while a transaction is open", XmlNode(transaction).GetPath()};
+        return;
+    }
+    auto found = release_nodes.find(active_release.node);
+    if (found == release_nodes.end()) {
+        err = new Error{lvl::ERR, "Cannot open a release: journal has no active release", ""};
+        return;
+    }
+    ReleaseInfo* parent = found->second;
+
+    // Numbers normally rise in document order; scan only when they do not.
+    std::vector<int> number = parent->number;
+    number.push_back(parent->children.empty() ? 1 : parent->children.back()->number.back() + 1);
+    if (releases.count(number))
+        for (ReleaseInfo* child : parent->children) number.back() = std::max(number.back(), child->number.back() + 1);
+    const int next = number.back();
+
+    const std::string now = CurrentIsoTimestampUTC();
+    xmlNodePtr node = NewRecordNode(doc, "Release",
+        {{"Number", std::to_string(next)}, {"Open", now}, {"Close", ""}});
+    if (!node) {
+        err = new Error{lvl::ERR, "Cannot open a release: Release node could not be created", ""};
+        return;
+    }
+    {
+        auto lock = MutationLock(doc);
+        xmlAddChild(parent->node, node);
+    }
+    Mutated(parent->node);
+
+    ReleaseInfo& info = releases[number];
+    info.node = node;
+    info.number = number;
+    info.open = now;
+    info.parent = parent;
+    parent->children.push_back(&info);
+    ++parent->open_children;
+    release_nodes[node] = &info;
+
+    active_release = XmlNode(node);
+    rel_no = number;
+
+    if (wal) {
+        wal->AppendRelease(number, now);
+        if (wal->err) err = wal->err;
+    }
+}
+
+void XmlJrnl::CloseRelease()
+{
+    Flush();
+
+    if (transaction) {
+        err = new Error{lvl::ERR, "Cannot close a release while a transaction is open", XmlNode(transaction).GetPath()};
+        return;
+    }
+    auto found = release_nodes.find(active_release.node);
+    if (found == release_nodes.end()) {
+        err = new Error{lvl::ERR, "Cannot close a release: journal has no active release", ""};
+        return;
+    }
+    ReleaseInfo* release = found->second;
+    if (!release->parent) {
+        err = new Error{lvl::ERR, "Cannot close a top-level Release", active_release.GetPath()};
+        return;
+    }
+
+    const std::string now = CurrentIsoTimestampUTC();
+    {
+        auto lock = MutationLock(doc);
+        xmlSetProp(release->node, BAD_CAST "Close", BAD_CAST now.c_str());
+    }
+    Mutated(release->node);
+    release->close = now;
+    --release->parent->open_children;
+
+    ActivateRelease(release->parent);
+
+    if (wal) {
+        wal->AppendClose(release->number, now);
+        if (wal->err) err = wal->err;
+    }
+}
+
+const ReleaseInfo* XmlJrnl::FindRelease(const std::vector<int>& release) const
+{
+    auto found = releases.find(release);
+    return found == releases.end() ? nullptr : &found->second;
+}
+
+std::vector<XmlNode> XmlJrnl::ReleaseChanges(const std::vector<int>& release)
+{
+    Flush();
+
+    std::vector<XmlNode> changes;
+    const ReleaseInfo* info = FindRelease(release);
+    if (!info) {
+        err = new Error{lvl::ERR, "No Release with this number in journal", ReleaseName(release)};
+        return changes;
+    }
+
+    changes.reserve(info->changes);
+    for (xmlNodePtr child = xmlFirstElementChild(info->node); child; child = xmlNextElementSibling(child))
+        if (xmlStrEqual(child->name, BAD_CAST "Change")) changes.emplace_back(child);
+    return changes;
+}
+
+/// Root child subtrees below which BuildJIDMap() does not start threads.
+static const size_t kParallelJIDMapMin = 1024;
+
+/// Slot-order buckets used by BuildJIDMap() to load a large jid_map.
+static const size_t kJIDMapBuckets = 1024;
+
+/**
+ * @brief Append the JIDs of the elements in the subtree at @p top.
+ * @param bad Receives the first element with a malformed JID, if any.
+ */
+static void CollectJIDs(xmlNodePtr top, std::vector<std::pair<uint64_t, xmlNodePtr>>& out, xmlNodePtr& bad)
+{
+    for (xmlNodePtr n = top; n;) {
+        if (n->type == XML_ELEMENT_NODE) {
+            uint64_t key;
+            switch (ReadJID(n, key)) {
+            case 1:  out.emplace_back(key, n); break;
+            case -1: if (!bad) bad = n; break;
+            }
+            if (n->children) { n = n->children; continue; }
+        }
+        while (n != top && !n->next) n = n->parent;
+        if (n == top) break;
+        n = n->next;
+    }
+}
+
+void XmlJrnl::BuildJIDMap(unsigned threads)
+{
+    using clock = std::chrono::steady_clock;
+    const auto start = clock::now();
+
+    jid_map.clear();
+    jid_map_stats = JidMapStats{};
+
+    xmlNodePtr root = source_doc.doc ? xmlDocGetRootElement(source_doc.doc) : nullptr;
+    if (!root) return;
+
+    auto lock = MutationLock(source_doc.doc);
+
+    std::vector<xmlNodePtr> subtrees;
+    for (xmlNodePtr child = root->children; child; child = child->next)
+        if (child->type == XML_ELEMENT_NODE) subtrees.push_back(child);
+
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    if (subtrees.size() < kParallelJIDMapMin) threads = 1;
+
+    // Several runs per thread so that uneven subtrees balance out.
+    const size_t runs = threads > 1 ? std::min(subtrees.size(), size_t(threads) * 4) : 1;
+    std::vector<std::vector<std::pair<uint64_t, xmlNodePtr>>> found(runs);
+    std::vector<xmlNodePtr> bad(runs, nullptr);
+    xmlNodePtr root_bad = nullptr;
+
+    // The root itself, then its subtrees; the root's key goes first.
+    uint64_t root_key;
+    int root_jid = ReadJID(root, root_key);
+    if (root_jid < 0) root_bad = root;
+
+    std::atomic<size_t> next{0};
+    auto work = [&] {
+        for (size_t r; (r = next++) < runs;) {
+            size_t begin = subtrees.size() * r / runs, end = subtrees.size() * (r + 1) / runs;
+            for (size_t i = begin; i < end; ++i) CollectJIDs(subtrees[i], found[r], bad[r]);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < threads; ++t) workers.emplace_back(work);
+    work();
+    for (auto& worker : workers) worker.join();
+
+    const auto walked = clock::now();
+    jid_map_stats.threads = threads;
+    jid_map_stats.walk_ms = std::chrono::duration<double, std::milli>(walked - start).count();
+
+    auto malformed = [this](xmlNodePtr node) {
+        xmlChar* value = xmlGetProp(node, BAD_CAST "JID");
+        err = new Error{ lvl::ERR, "Malformed JID \"" + std::string(value ? (const char*)value : "") + "\"",
+                         XmlNode(node).GetPath() + "/@JID" };
+        xmlFree(value);
+    };
+    if (root_bad) { malformed(root_bad); return; }
+    for (xmlNodePtr node : bad)
+        if (node) { malformed(node); return; }
+
+    size_t total = root_jid == 1;
+    for (auto& run : found) total += run.size();
+    jid_map.reserve(total);
+
+    auto insert = [this](uint64_t key, xmlNodePtr node) {
+        if (jid_map.emplace(key, node).second) return true;
+        err = new Error{ lvl::ERR, "Duplicate JID \"" + JidIndex::String(key) + "\"",
+                         XmlNode(node).GetPath() + "/@JID" };
+        return false;
+    };
+    if (root_jid == 1 && !insert(root_key, root)) return;
+
+    /*
+     * Random inserts into a large table miss the cache on nearly every key.
+     * Each run is instead stably bucketed by the top bits of its keys' home
+     * slots, and the buckets are inserted in slot order across runs, so the
+     * table is written front to back.  Equal keys share a bucket and keep
+     * document order, so duplicates are still found.
+     */
+    const size_t slots = jid_map.slot_count();
+    const size_t buckets = std::min<size_t>(slots, kJIDMapBuckets);
+    if (total < kJIDMapBuckets * 64) {
+        for (auto& run : found)
+            for (auto& [key, node] : run)
+                if (!insert(key, node)) return;
+    } else {
+        const size_t shift = size_t(__builtin_ctzll(slots / buckets));
+        std::vector<std::vector<size_t>> offsets(runs, std::vector<size_t>(buckets + 1, 0));
+
+        std::atomic<size_t> next_run{0};
+        auto order = [&] {
+            for (size_t r; (r = next_run++) < runs;) {
+                std::vector<size_t>& offset = offsets[r];
+                for (auto& entry : found[r]) ++offset[(jid_map.home_slot(entry.first) >> shift) + 1];
+                for (size_t b = 1; b <= buckets; ++b) offset[b] += offset[b - 1];
+
+                std::vector<std::pair<uint64_t, xmlNodePtr>> sorted(found[r].size());
+                std::vector<size_t> fill(offset.begin(), offset.end() - 1);
+                for (auto& entry : found[r]) sorted[fill[jid_map.home_slot(entry.first) >> shift]++] = entry;
+                found[r].swap(sorted);
+            }
+        };
+
+        std::vector<std::thread> sorters;
+        for (unsigned t = 1; t < threads; ++t) sorters.emplace_back(order);
+        order();
+        for (auto& sorter : sorters) sorter.join();
+
+        for (size_t b = 0; b < buckets; ++b)
+            for (size_t r = 0; r < runs; ++r)
+                for (size_t i = offsets[r][b]; i < offsets[r][b + 1]; ++i)
+                    if (!insert(found[r][i].first, found[r][i].second)) return;
+    }
+
+    jid_map_stats.jids = total;
+    jid_map_stats.merge_ms = std::chrono::duration<double, std::milli>(clock::now() - walked).count();
+}
+
+std::string XmlJrnl::JID()
+{
+    return JidIndex::String(JIDKey());
+}
+
+uint64_t XmlJrnl::JIDKey()
+{
+    if (!sequential_jids) {
+        static thread_local std::mt19937_64 rng{std::random_device{}()};
+
+        for (;;) {
+            uint64_t key = rng();
+
+            std::lock_guard<std::mutex> lock(map_lock);
+            if (!jid_map.contains(key))
+                return key;
+        }
+    }
+
+    // One block per thread and journal, so interleaving journals on a
+    // thread does not give up a block each time.  Serials are never reused,
+    // so an entry left by a destroyed journal is only a few idle bytes.
+    struct Block { uint64_t next = 0, end = 0; };
+    static thread_local std::unordered_map<uint64_t, Block> blocks;
+    Block& block = blocks[jid_serial];
+
+    for (;;) {
+        if (block.next == block.end) {
+            const uint64_t size = jid_block ? jid_block : 1;
+            const uint64_t start = next_jid.fetch_add(size);
+            block = Block{start, start + size};
+            PersistNextJID(block.end);
+        }
+
+        uint64_t key = block.next++;
+        if (!jid_mixed) return key;
+
+        std::lock_guard<std::mutex> lock(map_lock);
+        if (!(jid_map.contains(key) || change_index.count(key)))
+            return key;
+    }
+}
+
+/// Largest JID that sequential allocation can continue above without running out.
+static const uint64_t kSequentialJIDLimit = uint64_t{1} << 62;
+
+void XmlJrnl::UseSequentialJIDs()
+{
+    if (sequential_jids) return;
+
+    uint64_t highest = 0;
+    for (auto entry : jid_map) {
+        uint64_t key;
+        if (JidIndex::Key(entry.first, key)) highest = std::max(highest, key);
+    }
+    for (auto& [key, changes] : change_index) highest = std::max(highest, key);
+
+    if (highest < kSequentialJIDLimit)
+        next_jid = std::max<uint64_t>(next_jid, highest + 1);
+    else
+        jid_mixed = true;
+
+    sequential_jids = true;
+    PersistNextJID(next_jid);
+}
+
+void XmlJrnl::LoadJIDCounter()
+{
+    xmlNodePtr root = xmlDocGetRootElement(doc);
+    xmlChar* value = root ? xmlGetProp(root, BAD_CAST "NextJID") : nullptr;
+    if (!value) return;
+
+    uint64_t next;
+    const bool valid = JidIndex::Key(reinterpret_cast<const char*>(value), next) && next > 0;
+    xmlFree(value);
+    if (!valid) {
+        err = new Error{lvl::ERR, "Malformed NextJID", "/JRNL"};
+        return;
+    }
+
+    next_jid = next;
+    jid_persisted = next;
+    UseSequentialJIDs();
+}
+
+void XmlJrnl::PersistNextJID(uint64_t next)
+{
+    std::lock_guard<std::mutex> guard(jid_lock);
+    if (next <= jid_persisted) return;
+    jid_persisted = next;
+
+    // Only the writer touches the journal while it runs.
+    if (writer)
+        writer->PushNextJID(next);
+    else if (ErrorPtr logged = WriteNextJID(next))
+        err = logged;
+}
+
+ErrorPtr XmlJrnl::WriteNextJID(uint64_t next)
+{
+    xmlNodePtr root = xmlDocGetRootElement(doc);
+    if (!root) return nullptr;
+
+    {
+        auto lock = MutationLock(doc);
+        xmlSetProp(root, BAD_CAST "NextJID", BAD_CAST JidIndex::String(next).c_str());
+        Mutated(root);
+    }
+
+    if (!wal) return nullptr;
+    wal->AppendNextJID(next);
+    return wal->err;
+}
+
+void XmlJrnl::BuildChangeIndex()
+{
+    Flush();
+
+    change_index.clear();
+    undo_stacks.clear();
+    timeline.clear();
+
+    auto changes = XPath<std::vector<XmlNode>>("//Change");
+    if (err) return;
+
+    for (auto& change : changes)
+        IndexChange(change.node);
+
+    // Hand-edited journals may list Seq values out of order.
+    auto by_seq = [](const ChangeStamp& a, const ChangeStamp& b) { return a.seq < b.seq; };
+    if (!std::is_sorted(timeline.begin(), timeline.end(), by_seq)) {
+        std::stable_sort(timeline.begin(), timeline.end(), by_seq);
+        for (size_t i = 1; i < timeline.size(); ++i)
+            timeline[i].time_ns = std::max(timeline[i].time_ns, timeline[i - 1].time_ns);
+    }
+}
+
+/**
+ * @brief True for a Release whose Close timestamp is set, as it is on every
+ *        Release nested in it.
+ */
+static bool IsClosedRelease(xmlNodePtr node)
+{
+    if (!xmlStrEqual(node->name, BAD_CAST "Release") || RecordAttr(node, "Close").empty())
+        return false;
+    for (xmlNodePtr child = xmlFirstElementChild(node); child; child = xmlNextElementSibling(child))
+        if (xmlStrEqual(child->name, BAD_CAST "Release") && !IsClosedRelease(child))
+            return false;
+    return true;
+}
+
+/**
+ * @brief Releases folded into @p release: its Checkpoint count, or 1.
+ */
+static size_t CheckpointCount(xmlNodePtr release)
+{
+    const std::string count = RecordAttr(release, "Checkpoint");
+    return count.empty() ? 1 : std::strtoull(count.c_str(), nullptr, 10);
+}
+
+/**
+ * @brief Replace each Release nested in @p release by its Changes, in place.
+ * @param count Receives the checkpoint counts of the removed releases.
+ * @return Number of Release elements removed.
+ */
+static size_t FlattenRelease(xmlNodePtr release, size_t& count)
+{
+    size_t removed = 0;
+    for (xmlNodePtr child = xmlFirstElementChild(release), next; child; child = next) {
+        next = xmlNextElementSibling(child);
+        if (!xmlStrEqual(child->name, BAD_CAST "Release")) continue;
+
+        removed += FlattenRelease(child, count) + 1;
+        count += CheckpointCount(child);
+        for (xmlNodePtr change = xmlFirstElementChild(child), after; change; change = after) {
+            after = xmlNextElementSibling(change);
+            xmlUnlinkNode(change);
+            xmlAddPrevSibling(child, change);
+        }
+        xmlUnlinkNode(child);
+        xmlFreeNode(child);
+    }
+    return removed;
+}
+
+void XmlJrnl::Compact()
+{
+    Flush();
+
+    if (transaction) {
+        err = new Error{lvl::ERR, "Cannot compact while a transaction is open", XmlNode(transaction).GetPath()};
+        return;
+    }
+
+    xmlNodePtr root = xmlDocGetRootElement(doc);
+    if (!root) {
+        err = new Error{lvl::ERR, "Cannot compact: journal has no root element", ""};
+        return;
+    }
+
+    compact_stats = CompactStats();
+    ClearSnapshots();
+    compact_stats.bytes_before = wal ? wal->Size() : XML().size();
+
+    std::vector<xmlNodePtr> checkpoints;
+    {
+        auto lock = MutationLock(doc);
+
+        // Reversed Changes can only be undone again as no-ops.
+        for (auto& change : XPath<std::vector<XmlNode>>("//Release/Change")) {
+            if (!IsReversed(change.node)) continue;
+            xmlUnlinkNode(change.node);
+            xmlFreeNode(change.node);
+            ++compact_stats.dropped;
+        }
+
+        // Squash each run of adjacent closed sibling releases into its first.
+        std::function<void(xmlNodePtr)> squash = [&](xmlNodePtr parent) {
+            xmlNodePtr head = nullptr;
+            size_t count = 0;
+            for (xmlNodePtr child = xmlFirstElementChild(parent), next; child; child = next) {
+                next = xmlNextElementSibling(child);
+                if (!IsClosedRelease(child)) {
+                    if (head) xmlSetProp(head, BAD_CAST "Checkpoint", BAD_CAST std::to_string(count).c_str());
+                    head = nullptr;
+                    if (xmlStrEqual(child->name, BAD_CAST "Release")) squash(child);
+                    continue;
+                }
+
+                if (!head) count = 0;
+                compact_stats.releases += FlattenRelease(child, count);
+                if (!head) {
+                    head = child;
+                    count += CheckpointCount(child);
+                    checkpoints.push_back(head);
+                    continue;
+                }
+
+                count += CheckpointCount(child);
+                for (xmlNodePtr change = xmlFirstElementChild(child), after; change; change = after) {
+                    after = xmlNextElementSibling(change);
+                    xmlUnlinkNode(change);
+                    xmlAddChild(head, change);
+                }
+                xmlSetProp(head, BAD_CAST "Close", BAD_CAST RecordAttr(child, "Close").c_str());
+                xmlUnlinkNode(child);
+                xmlFreeNode(child);
+                ++compact_stats.releases;
+            }
+            if (head) xmlSetProp(head, BAD_CAST "Checkpoint", BAD_CAST std::to_string(count).c_str());
+        };
+        squash(root);
+
+        // Undoing the earliest snapshot of a Modify run restores the state
+        // before the run, provided nothing inside the node changed in between.
+        // jid_map may still name nodes a Modify replaced, so places are looked
+        // up in the live tree.
+        std::unordered_map<uint64_t, xmlNodePtr> live;
+        if (!checkpoints.empty()) {
+            std::vector<xmlNodePtr> pending{xmlDocGetRootElement(source_doc.doc)};
+            while (!pending.empty()) {
+                xmlNodePtr node = pending.back();
+                pending.pop_back();
+                if (!node) continue;
+                uint64_t key;
+                if (ReadJID(node, key) == 1) live[key] = node;
+                for (xmlNodePtr child = xmlFirstElementChild(node); child; child = xmlNextElementSibling(child))
+                    pending.push_back(child);
+            }
+        }
+
+        for (xmlNodePtr checkpoint : checkpoints) {
+            std::unordered_map<uint64_t, xmlNodePtr> runs;  // JID -> earliest snapshot Modify
+            for (xmlNodePtr change = xmlFirstElementChild(checkpoint), next; change; change = next) {
+                next = xmlNextElementSibling(change);
+                const std::string type = RecordAttr(change, "Type");
+                uint64_t key = 0;
+                const bool keyed = JidIndex::Key(RecordAttr(change, "JID"), key);
+                const bool merge = type == "Modify" && keyed && runs.count(key);
+
+                std::unordered_set<std::string> refs, slots;
+                ChangeRefs(change, refs, slots);
+                if (!merge) refs.insert(RecordAttr(change, "JID"));
+                for (xmlNodePtr nested : NestedChanges(change)) {
+                    refs.insert(RecordAttr(nested, "JID"));
+                    ChangeRefs(nested, refs, slots);
+                }
+
+                // A change inside a node ends that node's run; so does one
+                // whose place can no longer be told.
+                for (const std::string& ref : refs) {
+                    if (runs.empty()) break;
+                    uint64_t at;
+                    auto it = JidIndex::Key(ref, at) ? live.find(at) : live.end();
+                    if (it == live.end()) { runs.clear(); break; }
+                    for (xmlNodePtr n = it->second; n && n->type == XML_ELEMENT_NODE; n = n->parent) {
+                        uint64_t inside;
+                        if (ReadJID(n, inside) == 1) runs.erase(inside);
+                    }
+                }
+
+                if (merge) {
+                    xmlUnlinkNode(change);
+                    xmlFreeNode(change);
+                    ++compact_stats.merged;
+                    continue;
+                }
+
+                bool snapshot = type == "Modify" && keyed;
+                for (xmlNodePtr child = xmlFirstElementChild(change); snapshot && child; child = xmlNextElementSibling(child))
+                    if (xmlStrEqual(child->name, BAD_CAST "Delta")) snapshot = false;
+                if (snapshot) runs[key] = change;
+            }
+        }
+    }
+    Mutated(root);
+
+    RefreshActiveRelease();
+    if (err) return;
+
+    BuildChangeIndex();
+    if (err) return;
+
+    if (wal) {
+        const ErrorPtr before = wal->err;
+        wal->Rewrite(root);
+        if (wal->err != before) { err = wal->err; return; }
+
+        wal_changes.clear();
+        auto changes = XPath<std::vector<XmlNode>>("//Release/Change");
+        for (uint64_t i = 0; i < changes.size(); ++i)
+            wal_changes[changes[i].node] = i;
+    }
+
+    compact_stats.bytes_after = wal ? wal->Size() : XML().size();
+}
+
+/**
+ * @brief Last journal record under @p release in document order: the deepest
+ *        last Change or Release, or @p release itself when it is empty.
+ */
+static xmlNodePtr LastRecord(xmlNodePtr release)
+{
+    xmlNodePtr last = release;
+    for (xmlNodePtr child = xmlLastElementChild(last); child; child = xmlLastElementChild(last)) {
+        if (xmlStrEqual(child->name, BAD_CAST "Change")) return child;
+        if (!xmlStrEqual(child->name, BAD_CAST "Release")) break;
+        last = child;
+    }
+    return last;
+}
+
+/**
+ * @brief Journal record after @p node in document order, without entering a
+ *        Change; null after the last one.
+ */
+static xmlNodePtr NextRecord(xmlNodePtr node)
+{
+    xmlNodePtr next = xmlStrEqual(node->name, BAD_CAST "Release") ? xmlFirstElementChild(node) : nullptr;
+    for (xmlNodePtr up = node; !next && up && up->type == XML_ELEMENT_NODE; up = up->parent)
+        next = xmlNextElementSibling(up);
+    return next;
+}
+
+void XmlJrnl::Snapshot()
+{
+    Flush();
+
+    if (transaction) {
+        err = new Error{lvl::ERR, "Cannot take a snapshot while a transaction is open", XmlNode(transaction).GetPath()};
+        return;
+    }
+    if (!active_release.node) {
+        err = new Error{lvl::ERR, "Cannot take a snapshot: journal has no active release", ""};
+        return;
+    }
+
+    std::unique_lock<std::shared_mutex> exclusive(source_doc.mutation_lock);
+    TakeSnapshot(LastRecord(active_release.node));
+}
+
+void XmlJrnl::TakeSnapshot(xmlNodePtr anchor)
+{
+    since_snapshot = 0;
+
+    xmlDocPtr copy = xmlCopyDoc(source_doc.doc, 1);
+    if (!copy) {
+        err = new Error{lvl::ERR, "Could not copy document for a replay snapshot", ""};
+        return;
+    }
+
+    if (!snapshots.empty() && snapshots.back().anchor == anchor) {
+        xmlFreeDoc(snapshots.back().doc);
+        snapshots.back().doc = copy;
+        return;
+    }
+    snapshots.push_back(ReplaySnapshot{anchor, copy});
+
+    if (max_snapshots && snapshots.size() > max_snapshots) {
+        const size_t evicted = snapshots.size() - max_snapshots;
+        for (size_t i = 0; i < evicted; ++i)
+            xmlFreeDoc(snapshots[i].doc);
+        snapshots.erase(snapshots.begin(), snapshots.begin() + evicted);
+    }
+}
+
+void XmlJrnl::DropSnapshots(xmlNodePtr change)
+{
+    if (snapshots.empty()) return;
+    while (IsNestedChange(change)) change = change->parent;
+
+    // The snapshots that include the change are a suffix.
+    size_t keep = snapshots.size();
+    while (keep > 0 && xmlXPathCmpNodes(change, snapshots[keep - 1].anchor) != -1) --keep;
+    for (size_t i = keep; i < snapshots.size(); ++i)
+        xmlFreeDoc(snapshots[i].doc);
+    snapshots.resize(keep);
+}
+
+void XmlJrnl::ClearSnapshots()
+{
+    for (auto& snapshot : snapshots)
+        xmlFreeDoc(snapshot.doc);
+    snapshots.clear();
+    since_snapshot = 0;
+}
+
+void XmlDocDelete::operator()(XmlDoc* state) const
+{
+    if (!state) return;
+    xmlDocPtr dom = state->doc;
+    delete state;
+    xmlFreeDoc(dom);
+}
+
+OwnedXmlDoc XmlJrnl::ReplayTo(const std::vector<int>& release)
+{
+    Flush();
+
+    const auto start = std::chrono::steady_clock::now();
+    replay_stats = ReplayStats();
+
+    // Locate the release by its number path.
+    xmlNodePtr target = xmlDocGetRootElement(doc);
+    std::string name;
+    for (int number : release) {
+        name += (name.empty() ? "" : ".") + std::to_string(number);
+        xmlNodePtr child = target ? xmlFirstElementChild(target) : nullptr;
+        while (child && !(xmlStrEqual(child->name, BAD_CAST "Release") &&
+                          RecordAttr(child, "Number") == std::to_string(number)))
+            child = xmlNextElementSibling(child);
+        target = child;
+    }
+    if (release.empty() || !target) {
+        err = new Error{lvl::ERR, "Cannot replay: journal has no Release " + name, ""};
+        return nullptr;
+    }
+    const xmlNodePtr end = LastRecord(target);
+
+    // Records keep only the state a Change replaced, so a Change undone
+    // after the release closed cannot be given back to the copy.  Stamps
+    // have whole seconds; one undone in the second of the close may be later.
+    const std::string close = RecordAttr(target, "Close");
+    if (!close.empty())
+        for (xmlNodePtr node = xmlFirstElementChild(xmlDocGetRootElement(doc)); node; node = NextRecord(node)) {
+            if (xmlStrEqual(node->name, BAD_CAST "Change") && IsReversed(node) &&
+                RecordAttr(ReversedState(node), "TimeStamp") >= close) {
+                err = new Error{lvl::ERR, "Cannot replay Release " + name +
+                                ": a Change it includes was undone after the release closed", XmlNode(node).GetPath()};
+                return nullptr;
+            }
+            if (node == end) break;
+        }
+
+    // Start from the earliest snapshot that includes the whole release.
+    xmlDocPtr base = source_doc.doc;
+    xmlNodePtr stop = nullptr;
+    for (auto& snapshot : snapshots)
+        if (xmlXPathCmpNodes(end, snapshot.anchor) != -1) {
+            base = snapshot.doc;
+            stop = snapshot.anchor;
+            replay_stats.from_snapshot = true;
+            break;
+        }
+
+    // The unreversed Changes after the release, up to the starting point.
+    std::vector<xmlNodePtr> changes;
+    for (xmlNodePtr node = end; node != stop;) {
+        if (!(node = NextRecord(node))) break;
+        if (xmlStrEqual(node->name, BAD_CAST "Change") && !IsReversed(node))
+            changes.push_back(node);
+    }
+
+    xmlDocPtr copy;
+    {
+        std::unique_lock<std::shared_mutex> exclusive(source_doc.mutation_lock, std::defer_lock);
+        if (base == source_doc.doc) exclusive.lock();
+        copy = xmlCopyDoc(base, 1);
+    }
+    if (!copy) {
+        err = new Error{lvl::ERR, "Could not copy document for replay", ""};
+        return nullptr;
+    }
+    OwnedXmlDoc state(new XmlDoc(copy));
+    if (changes.empty()) {
+        replay_stats.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return state;
+    }
+
+    // Undo them on the copy through a journal of just those Changes.
+    XmlJrnl* scratch = new XmlJrnl(*state, std::string("<JRNL><Release Number=\"0\" Open=\"\" Close=\"\"/></JRNL>"));
+    state->JRNL = scratch;
+    ErrorPtr failed = scratch->err;
+    std::vector<xmlNodePtr> copies;
+    for (size_t i = 0; i < changes.size() && !failed; ++i) {
+        xmlNodePtr copied = xmlDocCopyNode(changes[i], scratch->doc, 1);
+        if (!copied) {
+            failed = new Error{lvl::ERR, "Could not copy journal Change for replay", XmlNode(changes[i]).GetPath()};
+            break;
+        }
+        xmlAddChild(scratch->active_release.node, copied);
+        scratch->IndexChange(copied);
+        copies.push_back(copied);
+    }
+    for (auto it = copies.rbegin(); it != copies.rend() && !failed; ++it) {
+        scratch->Undo(XmlNode(*it));
+        if (!(failed = scratch->err)) ++replay_stats.reversed;
+    }
+
+    // ~XmlDoc() leaves the DOM to its creator.
+    state->JRNL = nullptr;
+    xmlDocPtr scratch_doc = scratch->doc;
+    delete scratch;
+    xmlFreeDoc(scratch_doc);
+
+    if (failed) {
+        err = failed;
+        return nullptr;
+    }
+
+    replay_stats.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return state;
+}
+
+void XmlJrnl::IndexChange(xmlNodePtr change)
+{
+    uint64_t key;
+    if (ReadJID(change, key) == 1)
+        change_index[key].push_back(change);
+
+    // Nested changes are undone with their Transaction, never on their own.
+    if (IsNestedChange(change)) return;
+    StampIndex(change);
+    if (!IsReversed(change))
+        undo_stacks[change->parent].push_back(change);
+}
+
+/**
+ * @brief Nanoseconds since the Unix epoch for an ISO "YYYY-MM-DDTHH:MM:SSZ"
+ *        timestamp; 0 when it does not parse.
+ */
+static int64_t IsoTimeNs(const std::string& iso)
+{
+    std::tm tm{};
+    if (std::sscanf(iso.c_str(), "%d-%d-%dT%d:%d:%dZ", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                    &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+        return 0;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    return int64_t(timegm(&tm)) * 1000000000;
+}
+
+std::pair<std::string, std::string> XmlJrnl::NextStamp()
+{
+    const int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    std::lock_guard<std::mutex> lock(stamp_lock);
+    // Never step back, even when the wall clock does.
+    last_ns = std::max(last_ns, now);
+    return {std::to_string(next_seq++), std::to_string(last_ns)};
+}
+
+void XmlJrnl::StampIndex(xmlNodePtr change)
+{
+    ChangeStamp stamp{0, 0, change};
+    const std::string seq = RecordAttr(change, "Seq");
+    const std::string ns = RecordAttr(change, "TimeNs");
+    stamp.seq = !seq.empty() ? std::strtoull(seq.c_str(), nullptr, 10) : timeline.empty() ? 1 : timeline.back().seq + 1;
+    stamp.time_ns = !ns.empty() ? std::strtoll(ns.c_str(), nullptr, 10) : IsoTimeNs(RecordAttr(change, "TimeStamp"));
+    if (!timeline.empty()) stamp.time_ns = std::max(stamp.time_ns, timeline.back().time_ns);
+
+    {
+        std::lock_guard<std::mutex> lock(stamp_lock);
+        next_seq = std::max(next_seq, stamp.seq + 1);
+        last_ns = std::max(last_ns, stamp.time_ns);
+    }
+    timeline.push_back(stamp);
+}
+
+std::vector<XmlNode> XmlJrnl::ChangesBetween(int64_t from_ns, int64_t to_ns)
+{
+    Flush();
+
+    auto before = [](const ChangeStamp& stamp, int64_t ns) { return stamp.time_ns < ns; };
+    auto first = std::lower_bound(timeline.begin(), timeline.end(), from_ns, before);
+    auto last = from_ns < to_ns ? std::lower_bound(first, timeline.end(), to_ns, before) : first;
+
+    std::vector<XmlNode> changes;
+    changes.reserve(size_t(last - first));
+    for (auto it = first; it != last; ++it) changes.emplace_back(it->change);
+    return changes;
+}
+
+std::vector<XmlNode> XmlJrnl::ChangesSince(uint64_t seq)
+{
+    Flush();
+
+    auto first = std::upper_bound(timeline.begin(), timeline.end(), seq,
+                                  [](uint64_t n, const ChangeStamp& stamp) { return n < stamp.seq; });
+
+    std::vector<XmlNode> changes;
+    changes.reserve(size_t(timeline.end() - first));
+    for (auto it = first; it != timeline.end(); ++it) changes.emplace_back(it->change);
+    return changes;
+}
+
+std::vector<XmlNode> XmlJrnl::History(uint64_t jid)
+{
+    Flush();
+
+    std::vector<XmlNode> history;
+
+    auto it = change_index.find(jid);
+    if (it != change_index.end())
+        history.assign(it->second.begin(), it->second.end());
+    return history;
+}
+
+std::vector<XmlNode> XmlJrnl::History(const std::string& jid)
+{
+    uint64_t key;
+    return JidIndex::Key(jid, key) ? History(key) : std::vector<XmlNode>();
+}
+
+/* -------------------------------------------------------------------------
+ * Journal Action implementations
+ *
+ * Action::Record()/ReverseStamp()/Conflict() contain transaction mechanics
+ * common to all actions.  ActionModify, ActionDelete, and ActionAdd contain
+ * only the payload and inverse operation specific to their mutation type.
+ * ------------------------------------------------------------------------- */
+
+ActionModify::ActionModify(XmlJrnl& j, XmlNode n, const std::string& old)
+    : Action(j), node(n), oldXML(old)
+{
+    type = "Modify";
+    jid = node.JID();
+
+    if (node.err)
+        err = node.err;
+}
+
+ActionModify::ActionModify(XmlJrnl& j, XmlNode n, xmlNodePtr r)
+    : Action(j), node(n), replacement(r)
+{
+    type = "Modify";
+    jid = node.JID();
+
+    if (node.err)
+        err = node.err;
+}
+
+ActionModify::ActionModify(XmlJrnl& j, XmlNode action)
+    : Action(j, action)
+{
+    type = "Modify";
+    jid = action_node.XPath<std::string>("@JID");
+
+    if (action_node.err)
+        err = action_node.err;
+}
+
+void Action::Record()
+{
+    if (type.empty() || jid.empty()) {
+        err = new Error{lvl::ERR, "Cannot record journal action: Type or JID is missing", ""};
+        return;
+    }
+
+    release = jrnl.transaction ? jrnl.transaction : jrnl.active_release.node;
+    if (!release) {
+        err = new Error{lvl::ERR, "Cannot record journal action: journal has no active release", ""};
+        return;
+    }
+
+    const auto [stamp, ns] = jrnl.NextStamp();
+    seq = std::strtoull(stamp.c_str(), nullptr, 10);
+    xmlNodePtr change = NewRecordNode(RecordDoc(), "Change",
+        {{"Type", type}, {"TimeStamp", CurrentIsoTimestampUTC()}, {"TimeNs", ns}, {"Seq", stamp}, {"JID", jid}});
+    xmlNodePtr reversed = NewRecordNode(RecordDoc(), "Reversed", {{"TimeStamp", ""}, {"Value", "false"}});
+
+    if (!change || !reversed || !xmlAddChild(change, reversed)) {
+        xmlFreeNode(reversed);
+        xmlFreeNode(change);
+        err = new Error{lvl::ERR, "Cannot record journal action: Change node could not be created", type};
+        return;
+    }
+
+    // The writer attaches and indexes the Change once it is complete.
+    if (jrnl.writer) {
+        action_node.node = change;
+        return;
+    }
+
+    const bool snapshot = jrnl.snapshot_every && !jrnl.transaction &&
+                          ++jrnl.since_snapshot >= jrnl.snapshot_every;
+    // An Add is recorded after its node is inserted; the other Changes before
+    // they are applied.
+    xmlNodePtr anchor = snapshot && type != "Add" ? LastRecord(release) : nullptr;
+
+    auto lock = MutationLock(jrnl.doc);
+
+    xmlAddChild(release, change);
+    Mutated(release);
+    if (!jrnl.transaction) {
+        auto info = jrnl.release_nodes.find(release);
+        if (info != jrnl.release_nodes.end()) ++info->second->changes;
+    }
+
+    action_node = XmlNode(change);
+    jrnl.IndexChange(change);
+
+    if (snapshot) jrnl.TakeSnapshot(anchor ? anchor : change);
+}
+
+/**
+ * @brief zlib-compress @p data; empty on failure.
+ */
+static std::string Deflate(const std::string& data)
+{
+    uLongf size = compressBound(uLong(data.size()));
+    std::string out(size, '\0');
+    if (compress2(reinterpret_cast<Bytef*>(&out[0]), &size,
+                  reinterpret_cast<const Bytef*>(data.data()), uLong(data.size()), Z_DEFAULT_COMPRESSION) != Z_OK)
+        return std::string();
+    out.resize(size);
+    return out;
+}
+
+/// Most a deflate stream can expand: 258-byte matches coded in under two bits.
+static const size_t kMaxInflateRatio = 1032;
+
+/**
+ * @brief Inflate zlib data of known uncompressed @p size.
+ *
+ * A @p size that @p data could not possibly expand to, as in a damaged or
+ * forged record, fails before anything is allocated.
+ */
+static bool Inflate(const std::string& data, size_t size, std::string& out)
+{
+    if (size > data.size() * kMaxInflateRatio) return false;
+
+    out.assign(size, '\0');
+    uLongf length = size;
+    if (uncompress(reinterpret_cast<Bytef*>(&out[0]), &length,
+                   reinterpret_cast<const Bytef*>(data.data()), uLong(data.size())) != Z_OK || length != size)
+        return false;
+    return true;
+}
+
+/**
+ * @brief Create a detached payload element holding @p xml.
+ *
+ * Payloads of at least @p threshold bytes (when nonzero) that shrink under
+ * zlib are stored as zlib+Base64 with their uncompressed Size; all others
+ * as Base64.
+ */
+static xmlNodePtr NewPayloadNode(xmlDocPtr doc, const char* name, const std::string& xml, size_t threshold)
+{
+    if (threshold && xml.size() >= threshold) {
+        const std::string deflated = Deflate(xml);
+        if (!deflated.empty() && deflated.size() < xml.size())
+            return NewRecordNode(doc, name, {{"Encoding", "zlib+Base64"}, {"Size", std::to_string(xml.size())}},
+                                 base64_encode(deflated));
+    }
+    return NewRecordNode(doc, name, {{"Encoding", "Base64"}}, base64_encode(xml));
+}
+
+/**
+ * @brief Decode a payload element written by NewPayloadNode().
+ * @return False, with @p err set, for an unknown encoding or damaged data.
+ */
+static bool DecodePayload(xmlNodePtr payload, std::string& xml, ErrorPtr& err)
+{
+    xmlChar* content = xmlNodeGetContent(payload);
+    xmlChar* encoding = xmlGetProp(payload, BAD_CAST "Encoding");
+    xmlChar* size = xmlGetProp(payload, BAD_CAST "Size");
+    const std::string text = content ? reinterpret_cast<const char*>(content) : "";
+    const std::string method = encoding ? reinterpret_cast<const char*>(encoding) : "Base64";
+    const std::string length = size ? reinterpret_cast<const char*>(size) : "";
+    xmlFree(content);
+    xmlFree(encoding);
+    xmlFree(size);
+
+    xml.clear();
+    if (text.empty()) return true;
+
+    if (method == "Base64") {
+        xml = base64_decode(text);
+        return true;
+    }
+
+    if (method == "zlib+Base64") {
+        char* end = nullptr;
+        errno = 0;
+        const unsigned long long bytes = std::strtoull(length.c_str(), &end, 10);
+        if (!length.empty() && *end == '\0' && errno != ERANGE && bytes <= SIZE_MAX &&
+            Inflate(base64_decode(text), size_t(bytes), xml))
+            return true;
+        err = new Error{lvl::ERR, "Journal payload cannot be decompressed", ""};
+        return false;
+    }
+
+    err = new Error{lvl::ERR, "Unsupported journal payload encoding \"" + method + "\"", ""};
+    return false;
+}
+
+void Action::AddPayload(const std::string& xml)
+{
+    if (err || !action_node.node) return;
+
+    xmlNodePtr payload = NewPayloadNode(RecordDoc(), "Node", xml, jrnl.compress_threshold);
+    if (!payload) {
+        err = new Error{lvl::ERR, "Cannot record journal action: Node node could not be created", type};
+        return;
+    }
+
+    auto lock = MutationLock(action_node.node->doc);
+
+    xmlAddChild(action_node.node, payload);
+    Mutated(action_node.node);
+}
+
+std::string Action::Payload()
+{
+    xmlNodePtr payload = action_node.node ? xmlFirstElementChild(action_node.node) : nullptr;
+    while (payload && !xmlStrEqual(payload->name, BAD_CAST "Node"))
+        payload = xmlNextElementSibling(payload);
+
+    std::string xml;
+    if (payload && !DecodePayload(payload, xml, err)) xml.clear();
+    return xml;
+}
+
+XmlNode Action::LaterChange()
+{
+    bool after = false;
+    for (XmlNode& change : jrnl.History(jid)) {
+        if (after && !IsReversed(change.node)) return change;
+        if (change.node == action_node.node) after = true;
+    }
+    return XmlNode();
+}
+
+void Action::AddRecordChild(const char* name, RecordAttrs attrs, const std::string& text)
+{
+    if (err || !action_node.node) return;
+
+    xmlNodePtr child = NewRecordNode(RecordDoc(), name, attrs, text);
+    if (!child) {
+        err = new Error{lvl::ERR, std::string("Cannot record journal action: ") + name + " node could not be created", type};
+        return;
+    }
+
+    auto lock = MutationLock(action_node.node->doc);
+
+    xmlAddChild(action_node.node, child);
+    Mutated(action_node.node);
+}
+
+void Action::ReverseStamp()
+{
+    auto reversed = action_node.XPath<std::vector<XmlNode>>("./Reversed");
+
+    if (reversed.size() != 1) {
+        err = new Error{lvl::ERR, "Journal action contains invalid Reversed state", action_node.GetPath()};
+        return;
+    }
 
     const std::string timestamp = CurrentIsoTimestampUTC();
-    xmlSetProp(reversed[0].node, BAD_CAST "TimeStamp", BAD_CAST timestamp.c_str());
+    {
+        auto lock = MutationLock(jrnl.doc);
+        xmlSetProp(reversed[0].node, BAD_CAST "Value", BAD_CAST "true");
+        xmlSetProp(reversed[0].node, BAD_CAST "TimeStamp", BAD_CAST timestamp.c_str());
+    }
+    Mutated(reversed[0].node);
+    jrnl.DropSnapshots(action_node.node);
+
+    if (ErrorPtr logged = jrnl.LogReverse(action_node.node, timestamp))
+        err = logged;
+}
+
+void ActionModify::Record()
+{
+    if (err) return;
+
+    XmlNode parent(node.node->parent);
+    const std::string parent_jid = parent.JID();
+    if (parent.err || parent_jid.empty()) { err = parent.err; return; }
+
+    Action::Record();
+
+    AddRecordChild("Parent", {{"JID", parent_jid}});
+    if (replacement && AddDelta()) return;
+    AddPayload(replacement ? PayloadXML(node.node) : oldXML);
+}
+
+/* -------------------------------------------------------------------------
+ * Delta-encoded Modify
+ *
+ * A Delta lists, by element-index Path from the modified node, each element
+ * whose attribute list differs (Attrs, holding the old start tag) and each
+ * element whose name or non-element content differs (Node, holding the old
+ * subtree).  Paths are taken in the new tree; restoring any entry leaves the
+ * element children of every other path in place, so entries are independent.
+ * The new subtree's hash guards Undo against later changes inside it.
+ * ------------------------------------------------------------------------- */
+
+/// Approximate journal bytes per Delta entry beyond its payload: the
+/// <Attrs Path="" Encoding="Base64"></Attrs> element itself.
+static const size_t kDeltaEntryOverhead = 48;
+
+struct DeltaEntry {
+    std::string path;          ///< Child-element indices from the modified node, '/'-separated.
+    xmlNodePtr old;            ///< Element in the prior subtree.
+    bool whole;                ///< Node (subtree) rather than Attrs.
+};
+
+static bool SameAttributes(xmlNodePtr a, xmlNodePtr b)
+{
+    xmlAttrPtr x = a->properties, y = b->properties;
+    for (; x && y; x = x->next, y = y->next) {
+        if (!xmlStrEqual(x->name, y->name)) return false;
+        if (!xmlStrEqual(x->ns ? x->ns->href : nullptr, y->ns ? y->ns->href : nullptr)) return false;
+
+        xmlNodePtr t = x->children, w = y->children;
+        if (t && w && !t->next && !w->next && t->type == XML_TEXT_NODE && w->type == XML_TEXT_NODE) {
+            if (!xmlStrEqual(t->content, w->content)) return false;
+            continue;
+        }
+
+        xmlChar* u = xmlNodeListGetString(a->doc, x->children, 1);
+        xmlChar* v = xmlNodeListGetString(b->doc, y->children, 1);
+        const bool same = xmlStrEqual(u, v);
+        xmlFree(u);
+        xmlFree(v);
+        if (!same) return false;
+    }
+    return !x && !y;
+}
+
+/**
+ * @brief True when two elements have the same name and the same child
+ *        sequence apart from the content of their element children.
+ */
+static bool SameSkeleton(xmlNodePtr a, xmlNodePtr b)
+{
+    if (!xmlStrEqual(a->name, b->name)) return false;
+    if (!xmlStrEqual(a->ns ? a->ns->href : nullptr, b->ns ? b->ns->href : nullptr)) return false;
+
+    xmlNodePtr x = a->children, y = b->children;
+    for (; x && y; x = x->next, y = y->next) {
+        if (x->type != y->type) return false;
+        if (x->type == XML_ELEMENT_NODE) continue;
+        if (!xmlStrEqual(x->name, y->name) || !xmlStrEqual(x->content, y->content)) return false;
+    }
+    return !x && !y;
+}
+
+static std::string DeltaPath(const std::vector<int>& indices)
+{
+    std::string path;
+    for (int index : indices) {
+        if (!path.empty()) path += '/';
+        path += std::to_string(index);
+    }
+    return path;
+}
+
+/**
+ * @brief Collect the Delta entries from @p a to @p b.
+ * @return SubtreeHash() of @p b, computed in the same walk without caching.
+ */
+static uint64_t DeltaSubtrees(xmlNodePtr a, xmlNodePtr b, std::vector<int>& path, std::vector<DeltaEntry>& entries)
+{
+    if (!SameSkeleton(a, b)) {
+        entries.push_back({DeltaPath(path), a, true});
+        return SubtreeHash(b, false);
+    }
+    if (!SameAttributes(a, b))
+        entries.push_back({DeltaPath(path), a, false});
+
+    uint64_t h = ElementHash(b);
+    path.push_back(0);
+    for (xmlNodePtr x = a->children, y = b->children; x; x = x->next, y = y->next) {
+        if (x->type != XML_ELEMENT_NODE) {
+            h = HashMix(h, LeafHash(y));
+            continue;
+        }
+        h = HashMix(h, DeltaSubtrees(x, y, path, entries));
+        ++path.back();
+    }
+    path.pop_back();
+    return h;
+}
+
+/**
+ * @brief Element at @p path below @p root, or nullptr.
+ */
+static xmlNodePtr DeltaTarget(xmlNodePtr root, const std::string& path)
+{
+    xmlNodePtr node = root;
+    for (size_t pos = 0; node && pos < path.size();) {
+        char* end = nullptr;
+        long index = std::strtol(path.c_str() + pos, &end, 10);
+        if (end == path.c_str() + pos || index < 0) return nullptr;
+        pos = size_t(end - path.c_str());
+        if (pos < path.size() && path[pos++] != '/') return nullptr;
+
+        node = xmlFirstElementChild(node);
+        while (node && index-- > 0) node = xmlNextElementSibling(node);
+    }
+    return node;
+}
+
+static std::string HashString(uint64_t hash)
+{
+    char buffer[17];
+    std::snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(hash));
+    return buffer;
+}
+
+bool ActionModify::AddDelta()
+{
+    if (err || !action_node.node) return true;
+
+    std::vector<DeltaEntry> entries;
+    std::vector<int> path;
+    const uint64_t hash = DeltaSubtrees(node.node, replacement, path, entries);
+
+    // Replacing the whole node is a snapshot by another name.
+    if (!entries.empty() && entries[0].whole && entries[0].path.empty()) return false;
+
+    std::vector<std::string> payloads;
+    size_t bytes = 0;
+    for (const DeltaEntry& entry : entries) {
+        if (entry.whole) {
+            payloads.push_back(PayloadXML(entry.old));
+        } else {
+            xmlNodePtr tag = xmlDocCopyNode(entry.old, entry.old->doc, 2);
+            payloads.push_back(tag ? PayloadXML(tag) : std::string());
+            xmlFreeNode(tag);
+        }
+        bytes += payloads.back().size() + entry.path.size() + kDeltaEntryOverhead;
+    }
+
+    // One entry is a part of the old serialization; several may not beat it.
+    if (entries.size() > 1 && bytes >= PayloadXML(node.node).size()) return false;
+
+    xmlNodePtr delta = NewRecordNode(RecordDoc(), "Delta", {{"Hash", HashString(hash)}});
+    for (size_t i = 0; delta && i < entries.size(); ++i) {
+        xmlNodePtr entry = NewPayloadNode(RecordDoc(), entries[i].whole ? "Node" : "Attrs", payloads[i],
+                                          jrnl.compress_threshold);
+        if (!entry || !xmlNewProp(entry, BAD_CAST "Path", BAD_CAST entries[i].path.c_str())) {
+            xmlFreeNode(entry);
+            xmlFreeNode(delta);
+            delta = nullptr;
+            break;
+        }
+        xmlAddChild(delta, entry);
+    }
+
+    if (!delta) {
+        err = new Error{lvl::ERR, "Cannot record journal action: Delta node could not be created", type};
+        return true;
+    }
+
+    auto lock = MutationLock(action_node.node->doc);
+
+    xmlAddChild(action_node.node, delta);
+    Mutated(action_node.node);
+    return true;
+}
+
+/**
+ * @brief Give @p target the attribute list @p props, keeping its jid_map
+ *        entry on the JID it then has; returns the list it had.
+ */
+static xmlAttrPtr SwapProps(JidIndex& jid_map, xmlNodePtr target, xmlAttrPtr props)
+{
+    uint64_t key;
+    if (ReadJID(target, key) == 1 && jid_map.contains(key) && jid_map[key] == target)
+        jid_map[key] = nullptr;
+
+    xmlAttrPtr previous = target->properties;
+    target->properties = props;
+
+    if (XmlNodeInfo* info = NodeInfo(target)) info->jid_valid = false;
+    if (ReadJID(target, key) == 1) jid_map[key] = target;
+    InvalidateHash(target);
+    return previous;
+}
+
+void ActionModify::UndoDelta(xmlNodePtr current, xmlNodePtr delta)
+{
+    auto journal_path = [this] { return action_node.GetPath(); };
+
+    xmlChar* hash = xmlGetProp(delta, BAD_CAST "Hash");
+    const bool unchanged = hash && HashString(SubtreeHash(current)) == reinterpret_cast<const char*>(hash);
+    xmlFree(hash);
+
+    if (!unchanged) {
+        Conflict("modified node has changed since the delta was recorded", action_node);
+        return;
+    }
+
+    /*
+     * Resolve and parse every entry before touching the live tree.
+     */
+    struct Restore { xmlNodePtr target; xmlNodePtr old; bool whole; };
+    std::vector<Restore> restores;
+
+    auto discard = [&restores] { for (Restore& r : restores) xmlFreeNode(r.old); };
+
+    for (xmlNodePtr entry = xmlFirstElementChild(delta); entry; entry = xmlNextElementSibling(entry)) {
+        const bool whole = xmlStrEqual(entry->name, BAD_CAST "Node");
+        xmlChar* path = xmlGetProp(entry, BAD_CAST "Path");
+        xmlNodePtr target = path ? DeltaTarget(current, reinterpret_cast<const char*>(path)) : nullptr;
+        xmlFree(path);
+
+        std::string xml;
+        xmlNodePtr old = nullptr;
+        if (target && DecodePayload(entry, xml, err))
+            old = XmlNodeFromString(xml, jrnl.source_doc.doc, err);
+
+        if (!old) {
+            discard();
+            if (err) err->data = journal_path();
+            else err = new Error{lvl::ERR, "Cannot undo Modify: delta entry cannot be restored", journal_path()};
+            return;
+        }
+        restores.push_back({target, old, whole});
+    }
+
+    JidIndex* jid_map = &jrnl.jid_map;
+    for (Restore& r : restores) {
+        xmlNodePtr target = r.target, old = r.old;
+        if (r.whole) {
+            RemapJIDs(jrnl.jid_map, target, false);
+            xmlReplaceNode(target, old);
+            RemapJIDs(jrnl.jid_map, old, true);
+            InvalidateHash(old->parent);
+            Revert([jid_map, target, old] {
+                xmlReplaceNode(old, target);
+                RemapJIDs(*jid_map, old, false);
+                RemapJIDs(*jid_map, target, true);
+                xmlFreeNode(old);
+                Mutated(target->parent);
+            }, [target] { xmlFreeNode(target); });
+            continue;
+        }
+
+        xmlAttrPtr previous = SwapProps(jrnl.jid_map, target, xmlCopyPropList(target, old->properties));
+        xmlFreeNode(old);
+        Revert([jid_map, target, previous] {
+            xmlFreePropList(SwapProps(*jid_map, target, previous));
+            Mutated(target);
+        }, [previous] { xmlFreePropList(previous); });
+    }
+
+    Mutated(current);
+    ReverseStamp();
+}
+
+void ActionModify::Undo()
+{
+    if (!action_node.node) {
+        err = new Error{lvl::ERR, "Cannot undo Modify: invalid journal action node", ""};
+        return;
+    }
+
+    // Built only for error reports; GetPath() is linear in the number of sibling Changes.
+    auto journal_path = [this] { return action_node.GetPath(); };
+
+    if (IsReversed(action_node.node))
+        return;
+
+    if (jid.empty()) {
+        err = new Error{lvl::ERR, "Cannot undo Modify: journal transaction has no JID", journal_path()};
+        return;
+    }
+
+    /*
+     * JID must identify the current live incarnation of this logical node.
+     */
+    const std::string parent_jid = action_node.XPath<std::string>("./Parent/@JID");
+
+    if (parent_jid.empty()) {
+        err = new Error{lvl::ERR, "Cannot undo Modify: journal transaction has no Parent JID", journal_path()};
+        return;
+    }
+
+    auto pit = jrnl.jid_map.find(parent_jid);
+
+    if (pit == jrnl.jid_map.end() || !pit->second) {
+        auto causes = jrnl.History(parent_jid);
+
+        if (!causes.empty())
+            Conflict("parent node is no longer available", causes.back());
+        else
+            err = new Error{lvl::ERR, "Cannot undo Modify: parent JID \"" + parent_jid + "\" is not present in the source DOM", journal_path()};
+
+        return;
+    }
+
+    auto it = jrnl.jid_map.find(jid);
+
+    if (it == jrnl.jid_map.end() || !it->second) {
+        auto causes = jrnl.History(jid);
+
+        if (!causes.empty())
+            Conflict("modified node is no longer available", causes.back());
+        else
+            err = new Error{lvl::ERR, "Cannot undo Modify: JID \"" + jid + "\" is not present in the source DOM", journal_path()};
+
+        return;
+    }
+
+    xmlNodePtr current = it->second;
+
+    if (current->doc != jrnl.source_doc.doc) {
+        err = new Error{lvl::ERR, "Cannot undo Modify: JID \"" + jid + "\" belongs to an incompatible DOM", journal_path()};
+        return;
+    }
+
+    xmlNodePtr delta = xmlFirstElementChild(action_node.node);
+    while (delta && !xmlStrEqual(delta->name, BAD_CAST "Delta"))
+        delta = xmlNextElementSibling(delta);
+
+    if (delta) {
+        UndoDelta(current, delta);
+        return;
+    }
+
+    /*
+     * Recover the previous serialized state.
+     */
+    const std::string oldXML = Payload();
+
+    if (err) { err->data = journal_path(); return; }
+    if (oldXML.empty()) {
+        err = new Error{lvl::ERR, "Cannot undo Modify: journal contains no previous node state", journal_path()};
+        return;
+    }
+    xmlNodePtr restored = XmlNodeFromString(oldXML, jrnl.source_doc.doc, err);
+
+    if (!restored) {
+        if (err)
+            err->data = journal_path();
+        else
+            err = new Error{lvl::ERR, "Cannot undo Modify: saved XML cannot be restored", journal_path()};
+
+        return;
+    }
+
+    /*
+     * Saved state must represent the same logical node.
+     */
+    XmlNode restored_node(restored);
+    const std::string restored_jid = restored_node.XPath<std::string>("@JID");
+
+    if (restored_jid != jid) {
+        xmlFreeNode(restored);
+        err = new Error{lvl::ERR, "Cannot undo Modify: saved node JID does not match transaction JID", journal_path()};
+        return;
+    }
+
+    /*
+     * Replace the current physical node with its previous incarnation.
+     */
+    xmlNodePtr replaced = xmlReplaceNode(current, restored);
+
+    if (replaced != current) {
+        xmlFreeNode(restored);
+        err = new Error{lvl::ERR, "Cannot undo Modify: xmlReplaceNode failed", journal_path()};
+        return;
+    }
+
+    /*
+     * Logical identity remains the same; only xmlNodePtr changed.  Nodes
+     * under the replaced incarnation are gone, and those in the saved state
+     * are back.
+     */
+    RemapJIDs(jrnl.jid_map, current, false);
+    RemapJIDs(jrnl.jid_map, restored, true);
+    Mutated(restored->parent);
+
+    JidIndex* jid_map = &jrnl.jid_map;
+    Revert([jid_map, current, restored] {
+        xmlReplaceNode(restored, current);
+        RemapJIDs(*jid_map, restored, false);
+        RemapJIDs(*jid_map, current, true);
+        xmlFreeNode(restored);
+        Mutated(current->parent);
+    }, [current] { xmlFreeNode(current); });
+
+    ReverseStamp();
+}
+
+ActionDelete::ActionDelete(XmlJrnl& j, XmlNode n) : Action(j), node(n) {
+    type = "Deletion";
+    jid = node.JID();
+    if (node.err) err = node.err;
+}
+
+ActionDelete::ActionDelete(XmlJrnl& j, XmlNode action, bool) : Action(j, action) {
+    type = "Deletion";
+    jid = action_node.XPath<std::string>("@JID");
+    if (action_node.err) err = action_node.err;
+}
+
+void ActionDelete::Record()
+{
+    if (err) return;
+
+    XmlNode parent(node.node->parent);
+    std::string parent_jid = parent.JID();
+    if (parent.err || parent_jid.empty()) { err = parent.err; return; }
+
+    // Nearest element siblings, as preceding-/following-sibling::*[1].
+    xmlNodePtr before = xmlPreviousElementSibling(node.node);
+    xmlNodePtr after = xmlNextElementSibling(node.node);
+
+    Action::Record();
+
+    AddRecordChild("Parent", {{"JID", parent_jid}});
+    if (before) AddRecordChild("Before", {{"JID", XmlNode(before).JID()}});
+    if (after)  AddRecordChild("After", {{"JID", XmlNode(after).JID()}});
+    AddPayload(PayloadXML(node.node));
+}
+
+void ActionDelete::Undo()
+{
+    if (!action_node.node) {
+        err = new Error{lvl::ERR, "Cannot undo Deletion: invalid journal action node", ""};
+        return;
+    }
+
+    auto journal_path = [this] { return action_node.GetPath(); };
+
+    if (IsReversed(action_node.node))
+        return;
+
+    if (jid.empty()) {
+        err = new Error{lvl::ERR, "Cannot undo Deletion: journal transaction has no JID", journal_path()};
+        return;
+    }
+
+    const std::string parent_jid = action_node.XPath<std::string>("./Parent/@JID");
+    if (parent_jid.empty()) {
+        err = new Error{lvl::ERR, "Cannot undo Deletion: journal transaction has no Parent JID", journal_path()};
+        return;
+    }
+
+    auto pit = jrnl.jid_map.find(parent_jid);
+    if (pit == jrnl.jid_map.end() || !pit->second) {
+        Conflict("parent node is no longer available", action_node);
+        return;
+    }
+
+    XmlNode parent(pit->second);
+
+    XmlNode before;
+    if (action_node.XPath<bool>("./Before")) {
+        const std::string before_jid = action_node.XPath<std::string>("./Before/@JID");
+        auto it = jrnl.jid_map.find(before_jid);
+
+        if (it == jrnl.jid_map.end() || !it->second) {
+            Conflict("preceding sibling is no longer available", action_node);
+            return;
+        }
+
+        before = XmlNode(it->second);
+
+        if (before.node->parent != parent.node) {
+            Conflict("preceding sibling is no longer under the recorded parent", action_node);
+            return;
+        }
+    }
+
+    XmlNode after;
+    if (action_node.XPath<bool>("./After")) {
+        const std::string after_jid = action_node.XPath<std::string>("./After/@JID");
+        auto it = jrnl.jid_map.find(after_jid);
+
+        if (it == jrnl.jid_map.end() || !it->second) {
+            Conflict("following sibling is no longer available", action_node);
+            return;
+        }
+
+        after = XmlNode(it->second);
+
+        if (after.node->parent != parent.node) {
+            Conflict("following sibling is no longer under the recorded parent", action_node);
+            return;
+        }
+    }
+
+    if (before.node && after.node) {
+        auto next = before.XPath<std::vector<XmlNode>>("following-sibling::*[1]");
+
+        if (next.size() != 1 || next[0].node != after.node) {
+            Conflict("deletion slot has been changed", action_node);
+            return;
+        }
+    }
+
+    if (!before.node && !after.node && parent.XPath<bool>("./*")) {
+        Conflict("parent now contains children that did not exist at deletion", action_node);
+        return;
+    }
+
+    const std::string oldXML = Payload();
+
+    if (err) { err->data = journal_path(); return; }
+    if (oldXML.empty()) {
+        err = new Error{lvl::ERR, "Cannot undo Deletion: journal contains no deleted node", journal_path()};
+        return;
+    }
+    xmlNodePtr restored = XmlNodeFromString(oldXML, jrnl.source_doc.doc, err);
+
+    if (!restored) {
+        if (err) err->data = journal_path();
+        else err = new Error{lvl::ERR, "Cannot undo Deletion: saved XML cannot be restored", journal_path()};
+        return;
+    }
+
+    XmlNode restored_node(restored);
+
+    if (restored_node.XPath<std::string>("@JID") != jid) {
+        xmlFreeNode(restored);
+        err = new Error{lvl::ERR, "Cannot undo Deletion: saved node JID does not match transaction JID", journal_path()};
+        return;
+    }
+
+    xmlNodePtr inserted = nullptr;
+
+    if (before.node)
+        inserted = xmlAddNextSibling(before.node, restored);
+    else if (after.node)
+        inserted = xmlAddPrevSibling(after.node, restored);
+    else
+        inserted = xmlAddChild(parent.node, restored);
+
+    if (!inserted) {
+        xmlFreeNode(restored);
+        err = new Error{lvl::ERR, "Cannot undo Deletion: node could not be restored", journal_path()};
+        return;
+    }
+
+    XmlNode inserted_node(inserted);
+    inserted_node.JID(jid);
+
+    if (inserted_node.err) {
+        err = inserted_node.err;
+        return;
+    }
+    RemapJIDs(jrnl.jid_map, inserted, true);
+
+    Mutated(parent.node);
+
+    JidIndex* jid_map = &jrnl.jid_map;
+    xmlNodePtr container = parent.node;
+    Revert([jid_map, inserted, container] {
+        RemapJIDs(*jid_map, inserted, false);
+        xmlUnlinkNode(inserted);
+        xmlFreeNode(inserted);
+        Mutated(container);
+    });
+
+    ReverseStamp();
 }
 
-void ActionModify::Record()
+ActionAdd::ActionAdd(XmlJrnl& j, XmlNode n) : Action(j), node(n) {
+    type = "Add";
+    jid = node.JID();
+    if (node.err) err = node.err;
+}
+
+ActionAdd::ActionAdd(XmlJrnl& j, XmlNode action, bool) : Action(j, action) {
+    type = "Add";
+    jid = action_node.XPath<std::string>("@JID");
+    if (action_node.err) err = action_node.err;
+}
+
+void ActionAdd::Record()
 {
     if (err) return;
 
-    XmlNode parent = node.XPath<std::vector<XmlNode>>("..")[0];
+    XmlNode parent(node.node->parent);
     const std::string parent_jid = parent.JID();
-    if (parent.err || parent_jid.empty()) { err = parent.err; return; }
 
-    Action::Record();
-    if (err) return;
+    if (parent.err || parent_jid.empty()) {
+        err = parent.err;
+        return;
+    }
+
+    Action::Record();
+
+    AddRecordChild("Parent", {{"JID", parent_jid}});
+}
+
+void ActionAdd::Undo()
+{
+    if (!action_node.node) {
+        err = new Error{lvl::ERR, "Cannot undo Add: invalid journal action node", ""};
+        return;
+    }
+
+    auto journal_path = [this] { return action_node.GetPath(); };
+
+    if (IsReversed(action_node.node))
+        return;
+
+    if (jid.empty()) {
+        err = new Error{lvl::ERR, "Cannot undo Add: journal transaction has no JID", journal_path()};
+        return;
+    }
+
+    const std::string parent_jid = action_node.XPath<std::string>("./Parent/@JID");
+
+    if (parent_jid.empty()) {
+        err = new Error{lvl::ERR, "Cannot undo Add: journal transaction has no Parent JID", journal_path()};
+        return;
+    }
+
+    auto pit = jrnl.jid_map.find(parent_jid);
+
+    if (pit == jrnl.jid_map.end() || !pit->second) {
+        Conflict("parent node is no longer available", action_node);
+        return;
+    }
+
+    auto it = jrnl.jid_map.find(jid);
+
+    if (it == jrnl.jid_map.end() || !it->second) {
+        Conflict("added node is no longer available", action_node);
+        return;
+    }
+
+    xmlNodePtr current = it->second;
+
+    if (current->parent != pit->second) {
+        Conflict("added node is no longer under its recorded parent", action_node);
+        return;
+    }
+
+    /*
+     * Keep the identities reserved in the journal namespace; the entries
+     * for the subtree are nulled, not erased.
+     */
+    xmlNodePtr parent = pit->second, followed = current->next;
+    RemapJIDs(jrnl.jid_map, current, false);
+    xmlUnlinkNode(current);
+    Mutated(parent);
+
+    JidIndex* jid_map = &jrnl.jid_map;
+    Revert([jid_map, current, parent, followed] {
+        if (followed) xmlAddPrevSibling(followed, current);
+        else xmlAddChild(parent, current);
+        RemapJIDs(*jid_map, current, true);
+        Mutated(parent);
+    }, [current] { xmlFreeNode(current); });
+
+    ReverseStamp();
+}
+
+/**
+ * @brief JIDs that undoing a Deletion or Modify brings back: its own and
+ *        every one in its saved XML.
+ */
+static void SavedJIDs(xmlNodePtr change, std::unordered_set<std::string>& jids)
+{
+    const std::string type = RecordAttr(change, "Type");
+    if (type != "Deletion" && type != "Modify") return;
+    jids.insert(RecordAttr(change, "JID"));
+
+    // Payloads are the Node element, or the entries of a Delta.
+    std::function<void(xmlNodePtr)> scan = [&](xmlNodePtr parent) {
+        for (xmlNodePtr child = xmlFirstElementChild(parent); child; child = xmlNextElementSibling(child)) {
+            if (xmlStrEqual(child->name, BAD_CAST "Delta")) { scan(child); continue; }
+            if (!xmlStrEqual(child->name, BAD_CAST "Node") && !xmlStrEqual(child->name, BAD_CAST "Attrs")) continue;
+
+            std::string xml;
+            ErrorPtr ignored = nullptr;
+            if (!DecodePayload(child, xml, ignored)) continue;
+            for (size_t at = xml.find(" JID=\""); at != std::string::npos; at = xml.find(" JID=\"", at + 1)) {
+                const size_t begin = at + 6, end = xml.find('"', begin);
+                if (end != std::string::npos) jids.insert(xml.substr(begin, end - begin));
+            }
+        }
+    };
+    scan(change);
+}
+
+/**
+ * @brief Changes among @p changes whose node is gone from the source DOM.
+ * @param changes Single Changes in record order; they are undone newest first.
+ * @param found Receives the index of each such Change and the JID it lacks.
+ *
+ * A Deletion needs its parent, any other Change its own node, in the source
+ * DOM through all its ancestors.  A node that is gone still counts when a
+ * newer one of @p changes saved it, on its own or inside an ancestor, since
+ * undoing that one brings it back first.
+ */
+static void MissingNodes(XmlJrnl& jrnl, const std::vector<xmlNodePtr>& changes,
+                         std::vector<std::pair<size_t, std::string>>& found)
+{
+    std::unordered_set<std::string> back;    // JIDs the newer Changes bring back
+    size_t saved = changes.size();           // changes[saved..] are read into back
+    for (size_t k = changes.size(); k-- > 0;) {
+        std::unordered_set<std::string> refs, needed;
+        if (RecordAttr(changes[k], "Type") == "Deletion") ChangeRefs(changes[k], refs, needed);
+        else needed.insert(RecordAttr(changes[k], "JID"));
+
+        for (const std::string& jid : needed) {
+            if (jid.empty() || AttachedNode(jrnl, jid)) continue;
+            // Saved XML is decoded only once some node is missing.
+            for (; saved > k + 1; --saved) SavedJIDs(changes[saved - 1], back);
+            if (!back.count(jid)) found.emplace_back(k, jid);
+        }
+    }
+}
+
+void XmlJrnl::BeginTransaction()
+{
+    if (transaction) {
+        err = new Error{lvl::ERR, "Cannot begin a transaction: one is already open", XmlNode(transaction).GetPath()};
+        return;
+    }
+    if (!active_release.node) {
+        err = new Error{lvl::ERR, "Cannot begin a transaction: journal has no active release", ""};
+        return;
+    }
+    if (writer) {
+        err = new Error{lvl::ERR, "Cannot begin a transaction: the journal writer is running", ""};
+        return;
+    }
+
+    const auto [seq, ns] = NextStamp();
+    xmlNodePtr group = NewRecordNode(doc, "Change",
+        {{"Type", "Transaction"}, {"TimeStamp", CurrentIsoTimestampUTC()}, {"TimeNs", ns}, {"Seq", seq}});
+    xmlNodePtr reversed = NewRecordNode(doc, "Reversed", {{"TimeStamp", ""}, {"Value", "false"}});
+
+    if (!group || !reversed || !xmlAddChild(group, reversed)) {
+        xmlFreeNode(reversed);
+        xmlFreeNode(group);
+        err = new Error{lvl::ERR, "Cannot begin a transaction: Change node could not be created", ""};
+        return;
+    }
+
+    auto lock = MutationLock(doc);
+    xmlAddChild(active_release.node, group);
+    Mutated(active_release.node);
+    transaction = group;
+}
+
+void XmlJrnl::Commit()
+{
+    if (!transaction) {
+        err = new Error{lvl::ERR, "Cannot commit: no transaction is open", ""};
+        return;
+    }
+
+    xmlNodePtr group = transaction;
+    transaction = nullptr;
+
+    if (NestedChanges(group).empty()) {
+        xmlNodePtr release = group->parent;
+        {
+            auto lock = MutationLock(doc);
+            xmlUnlinkNode(group);
+            xmlFreeNode(group);
+        }
+        Mutated(release);
+        return;
+    }
+
+    undo_stacks[group->parent].push_back(group);
+    StampIndex(group);
+    auto info = release_nodes.find(group->parent);
+    if (info != release_nodes.end()) ++info->second->changes;
+    if (ErrorPtr logged = LogWAL(group))
+        err = logged;
+}
+
+void XmlJrnl::Rollback()
+{
+    if (!transaction) {
+        err = new Error{lvl::ERR, "Cannot roll back: no transaction is open", ""};
+        return;
+    }
+
+    xmlNodePtr group = transaction;
+    transaction = nullptr;
+    const auto nested = NestedChanges(group);
+
+    ErrorPtr failed = nullptr;
+    std::vector<std::pair<size_t, std::string>> missing;
+    MissingNodes(*this, nested, missing);
+    if (!missing.empty()) {
+        failed = new Error{lvl::INFO, "Conflict: node " + missing[0].second + " is no longer available",
+                           XmlNode(nested[missing[0].first]).GetPath()};
+    }
+    else {
+        auto lock = MutationLock(source_doc.doc);
+        failed = UndoAll(nested);
+    }
+
+    if (failed) {
+        // Keep the group, which is left whole, as an ordinary committed one.
+        undo_stacks[group->parent].push_back(group);
+        StampIndex(group);
+        auto info = release_nodes.find(group->parent);
+        if (info != release_nodes.end()) ++info->second->changes;
+        if (ErrorPtr logged = LogWAL(group)) failed = logged;
+        err = failed;
+        return;
+    }
+
+    for (xmlNodePtr change : nested) {
+        uint64_t key;
+        if (ReadJID(change, key) != 1) continue;
+        auto found = change_index.find(key);
+        if (found == change_index.end()) continue;
+        auto& history = found->second;
+        history.erase(std::remove(history.begin(), history.end(), change), history.end());
+        if (history.empty()) change_index.erase(found);
+    }
+
+    xmlNodePtr release = group->parent;
+    {
+        auto lock = MutationLock(doc);
+        xmlUnlinkNode(group);
+        xmlFreeNode(group);
+    }
+    Mutated(release);
+}
+
+ActionTransaction::ActionTransaction(XmlJrnl& j, XmlNode action, bool) : Action(j, action) {
+    type = "Transaction";
+}
+
+/**
+ * @brief Unreversed Changes recorded after @p start that interfere with @p changes.
+ * @param found Receives each interfering Change and the JID it collides on.
+ * @param all Keep looking after the first one.
+ *
+ * A later Change interferes when it touches a node the changes touch, changes
+ * a node they refer to other than by SetAttr, adds, moves, or deletes under a
+ * parent whose slots they restore, or refers to a node inside one that they
+ * add or modify, which undoing them would replace.  The subtree of @p start
+ * is not searched.
+ */
+static void LaterChanges(XmlJrnl& jrnl, xmlNodePtr start, const std::vector<xmlNodePtr>& changes,
+                         std::vector<std::pair<xmlNodePtr, std::string>>& found, bool all)
+{
+    std::unordered_set<std::string> touched, context, restored, unused;
+    std::unordered_set<xmlNodePtr> replaced;
+    for (xmlNodePtr change : changes) {
+        if (IsReversed(change)) continue;
+        std::string jid = RecordAttr(change, "JID");
+        if (!jid.empty()) touched.insert(jid);
+        // Only deletions and moves put nodes back into a parent's child list.
+        const std::string type = RecordAttr(change, "Type");
+        ChangeRefs(change, context, (type == "Deletion" || type == "Move") ? restored : unused);
+        if (type == "Add" || type == "Modify")
+            if (xmlNodePtr node = AttachedNode(jrnl, jid)) replaced.insert(node);
+    }
+
+    // JID of a live node under one of the replaced ones, among @p jids.
+    auto inside = [&](const std::unordered_set<std::string>& jids) {
+        for (const std::string& jid : jids) {
+            xmlNodePtr node = replaced.empty() ? nullptr : AttachedNode(jrnl, jid);
+            for (xmlNodePtr up = node ? node->parent : nullptr; up && up->type == XML_ELEMENT_NODE; up = up->parent)
+                if (replaced.count(up)) return jid;
+        }
+        return std::string();
+    };
+
+    // One document-order walk over everything recorded afterwards.
+    xmlNodePtr node = start;
+    while (node) {
+        xmlNodePtr next = nullptr;
+        if (node != start && node->type == XML_ELEMENT_NODE) {
+            const bool change = xmlStrEqual(node->name, BAD_CAST "Change");
+            if (change && !IsReversed(node)) {
+                const std::string type = RecordAttr(node, "Type");
+                if (type == "Transaction") {
+                    next = xmlFirstElementChild(node);
+                }
+                else {
+                    const std::string jid = RecordAttr(node, "JID");
+                    std::string hit;
+                    if (touched.count(jid) || (context.count(jid) && type != "SetAttr"))
+                        hit = jid;
+
+                    std::unordered_set<std::string> refs, slots;
+                    ChangeRefs(node, refs, slots);
+                    for (const std::string& parent : slots)
+                        if (hit.empty() && restored.count(parent)) hit = parent;
+                    if (hit.empty() && !replaced.empty()) {
+                        refs.insert(jid);
+                        hit = inside(refs);
+                    }
+
+                    if (!hit.empty()) {
+                        found.emplace_back(node, hit);
+                        if (!all) return;
+                    }
+                }
+            }
+            else if (!change) {
+                next = xmlFirstElementChild(node);
+            }
+        }
 
-    action_node.AddChild("<Parent JID=\"" + parent_jid + "\"/>");
-    if (action_node.err) { err = action_node.err; return; }
+        // Descend where asked; otherwise step past this subtree.
+        for (xmlNodePtr up = node; !next && up && up->type == XML_ELEMENT_NODE; up = up->parent)
+            next = xmlNextElementSibling(up);
+        node = next;
+    }
+}
 
-    action_node.AddChild("<Node Encoding=\"Base64\">" + base64_encode(oldXML) + "</Node>");
-    if (action_node.err) err = action_node.err;
+XmlNode ActionTransaction::LaterConflict(const std::vector<xmlNodePtr>& nested)
+{
+    std::vector<std::pair<xmlNodePtr, std::string>> found;
+    LaterChanges(jrnl, action_node.node, nested, found, false);
+    return found.empty() ? XmlNode() : XmlNode(found[0].first);
 }
 
-void ActionModify::Undo()
+void ActionTransaction::Undo()
 {
     if (!action_node.node) {
-        err = new Error{lvl::ERR, "Cannot undo Modify: invalid journal action node", ""};
+        err = new Error{lvl::ERR, "Cannot undo Transaction: invalid journal action node", ""};
         return;
     }
 
-    const std::string journal_path = action_node.GetPath();
-
-    if (action_node.XPath<bool>("./Reversed[@Value='true']"))
+    if (IsReversed(action_node.node))
         return;
 
-    if (jid.empty()) {
-        err = new Error{lvl::ERR, "Cannot undo Modify: journal transaction has no JID", journal_path};
+    const auto nested = NestedChanges(action_node.node);
+
+    if (XmlNode cause = LaterConflict(nested); cause.node) {
+        Conflict("a later change touches the transaction's nodes", cause);
         return;
     }
 
-    /*
-     * JID must identify the current live incarnation of this logical node.
-     */
-    const std::string parent_jid = action_node.XPath<std::string>("./Parent/@JID");
-
-    if (parent_jid.empty()) {
-        err = new Error{lvl::ERR, "Cannot undo Modify: journal transaction has no Parent JID", journal_path};
+    std::vector<std::pair<size_t, std::string>> missing;
+    MissingNodes(jrnl, nested, missing);
+    if (!missing.empty()) {
+        Conflict("node " + missing[0].second + " is no longer available", XmlNode(nested[missing[0].first]));
         return;
     }
 
-    auto pit = jrnl.jid_map.find(parent_jid);
-
-    if (pit == jrnl.jid_map.end() || !pit->second) {
-        auto causes = jrnl.XPath<std::vector<XmlNode>>("//Change[@JID='" + parent_jid + "']");
-
-        if (!causes.empty())
-            Conflict("parent node is no longer available", causes.back());
-        else
-            err = new Error{lvl::ERR, "Cannot undo Modify: parent JID \"" + parent_jid + "\" is not present in the source DOM", journal_path};
-
+    if (ErrorPtr failed = jrnl.UndoAll(nested)) {
+        err = failed;
         return;
     }
 
-    auto it = jrnl.jid_map.find(jid);
+    ReverseStamp();
+}
 
-    if (it == jrnl.jid_map.end() || !it->second) {
-        auto causes = jrnl.XPath<std::vector<XmlNode>>("//Change[@JID='" + jid + "']");
+void XmlJrnl::UndoRelease(const std::vector<int>& release)
+{
+    Flush();
 
-        if (!causes.empty())
-            Conflict("modified node is no longer available", causes.back());
-        else
-            err = new Error{lvl::ERR, "Cannot undo Modify: JID \"" + jid + "\" is not present in the source DOM", journal_path};
+    release_undo = ReleaseUndo();
 
+    if (transaction) {
+        err = new Error{lvl::ERR, "Cannot undo a release while a transaction is open", XmlNode(transaction).GetPath()};
         return;
     }
-
-    xmlNodePtr current = it->second;
-
-    if (current->doc != jrnl.source_doc.doc) {
-        err = new Error{lvl::ERR, "Cannot undo Modify: JID \"" + jid + "\" belongs to an incompatible DOM", journal_path};
+    const ReleaseInfo* info = FindRelease(release);
+    if (!info) {
+        err = new Error{lvl::ERR, "Cannot undo: journal has no Release " + ReleaseName(release), ""};
         return;
     }
 
+    // Unreversed Changes of the release and its nested releases, in record order.
+    std::vector<xmlNodePtr> changes;
+    std::function<void(xmlNodePtr)> collect = [&](xmlNodePtr parent) {
+        for (xmlNodePtr child = xmlFirstElementChild(parent); child; child = xmlNextElementSibling(child)) {
+            if (xmlStrEqual(child->name, BAD_CAST "Release")) collect(child);
+            else if (xmlStrEqual(child->name, BAD_CAST "Change") && !IsReversed(child)) changes.push_back(child);
+        }
+    };
+    collect(info->node);
+    release_undo.changes = changes.size();
+
     /*
-     * Recover the previous serialized state.
+     * Link Changes that share a node, parent, or sibling into groups.  flat
+     * holds every single Change, with a Transaction's nested ones in place of
+     * the group, and unit the index of the Change it belongs to.
      */
-    const std::string encoded = action_node.XPath<std::string>("./Node");
-
-    if (encoded.empty()) {
-        err = new Error{lvl::ERR, "Cannot undo Modify: journal contains no previous node state", journal_path};
-        return;
-    }
-
-    const std::string oldXML = base64_decode(encoded);
-    xmlNodePtr restored = XmlNodeFromString(oldXML, jrnl.source_doc.doc, err);
-
-    if (!restored) {
-        if (err)
-            err->data = journal_path;
-        else
-            err = new Error{lvl::ERR, "Cannot undo Modify: saved XML cannot be restored", journal_path};
-
-        return;
+    std::vector<xmlNodePtr> flat;
+    std::vector<size_t> unit, group(changes.size());
+    std::unordered_map<std::string, size_t> first;      // JID -> first Change referring to it
+    std::unordered_map<std::string, size_t> newest;     // JID -> newest Change referring to it
+    auto find = [&group](size_t i) {
+        while (group[i] != i) i = group[i] = group[group[i]];
+        return i;
+    };
+    for (size_t i = 0; i < changes.size(); ++i) {
+        group[i] = i;
+        std::vector<xmlNodePtr> parts = RecordAttr(changes[i], "Type") == "Transaction"
+                                      ? NestedChanges(changes[i]) : std::vector<xmlNodePtr>{changes[i]};
+        for (xmlNodePtr part : parts) {
+            std::unordered_set<std::string> refs, slots;
+            ChangeRefs(part, refs, slots);
+            refs.insert(RecordAttr(part, "JID"));
+            for (const std::string& ref : refs) {
+                if (ref.empty()) continue;
+                auto [it, fresh] = first.emplace(ref, i);
+                if (!fresh) group[find(i)] = find(it->second);
+                newest[ref] = i;
+            }
+            flat.push_back(part);
+            unit.push_back(i);
+        }
     }
+    for (size_t i = 0; i < changes.size(); ++i)
+        if (find(i) == i) ++release_undo.groups;
 
     /*
-     * Saved state must represent the same logical node.
+     * Report every conflict before changing anything: later Changes that
+     * interfere, then nodes that are gone with no newer Change in the release
+     * that could bring them back.
      */
-    XmlNode restored_node(restored);
-    const std::string restored_jid = restored_node.XPath<std::string>("@JID");
-
-    if (restored_jid != jid) {
-        xmlFreeNode(restored);
-        err = new Error{lvl::ERR, "Cannot undo Modify: saved node JID does not match transaction JID", journal_path};
-        return;
+    std::vector<std::pair<xmlNodePtr, std::string>> later;
+    LaterChanges(*this, info->node, flat, later, true);
+    std::unordered_set<size_t> blocked;
+    for (const auto& [cause, jid] : later) {
+        const size_t i = newest[jid];
+        blocked.insert(i);
+        release_undo.conflicts.push_back({XmlNode(changes[i]), XmlNode(cause), "a later change touches node " + jid});
     }
 
-    /*
-     * Replace the current physical node with its previous incarnation.
-     */
-    xmlNodePtr replaced = xmlReplaceNode(current, restored);
+    std::vector<std::pair<size_t, std::string>> missing;
+    MissingNodes(*this, flat, missing);
+    for (const auto& [k, jid] : missing) {
+        if (!blocked.insert(unit[k]).second) continue;
+        release_undo.conflicts.push_back({XmlNode(changes[unit[k]]), XmlNode(flat[k]),
+                                          "node " + jid + " is no longer available"});
+    }
 
-    if (replaced != current) {
-        xmlFreeNode(restored);
-        err = new Error{lvl::ERR, "Cannot undo Modify: xmlReplaceNode failed", journal_path};
+    if (!release_undo.conflicts.empty()) {
+        err = new Error{lvl::INFO, "Conflict: " + std::to_string(release_undo.conflicts.size()) +
+                                   " change(s) block undoing Release " + ReleaseName(release),
+                        release_undo.conflicts[0].cause.GetPath()};
         return;
     }
 
-    xmlFreeNode(current);
-
-    /*
-     * Logical identity remains the same; only xmlNodePtr changed.
-     */
-    jrnl.jid_map[jid] = restored;
-
-    ReverseStamp();
+    auto lock = MutationLock(source_doc.doc);
+    if (ErrorPtr failed = UndoAll(changes)) err = failed;
 }
 
-ActionDelete::ActionDelete(XmlJrnl& j, XmlNode n) : Action(j), node(n) {
-    type = "Deletion";
+ActionMove::ActionMove(XmlJrnl& j, XmlNode n, XmlNode to, xmlNodePtr prev, xmlNodePtr next)
+    : Action(j), node(n), parent(to), before(prev), after(next)
+{
+    type = "Move";
     jid = node.JID();
     if (node.err) err = node.err;
 }
 
-ActionDelete::ActionDelete(XmlJrnl& j, XmlNode action, bool) : Action(j, action) {
-    type = "Deletion";
+ActionMove::ActionMove(XmlJrnl& j, XmlNode action, bool) : Action(j, action) {
+    type = "Move";
     jid = action_node.XPath<std::string>("@JID");
     if (action_node.err) err = action_node.err;
 }
 
-void ActionDelete::Record()
+void ActionMove::Record()
 {
     if (err) return;
 
-    XmlNode parent = node.XPath<std::vector<XmlNode>>("..")[0];
-    std::string parent_jid = parent.JID();
-    if (parent.err || parent_jid.empty()) { err = parent.err; return; }
-
-    XmlNode before;
-    auto before_nodes = node.XPath<std::vector<XmlNode>>("preceding-sibling::*[1]");
-    if (!before_nodes.empty()) before = before_nodes[0];
+    // JIDs of a slot's parent and nearest element siblings, as Delete records them.
+    auto slot_jids = [this](std::initializer_list<xmlNodePtr> nodes, std::string* jids) {
+        for (xmlNodePtr n : nodes) {
+            if (n) {
+                XmlNode wrapped(n);
+                *jids = wrapped.JID();
+                if (wrapped.err || jids->empty()) { err = wrapped.err; return false; }
+            }
+            ++jids;
+        }
+        return true;
+    };
 
-    XmlNode after;
-    auto after_nodes = node.XPath<std::vector<XmlNode>>("following-sibling::*[1]");
-    if (!after_nodes.empty()) after = after_nodes[0];
+    std::string from[3], to[3];
+    if (!slot_jids({node.node->parent, xmlPreviousElementSibling(node.node), xmlNextElementSibling(node.node)}, from) ||
+        !slot_jids({parent.node, before, after}, to))
+        return;
 
     Action::Record();
-    if (err) return;
-
-    action_node.AddChild("<Parent JID=\"" + parent_jid + "\"/>");
-    if (action_node.err) { err = action_node.err; return; }
-
-    if (before.node) {
-        action_node.AddChild("<Before JID=\"" + before.JID() + "\"/>");
-        if (action_node.err) { err = action_node.err; return; }
-    }
 
-    if (after.node) {
-        action_node.AddChild("<After JID=\"" + after.JID() + "\"/>");
-        if (action_node.err) { err = action_node.err; return; }
-    }
+    auto add_slot = [this](const char* name, const std::string* jids) {
+        if (!jids[1].empty() && !jids[2].empty())
+            AddRecordChild(name, {{"Parent", jids[0]}, {"Before", jids[1]}, {"After", jids[2]}});
+        else if (!jids[1].empty())
+            AddRecordChild(name, {{"Parent", jids[0]}, {"Before", jids[1]}});
+        else if (!jids[2].empty())
+            AddRecordChild(name, {{"Parent", jids[0]}, {"After", jids[2]}});
+        else
+            AddRecordChild(name, {{"Parent", jids[0]}});
+    };
+    add_slot("From", from);
+    add_slot("To", to);
+}
 
-    action_node.AddChild("<Node Encoding=\"Base64\">" + base64_encode(node.XML()) + "</Node>");
-    if (action_node.err) err = action_node.err;
+/**
+ * @brief Live node for one JID attribute of a Move slot record.
+ * @return False when the attribute is present but its node is gone.
+ */
+static bool SlotNode(XmlJrnl& jrnl, xmlNodePtr slot, const char* attr, xmlNodePtr& live)
+{
+    live = nullptr;
+    xmlChar* value = xmlGetProp(slot, BAD_CAST attr);
+    if (!value) return true;
+
+    auto it = jrnl.jid_map.find(reinterpret_cast<const char*>(value));
+    xmlFree(value);
+    if (it == jrnl.jid_map.end() || !it->second) return false;
+    live = it->second;
+    return true;
 }
 
-void ActionDelete::Undo()
+void ActionMove::Undo()
 {
-    if (!action_node.node) {
-        err = new Error{lvl::ERR, "Cannot undo Deletion: invalid journal action node", ""};
+    if (action_node.node && IsReversed(action_node.node))
         return;
-    }
 
-    const std::string journal_path = action_node.GetPath();
+    xmlNodePtr current = InPlaceTarget("Move");
+    if (!current) return;
 
-    if (action_node.XPath<bool>("./Reversed[@Value='true']"))
-        return;
-
-    if (jid.empty()) {
-        err = new Error{lvl::ERR, "Cannot undo Deletion: journal transaction has no JID", journal_path};
+    xmlNodePtr from = nullptr, to = nullptr;
+    for (xmlNodePtr child = xmlFirstElementChild(action_node.node); child; child = xmlNextElementSibling(child)) {
+        if (xmlStrEqual(child->name, BAD_CAST "From")) from = child;
+        else if (xmlStrEqual(child->name, BAD_CAST "To")) to = child;
+    }
+    if (!from || !to) {
+        err = new Error{lvl::ERR, "Cannot undo Move: journal transaction has no From/To slot", action_node.GetPath()};
         return;
     }
 
-    const std::string parent_jid = action_node.XPath<std::string>("./Parent/@JID");
-    if (parent_jid.empty()) {
-        err = new Error{lvl::ERR, "Cannot undo Deletion: journal transaction has no Parent JID", journal_path};
+    xmlNodePtr to_parent, from_parent, prev, next;
+    if (!SlotNode(jrnl, to, "Parent", to_parent) || !to_parent || current->parent != to_parent) {
+        Conflict("moved node is no longer under its recorded parent", action_node);
         return;
     }
-
-    auto pit = jrnl.jid_map.find(parent_jid);
-    if (pit == jrnl.jid_map.end() || !pit->second) {
-        Conflict("parent node is no longer available", action_node);
+    if (!SlotNode(jrnl, from, "Parent", from_parent) || !from_parent) {
+        Conflict("original parent is no longer available", action_node);
         return;
     }
-
-    XmlNode parent(pit->second);
-
-    XmlNode before;
-    if (action_node.XPath<bool>("./Before")) {
-        const std::string before_jid = action_node.XPath<std::string>("./Before/@JID");
-        auto it = jrnl.jid_map.find(before_jid);
-
-        if (it == jrnl.jid_map.end() || !it->second) {
-            Conflict("preceding sibling is no longer available", action_node);
+    for (xmlNodePtr up = from_parent; up; up = up->parent)
+        if (up == current) {
+            Conflict("original parent is now inside the moved node", action_node);
             return;
         }
 
-        before = XmlNode(it->second);
-
-        if (before.node->parent != parent.node) {
-            Conflict("preceding sibling is no longer under the recorded parent", action_node);
-            return;
-        }
+    if (!SlotNode(jrnl, from, "Before", prev) || (prev && prev->parent != from_parent)) {
+        Conflict("preceding sibling is no longer under the recorded parent", action_node);
+        return;
+    }
+    if (!SlotNode(jrnl, from, "After", next) || (next && next->parent != from_parent)) {
+        Conflict("following sibling is no longer under the recorded parent", action_node);
+        return;
     }
 
-    XmlNode after;
-    if (action_node.XPath<bool>("./After")) {
-        const std::string after_jid = action_node.XPath<std::string>("./After/@JID");
-        auto it = jrnl.jid_map.find(after_jid);
+    // The original slot must still be one gap, ignoring the node being moved back.
+    bool intact;
+    if (prev)
+        intact = ElementSibling(prev, true, current) == next;
+    else if (next)
+        intact = !ElementSibling(next, false, current);
+    else {
+        xmlNodePtr first = xmlFirstElementChild(from_parent);
+        intact = !first || (first == current && !ElementSibling(first, true, current));
+    }
+    if (!intact) {
+        Conflict("original slot has been changed", action_node);
+        return;
+    }
 
-        if (it == jrnl.jid_map.end() || !it->second) {
-            Conflict("following sibling is no longer available", action_node);
-            return;
-        }
+    xmlNodePtr followed = current->next;
+    Relink(current, from_parent, prev, next);
+
+    Mutated(to_parent);
+    Mutated(from_parent);
+    Revert([current, to_parent, from_parent, followed] {
+        xmlUnlinkNode(current);
+        if (followed) xmlAddPrevSibling(followed, current);
+        else xmlAddChild(to_parent, current);
+        xmlReconciliateNs(current->doc, current);
+        Mutated(to_parent);
+        Mutated(from_parent);
+    });
+    ReverseStamp();
+}
 
-        after = XmlNode(it->second);
+ActionSetAttr::ActionSetAttr(XmlJrnl& j, XmlNode n, const std::string& attr, const xmlChar* value)
+    : Action(j), node(n), name(attr), old(value)
+{
+    type = "SetAttr";
+    jid = node.JID();
+    if (node.err) err = node.err;
+}
 
-        if (after.node->parent != parent.node) {
-            Conflict("following sibling is no longer under the recorded parent", action_node);
-            return;
-        }
-    }
+ActionSetAttr::ActionSetAttr(XmlJrnl& j, XmlNode action, bool) : Action(j, action) {
+    type = "SetAttr";
+    jid = action_node.XPath<std::string>("@JID");
+    if (action_node.err) err = action_node.err;
+}
 
-    if (before.node && after.node) {
-        auto next = before.XPath<std::vector<XmlNode>>("following-sibling::*[1]");
+void ActionSetAttr::Record()
+{
+    if (err) return;
 
-        if (next.size() != 1 || next[0].node != after.node) {
-            Conflict("deletion slot has been changed", action_node);
-            return;
-        }
-    }
+    Action::Record();
 
-    if (!before.node && !after.node && parent.XPath<bool>("./*")) {
-        Conflict("parent now contains children that did not exist at deletion", action_node);
+    if (!old) {
+        AddRecordChild("Attr", {{"Name", name}});
         return;
     }
 
-    const std::string encoded = action_node.XPath<std::string>("./Node");
+    // The following attribute lets Undo() put a removed one back in place.
+    xmlAttrPtr attr = ElementAttr(node.node, BAD_CAST name.c_str());
+    if (attr && attr->next)
+        AddRecordChild("Attr", {{"Name", name}, {"Old", reinterpret_cast<const char*>(old)},
+                                {"Before", reinterpret_cast<const char*>(attr->next->name)}});
+    else
+        AddRecordChild("Attr", {{"Name", name}, {"Old", reinterpret_cast<const char*>(old)}});
+}
 
-    if (encoded.empty()) {
-        err = new Error{lvl::ERR, "Cannot undo Deletion: journal contains no deleted node", journal_path};
-        return;
+xmlNodePtr Action::InPlaceTarget(const char* what)
+{
+    if (!action_node.node) {
+        err = new Error{lvl::ERR, std::string("Cannot undo ") + what + ": invalid journal action node", ""};
+        return nullptr;
+    }
+    if (jid.empty()) {
+        err = new Error{lvl::ERR, std::string("Cannot undo ") + what + ": journal transaction has no JID",
+                         action_node.GetPath()};
+        return nullptr;
     }
 
-    const std::string oldXML = base64_decode(encoded);
-    xmlNodePtr restored = XmlNodeFromString(oldXML, jrnl.source_doc.doc, err);
+    auto it = jrnl.jid_map.find(jid);
+    if (it == jrnl.jid_map.end() || !it->second) {
+        auto causes = jrnl.History(jid);
+        Conflict("changed node is no longer available", causes.empty() ? action_node : causes.back());
+        return nullptr;
+    }
+    return it->second;
+}
 
-    if (!restored) {
-        if (err) err->data = journal_path;
-        else err = new Error{lvl::ERR, "Cannot undo Deletion: saved XML cannot be restored", journal_path};
+void ActionSetAttr::Undo()
+{
+    if (action_node.node && IsReversed(action_node.node))
         return;
-    }
 
-    XmlNode restored_node(restored);
+    xmlNodePtr current = InPlaceTarget("SetAttr");
+    if (!current) return;
 
-    if (restored_node.XPath<std::string>("@JID") != jid) {
-        xmlFreeNode(restored);
-        err = new Error{lvl::ERR, "Cannot undo Deletion: saved node JID does not match transaction JID", journal_path};
+    XmlNode later = LaterChange();
+    if (later.node) {
+        Conflict("node has been changed by a later action", later);
         return;
     }
 
-    xmlNodePtr inserted = nullptr;
-
-    if (before.node)
-        inserted = xmlAddNextSibling(before.node, restored);
-    else if (after.node)
-        inserted = xmlAddPrevSibling(after.node, restored);
-    else
-        inserted = xmlAddChild(parent.node, restored);
+    xmlNodePtr attr = xmlFirstElementChild(action_node.node);
+    while (attr && !xmlStrEqual(attr->name, BAD_CAST "Attr"))
+        attr = xmlNextElementSibling(attr);
 
-    if (!inserted) {
-        xmlFreeNode(restored);
-        err = new Error{lvl::ERR, "Cannot undo Deletion: node could not be restored", journal_path};
+    xmlChar* attr_name = attr ? xmlGetProp(attr, BAD_CAST "Name") : nullptr;
+    if (!attr_name || xmlStrEqual(attr_name, BAD_CAST "JID")) {
+        xmlFree(attr_name);
+        err = new Error{lvl::ERR, "Cannot undo SetAttr: journal transaction has no attribute name", action_node.GetPath()};
         return;
     }
 
-    XmlNode inserted_node(inserted);
-    inserted_node.JID(jid);
+    // The attribute list as it stands, should an enclosing UndoAll() fail.
+    xmlAttrPtr saved = Guarded() ? xmlCopyPropList(current, current->properties) : nullptr;
 
-    if (inserted_node.err) {
-        err = inserted_node.err;
-        return;
-    }
+    if (xmlAttrPtr previous = ElementAttr(attr, BAD_CAST "Old")) {
+        xmlChar* value = xmlNodeListGetString(attr->doc, previous->children, 1);
+        bool existed = ElementAttr(current, attr_name);
+        xmlAttrPtr restored = xmlSetProp(current, attr_name, value ? value : BAD_CAST "");
+        xmlFree(value);
 
+        xmlChar* before = existed ? nullptr : xmlGetProp(attr, BAD_CAST "Before");
+        xmlAttrPtr next = before ? ElementAttr(current, before) : nullptr;
+        if (restored && next && next != restored) {
+            // xmlSetProp() appended it; relink ahead of its former successor.
+            restored->prev->next = nullptr;
+            restored->prev = next->prev;
+            restored->next = next;
+            if (next->prev) next->prev->next = restored;
+            else current->properties = restored;
+            next->prev = restored;
+        }
+        xmlFree(before);
+    } else if (xmlAttrPtr present = ElementAttr(current, attr_name)) {
+        xmlRemoveProp(present);
+    }
+    xmlFree(attr_name);
+
+    Mutated(current);
+    if (Guarded())
+        Revert([current, saved] {
+            xmlFreePropList(current->properties);
+            current->properties = saved;
+            Mutated(current);
+        }, [saved] { xmlFreePropList(saved); });
     ReverseStamp();
 }
 
-ActionAdd::ActionAdd(XmlJrnl& j, XmlNode n) : Action(j), node(n) {
-    type = "Add";
+ActionSetText::ActionSetText(XmlJrnl& j, XmlNode n, const std::string& text)
+    : Action(j), node(n), old(text)
+{
+    type = "SetText";
     jid = node.JID();
     if (node.err) err = node.err;
 }
 
-ActionAdd::ActionAdd(XmlJrnl& j, XmlNode action, bool) : Action(j, action) {
-    type = "Add";
+ActionSetText::ActionSetText(XmlJrnl& j, XmlNode action, bool) : Action(j, action) {
+    type = "SetText";
     jid = action_node.XPath<std::string>("@JID");
     if (action_node.err) err = action_node.err;
 }
 
-void ActionAdd::Record()
+void ActionSetText::Record()
 {
     if (err) return;
 
-    XmlNode parent = node.XPath<std::vector<XmlNode>>("..")[0];
-    const std::string parent_jid = parent.JID();
+    Action::Record();
+    if (err || !action_node.node) return;
 
-    if (parent.err || parent_jid.empty()) {
-        err = parent.err;
+    xmlNodePtr payload = NewPayloadNode(RecordDoc(), "Text", old, jrnl.compress_threshold);
+    if (!payload) {
+        err = new Error{lvl::ERR, "Cannot record journal action: Text node could not be created", type};
         return;
     }
 
-    Action::Record();
-    if (err) return;
+    auto lock = MutationLock(action_node.node->doc);
 
-    action_node.AddChild("<Parent JID=\"" + parent_jid + "\"/>");
-    if (action_node.err) err = action_node.err;
+    xmlAddChild(action_node.node, payload);
+    Mutated(action_node.node);
 }
 
-void ActionAdd::Undo()
+void ActionSetText::Undo()
 {
-    if (!action_node.node) {
-        err = new Error{lvl::ERR, "Cannot undo Add: invalid journal action node", ""};
-        return;
-    }
-
-    const std::string journal_path = action_node.GetPath();
-
-    if (action_node.XPath<bool>("./Reversed[@Value='true']"))
+    if (action_node.node && IsReversed(action_node.node))
         return;
 
-    if (jid.empty()) {
-        err = new Error{lvl::ERR, "Cannot undo Add: journal transaction has no JID", journal_path};
-        return;
-    }
-
-    const std::string parent_jid = action_node.XPath<std::string>("./Parent/@JID");
+    xmlNodePtr current = InPlaceTarget("SetText");
+    if (!current) return;
 
-    if (parent_jid.empty()) {
-        err = new Error{lvl::ERR, "Cannot undo Add: journal transaction has no Parent JID", journal_path};
+    XmlNode later = LaterChange();
+    if (later.node) {
+        Conflict("node has been changed by a later action", later);
         return;
     }
-
-    auto pit = jrnl.jid_map.find(parent_jid);
-
-    if (pit == jrnl.jid_map.end() || !pit->second) {
-        Conflict("parent node is no longer available", action_node);
+    if (HasNonTextChildren(current)) {
+        Conflict("node now has child nodes", action_node);
         return;
     }
 
-    auto it = jrnl.jid_map.find(jid);
+    xmlNodePtr payload = xmlFirstElementChild(action_node.node);
+    while (payload && !xmlStrEqual(payload->name, BAD_CAST "Text"))
+        payload = xmlNextElementSibling(payload);
 
-    if (it == jrnl.jid_map.end() || !it->second) {
-        Conflict("added node is no longer available", action_node);
+    std::string text;
+    if (!payload) {
+        err = new Error{lvl::ERR, "Cannot undo SetText: journal contains no previous text", action_node.GetPath()};
         return;
     }
-
-    xmlNodePtr current = it->second;
-
-    if (current->parent != pit->second) {
-        Conflict("added node is no longer under its recorded parent", action_node);
+    if (!DecodePayload(payload, text, err)) {
+        err->data = action_node.GetPath();
         return;
     }
 
-    xmlUnlinkNode(current);
-    xmlFreeNode(current);
-
-    /*
-     * Keep the identity reserved in the journal namespace.
-     */
-    jrnl.jid_map[jid] = nullptr;
-
+    xmlNodePtr saved = Guarded() ? xmlCopyNodeList(current->children) : nullptr;
+    ReplaceText(current, text);
+    Mutated(current);
+    if (Guarded())
+        Revert([current, saved] {
+            ReplaceText(current, std::string());
+            if (saved) xmlAddChildList(current, saved);
+            Mutated(current);
+        }, [saved] { xmlFreeNodeList(saved); });
     ReverseStamp();
 }
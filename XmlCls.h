@@ -15,14 +15,25 @@
 
 #include <stdio.h>
 #include <map>
+#include <memory>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 #include <libxml/xpath.h>
 #include <libxml/xpathInternals.h>
 #include <libxml/xmlerror.h>
+#include <libxml/c14n.h>
 #include <ctime>
 #include <random>
 #include <cstdint>
+#include <future>
+#include <atomic>
+#include <functional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <chrono>
+#include <mutex>
+#include <charconv>
+#include <type_traits>
 
 #include "string.h"
 
@@ -42,6 +53,8 @@ typedef Error* ErrorPtr;
 class XmlDoc;
 class XmlJrnl;
 class XmlNode;
+struct XmlDiff;
+struct Action;
 
 static std::string CurrentIsoTimestampUTC()
 {
@@ -54,6 +67,53 @@ static std::string CurrentIsoTimestampUTC()
     return buffer;
 }
 
+/**
+ * @struct AutosavePolicy
+ * @brief Conditions under which a dirty XmlDoc is saved in the background.
+ *
+ * A save is triggered once @ref changes mutations have accumulated, or once
+ * the document has been quiet for @ref quiescence_ms milliseconds after its
+ * last mutation, whichever happens first.  A zero field disables that trigger.
+ */
+struct AutosavePolicy {
+    unsigned changes = 0;                ///< Save after this many mutations; 0 disables.
+    unsigned quiescence_ms = 0;          ///< Save after this much idle time; 0 disables.
+
+    /// Receives the result of every autosave; invoked on the autosave worker.
+    std::function<void(const Error*)> report = g_handle_err_handler;
+};
+
+/**
+ * @struct C14NOptions
+ * @brief Canonicalization method for XmlDoc/XmlNode C14N() and Digest().
+ *
+ * The defaults select Canonical XML 1.0 without comments, the usual choice
+ * for signing whole configuration files.  Exclusive canonicalization is the
+ * usual choice for signing a subtree independently of its context.
+ */
+struct C14NOptions {
+    xmlC14NMode mode = XML_C14N_1_0;     ///< XML_C14N_1_0, XML_C14N_EXCLUSIVE_1_0, or XML_C14N_1_1.
+    bool comments = false;               ///< Include comment nodes in the canonical form.
+
+    /// Namespace prefixes treated inclusively; exclusive mode only.
+    std::vector<std::string> inclusive_prefixes;
+};
+
+/**
+ * @struct WalOptions
+ * @brief Group-commit policy for a JournalWAL.
+ *
+ * Every record is written to the file as soon as it is appended, so it
+ * survives a crash of the process.  fdatasync(), which makes it survive a
+ * crash of the host, is issued once @ref sync_records records are pending or
+ * once @ref sync_ms milliseconds have passed since the last sync, whichever
+ * happens first.  Both fields zero leaves syncing to Sync() and close.
+ */
+struct WalOptions {
+    unsigned sync_records = 1;           ///< Sync after this many appended records; 0 disables.
+    unsigned sync_ms = 0;                ///< Sync on the first append this long after the last sync; 0 disables.
+};
+
 /**
  * @class XmlDoc
  * @brief Canonical wrapper for one libxml2 document.
@@ -80,6 +140,9 @@ public:
 
     xmlDocPtr const doc;                  ///< Immutable identity of the wrapped libxml2 DOM.
 
+    /// Held shared by XmlNode mutations and exclusively while a snapshot is taken.
+    std::shared_mutex mutation_lock;
+
     XmlDoc() : doc(nullptr) {}
     XmlDoc(const XmlDoc&) = delete;
     XmlDoc& operator=(const XmlDoc&) = delete;
@@ -133,6 +196,23 @@ public:
     explicit operator std::string() const { return XML(); }
     std::ostream& operator<<(std::ostream& os) { return os << XML(); }
 
+    /**
+     * @brief Generate the XML() representation using several threads.
+     * @param threads Worker count including the caller; 0 uses the hardware
+     *                concurrency.
+     * @return Output byte-identical to XML().
+     *
+     * The root's child subtrees are divided into runs that are serialized
+     * concurrently and concatenated in document order.  Documents that
+     * cannot be split exactly (one root child, text directly under the root,
+     * XHTML, or a non-ASCII-compatible encoding) are written by XML().
+     *
+     * The root's child list is relinked while the workers run.  The method
+     * holds @ref mutation_lock exclusively, and other threads must not read
+     * the document until it returns.
+     */
+    std::string ParallelXML(unsigned threads = 0);
+
     /**
      * @brief Save the document to a filename.
      * @param filename Destination path.
@@ -148,7 +228,103 @@ public:
      * If the document has no URL, the method returns without writing.
      */
     void Save();
-    
+
+    /**
+     * @brief Save a point-in-time snapshot of the document on a background thread.
+     * @param filename Destination path.
+     * @return Future carrying the save result; nullptr indicates success.
+     *
+     * The DOM is copied before this method returns, so callers may continue
+     * mutating the document while the snapshot is serialized.  At most one
+     * save is in flight per document; requests made meanwhile wait in order.
+     * A request replaces a snapshot still waiting for the same file, and
+     * every coalesced caller receives the result of the newest one.
+     * Requests for other files are kept and written separately.
+     *
+     * As with Save(const char*), the libxml2 document URL is updated
+     * immediately.
+     */
+    std::shared_future<ErrorPtr> SaveAsync(const char* filename);
+
+    /**
+     * @brief Save a snapshot in the background using the current document URL.
+     * @return Future carrying the save result; immediately ready with nullptr
+     *         if the document has no URL.
+     */
+    std::shared_future<ErrorPtr> SaveAsync();
+
+    /**
+     * @brief Report whether the DOM has changed since it was last saved.
+     *
+     * XmlNode mutation methods and journal Undo mark the document dirty.
+     * A successful Save() or SaveAsync() clears the flag unless further
+     * mutations were made after its snapshot was taken.
+     */
+    bool IsDirty() const { return generation.load() != saved_generation.load(); }
+
+    /**
+     * @brief Record that the DOM has changed.
+     *
+     * Called by every XmlCls mutation.  Callers that modify the underlying
+     * libxml2 tree directly should call it themselves so that dirty state and
+     * autosave remain accurate.
+     */
+    void MarkDirty();
+
+    /**
+     * @brief Enable, change, or disable background autosave.
+     * @param policy Save triggers; a policy with both triggers zero disables
+     *               autosave.
+     *
+     * Autosave writes through SaveAsync() to the current document URL, so a
+     * burst of edits costs one write.  Outstanding changes are flushed when
+     * the document is destroyed.
+     */
+    void Autosave(AutosavePolicy policy);
+
+    /**
+     * @brief Return the Merkle content hash of the root element.
+     * @return Root subtree hash, or 0 for a document without a root element.
+     *
+     * See XmlNode::Hash().  Equal documents have equal hashes regardless of
+     * attribute order or JID assignment.
+     */
+    uint64_t Hash();
+
+    /**
+     * @brief Compare this document with another by content hash.
+     * @param other Document to compare against.
+     * @return Corresponding element pairs that differ; empty when equal.
+     *
+     * Only subtrees whose hashes differ are visited.  A pair is reported at
+     * the deepest level where the elements themselves differ: their names,
+     * attributes, non-element content, or number and kinds of children.
+     * Element children that line up are compared recursively instead.
+     */
+    std::vector<XmlDiff> Diff(XmlDoc& other);
+
+    /**
+     * @brief Return the canonical form (C14N) of the document.
+     * @param options Canonicalization method.
+     * @return Canonical UTF-8 text, or an empty string on error.
+     *
+     * Intended for inspection and small documents; use Digest() to
+     * fingerprint a document without holding its canonical text.
+     */
+    std::string C14N(const C14NOptions& options = C14NOptions());
+
+    /**
+     * @brief Return the SHA-256 digest of the document's canonical form.
+     * @param options Canonicalization method.
+     * @return 64 lowercase hexadecimal digits, or an empty string on error.
+     *
+     * Canonical output is streamed into the digest block by block, so memory
+     * use beyond the DOM itself does not grow with document size.  Unlike
+     * Hash(), the digest covers the document exactly as it would be signed,
+     * including JID attributes.
+     */
+    std::string Digest(const C14NOptions& options = C14NOptions());
+
    /**
     * @brief Evaluate an XPath expression relative to the document.
     * @tparam T Desired C++ result type.
@@ -176,6 +352,18 @@ public:
      */
     void CreateJournal(const char* filename, std::string XML = "");
 
+    /**
+     * @brief Attach a journal backed by a binary write-ahead log.
+     * @param filename Log file; created if absent, otherwise recovered.
+     * @param options Group-commit policy.
+     *
+     * The journal DOM is rebuilt from the log, and every later Change and
+     * reversal is appended to the log as it is recorded, so no XML rewrite
+     * is needed to make the journal durable.  JournalWAL::ExportXML() renders
+     * the log in the XML journal format.
+     */
+    void OpenJournalWAL(const char* filename, WalOptions options = WalOptions());
+
     /**
      * @brief Return the cached XPath context, creating it on first use.
      * @return XPath context associated with this document.
@@ -187,6 +375,15 @@ public:
 
 private:
 
+    struct AsyncSave;                     ///< Background writer state; see SaveAsync().
+    AsyncSave* async_save = nullptr;
+
+    struct Autosaver;                     ///< Autosave worker state; see Autosave().
+    Autosaver* autosaver = nullptr;
+
+    std::atomic<uint64_t> generation{0};        ///< Mutations applied to this DOM.
+    std::atomic<uint64_t> saved_generation{0};  ///< Generation captured by the last successful save.
+
     void clear() ;
 };
 
@@ -305,13 +502,81 @@ public:
     /**
      * @brief Remove this node from the XML tree and invalidate this wrapper.
      *
-     * With journaling enabled, the parent and all element children of the
-     * parent are first assigned JIDs, the Deletion action is recorded, and the
+     * With journaling enabled, the node, its parent, and its nearest element
+     * siblings are assigned JIDs, the Deletion action is recorded, and the
      * deleted node's JID remains reserved in the journal map with a null live
-     * node pointer.
+     * node pointer.  Other siblings are left without JIDs.
      */
     void Delete();
 
+    /**
+     * @brief Relink this element under @p parent without copying it.
+     * @param parent New parent element in the same document.
+     * @param before Optional child of @p parent to insert in front of.
+     * @param after Optional child of @p parent to insert behind; ignored
+     *        when @p before is given.  With neither, the node is appended.
+     *
+     * The subtree keeps its xmlNodePtrs, so JIDs and jid_map entries stay
+     * valid.  With journaling enabled a single Move action records the old and
+     * new structural slots instead of a Deletion plus an Add.
+     */
+    void MoveTo(XmlNode& parent, XmlNode* before = nullptr, XmlNode* after = nullptr);
+
+    /**
+     * @brief Set one attribute of this element.
+     * @param name Attribute name; the journal-managed JID attribute is refused.
+     * @param value New value.
+     *
+     * Unlike parse(), the node is changed in place.  With journaling enabled
+     * a SetAttr action records only the attribute's previous value.
+     */
+    void SetAttr(const std::string& name, const char* value);
+    void SetAttr(const std::string& name, const std::string& value) { SetAttr(name, value.c_str()); }
+    void SetAttr(const std::string& name, bool value) { SetAttr(name, value ? "true" : "false"); }
+
+    /**
+     * @brief Set a numeric attribute, formatted with std::to_chars.
+     *
+     * Floating-point values use the shortest representation that reads back
+     * exactly.
+     */
+    template <typename T, typename = std::enable_if_t<std::is_arithmetic_v<T> && !std::is_same_v<T, bool>>>
+    void SetAttr(const std::string& name, T value)
+    {
+        char buffer[32];
+        auto result = std::to_chars(buffer, buffer + sizeof(buffer) - 1, value);
+        *result.ptr = '\0';
+        SetAttr(name, static_cast<const char*>(buffer));
+    }
+
+    /**
+     * @brief Remove one attribute of this element.
+     * @param name Attribute name; the journal-managed JID attribute is refused.
+     *
+     * Removing an attribute that is not present does nothing and records
+     * nothing.  The journaled action is SetAttr with no prior value to restore.
+     */
+    void RemoveAttr(const std::string& name);
+
+    /**
+     * @brief Replace the text content of this element.
+     * @param text New text, stored literally.
+     *
+     * The element may contain only text and CDATA; an element with other
+     * children is refused rather than losing them.  With journaling enabled a
+     * SetText action records only the previous text.
+     */
+    void SetText(const std::string& text);
+
+    /// Set numeric text content, formatted as for SetAttr().
+    template <typename T, typename = std::enable_if_t<std::is_arithmetic_v<T> && !std::is_same_v<T, bool>>>
+    void SetText(T value)
+    {
+        char buffer[32];
+        auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+        SetText(std::string(buffer, result.ptr));
+    }
+
     /**
      * @brief Return libxml2's structural XPath for the current node.
      * @return Path from xmlGetNodePath(), or an empty string for a null node.
@@ -338,6 +603,18 @@ public:
      */
     std::string JID();
 
+    /**
+     * @brief Return this node's JID as its 64-bit value; see JID().
+     * @param value Receives the JID value.
+     * @return False, with @ref err set, when no JID could be read or created.
+     *
+     * The value is cached beside the node on first read, so repeated calls do
+     * not touch the attribute or allocate.  The cache is refreshed by every
+     * XmlCls method that writes a JID; code that edits JID attributes through
+     * libxml2 directly must not rely on it.
+     */
+    bool JIDValue(uint64_t& value);
+
     /**
      * @brief Propagate an existing logical JID to this physical node.
      * @param jid Journal identity to assign.
@@ -348,6 +625,40 @@ public:
      */
     void JID(std::string jid);
 
+    /**
+     * @brief Return the Merkle content hash of this element subtree.
+     * @return 64-bit hash, or 0 for a null node.
+     *
+     * The hash combines the element namespace and name, its attributes
+     * (order-independent, excluding JID), and the ordered hashes of its
+     * children including text.  Element hashes are cached beside the node and
+     * invalidated along the ancestor path by XmlCls mutations, so after an
+     * edit only the changed path is recomputed.  Code that edits the libxml2
+     * tree directly bypasses that invalidation.
+     */
+    uint64_t Hash();
+
+    /**
+     * @brief Return the canonical form (C14N) of this node's subtree.
+     * @param options Canonicalization method.
+     * @return Canonical UTF-8 text, or an empty string on error.
+     *
+     * The subtree is canonicalized as a document subset: with inclusive
+     * methods, namespace declarations and xml:* attributes in scope from
+     * ancestors are rendered on this node; exclusive C14N renders only the
+     * namespaces the subtree uses.
+     */
+    std::string C14N(const C14NOptions& options = C14NOptions());
+
+    /**
+     * @brief Return the SHA-256 digest of this subtree's canonical form.
+     * @param options Canonicalization method.
+     * @return 64 lowercase hexadecimal digits, or an empty string on error.
+     *
+     * See XmlDoc::Digest().
+     */
+    std::string Digest(const C14NOptions& options = C14NOptions());
+
 /**
     * @brief Evaluate an XPath expression relative to this node.
     * @tparam T Desired C++ result type.
@@ -361,6 +672,344 @@ public:
     template <typename T> T XPath(std::string query);
 };
 
+/**
+ * @struct XmlDiff
+ * @brief One pair of corresponding elements whose content differs.
+ *
+ * Either side is an empty XmlNode when one document has no root element.
+ */
+struct XmlDiff {
+    XmlNode left;              ///< Element in the document on which Diff() was called.
+    XmlNode right;             ///< Corresponding element in the other document.
+};
+
+/**
+ * @class JidIndex
+ * @brief Hash index from JID to live source node, keyed by the JID's 64-bit value.
+ *
+ * A JID is the 16-digit lowercase hexadecimal form of a 64-bit value, as
+ * produced by XmlJrnl::JID().  The index keeps that value in an open-addressing
+ * table with linear probing, so a lookup parses the string once and then
+ * compares integers.  Erased entries leave tombstones that later insertions
+ * reuse and that are dropped whenever the table is rebuilt.
+ *
+ * The string-facing members mirror the std::map<std::string, xmlNodePtr> the
+ * index replaced, except that iteration order is unspecified.  A null node is
+ * an ordinary entry: it reserves the JID of a logically deleted node.
+ */
+class JidIndex
+{
+public:
+    /// Dereferenced iterator value; @ref second refers into the index.
+    struct Entry {
+        std::string first;               ///< JID string.
+        xmlNodePtr& second;              ///< Live node, or nullptr while logically deleted.
+        const Entry* operator->() const { return this; }
+    };
+
+    class iterator
+    {
+    public:
+        Entry operator*() const;
+        Entry operator->() const { return **this; }
+        iterator& operator++();
+        bool operator==(const iterator& other) const { return slot == other.slot; }
+        bool operator!=(const iterator& other) const { return slot != other.slot; }
+
+    private:
+        friend class JidIndex;
+        iterator(JidIndex* index, size_t slot) : index(index), slot(slot) {}
+        JidIndex* index;
+        size_t slot;
+    };
+
+    /**
+     * @brief Parse a JID string into its 64-bit key.
+     * @return False unless @p jid is exactly 16 lowercase hexadecimal digits.
+     */
+    static bool Key(const std::string& jid, uint64_t& key);
+    static bool Key(const char* jid, uint64_t& key);
+
+    /**
+     * @brief Format a 64-bit key as its JID string.
+     */
+    static std::string String(uint64_t key);
+
+    iterator begin();
+    iterator end() { return iterator(this, slots.size()); }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    bool contains(uint64_t key) const;
+
+    iterator find(uint64_t key);
+    iterator find(const std::string& jid);
+
+    /**
+     * @brief Insert @p node under @p key unless the key is already present.
+     * @return Iterator to the entry for @p key, and whether it was inserted.
+     */
+    std::pair<iterator, bool> emplace(uint64_t key, xmlNodePtr node);
+
+    /**
+     * @brief Return the node stored for a key, inserting nullptr if absent.
+     *
+     * Only keys can be inserted; parse JIDs read from documents with Key()
+     * first, so that a malformed one is caught rather than stored.
+     */
+    xmlNodePtr& operator[](uint64_t key);
+
+    /**
+     * @brief The node stored for @p jid, without inserting.
+     * @return Null when the JID is logically deleted, absent, or malformed;
+     *         find() tells these apart.
+     */
+    xmlNodePtr at(const std::string& jid) const;
+
+    size_t erase(uint64_t key);
+    size_t erase(const std::string& jid);
+
+    void clear();
+
+    /**
+     * @brief Size the table for @p n entries without further rehashing.
+     */
+    void reserve(size_t n);
+
+    /// Table slots: a power of two, or 0 before the first insertion.
+    size_t slot_count() const { return slots.size(); }
+
+    /**
+     * @brief Slot at which the probe for @p key starts.
+     *
+     * Bulk loads that insert keys roughly in this order touch the table
+     * sequentially instead of at random.  Requires slot_count() > 0.
+     */
+    size_t home_slot(uint64_t key) const;
+
+private:
+    enum : uint8_t { EMPTY, FULL, TOMBSTONE };
+
+    struct Slot {
+        uint64_t key;
+        xmlNodePtr node;
+        uint8_t state;
+    };
+
+    std::vector<Slot> slots;             ///< Power-of-two table; empty until first insertion.
+    size_t count = 0;                    ///< FULL slots.
+    size_t used = 0;                     ///< FULL plus TOMBSTONE slots.
+
+    size_t Probe(uint64_t key, bool& found) const;
+    void Rehash(size_t capacity);
+};
+
+/**
+ * @class JournalWAL
+ * @brief Append-only binary write-ahead log backing an XmlJrnl.
+ *
+ * The file is an 8-byte header followed by framed records:
+ *
+ * @code
+ * u32 length | u32 CRC-32 of type+body | u8 type | body[length]
+ * @endcode
+ *
+ * Release records open a Release, Add/Modify/Deletion records carry one
+ * Change element exactly as it appears in the XML journal, Reverse records
+ * mark an earlier Change reversed, and NextJID records persist the
+ * sequential JID counter.  Appending costs one write() of
+ * the new record regardless of how large the log has grown.
+ *
+ * Opening a log recovers it: records are read up to the first torn or
+ * corrupt frame and the file is truncated there, so a crash in mid-append
+ * loses at most the record being written.  Failures are reported through
+ * @ref err.
+ */
+class JournalWAL
+{
+public:
+    /// Record types; the Change types match the Change Type attribute.
+    enum RecordType : uint8_t { RELEASE = 1, ADD = 2, MODIFY = 3, DELETION = 4, REVERSE = 5, CHANGE = 6,
+                                NEXT_JID = 7, CLOSE = 8 };
+
+    ErrorPtr err = nullptr;              ///< Last error reported by this log.
+    uint64_t records = 0;                ///< Intact records in the log.
+    uint64_t changes = 0;                ///< Change records in the log; the next Change's ordinal.
+    size_t discarded = 0;                ///< Bytes dropped from a torn tail when the log was opened.
+
+    /**
+     * @brief Open or create a log and recover it.
+     * @param filename Log file path; created with an empty header if absent.
+     * @param options Group-commit policy for later appends.
+     */
+    JournalWAL(const char* filename, WalOptions options = WalOptions());
+
+    /// Sync pending records and close the file.
+    ~JournalWAL();
+
+    JournalWAL(const JournalWAL&) = delete;
+    JournalWAL& operator=(const JournalWAL&) = delete;
+
+    /**
+     * @brief Append a Release record.
+     * @param number Release-number path, e.g. {0,1} for Release 0.1.
+     * @param open Open timestamp.
+     *
+     * Later Change records belong to this Release until another is opened.
+     */
+    void AppendRelease(const std::vector<int>& number, const std::string& open);
+
+    /**
+     * @brief Append a Close record.
+     * @param number Release-number path of the closed Release.
+     * @param close Close timestamp.
+     *
+     * Later Change records belong to the enclosing Release.
+     */
+    void AppendClose(const std::vector<int>& number, const std::string& close);
+
+    /**
+     * @brief Append a Change record.
+     * @param change Journal Change element; its Type selects the record type.
+     * @return Ordinal of the new Change, as used by AppendReverse().
+     */
+    uint64_t AppendChange(xmlNodePtr change);
+
+    /**
+     * @brief Append a Reverse record.
+     * @param ordinal Ordinal of the reversed Change.
+     * @param timestamp Reversal timestamp.
+     */
+    void AppendReverse(uint64_t ordinal, const std::string& timestamp);
+
+    /**
+     * @brief Append a NextJID record.
+     * @param next First JID value not yet reserved; see XmlJrnl::UseSequentialJIDs().
+     */
+    void AppendNextJID(uint64_t next);
+
+    /// fdatasync() any records appended since the last sync.
+    void Sync();
+
+    /// Current length of the log file in bytes.
+    size_t Size();
+
+    /**
+     * @brief Replace the log with the records of journal DOM @p root.
+     *
+     * Release and Change records are written in document order to a sibling
+     * file, which is synced and renamed over the log; a Change carries its
+     * Reversed state inline and a closed Release is followed by its Close.  On failure the original log is kept.
+     */
+    void Rewrite(xmlNodePtr root);
+
+    /**
+     * @brief Render the log in the XML journal format.
+     * @return A complete \<JRNL\> document, or an empty string on error.
+     *
+     * The output can be saved and opened with XmlDoc::OpenJournal().
+     */
+    std::string ExportXML();
+
+private:
+    int fd = -1;
+    std::string path;
+    WalOptions options;
+    unsigned pending = 0;                ///< Records written since the last sync.
+    std::chrono::steady_clock::time_point last_sync;
+    std::mutex append_lock;
+
+    /// Frame and write one record, then apply the group-commit policy.
+    void Append(RecordType type, const std::string& body);
+
+    /// Read the file into a \<JRNL\> DOM; @p valid receives the length of the intact prefix.
+    xmlDocPtr Replay(size_t& valid, size_t& size);
+};
+
+/**
+ * @struct JidMapStats
+ * @brief What XmlJrnl::BuildJIDMap() did and how long it took.
+ */
+struct JidMapStats {
+    size_t jids = 0;          ///< JIDs indexed.
+    unsigned threads = 1;     ///< Threads that walked the tree.
+    double walk_ms = 0;       ///< Tree walk, including reading the JID attributes.
+    double merge_ms = 0;      ///< Ordering by slot, insertion into jid_map, and duplicate detection.
+};
+
+/**
+ * @struct CompactStats
+ * @brief What XmlJrnl::Compact() removed and how many bytes it reclaimed.
+ */
+struct CompactStats {
+    size_t releases = 0;      ///< Closed releases squashed into checkpoints.
+    size_t dropped = 0;       ///< Reversed Changes removed.
+    size_t merged = 0;        ///< Modify Changes folded into an earlier snapshot.
+    size_t bytes_before = 0;  ///< Journal size before; the log file with a WAL, else the XML.
+    size_t bytes_after = 0;   ///< Journal size after, measured the same way.
+
+    /// Bytes reclaimed by the compaction.
+    size_t reclaimed() const { return bytes_before > bytes_after ? bytes_before - bytes_after : 0; }
+};
+
+/**
+ * @struct XmlDocDelete
+ * @brief Deleter for an XmlDoc that owns its DOM, such as XmlJrnl::ReplayTo() returns.
+ *
+ * ~XmlDoc() leaves the xmlDoc to its creator; this frees both.
+ */
+struct XmlDocDelete {
+    void operator()(XmlDoc* state) const;
+};
+
+/// An XmlDoc whose DOM is freed with it.
+typedef std::unique_ptr<XmlDoc, XmlDocDelete> OwnedXmlDoc;
+
+/**
+ * @struct ReplayStats
+ * @brief How XmlJrnl::ReplayTo() reached its target.
+ */
+struct ReplayStats {
+    size_t reversed = 0;          ///< Changes undone on the copy.
+    bool from_snapshot = false;   ///< Started from a snapshot rather than the live document.
+    double ms = 0;                ///< Wall-clock time, including the copy.
+};
+
+/**
+ * @struct ReleaseConflict
+ * @brief One reason XmlJrnl::UndoRelease() could not undo a release.
+ */
+struct ReleaseConflict {
+    XmlNode change;       ///< Change in the release that cannot be undone.
+    XmlNode cause;        ///< Change that blocks it; the release's own Change when no other is to blame.
+    std::string reason;   ///< Human-readable description.
+};
+
+/**
+ * @struct ReleaseUndo
+ * @brief Analysis made by the last XmlJrnl::UndoRelease().
+ */
+struct ReleaseUndo {
+    size_t changes = 0;                       ///< Unreversed Changes in the release and its nested releases; a Transaction counts once.
+    size_t groups = 0;                        ///< Groups of Changes linked by shared JIDs, parents, or siblings.
+    std::vector<ReleaseConflict> conflicts;   ///< Everything that blocked the undo; empty when it was applied.
+};
+
+/**
+ * @struct ReleaseInfo
+ * @brief One Release in XmlJrnl::releases, the in-memory release tree.
+ */
+struct ReleaseInfo {
+    xmlNodePtr node = nullptr;              ///< Release element in the journal DOM.
+    std::vector<int> number;                ///< Release-number path, e.g. {0,3} for Release 0.3.
+    std::string open;                       ///< Open timestamp.
+    std::string close;                      ///< Close timestamp; empty while the release is open.
+    size_t changes = 0;                     ///< Change records directly in the release; a Transaction counts once.
+    ReleaseInfo* parent = nullptr;          ///< Enclosing release; null at the top level.
+    std::vector<ReleaseInfo*> children;     ///< Nested releases in document order.
+    size_t open_children = 0;               ///< How many of @ref children are still open.
+};
+
 /**
  * @class XmlJrnl
  * @brief Mutation journal permanently associated with one canonical XmlDoc.
@@ -389,10 +1038,49 @@ public:
     /// Deepest currently open Release node to which changes are appended.
     XmlNode active_release;
 
+    /// Every Release keyed by number path; kept current as releases open, close, and record.
+    std::map<std::vector<int>, ReleaseInfo> releases;
+
     XmlDoc& source_doc;  ///< Canonical source DOM permanently attached to this journal.
 
     /// Reserved JID -> current live source node; nullptr means logically deleted.
-    std::map<std::string, xmlNodePtr> jid_map;
+    JidIndex jid_map;
+
+    /// Write-ahead log receiving every Change and reversal; null for an XML-only journal.
+    JournalWAL* wal = nullptr;
+
+    /**
+     * Node payloads of at least this many bytes are stored zlib-compressed
+     * as Encoding="zlib+Base64"; 0 stores every payload as plain Base64.
+     * A payload that does not shrink is stored as Base64 regardless.  The
+     * setting affects recording only; Undo decodes either encoding.
+     */
+    size_t compress_threshold = 0;
+
+    /// Timing of the last BuildJIDMap().
+    JidMapStats jid_map_stats;
+
+    /// Result of the last Compact().
+    CompactStats compact_stats;
+
+    /// Take a Snapshot() automatically after this many recorded Changes; 0 disables.
+    unsigned snapshot_every = 0;
+
+    /**
+     * Most replay snapshots kept, each a full copy of the source document.
+     * Taking one more frees the oldest; ReplayTo() an earlier release then
+     * starts from a later snapshot and undoes more.  0 keeps every snapshot.
+     */
+    size_t max_snapshots = 8;
+
+    /// Result of the last ReplayTo().
+    ReplayStats replay_stats;
+
+    /// Analysis made by the last UndoRelease().
+    ReleaseUndo release_undo;
+
+    /// JIDs reserved by one thread at a time in sequential mode.
+    unsigned jid_block = 256;
 
     /**
      * @brief Open an existing journal for a canonical source document.
@@ -428,38 +1116,130 @@ public:
      */
     void CreateJournal(const char*, std::string) = delete;
 
+    /**
+     * @brief Journals cannot themselves have journals.
+     *
+     * Disabled to prevent recursively journaling an XmlJrnl.
+     */
+    void OpenJournalWAL(const char*, WalOptions) = delete;
+
+    /// Close the write-ahead log, if any.
+    ~XmlJrnl();
+
     /**
      * @brief Record addition of a source node.
      * @param added Newly inserted node.
+     * @return The recording failure, or null; see @ref err.
      *
      * Delegates action-specific recording to ActionAdd.  The Change record
      * contains the added node JID and the JID of its parent.
      */
-    void LogAdd(XmlNode& added);
+    ErrorPtr LogAdd(XmlNode& added);
 
     /**
      * @brief Record replacement or modification of a source node.
      * @param node Logical node being modified.
      * @param oldXML Serialized state before replacement.
+     * @return The recording failure, or null; see @ref err.
      *
      * Delegates to ActionModify, which records the node JID, parent JID, and
      * Base64-encoded prior XML required for reversal.
      */
-    void LogModify(XmlNode& node, const std::string& oldXML);
+    ErrorPtr LogModify(XmlNode& node, const std::string& oldXML);
+
+    /**
+     * @brief Record replacement of a source node by @p replacement.
+     * @param node Logical node about to be replaced.
+     * @param replacement Detached node that will take its place, already
+     *                    carrying the node's JID.
+     * @return The recording failure, or null; see @ref err.
+     *
+     * Records a Delta of the elements and attribute lists that differ
+     * between the two subtrees, or the full prior XML when the delta would
+     * not be smaller.  Used by XmlNode::parse().
+     */
+    ErrorPtr LogModify(XmlNode& node, xmlNodePtr replacement);
+
+    /**
+     * @brief Record a change to one attribute before it is made.
+     * @param node Element whose attribute changes.
+     * @param name Attribute name.
+     * @param old Current value, or null when the attribute is absent.
+     * @return The recording failure, or null; see @ref err.
+     *
+     * Delegates to ActionSetAttr.
+     */
+    ErrorPtr LogSetAttr(XmlNode& node, const std::string& name, const xmlChar* old);
+
+    /**
+     * @brief Record a change to an element's text before it is made.
+     * @param node Element whose text changes.
+     * @param old Current text.
+     * @return The recording failure, or null; see @ref err.
+     *
+     * Delegates to ActionSetText.
+     */
+    ErrorPtr LogSetText(XmlNode& node, const std::string& old);
 
     /**
      * @brief Record deletion of a source node before it is unlinked.
      * @param node Node immediately before removal.
+     * @return The recording failure, or null; see @ref err.
      *
      * Delegates to ActionDelete, which records the deleted JID, parent JID,
      * optional immediate element sibling JIDs (Before/After), and Base64-
      * encoded node XML.  These relationships define the structural slot needed
      * for Undo().
      */
-    void LogDelete(XmlNode& node);
+    ErrorPtr LogDelete(XmlNode& node);
+
+    /**
+     * @brief Record relinking of an element before it is moved.
+     * @param node Element about to move.
+     * @param parent Destination parent.
+     * @param before Element sibling that will precede it, or null.
+     * @param after Element sibling that will follow it, or null.
+     * @return The recording failure, or null; see @ref err.
+     *
+     * Delegates to ActionMove.
+     */
+    ErrorPtr LogMove(XmlNode& node, XmlNode& parent, xmlNodePtr before, xmlNodePtr after);
+
+    /**
+     * @brief Start grouping mutations into one Transaction Change.
+     *
+     * Until Commit() or Rollback(), every recorded Change is nested inside a
+     * single \<Change Type="Transaction"\> in the active release instead of
+     * being appended to it.  Transactions do not nest; a second Begin is an
+     * error, as is a Begin while the journal writer runs.
+     */
+    void BeginTransaction();
+
+    /**
+     * @brief Close the open transaction as one undoable Change.
+     *
+     * An empty transaction leaves no record.  With a write-ahead log the whole
+     * group is appended as one record here rather than change by change.
+     */
+    void Commit();
+
+    /**
+     * @brief Undo every change of the open transaction and discard its record.
+     *
+     * If some change cannot be undone, none is, and the group is kept as a
+     * committed one.
+     */
+    void Rollback();
+
+    /// True between BeginTransaction() and Commit() or Rollback().
+    bool InTransaction() const { return transaction != nullptr; }
 
     /**
      * @brief Undo the most recent unreversed Change in the active release.
+     *
+     * The target is taken from an in-memory stack per release, so the cost
+     * does not depend on how many changes the release holds.  Not allowed
+     * while a transaction is open.
      */
     void Undo();
 
@@ -467,8 +1247,9 @@ public:
      * @brief Undo one recorded Change.
      * @param action_node Journal Change node.
      *
-     * Dispatches to ActionModify, ActionDelete, or ActionAdd according to
-     * its Type attribute.  Already reversed actions return without further work.
+     * Dispatches to the Action specialization named by its Type attribute.
+     * Already reversed actions return without further work.  A Change nested
+     * in a Transaction is undone only as part of its group.
      */
     void Undo(XmlNode action_node);
 
@@ -478,46 +1259,384 @@ public:
      */
     void Undo(std::vector<XmlNode> action_nodes);
 
+    /**
+     * @brief Undo every Change of a release, including its nested releases, or none.
+     * @param release Release-number path, e.g. @ref rel_no.
+     *
+     * The Changes are first linked into groups by the JIDs they touch and the
+     * parents and siblings they refer to.  Every later Change that touches
+     * one of those nodes, and every Change whose node, or an ancestor of it,
+     * is gone unless a newer Change in the release saved it, is collected in
+     * @ref release_undo.  If there are any, a conflict is reported at
+     * lvl::INFO and nothing is changed; otherwise all the Changes are undone
+     * newest first in one pass, through UndoAll(), which puts everything back
+     * if one still fails.  Not allowed while a transaction is open.
+     */
+    void UndoRelease(const std::vector<int>& release);
+
 
     /**
-     * @brief Recalculate the currently active Release branch.
+     * @brief Rebuild @ref releases and the active Release branch from the DOM.
      *
-     * Searches the journal for the deepest nested Release whose Close
-     * attribute is empty, updates @ref active_release to that node, and
-     * rebuilds @ref rel_no with its release-number path.
+     * Walks the Release elements once, counting their Changes, then follows
+     * the last open top-level Release down through its last open children.
+     * The deepest one becomes @ref active_release and its path @ref rel_no.
+     * Called on construction; OpenRelease() and CloseRelease() keep both
+     * current, so it is needed only after editing Release elements directly.
      */
     void RefreshActiveRelease();
 
+    /**
+     * @brief Open a Release inside the active one and make it active.
+     *
+     * It is numbered one past its last sibling, or 1 when it is the first;
+     * its Open timestamp is the current time.  Refused while a transaction is
+     * open.
+     */
+    void OpenRelease();
+
+    /**
+     * @brief Close the active Release; the enclosing one becomes active again.
+     *
+     * Top-level releases are not closed, so changes always have somewhere to
+     * go.  Refused while a transaction is open.
+     */
+    void CloseRelease();
+
+    /// The Release with number path @p release, or null.
+    const ReleaseInfo* FindRelease(const std::vector<int>& release) const;
+
+    /**
+     * @brief Change records directly in a Release, in record order.
+     * @param release Release-number path.
+     *
+     * Found through @ref releases, without searching the journal.
+     */
+    std::vector<XmlNode> ReleaseChanges(const std::vector<int>& release);
+
     /**
      * @brief Rebuild the live JID index from JID attributes in source_doc.
+     * @param threads Worker count including the caller; 0 uses the hardware
+     *                concurrency.
      *
-     * Duplicate JIDs are reported as errors.  XPath is used to obtain all JID
-     * attributes without manual DOM traversal.
+     * The source tree is walked directly, reading each JID attribute in
+     * place and caching its value beside the node.  When the root has enough
+     * child subtrees, runs of them are walked concurrently and the results
+     * merged in document order.  Duplicate or malformed JIDs are reported as
+     * errors.  Timing is left in @ref jid_map_stats.
      */
-    void BuildJIDMap();
+    void BuildJIDMap(unsigned threads = 0);
 
     /**
      * @brief Generate a JID unique within this journal namespace.
      * @return Unused 16-character hexadecimal JID.
      *
-     * Uniqueness is checked only against this journal's jid_map; JIDs are not
-     * intended to be globally unique across unrelated documents.
+     * Random JIDs are checked only against this journal's jid_map; JIDs are
+     * not intended to be globally unique across unrelated documents.  See
+     * UseSequentialJIDs() for the counter-based mode.
      */
     std::string JID();
 
+    /// JID() as its numeric value.
+    uint64_t JIDKey();
+
+    /**
+     * @brief Allocate JIDs from a persisted counter instead of at random.
+     *
+     * Each thread reserves @ref jid_block consecutive values at a time with
+     * one atomic add and hands them out without locking or a jid_map lookup.
+     * The end of the highest reserved block is persisted as the NextJID
+     * attribute of the journal root (and as a NextJID record in @ref wal), so
+     * a reopened journal resumes above every JID ever issued, including those
+     * of deleted nodes.  A journal that has NextJID opens in this mode.
+     *
+     * Switching a journal that already holds JIDs starts the counter above
+     * the largest one when that is small enough; when random JIDs are
+     * present, new values are still checked against the known JIDs.
+     */
+    void UseSequentialJIDs();
+
+    /// True once UseSequentialJIDs() is in effect.
+    bool SequentialJIDs() const { return sequential_jids; }
+
+    /**
+     * @brief Return every Change recorded for one logical node.
+     * @param jid JID of the source node.
+     * @return Change nodes in recording order, reversed ones included; empty
+     *         for an unknown or malformed JID.
+     *
+     * Served from an in-memory index, so the cost depends on the node's own
+     * history rather than on the size of the journal.
+     */
+    std::vector<XmlNode> History(const std::string& jid);
+    std::vector<XmlNode> History(uint64_t jid);
+
+    /**
+     * @brief Changes recorded in a time window.
+     * @param from_ns Start, in nanoseconds since the Unix epoch, inclusive.
+     * @param to_ns End, exclusive.
+     * @return Top-level Change nodes in recording order; a Transaction stands
+     *         for its nested changes.
+     *
+     * Each Change carries a TimeNs attribute beside its ISO TimeStamp.  The
+     * values never decrease within a journal, so the window is found by
+     * binary search in an in-memory index.
+     */
+    std::vector<XmlNode> ChangesBetween(int64_t from_ns, int64_t to_ns);
+
+    /**
+     * @brief Changes recorded after sequence number @p seq, by binary search.
+     *
+     * Each Change carries a Seq attribute, numbered from 1 within a journal.
+     * Changes recorded before Seq existed are numbered in document order when
+     * the journal is loaded and timed from their TimeStamp.
+     */
+    std::vector<XmlNode> ChangesSince(uint64_t seq);
+
+    /// Seq of the most recent Change; 0 when there is none.
+    uint64_t LastSeq() const { return next_seq - 1; }
+
+    /**
+     * @brief Let threads record mutations of disjoint subtrees concurrently.
+     *
+     * Each mutating thread builds its Change record apart from the journal
+     * DOM, stamps it with the next Seq, and hands it to a background writer
+     * through a lock-free queue.  The writer attaches the records to the
+     * release that was active when they were recorded, indexes them, and
+     * appends them to @ref wal strictly in Seq order, so the journal, its log,
+     * and Undo() see the Changes in the order they were stamped.
+     *
+     * Every source element is given a JID first, so that recording never
+     * writes to an ancestor two threads share.  The threads must not touch
+     * each other's subtrees, and element and attribute names should already
+     * occur in the source document, whose name dictionary is not thread-safe.
+     * While the writer runs, transactions are refused and automatic
+     * snapshots are skipped.  The writer also persists the NextJID of
+     * sequential JIDs, and recording failures are kept for Flush() rather
+     * than written to @ref err.  The journal's readers, undo, and release
+     * operations Flush() first; call them only once the recording threads
+     * are done.  Refused while a transaction is open.
+     */
+    void StartWriter();
+
+    /// Apply every recorded Change and stop the writer; recording is sequential again.
+    void StopWriter();
+
+    /**
+     * @brief Wait until the writer has applied every Change recorded so far.
+     *
+     * A failure to record or apply one, such as a log write error, is
+     * reported here in @ref err.  Does nothing without a writer.
+     */
+    void Flush();
+
+    /// True between StartWriter() and StopWriter().
+    bool Concurrent() const { return writer != nullptr; }
+
+    /**
+     * @brief Shrink the journal without losing an undo it can still perform.
+     *
+     * Reversed Changes are removed; undoing them again would be a no-op.
+     * Each run of adjacent closed sibling releases, with the releases nested
+     * in them, is squashed into its first Release, which gets a Checkpoint
+     * attribute counting the releases folded in.  Within a checkpoint,
+     * consecutive Modify Changes of one JID are merged into the earliest when
+     * it holds a full snapshot, so one undo restores the state before the run.
+     * Open releases keep every unreversed Change, so Undo() is unaffected.
+     *
+     * The indexes are rebuilt and an attached log is rewritten.  XmlNode
+     * handles to removed Change nodes are invalidated.  Refused while a
+     * transaction is open.  Counts and sizes are left in @ref compact_stats.
+     */
+    void Compact();
+
+    /**
+     * @brief Reconstruct the source document as it stood at the end of a release.
+     * @param release Release-number path, e.g. {0,3} for Release 0.3.
+     * @return A new document, freed with its DOM when the handle is
+     *         released, or null after setting @ref err.
+     *
+     * Records hold the state a Change replaced, so replay runs backwards.  It
+     * starts from a copy of the nearest snapshot taken at or after the end of
+     * @p release, or of source_doc when there is none.  Every unreversed Change
+     * recorded after the release and before that point is then undone on the
+     * copy, newest first, through a scratch journal that looks nodes up by
+     * JID.  The cost follows the number of those Changes plus one copy of the
+     * document.  A Change the release includes that was undone after the
+     * release closed cannot be given back, since its record holds only the
+     * state it replaced, so the replay fails instead.  Stamps have whole
+     * seconds, and an undo in the second of the close counts as later.
+     * Compact() drops reversed Changes, and with them this check.  Details
+     * are left in @ref replay_stats.
+     */
+    OwnedXmlDoc ReplayTo(const std::vector<int>& release);
+
+    /**
+     * @brief Keep a copy of source_doc as a ReplayTo() starting point.
+     *
+     * The copy stands for the journal as recorded so far.  It is discarded
+     * when a Change recorded before it is undone, by Compact(), and when
+     * more than @ref max_snapshots are held.  Refused while a transaction
+     * is open.
+     */
+    void Snapshot();
+
+    /**
+     * @brief Rebuild the History() and time indexes and the per-release undo
+     *        stacks from the Change nodes in the journal.
+     *
+     * Called on construction; Action::Record() keeps both current.  Code
+     * that removes Change nodes from the journal DOM directly must call it
+     * again.
+     */
+    void BuildChangeIndex();
+
     // std::string ReleaseString() const;
 
 private:
+    friend class XmlDoc;
+    friend class XmlNode;
+    friend struct Action;
+
+    struct Writer;                 ///< Background writer state; see StartWriter().
+    Writer* writer = nullptr;
+
+    /// Guards @ref jid_map and the History() index while the writer runs.
+    std::mutex map_lock;
+
+    /// Guards Seq and TimeNs issue.
+    std::mutex stamp_lock;
+
+    /// Document new Change records are created in: none while the writer
+    /// runs, so that threads do not share its name dictionary.
+    xmlDocPtr RecordDoc() const { return writer ? nullptr : doc; }
+
+    /// Hand a recorded Action to the writer, or log it to @ref wal directly; returns its failure.
+    ErrorPtr Submit(Action& action);
+
+    /**
+     * @brief Record a recording failure and return it.
+     *
+     * Kept in @ref err, or, while the writer runs, collected by the writer
+     * for the next Flush() so that recording threads never write @ref err.
+     */
+    ErrorPtr Report(ErrorPtr failure);
+
+    /// Write NextJID to the journal root and @ref wal; returns the log error, if any.
+    ErrorPtr WriteNextJID(uint64_t next);
+
+    /// JID value -> Change nodes for that JID in recording order.
+    std::unordered_map<uint64_t, std::vector<xmlNodePtr>> change_index;
+
+    /// Release -> its unreversed Change nodes, most recent last.  Entries
+    /// reversed out of order are skipped when they reach the top.
+    std::unordered_map<xmlNodePtr, std::vector<xmlNodePtr>> undo_stacks;
+
+    /**
+     * @brief Add a recorded Change to the History() index, to the time index
+     *        unless it is nested, and, while unreversed, to its release's
+     *        undo stack.
+     */
+    void IndexChange(xmlNodePtr change);
+
+    /// Position of a top-level Change in recording order.
+    struct ChangeStamp {
+        uint64_t seq;         ///< Seq attribute.
+        int64_t time_ns;      ///< TimeNs attribute, raised to the previous entry's where it is lower.
+        xmlNodePtr change;
+    };
+
+    /// Top-level Changes ordered by both Seq and TimeNs.
+    std::vector<ChangeStamp> timeline;
+
+    uint64_t next_seq = 1;   ///< Seq of the next Change.
+    int64_t last_ns = 0;     ///< Highest TimeNs issued or loaded.
+
+    /// Seq and TimeNs values for a Change being recorded now.
+    std::pair<std::string, std::string> NextStamp();
+
+    /// Add a top-level Change to @ref timeline.
+    void StampIndex(xmlNodePtr change);
+
+    bool sequential_jids = false;
+    bool jid_mixed = false;                  ///< Random JIDs present; sequential values are checked.
+    std::atomic<uint64_t> next_jid{1};       ///< Start of the next unreserved block.
+    uint64_t jid_persisted = 0;              ///< NextJID value last written to the journal.
+    std::mutex jid_lock;                     ///< Serializes NextJID updates.
+    const uint64_t jid_serial;               ///< Keys this journal's block in each thread's block map.
+
+    /// Read NextJID from the journal root, if present, and enter sequential mode.
+    void LoadJIDCounter();
+
+    /// Record @p next as the persisted NextJID if it is higher.
+    void PersistNextJID(uint64_t next);
+
+    friend struct ActionTransaction;
+
+    /// Open Transaction Change receiving recorded changes; null outside a transaction.
+    xmlNodePtr transaction = nullptr;
+
+    /// Undo() dispatch for one Change; the caller holds the source mutation lock.
+    void UndoChange(XmlNode action_node);
+
+    struct UndoGuard;                  ///< Inverses kept by UndoAll(); see there.
+    UndoGuard* undo_guard = nullptr;   ///< Guard of the UndoAll() in progress, if any.
+
     /**
-     * @brief Recursively locate the deepest open Release.
-     * @param start Current Release node from which to continue searching.
-     * @param path Release-number path accumulated during traversal.
-     * @return Deepest open Release reachable from @p start.
+     * @brief Undo @p changes newest first, all or none.
      *
-     * Each visited Release Number is appended to @p path.  When no further
-     * open child Release exists, the current node is returned.
+     * Each undone step registers its inverse, and nodes it takes out of the
+     * source DOM are kept rather than freed.  If a Change cannot be undone,
+     * the inverses are replayed newest first, putting back the same nodes,
+     * and the others are marked unreversed again.  Reversals reach @ref wal
+     * only once every Change is undone.  The caller holds the source
+     * mutation lock and has checked for conflicts.
+     * @return The failure, with @ref err left as it was; null on success.
      */
-    XmlNode FindActiveRelease(XmlNode start, std::vector<int>& path);
+    ErrorPtr UndoAll(const std::vector<xmlNodePtr>& changes);
+
+    /// Copy of source_doc taken when @ref anchor was the last journal record.
+    struct ReplaySnapshot {
+        xmlNodePtr anchor;    ///< Last Change, or Release without Changes, the copy includes.
+        xmlDocPtr doc;        ///< Owned copy of source_doc.
+    };
+
+    /// Snapshots in the order taken, which is also the order of their anchors.
+    std::vector<ReplaySnapshot> snapshots;
+
+    /// Changes recorded since the last automatic snapshot.
+    unsigned since_snapshot = 0;
+
+    /// Store a copy of source_doc that includes everything up to @p anchor.
+    void TakeSnapshot(xmlNodePtr anchor);
+
+    /// Discard the snapshots that include @p change, which is being undone.
+    void DropSnapshots(xmlNodePtr change);
+
+    /// Discard every snapshot.
+    void ClearSnapshots();
+
+    /// Journal Change -> its ordinal in @ref wal.
+    std::unordered_map<xmlNodePtr, uint64_t> wal_changes;
+
+    /**
+     * @brief Attach @p log as @ref wal.
+     * @param log Recovered log whose export this journal was built from.
+     * @param fresh The log is new; write Release records for the seed releases.
+     */
+    void AttachWAL(JournalWAL* log, bool fresh);
+
+    /// Append a recorded Change to @ref wal, if attached; returns the log error, if any.
+    ErrorPtr LogWAL(xmlNodePtr change);
+
+    /// Append the reversal of a Change to @ref wal, if attached; returns the log error, if any.
+    ErrorPtr LogReverse(xmlNodePtr change, const std::string& timestamp);
+
+    /// Release element -> its entry in @ref releases.
+    std::unordered_map<xmlNodePtr, ReleaseInfo*> release_nodes;
+
+    /// Make @p release, or its last open descendant, the active release.
+    void ActivateRelease(ReleaseInfo* release);
 };
 
 /**
@@ -536,6 +1655,8 @@ struct Action {
 
     std::string type;          ///< Change Type attribute supplied by the specialization.
     std::string jid;           ///< Logical source-node JID supplied by the specialization.
+    uint64_t seq = 0;          ///< Seq issued by Record(); 0 before.
+    xmlNodePtr release = nullptr;  ///< Release or Transaction the Change belongs in.
 
     Action(XmlJrnl& j) : jrnl(j) {}
     Action(XmlJrnl& j, XmlNode action) : jrnl(j), action_node(action) {}
@@ -551,34 +1672,76 @@ struct Action {
      * @brief Create the common journal Change node.
      *
      * Derived Record() implementations set @ref type and @ref jid before
-     * calling this method, then append their action-specific child nodes.
+     * calling this method, then append their action-specific child nodes
+     * with AddRecordChild().  While the journal writer runs the Change is
+     * left detached for XmlJrnl::Submit().
      */
-    void Record()
-    {
-        if (type.empty() || jid.empty()) {
-            err = new Error{lvl::ERR, "Cannot record journal action: Type or JID is missing", ""};
-            return;
-        }
+    void Record();
+
+protected:
+    /// Attribute name/value pairs for AddRecordChild().
+    typedef std::initializer_list<std::pair<const char*, std::string>> RecordAttrs;
+
+    /**
+     * @brief Append an element to the Change node.
+     * @param name Element name.
+     * @param attrs Attributes to set on the element.
+     * @param text Optional text content.
+     *
+     * The element is constructed directly in the journal DOM rather than
+     * parsed from XML text.  Failures are reported through @ref err.
+     */
+    void AddRecordChild(const char* name, RecordAttrs attrs, const std::string& text = std::string());
 
-        std::string xml =
-            "\n<Change Type=\"" + type + "\""
-            " TimeStamp=\"" + CurrentIsoTimestampUTC() + "\""
-            " JID=\"" + jid + "\">"
-            "<Reversed TimeStamp=\"\" Value=\"false\"/>"
-            "</Change>\n";
+    /// Document to create the Change's elements in; see XmlJrnl::StartWriter().
+    xmlDocPtr RecordDoc() const { return jrnl.RecordDoc(); }
 
-        action_node = jrnl.active_release.AddChild(xml);
+    /// True while undoing as one step of an XmlJrnl::UndoAll() that may still be put back.
+    bool Guarded() const;
 
-        if (action_node.err)
-            err = action_node.err;
-    }
+    /**
+     * @brief Register how to put back a DOM step this undo made.
+     * @param restore Reverses the step if the enclosing XmlJrnl::UndoAll() fails.
+     * @param release Frees what the step took out once it stands; run at
+     *        once when the undo is not Guarded().
+     */
+    void Revert(std::function<void()> restore, std::function<void()> release = nullptr);
+
+    /**
+     * @brief Append the Node payload element holding @p xml.
+     *
+     * The encoding follows XmlJrnl::compress_threshold.
+     */
+    void AddPayload(const std::string& xml);
+
+    /**
+     * @brief Decode the Node payload of @ref action_node.
+     * @return The stored XML; empty if there is no payload or it cannot be
+     *         decoded, in which case @ref err is set.
+     */
+    std::string Payload();
 
-protected:
     /**
      * @brief Mark a successfully undone action as reversed and timestamp it.
      */
     void ReverseStamp();
 
+    /**
+     * @brief The first unreversed Change recorded for @ref jid after this one.
+     * @return Empty when no later change is still in effect.
+     *
+     * In-place actions use it to detect that their target has since been
+     * changed again by an action that was not undone.
+     */
+    XmlNode LaterChange();
+
+    /**
+     * @brief The live element an in-place action changed, found through jid_map.
+     * @param what Action name used in error messages.
+     * @return Null after setting @ref err or reporting a Conflict.
+     */
+    xmlNodePtr InPlaceTarget(const char* what);
+
     /**
      * @brief Report a legitimate journal-history conflict.
      * @param msg Human-readable conflict description.
@@ -597,19 +1760,37 @@ protected:
  * @struct ActionModify
  * @brief Journal action for replacement/modification of one logical node.
  *
- * Record() stores the parent JID and the Base64-encoded prior node XML.
- * Undo() restores that prior XML while preserving the logical JID and updating
- * jid_map to the replacement xmlNodePtr.
+ * Record() stores the parent JID and either the encoded prior node XML or,
+ * for parse(), a Delta holding only the parts that differ from the new node.
+ * Undo() restores the prior XML while preserving the logical JID and updating
+ * jid_map to the replacement xmlNodePtr, or inverts the Delta in place.
  */
 struct ActionModify : public Action {
     XmlNode node;              ///< Live source node while recording.
     std::string oldXML;        ///< Serialized state prior to modification.
+    xmlNodePtr replacement = nullptr;  ///< New state, when recording a delta.
 
     ActionModify(XmlJrnl& j, XmlNode n, const std::string& old);
+    ActionModify(XmlJrnl& j, XmlNode n, xmlNodePtr replacement);
     ActionModify(XmlJrnl& j, XmlNode action);
 
     void Record();
     void Undo() override;
+
+private:
+    /**
+     * @brief Append a Delta from @ref node to @ref replacement.
+     * @return False when a full snapshot should be recorded instead.
+     */
+    bool AddDelta();
+
+    /**
+     * @brief Invert the Delta element @p delta on the live node @p current.
+     *
+     * @p current keeps its xmlNodePtr; only differing elements and attribute
+     * lists are restored.
+     */
+    void UndoDelta(xmlNodePtr current, xmlNodePtr delta);
 };
 
 /**
@@ -630,6 +1811,86 @@ struct ActionDelete : public Action {
     void Undo() override;
 };
 
+/**
+ * @struct ActionTransaction
+ * @brief Journal action for a group of changes undone together.
+ *
+ * The group is a Change of Type Transaction whose nested Change elements are
+ * ordinary records.  Undo() first scans the Changes recorded after the group
+ * once.  If any unreversed one touches a node the group references, or adds,
+ * moves, or deletes under a parent whose slots the group restores, the whole
+ * group is reported as a conflict and nothing is changed.  Otherwise the
+ * nested changes are undone in reverse order.
+ */
+struct ActionTransaction : public Action {
+    ActionTransaction(XmlJrnl& j, XmlNode action, bool);
+
+    void Undo() override;
+
+private:
+    /// First unreversed Change after the group that interferes with it, or empty.
+    XmlNode LaterConflict(const std::vector<xmlNodePtr>& nested);
+};
+
+/**
+ * @struct ActionMove
+ * @brief Journal action for relinking an element elsewhere in the document.
+ *
+ * Record() stores the From and To slots as Parent plus optional Before/After
+ * element-sibling JIDs; the subtree itself is not serialized.  Undo() checks
+ * that the node is still under the To parent and that the From slot is intact,
+ * then moves the same nodes back.
+ */
+struct ActionMove : public Action {
+    XmlNode node;                    ///< Live element while recording.
+    XmlNode parent;                  ///< Destination parent while recording.
+    xmlNodePtr before = nullptr;     ///< Destination preceding element sibling.
+    xmlNodePtr after = nullptr;      ///< Destination following element sibling.
+
+    ActionMove(XmlJrnl& j, XmlNode n, XmlNode to, xmlNodePtr before, xmlNodePtr after);
+    ActionMove(XmlJrnl& j, XmlNode action, bool);
+
+    void Record();
+    void Undo() override;
+};
+
+/**
+ * @struct ActionSetAttr
+ * @brief Journal action for setting or removing one attribute in place.
+ *
+ * Record() stores the attribute name and its previous value, if any.
+ * Undo() restores that value, or removes the attribute if it did not exist.
+ */
+struct ActionSetAttr : public Action {
+    XmlNode node;              ///< Live source element while recording.
+    std::string name;          ///< Attribute name.
+    const xmlChar* old = nullptr;  ///< Previous value while recording; null when absent.
+
+    ActionSetAttr(XmlJrnl& j, XmlNode n, const std::string& name, const xmlChar* old);
+    ActionSetAttr(XmlJrnl& j, XmlNode action, bool);
+
+    void Record();
+    void Undo() override;
+};
+
+/**
+ * @struct ActionSetText
+ * @brief Journal action for replacing an element's text in place.
+ *
+ * Record() stores the previous text as a Base64 payload.  Undo() restores it
+ * while the element still has no child elements.
+ */
+struct ActionSetText : public Action {
+    XmlNode node;              ///< Live source element while recording.
+    std::string old;           ///< Previous text while recording.
+
+    ActionSetText(XmlJrnl& j, XmlNode n, const std::string& old);
+    ActionSetText(XmlJrnl& j, XmlNode action, bool);
+
+    void Record();
+    void Undo() override;
+};
+
 /**
  * @struct ActionAdd
  * @brief Journal action for insertion of a new logical node.
@@ -0,0 +1,777 @@
+/**
+ * @file bench.cpp
+ * @brief Timing benchmarks for XmlCls.h / XmlCls.cpp.
+ *
+ * Build and run:
+ * @code
+ * make bench
+ * ./bench                # every benchmark
+ * ./bench serialize      # benchmarks whose name starts with "serialize"
+ * @endcode
+ *
+ * Each benchmark prints one line per configuration with the best of several
+ * runs, so results are comparable between builds on the same host.
+ */
+
+#include "XmlCls.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+/**
+ * @brief Best wall-clock time of @p runs calls to @p fn, in milliseconds.
+ */
+double best_ms(int runs, const std::function<void()>& fn)
+{
+    double best = 0;
+    for (int i = 0; i < runs; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        if (i == 0 || elapsed.count() < best) best = elapsed.count();
+    }
+    return best;
+}
+
+/**
+ * @brief A configuration-like document with @p rows mid-sized subtrees.
+ */
+std::string wide_document(int rows)
+{
+    std::string xml = "<Config Name=\"bench\">";
+    for (int i = 0; i < rows; ++i) {
+        std::string n = std::to_string(i);
+        xml += "<Subsystem Name=\"s" + n + "\" Enabled=\"true\">"
+               "<Param Key=\"timeout\">" + n + "</Param>"
+               "<Param Key=\"label\">subsystem &amp; " + n + "</Param>"
+               "<Limits Min=\"0\" Max=\"" + n + "\"/>"
+               "</Subsystem>";
+    }
+    return xml + "</Config>";
+}
+
+/* -------------------------------------------------------------------------
+ * serialize: XmlDoc::XML() against XmlDoc::ParallelXML()
+ * ------------------------------------------------------------------------- */
+
+void bench_serialize()
+{
+    const int rows = 200000;
+    XmlDoc doc(wide_document(rows));
+
+    std::string expected;
+    double serial = best_ms(3, [&] { expected = doc.XML(); });
+
+    std::printf("serialize: %d subtrees, %zu bytes, %u hardware threads\n",
+                rows, expected.size(), std::thread::hardware_concurrency());
+    std::printf("  %-16s %10.1f ms\n", "XML()", serial);
+
+    for (unsigned threads : {1u, 2u, 4u, 8u, 16u}) {
+        std::string out;
+        double ms = best_ms(3, [&] { out = doc.ParallelXML(threads); });
+
+        char label[32];
+        std::snprintf(label, sizeof(label), "ParallelXML(%u)", threads);
+        std::printf("  %-16s %10.1f ms  %5.2fx%s\n",
+                    label, ms, serial / ms, out == expected ? "" : "  MISMATCH");
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * jid: std::map<std::string, xmlNodePtr> against JidIndex at 10^6 JIDs
+ * ------------------------------------------------------------------------- */
+
+/// Store @p node under @p jid; JidIndex takes parsed keys.
+template <typename Map>
+void store(Map& map, const std::string& jid, xmlNodePtr node) { map[jid] = node; }
+
+void store(JidIndex& map, const std::string& jid, xmlNodePtr node)
+{
+    uint64_t key;
+    if (JidIndex::Key(jid, key)) map[key] = node;
+}
+
+template <typename Map>
+void bench_jid_map(const char* label, const std::vector<std::string>& jids,
+                   const std::vector<std::string>& misses, xmlNodePtr node)
+{
+    Map map;
+    double insert = best_ms(1, [&] { for (const std::string& jid : jids) store(map, jid, node); });
+
+    size_t hits = 0;
+    double find = best_ms(3, [&] {
+        hits = 0;
+        for (const std::string& jid : jids) hits += map.find(jid) != map.end();
+    });
+
+    size_t found = 0;
+    double miss = best_ms(3, [&] {
+        found = 0;
+        for (const std::string& jid : misses) found += map.find(jid) != map.end();
+    });
+
+    const double n = double(jids.size()) / 1e6;
+    std::printf("  %-12s insert %7.1f ms  find %7.1f ms  miss %7.1f ms  (%.0f / %.0f / %.0f ns per op)%s\n",
+                label, insert, find, miss, insert / n, find / n, miss / n,
+                hits == jids.size() && found == 0 ? "" : "  MISMATCH");
+}
+
+void bench_jid()
+{
+    const size_t count = 1000000;
+
+    std::mt19937_64 rng(42);
+    std::vector<std::string> jids, misses;
+    for (size_t i = 0; i < count; ++i) jids.push_back(JidIndex::String(rng() | 1));
+    for (size_t i = 0; i < count; ++i) misses.push_back(JidIndex::String(rng() & ~uint64_t{1}));
+
+    XmlDoc host(std::string("<Root/>"));
+    xmlNodePtr node = xmlDocGetRootElement(host.doc);
+
+    std::printf("jid: %zu random JIDs, string-keyed lookups\n", count);
+    bench_jid_map<std::map<std::string, xmlNodePtr>>("std::map", jids, misses, node);
+    bench_jid_map<JidIndex>("JidIndex", jids, misses, node);
+}
+
+/* -------------------------------------------------------------------------
+ * undo: XmlJrnl::Undo() step cost against release size
+ * ------------------------------------------------------------------------- */
+
+void bench_undo()
+{
+    std::printf("undo: Modify changes in one release; per-step cost of Undo()\n");
+
+    for (int changes : {1000, 10000, 100000}) {
+        std::string xml = "<Root>";
+        for (int i = 0; i < changes; ++i) xml += "<Item N=\"" + std::to_string(i) + "\"/>";
+        XmlDoc doc(xml + "</Root>");
+        doc.CreateJournal("/tmp/xmlcls_bench_undo.jrnl.xml");
+
+        auto items = doc.XPath<std::vector<XmlNode>>("/Root/Item");
+        double record = best_ms(1, [&] {
+            for (XmlNode& item : items) item.parse("<Item Changed=\"true\"/>");
+        });
+
+        // The XPath the stack replaced, for comparison.
+        XmlNode release = doc.JRNL->active_release;
+        double scan = best_ms(3, [&] {
+            release.XPath<std::vector<XmlNode>>("./Change[Reversed/@Value='false'][last()]");
+        });
+
+        const int steps = 1000;
+        double undo = best_ms(1, [&] { for (int i = 0; i < steps; ++i) doc.JRNL->Undo(); });
+
+        std::printf("  %6d changes  record %7.1f us/change  undo %6.1f us/step  (XPath scan %7.1f us)%s\n",
+                    changes, 1000 * record / changes, 1000 * undo / steps, 1000 * scan,
+                    doc.JRNL->err ? "  ERROR" : "");
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * record: per-mutation cost of journaling
+ * ------------------------------------------------------------------------- */
+
+/**
+ * @brief Time @p count Modify, Add, and Delete mutations, optionally journaled.
+ */
+void time_mutations(int count, bool journaled, double ms[3])
+{
+    std::string xml = "<Root>";
+    for (int i = 0; i < count; ++i) xml += "<Item N=\"" + std::to_string(i) + "\"><Value>v</Value></Item>";
+    XmlDoc doc(xml + "</Root>");
+    if (journaled) doc.CreateJournal("/tmp/xmlcls_bench_record.jrnl.xml");
+
+    auto items = doc.XPath<std::vector<XmlNode>>("/Root/Item");
+    ms[0] = best_ms(1, [&] { for (XmlNode& item : items) item.parse("<Item Changed=\"true\"><Value>w</Value></Item>"); });
+    ms[1] = best_ms(1, [&] { for (XmlNode& item : items) item.AddChild("<Extra/>"); });
+
+    auto extras = doc.XPath<std::vector<XmlNode>>("/Root/Item/Extra");
+    ms[2] = best_ms(1, [&] { for (XmlNode& extra : extras) extra.Delete(); });
+}
+
+void bench_record()
+{
+    const int count = 20000;
+    double plain[3], journaled[3];
+    time_mutations(count, false, plain);
+    time_mutations(count, true, journaled);
+
+    std::printf("record: journaling overhead per mutation, %d mutations each\n", count);
+    const char* names[] = {"Modify", "Add", "Delete"};
+    for (int i = 0; i < 3; ++i)
+        std::printf("  %-8s plain %6.1f us  journaled %6.1f us  overhead %6.1f us\n", names[i],
+                    1000 * plain[i] / count, 1000 * journaled[i] / count,
+                    1000 * (journaled[i] - plain[i]) / count);
+}
+
+/* -------------------------------------------------------------------------
+ * delta: parse() of a large element with one attribute changed
+ * ------------------------------------------------------------------------- */
+
+void bench_delta()
+{
+    const int rows = 20000, edits = 20;
+
+    const std::string config_xml = wide_document(rows);
+    XmlDoc doc("<Root>" + config_xml + "</Root>");
+    doc.CreateJournal("/tmp/xmlcls_bench_delta.jrnl.xml");
+
+    XmlNode config = doc.XPath<std::vector<XmlNode>>("/Root/Config")[0];
+    const std::string jid = config.JID();
+    const std::string body = config_xml.substr(config_xml.find('>') + 1);
+    const size_t before = doc.JRNL->XML().size();
+
+    double ms = best_ms(1, [&] {
+        for (int i = 0; i < edits; ++i)
+            config.parse("<Config Name=\"edit" + std::to_string(i) + "\" JID=\"" + jid + "\">" + body);
+    });
+
+    std::printf("delta: %zu-byte element, one attribute changed per parse()\n", body.size());
+    std::printf("  %8.1f ms/parse  %8zu journal bytes/change%s\n", ms / edits,
+                (doc.JRNL->XML().size() - before) / edits, doc.JRNL->err ? "  ERROR" : "");
+}
+
+/* -------------------------------------------------------------------------
+ * wal: write-ahead log recording cost against log size and sync policy
+ * ------------------------------------------------------------------------- */
+
+void bench_wal()
+{
+    const char* path = "/tmp/xmlcls_bench_wal.jrnl";
+    const int count = 100000, batch = 10000;
+
+    std::string xml = "<Root>";
+    for (int i = 0; i < count; ++i) xml += "<Item N=\"" + std::to_string(i) + "\"/>";
+    xml += "</Root>";
+
+    std::printf("wal: Modify changes recorded to a write-ahead log\n");
+
+    {
+        std::remove(path);
+        XmlDoc doc(xml);
+        doc.OpenJournalWAL(path, WalOptions{64, 0});
+        auto items = doc.XPath<std::vector<XmlNode>>("/Root/Item");
+
+        for (int start = 0; start < count; start += batch) {
+            double ms = best_ms(1, [&] {
+                for (int i = start; i < start + batch; ++i) items[i].parse("<Item Changed=\"true\"/>");
+            });
+            std::printf("  log holds %6d changes  %6.1f us/change%s\n", start, 1000 * ms / batch,
+                        doc.JRNL->err ? "  ERROR" : "");
+        }
+    }
+
+    const int synced = 2000;
+    for (unsigned every : {1u, 64u, 0u}) {
+        std::remove(path);
+        XmlDoc doc(xml);
+        doc.OpenJournalWAL(path, WalOptions{every, 0});
+        auto items = doc.XPath<std::vector<XmlNode>>("/Root/Item");
+
+        double ms = best_ms(1, [&] {
+            for (int i = 0; i < synced; ++i) items[i].parse("<Item Changed=\"true\"/>");
+        });
+        std::printf("  sync_records %-4u %6.1f us/change\n", every, 1000 * ms / synced);
+    }
+    std::remove(path);
+}
+
+/* -------------------------------------------------------------------------
+ * attr: SetAttr() against parse() for one attribute of a large element
+ * ------------------------------------------------------------------------- */
+
+void bench_attr()
+{
+    const int rows = 20000, edits = 20;
+
+    const std::string config_xml = wide_document(rows);
+    XmlDoc doc("<Root>" + config_xml + "</Root>");
+    doc.CreateJournal("/tmp/xmlcls_bench_attr.jrnl.xml");
+
+    XmlNode config = doc.XPath<std::vector<XmlNode>>("/Root/Config")[0];
+    const std::string jid = config.JID();
+    const std::string body = config_xml.substr(config_xml.find('>') + 1);
+
+    std::printf("attr: one attribute of a %zu-byte element, journaled\n", body.size());
+
+    size_t before = doc.JRNL->XML().size();
+    double parsed = best_ms(1, [&] {
+        for (int i = 0; i < edits; ++i)
+            config.parse("<Config Name=\"edit" + std::to_string(i) + "\" JID=\"" + jid + "\">" + body);
+    });
+    std::printf("  %-10s %10.1f us/edit  %8zu journal bytes/change\n", "parse()",
+                1000 * parsed / edits, (doc.JRNL->XML().size() - before) / edits);
+
+    const int sets = 20000;
+    before = doc.JRNL->XML().size();
+    double set = best_ms(1, [&] { for (int i = 0; i < sets; ++i) config.SetAttr("Name", i); });
+    std::printf("  %-10s %10.1f us/edit  %8zu journal bytes/change%s\n", "SetAttr()",
+                1000 * set / sets, (doc.JRNL->XML().size() - before) / sets,
+                doc.JRNL->err || config.err ? "  ERROR" : "");
+}
+
+/* -------------------------------------------------------------------------
+ * move: MoveTo() against XML() + Delete() + AddChild()
+ * ------------------------------------------------------------------------- */
+
+/**
+ * @brief Move every /Root/Config/Subsystem under /Root/Target, journaled.
+ */
+void time_moves(int rows, bool relink, double& ms, size_t& journal_bytes, bool& error)
+{
+    XmlDoc doc("<Root>" + wide_document(rows) + "<Target/></Root>");
+    doc.CreateJournal("/tmp/xmlcls_bench_move.jrnl.xml");
+
+    XmlNode target = doc.XPath<std::vector<XmlNode>>("/Root/Target")[0];
+    auto items = doc.XPath<std::vector<XmlNode>>("/Root/Config/Subsystem");
+    const size_t before = doc.JRNL->XML().size();
+
+    ms = best_ms(1, [&] {
+        for (XmlNode& item : items) {
+            if (relink) {
+                item.MoveTo(target);
+            } else {
+                std::string xml = item.XML();
+                item.Delete();
+                target.AddChild(xml);
+            }
+        }
+    });
+    journal_bytes = doc.JRNL->XML().size() - before;
+    error = doc.JRNL->err != nullptr;
+}
+
+void bench_move()
+{
+    std::printf("move: relocate every subtree of a document to a new parent, journaled\n");
+
+    for (int rows : {1000, 10000}) {
+        double copy_ms, move_ms;
+        size_t copy_bytes, move_bytes;
+        bool copy_err, move_err;
+        time_moves(rows, false, copy_ms, copy_bytes, copy_err);
+        time_moves(rows, true, move_ms, move_bytes, move_err);
+
+        std::printf("  %6d subtrees  delete+add %6.1f us %5zu B  MoveTo %6.1f us %5zu B  (per move)%s\n",
+                    rows, 1000 * copy_ms / rows, copy_bytes / rows, 1000 * move_ms / rows,
+                    move_bytes / rows, copy_err || move_err ? "  ERROR" : "");
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * delete: journaled Delete() of rows from wide parents
+ * ------------------------------------------------------------------------- */
+
+void bench_delete()
+{
+    const int deletes = 1000;
+
+    std::printf("delete: %d journaled Delete() calls spread over one wide parent\n", deletes);
+
+    for (int width : {1000, 10000, 50000}) {
+        std::string xml = "<Root>";
+        for (int i = 0; i < width; ++i) xml += "<Row N=\"" + std::to_string(i) + "\"/>";
+        XmlDoc doc(xml + "</Root>");
+        doc.CreateJournal("/tmp/xmlcls_bench_delete.jrnl.xml");
+
+        auto rows = doc.XPath<std::vector<XmlNode>>("/Root/Row");
+        const int stride = width / deletes;
+        double ms = best_ms(1, [&] { for (int i = 0; i < width; i += stride) rows[i].Delete(); });
+
+        std::printf("  %6d siblings  %8.1f us/delete  %6d JID attributes%s\n", width, 1000 * ms / deletes,
+                    doc.XPath<int>("count(//@JID)"), doc.JRNL->err ? "  ERROR" : "");
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * alloc: random against sequential block-reserved JID allocation
+ * ------------------------------------------------------------------------- */
+
+void bench_alloc()
+{
+    const int nodes = 1000000, draws = 1000000;
+
+    std::string xml = "<Root>";
+    for (int i = 0; i < nodes; ++i) xml += "<Item/>";
+    xml += "</Root>";
+
+    std::printf("alloc: JID() for %d nodes, then %d draws split across threads\n", nodes, draws);
+
+    for (bool sequential : {false, true}) {
+        XmlDoc doc(xml);
+        doc.CreateJournal("/tmp/xmlcls_bench_alloc.jrnl.xml");
+        if (sequential) doc.JRNL->UseSequentialJIDs();
+
+        auto items = doc.XPath<std::vector<XmlNode>>("/Root/Item");
+        double assign = best_ms(1, [&] { for (XmlNode& item : items) item.JID(); });
+
+        std::printf("  %-10s assign %6.1f ns/node ", sequential ? "sequential" : "random", 1e6 * assign / nodes);
+        for (unsigned threads : {1u, 4u, 8u}) {
+            double ms = best_ms(3, [&] {
+                std::vector<std::thread> workers;
+                for (unsigned t = 0; t < threads; ++t)
+                    workers.emplace_back([&] { for (int i = 0; i < draws / int(threads); ++i) doc.JRNL->JIDKey(); });
+                for (auto& worker : workers) worker.join();
+            });
+            std::printf(" %ux %5.1f ns", threads, 1e6 * ms / draws);
+        }
+        std::printf("%s\n", doc.JRNL->err ? "  ERROR" : "");
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * open: XmlJrnl::BuildJIDMap() on a large document carrying JIDs
+ * ------------------------------------------------------------------------- */
+
+void bench_open()
+{
+    const int rows = 500000;
+
+    std::string xml = "<Root>";
+    uint64_t key = 1;
+    for (int i = 0; i < rows; ++i) {
+        xml += "<Row JID=\"" + JidIndex::String(key++) + "\">";
+        for (int c = 0; c < 3; ++c) xml += "<Cell JID=\"" + JidIndex::String(key++) + "\">v</Cell>";
+        xml += "</Row>";
+    }
+    XmlDoc doc(xml + "</Root>");
+    XmlJrnl journal(doc, std::string("<JRNL><Release Number=\"0\" Open=\"\" Close=\"\"/></JRNL>"));
+
+    std::printf("open: BuildJIDMap() over %llu JIDs\n", static_cast<unsigned long long>(key - 1));
+    for (unsigned threads : {1u, 2u, 4u, 8u}) {
+        double ms = best_ms(3, [&] { journal.BuildJIDMap(threads); });
+        const JidMapStats& stats = journal.jid_map_stats;
+        std::printf("  %u threads  %7.1f ms  (walk %6.1f ms, merge %6.1f ms)%s\n", threads, ms,
+                    stats.walk_ms, stats.merge_ms,
+                    journal.err || stats.jids != key - 1 ? "  ERROR" : "");
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * transaction: grouped changes against the same changes one by one
+ * ------------------------------------------------------------------------- */
+
+/**
+ * @brief Record @p groups batches of @p size SetAttr() changes to a synced log, then undo them.
+ */
+void time_transactions(int groups, int size, bool grouped, double& record_ms, double& undo_ms,
+                       uint64_t& records, bool& error)
+{
+    const char* path = "/tmp/xmlcls_bench_transaction.jrnl";
+    std::remove(path);
+
+    std::string xml = "<Root>";
+    for (int i = 0; i < size; ++i) xml += "<Item N=\"" + std::to_string(i) + "\"/>";
+    XmlDoc doc(xml + "</Root>");
+    doc.OpenJournalWAL(path, WalOptions{1, 0});
+    auto items = doc.XPath<std::vector<XmlNode>>("/Root/Item");
+    for (XmlNode& item : items) item.JID();
+
+    record_ms = best_ms(1, [&] {
+        for (int g = 0; g < groups; ++g) {
+            if (grouped) doc.JRNL->BeginTransaction();
+            for (XmlNode& item : items) item.SetAttr("Batch", g);
+            if (grouped) doc.JRNL->Commit();
+        }
+    });
+    records = doc.JRNL->wal->records;
+
+    const int undos = grouped ? groups : groups * size;
+    undo_ms = best_ms(1, [&] { for (int i = 0; i < undos; ++i) doc.JRNL->Undo(); });
+    error = doc.JRNL->err != nullptr || doc.XPath<int>("count(/Root/Item/@Batch)") != 0;
+    std::remove(path);
+}
+
+void bench_transaction()
+{
+    std::printf("transaction: batches of SetAttr() to a log synced every record, then undone\n");
+
+    const int groups = 20;
+    for (int size : {10, 100}) {
+        double single_rec, single_undo, group_rec, group_undo;
+        uint64_t single_records, group_records;
+        bool single_err, group_err;
+        time_transactions(groups, size, false, single_rec, single_undo, single_records, single_err);
+        time_transactions(groups, size, true, group_rec, group_undo, group_records, group_err);
+
+        const double changes = groups * size;
+        std::printf("  %3d per batch  single %7.1f us/change %7.1f us/undo %5llu records"
+                    "  grouped %7.1f us/change %7.1f us/undo %5llu records%s\n",
+                    size, 1000 * single_rec / changes, 1000 * single_undo / changes,
+                    static_cast<unsigned long long>(single_records), 1000 * group_rec / changes,
+                    1000 * group_undo / changes, static_cast<unsigned long long>(group_records),
+                    single_err || group_err ? "  ERROR" : "");
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * compact: Compact() on a closed release of Modify runs and undone changes
+ * ------------------------------------------------------------------------- */
+
+void bench_compact()
+{
+    std::printf("compact: a closed release of 5 Modifies per node, every other node's last one undone\n");
+
+    const char* wal_path = "/tmp/xmlcls_bench_compact.jrnl";
+    for (bool logged : {false, true}) {
+        for (int rows : {200, 2000}) {
+            std::remove(wal_path);
+            XmlDoc doc(wide_document(rows));
+            if (logged) doc.OpenJournalWAL(wal_path, WalOptions{0, 0});
+            else doc.CreateJournal("/tmp/xmlcls_bench_compact.jrnl.xml");
+            XmlJrnl& jrnl = *doc.JRNL;
+
+            auto items = doc.XPath<std::vector<XmlNode>>("/Config/Subsystem");
+            for (int round = 0; round < 5; ++round)
+                for (XmlNode& item : items)
+                    item.parse("<Subsystem><Round N=\"" + std::to_string(round) + "\"/></Subsystem>");
+            for (int i = 0; i < rows; i += 2)
+                jrnl.Undo(jrnl.History(items[i].JID()).back());
+
+            jrnl.CloseRelease();
+            jrnl.OpenRelease();
+
+            double ms = best_ms(1, [&] { jrnl.Compact(); });
+            const CompactStats& stats = jrnl.compact_stats;
+            std::printf("  %-4s %5d nodes  %9zu -> %8zu bytes  dropped %5zu  merged %5zu  %7.1f ms%s\n",
+                        logged ? "wal" : "xml", rows, stats.bytes_before, stats.bytes_after, stats.dropped,
+                        stats.merged, ms, jrnl.err ? "  ERROR" : "");
+        }
+    }
+    std::remove(wal_path);
+}
+
+/* -------------------------------------------------------------------------
+ * replay: ReplayTo() an early release with and without snapshots
+ * ------------------------------------------------------------------------- */
+
+void bench_replay()
+{
+    const int rows = 2000, releases = 20, per_release = 1000;
+    std::printf("replay: %d releases of %d SetAttr() over %d subsystems\n", releases, per_release, rows);
+
+    for (bool snapshots : {false, true}) {
+        XmlDoc doc(wide_document(rows));
+        doc.CreateJournal("/tmp/xmlcls_bench_replay.jrnl.xml");
+        XmlJrnl& jrnl = *doc.JRNL;
+        auto items = doc.XPath<std::vector<XmlNode>>("/Config/Subsystem");
+        for (XmlNode& item : items) item.JID();
+
+        std::mt19937 rng(7);
+        for (int r = 1; r <= releases; ++r) {
+            if (r > 1) {
+                jrnl.CloseRelease();
+                jrnl.OpenRelease();
+            }
+            for (int i = 0; i < per_release; ++i) items[rng() % rows].SetAttr("Rev", r * per_release + i);
+            if (snapshots && r % 5 == 0) jrnl.Snapshot();
+        }
+
+        for (int target : {2, 10, 19}) {
+            OwnedXmlDoc state;
+            double ms = best_ms(3, [&] { state = jrnl.ReplayTo({0, target}); });
+            std::printf("  %-12s to 0.%-2d  %7.1f ms  %6zu changes undone%s\n",
+                        snapshots ? "snapshots/5" : "live only", target, ms, jrnl.replay_stats.reversed,
+                        state ? "" : "  ERROR");
+        }
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * release: finding the active release and a release's changes
+ * ------------------------------------------------------------------------- */
+
+void bench_release()
+{
+    const int releases = 2000, per_release = 10, depth = 8;
+    std::printf("release: %d closed releases of %d SetAttr(), %d open levels\n", releases, per_release, depth);
+
+    XmlDoc doc(wide_document(100));
+    doc.CreateJournal("/tmp/xmlcls_bench_release.jrnl.xml");
+    XmlJrnl& jrnl = *doc.JRNL;
+    auto items = doc.XPath<std::vector<XmlNode>>("/Config/Subsystem");
+
+    for (int r = 0; r < releases; ++r) {
+        for (int i = 0; i < per_release; ++i) items[i % items.size()].SetAttr("Rev", r * per_release + i);
+        jrnl.CloseRelease();
+        jrnl.OpenRelease();
+    }
+    for (int d = 1; d < depth; ++d) jrnl.OpenRelease();
+
+    const int reps = 1000;
+    double refresh = best_ms(3, [&] { jrnl.RefreshActiveRelease(); });
+    double cycle = best_ms(3, [&] {
+        for (int i = 0; i < reps; ++i) {
+            jrnl.OpenRelease();
+            jrnl.CloseRelease();
+        }
+    });
+    size_t found = 0;
+    double lookup = best_ms(3, [&] {
+        found = 0;
+        for (int i = 0; i < reps; ++i) found += jrnl.ReleaseChanges({0, 1 + i % releases}).size();
+    });
+    std::printf("  RefreshActiveRelease    %9.3f ms\n", refresh);
+    std::printf("  OpenRelease+Close       %9.3f us each\n", cycle * 1000 / reps);
+    std::printf("  ReleaseChanges          %9.3f us each  (%zu changes)%s\n", lookup * 1000 / reps, found,
+                jrnl.err ? "  ERROR" : "");
+}
+
+/* -------------------------------------------------------------------------
+ * undo-release: UndoRelease() against Undo() over the release's changes
+ * ------------------------------------------------------------------------- */
+
+void bench_undo_release()
+{
+    const int rows = 2000;
+    std::printf("undo-release: one release of SetAttr() over %d subsystems, later release blocking or not\n", rows);
+
+    for (int per_row : {1, 5}) {
+        for (int mode = 0; mode < 3; ++mode) {
+            XmlDoc doc(wide_document(rows));
+            doc.CreateJournal("/tmp/xmlcls_bench_undo_release.jrnl.xml");
+            XmlJrnl& jrnl = *doc.JRNL;
+            auto items = doc.XPath<std::vector<XmlNode>>("/Config/Subsystem");
+
+            jrnl.CloseRelease();
+            jrnl.OpenRelease();
+            for (int r = 0; r < per_row; ++r)
+                for (XmlNode& item : items) item.SetAttr("Rev", r);
+            jrnl.CloseRelease();
+            jrnl.OpenRelease();
+            // The last subsystem is edited again, so undoing the release conflicts there.
+            if (mode == 2) items.back().SetAttr("Rev", -1);
+
+            double ms;
+            if (mode == 0) ms = best_ms(1, [&] { jrnl.Undo(jrnl.ReleaseChanges({0, 2})); });
+            else ms = best_ms(1, [&] { jrnl.UndoRelease({0, 2}); });
+            const char* name = mode == 0 ? "Undo(changes)" : mode == 1 ? "UndoRelease" : "UndoRelease, blocked";
+            std::printf("  %5d changes  %-21s %8.1f ms  %4zu groups  %zu conflicts%s\n", rows * per_row, name, ms,
+                        jrnl.release_undo.groups, jrnl.release_undo.conflicts.size(),
+                        jrnl.err && jrnl.err->level != lvl::INFO ? "  ERROR" : "");
+        }
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * timeline: ChangesSince()/ChangesBetween() against an XPath scan
+ * ------------------------------------------------------------------------- */
+
+void bench_timeline()
+{
+    const int rows = 2000;
+    for (int total : {10000, 50000}) {
+        std::printf("timeline: %d SetAttr() over %d subsystems, last 1%% queried\n", total, rows);
+
+        XmlDoc doc(wide_document(rows));
+        doc.CreateJournal("/tmp/xmlcls_bench_timeline.jrnl.xml");
+        XmlJrnl& jrnl = *doc.JRNL;
+        auto items = doc.XPath<std::vector<XmlNode>>("/Config/Subsystem");
+        for (int i = 0; i < total; ++i) items[i % rows].SetAttr("Rev", i);
+
+        const uint64_t since = jrnl.LastSeq() - total / 100;
+        const int64_t from = std::strtoll(jrnl.ChangesSince(since)[0].XPath<std::string>("string(@TimeNs)").c_str(),
+                                          nullptr, 10);
+        const std::string seq_xpath = "//Change[@Seq > " + std::to_string(since) + "]";
+
+        size_t xpath_n = 0, seq_n = 0, time_n = 0;
+        double xpath = best_ms(3, [&] { xpath_n = jrnl.XPath<std::vector<XmlNode>>(seq_xpath).size(); });
+        double by_seq = best_ms(3, [&] { seq_n = jrnl.ChangesSince(since).size(); });
+        double by_time = best_ms(3, [&] { time_n = jrnl.ChangesBetween(from, INT64_MAX).size(); });
+        std::printf("  XPath @Seq scan   %9.3f ms  %5zu changes\n", xpath, xpath_n);
+        std::printf("  ChangesSince      %9.3f ms  %5zu changes\n", by_seq, seq_n);
+        std::printf("  ChangesBetween    %9.3f ms  %5zu changes%s\n", by_time, time_n, jrnl.err ? "  ERROR" : "");
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * writer: sequential recording against threads feeding the journal writer
+ * ------------------------------------------------------------------------- */
+
+void bench_writer()
+{
+    const int rows = 4000, rounds = 5;
+    std::printf("writer: %d rounds of SetAttr()+SetText() over %d subsystems\n", rounds, rows);
+
+    for (unsigned threads : {0u, 1u, 2u, 4u, 8u}) {
+        XmlDoc doc(wide_document(rows));
+        doc.CreateJournal("/tmp/xmlcls_bench_writer.jrnl.xml");
+        XmlJrnl& jrnl = *doc.JRNL;
+        auto items = doc.XPath<std::vector<XmlNode>>("/Config/Subsystem");
+        auto params = doc.XPath<std::vector<XmlNode>>("/Config/Subsystem/Param[1]");
+
+        // Attribute names must already be in the document's dictionary.
+        auto work = [&](unsigned first, unsigned step) {
+            for (int r = 0; r < rounds; ++r)
+                for (size_t i = first; i < items.size(); i += step) {
+                    items[i].SetAttr("Enabled", r);
+                    params[i].SetText(std::to_string(r));
+                }
+        };
+
+        if (threads) jrnl.StartWriter();
+        auto start = std::chrono::steady_clock::now();
+        if (!threads) {
+            work(0, 1);
+        } else {
+            std::vector<std::thread> workers;
+            for (unsigned t = 0; t < threads; ++t) workers.emplace_back(work, t, threads);
+            for (auto& worker : workers) worker.join();
+            jrnl.Flush();
+        }
+        std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+        jrnl.StopWriter();
+
+        if (threads) std::printf("  %u thread(s) + writer %9.3f ms", threads, ms.count());
+        else         std::printf("  sequential          %9.3f ms", ms.count());
+        std::printf("  %6llu changes%s\n", (unsigned long long)jrnl.LastSeq(), jrnl.err ? "  ERROR" : "");
+    }
+}
+
+struct Benchmark {
+    const char* name;
+    void (*run)();
+};
+
+const Benchmark benchmarks[] = {
+    {"serialize", bench_serialize},
+    {"jid",       bench_jid},
+    {"undo",      bench_undo},
+    {"record",    bench_record},
+    {"delta",     bench_delta},
+    {"wal",       bench_wal},
+    {"attr",      bench_attr},
+    {"move",      bench_move},
+    {"delete",    bench_delete},
+    {"alloc",     bench_alloc},
+    {"open",      bench_open},
+    {"transaction", bench_transaction},
+    {"compact",   bench_compact},
+    {"replay",    bench_replay},
+    {"release",   bench_release},
+    {"undo-release", bench_undo_release},
+    {"timeline",  bench_timeline},
+    {"writer",    bench_writer},
+};
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    const char* filter = argc > 1 ? argv[1] : "";
+
+    for (const Benchmark& b : benchmarks)
+        if (std::strncmp(b.name, filter, std::strlen(filter)) == 0)
+            b.run();
+    return 0;
+}
@@ -19,13 +19,22 @@
 
 #include "XmlCls.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdlib>
 #include <cstdio>
+#include <filesystem>
+#include <set>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 namespace {
 
 int failures = 0;
@@ -222,6 +231,611 @@ void test_save_and_reload()
     std::remove(path);
 }
 
+void test_save_async()
+{
+    banner("SaveAsync snapshot and coalescing");
+
+    const char* path = "/tmp/xmlcls_test_save_async.xml";
+
+    XmlDoc doc(std::string("<Root><A>snapshot</A></Root>"));
+    CHECK(!doc.err);
+
+    /*
+     * The snapshot is taken before SaveAsync() returns, so a mutation made
+     * while the write is in flight must not appear in the saved file.
+     */
+    auto saved = doc.SaveAsync(path);
+    auto root = require_nodes(doc, "/Root")[0];
+    root.AddChild("<Late/>");
+
+    ErrorPtr result = saved.get();
+    print_error("SaveAsync(path)", result);
+    CHECK(result == nullptr);
+
+    {
+        XmlDoc reloaded(path);
+        CHECK(!reloaded.err);
+        CHECK_EQ(reloaded.XPath<std::string>("/Root/A"), std::string("snapshot"));
+        CHECK_EQ(reloaded.XPath<int>("count(/Root/Late)"), 0);
+    }
+
+    /*
+     * A burst of requests is coalesced; every future completes and the file
+     * ends up holding the newest snapshot.
+     */
+    std::vector<std::shared_future<ErrorPtr>> burst;
+    for (int i = 0; i < 20; ++i) {
+        root.AddChild("<Item N=\"" + std::to_string(i) + "\"/>");
+        burst.push_back(doc.SaveAsync());
+    }
+
+    bool all_ok = true;
+    for (auto& f : burst) all_ok = all_ok && f.get() == nullptr;
+    CHECK(all_ok);
+
+    XmlDoc reloaded(path);
+    CHECK(!reloaded.err);
+    CHECK_EQ(reloaded.XPath<int>("count(/Root/Item)"), 20);
+    CHECK_EQ(reloaded.XPath<int>("count(/Root/Late)"), 1);
+
+    /*
+     * Requests for different files are never coalesced: each file is
+     * written with its own snapshot.
+     */
+    const std::string other = std::string(path) + ".other";
+    std::vector<std::shared_future<ErrorPtr>> mixed;
+    for (int i = 0; i < 10; ++i) {
+        root.SetAttr("Round", i);
+        mixed.push_back(doc.SaveAsync(i % 2 ? other.c_str() : path));
+    }
+    all_ok = true;
+    for (auto& f : mixed) all_ok = all_ok && f.get() == nullptr;
+    CHECK(all_ok);
+    {
+        XmlDoc first(path), second(other.c_str());
+        CHECK(!first.err && !second.err);
+        CHECK_EQ(first.XPath<std::string>("string(/Root/@Round)"), std::string("8"));
+        CHECK_EQ(second.XPath<std::string>("string(/Root/@Round)"), std::string("9"));
+    }
+    std::remove(other.c_str());
+
+    /*
+     * Write failures are delivered through the future.
+     */
+    ErrorPtr failed = doc.SaveAsync("/nonexistent-dir/xmlcls.xml").get();
+    CHECK(failed != nullptr);
+    if (failed) CHECK(failed->level == lvl::ERR);
+
+    std::remove(path);
+}
+
+void test_dirty_tracking()
+{
+    banner("dirty tracking");
+
+    const char* path = "/tmp/xmlcls_test_dirty.xml";
+    const char* jpath = "/tmp/xmlcls_test_dirty.jrnl.xml";
+
+    XmlDoc doc(std::string("<Root><A/></Root>"));
+    CHECK(!doc.err);
+    CHECK(!doc.IsDirty());
+
+    auto root = require_nodes(doc, "/Root")[0];
+    root.AddChild("<B/>");
+    CHECK(doc.IsDirty());
+
+    doc.Save(path);
+    CHECK(!doc.err);
+    CHECK(!doc.IsDirty());
+
+    auto a = require_nodes(doc, "/Root/A")[0];
+    a.parse("<A changed=\"true\"/>");
+    CHECK(doc.IsDirty());
+
+    CHECK(doc.SaveAsync().get() == nullptr);
+    CHECK(!doc.IsDirty());
+
+    require_nodes(doc, "/Root/B")[0].Delete();
+    CHECK(doc.IsDirty());
+    doc.Save();
+
+    /*
+     * Undo changes the source DOM and the journal's Reversed state.
+     */
+    doc.CreateJournal(jpath);
+    root = require_nodes(doc, "/Root")[0];
+    root.AddChild("<C/>");
+    CHECK(doc.JRNL->IsDirty());
+    doc.Save();
+    doc.JRNL->Save(jpath);
+    CHECK(!doc.IsDirty());
+    CHECK(!doc.JRNL->IsDirty());
+
+    doc.JRNL->Undo();
+    CHECK(!doc.JRNL->err);
+    CHECK_EQ(doc.XPath<int>("count(/Root/C)"), 0);
+    CHECK(doc.IsDirty());
+    CHECK(doc.JRNL->IsDirty());
+
+    std::remove(path);
+    std::remove(jpath);
+}
+
+void test_autosave()
+{
+    banner("debounced autosave");
+
+    const char* path = "/tmp/xmlcls_test_autosave.xml";
+
+    std::atomic<int> writes{0};
+    std::atomic<int> failures_seen{0};
+    auto count = [&](const Error* e) { ++writes; if (e) ++failures_seen; };
+
+    {
+        XmlDoc doc(std::string("<Root/>"));
+        doc.Save(path);
+
+        AutosavePolicy quiet;
+        quiet.quiescence_ms = 200;
+        quiet.report = count;
+        doc.Autosave(quiet);
+
+        /*
+         * A burst of edits followed by quiescence costs one write.
+         */
+        auto root = require_nodes(doc, "/Root")[0];
+        for (int i = 0; i < 100; ++i)
+            root.AddChild("<Item N=\"" + std::to_string(i) + "\"/>");
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(600));
+        CHECK_EQ(writes.load(), 1);
+        CHECK_EQ(failures_seen.load(), 0);
+        CHECK(!doc.IsDirty());
+
+        XmlDoc reloaded(path);
+        CHECK_EQ(reloaded.XPath<int>("count(/Root/Item)"), 100);
+
+        /*
+         * A change-count trigger saves without waiting for quiescence.
+         */
+        writes = 0;
+        AutosavePolicy counted;
+        counted.changes = 10;
+        counted.report = count;
+        doc.Autosave(counted);
+
+        for (int i = 0; i < 25; ++i)
+            root.AddChild("<More/>");
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        CHECK(writes.load() >= 1);
+        CHECK(writes.load() <= 3);
+    }
+
+    /*
+     * Destruction flushes any changes below the count threshold.
+     */
+    XmlDoc reloaded(path);
+    CHECK_EQ(reloaded.XPath<int>("count(/Root/More)"), 25);
+    CHECK_EQ(failures_seen.load(), 0);
+
+    std::remove(path);
+}
+
+void test_merkle_hash_and_diff()
+{
+    banner("Merkle hash and Diff");
+
+    /*
+     * Attribute order and JID assignment do not affect content hashes.
+     */
+    XmlDoc a(std::string("<Root><Item x=\"1\" y=\"2\">text</Item><Other/></Root>"));
+    XmlDoc b(std::string("<Root><Item y=\"2\" x=\"1\" JID=\"00000000000000aa\">text</Item><Other/></Root>"));
+    CHECK(!a.err);
+    CHECK(!b.err);
+    CHECK(a.Hash() != 0);
+    CHECK_EQ(a.Hash(), b.Hash());
+    CHECK(a.Diff(b).empty());
+
+    /*
+     * Text, attribute, and structural changes are all visible.
+     */
+    XmlDoc text(std::string("<Root><Item x=\"1\" y=\"2\">changed</Item><Other/></Root>"));
+    XmlDoc attr(std::string("<Root><Item x=\"1\" y=\"3\">text</Item><Other/></Root>"));
+    XmlDoc shape(std::string("<Root><Item x=\"1\" y=\"2\">text</Item></Root>"));
+    CHECK(a.Hash() != text.Hash());
+    CHECK(a.Hash() != attr.Hash());
+    CHECK(a.Hash() != shape.Hash());
+
+    /*
+     * Diff descends only into differing subtrees and reports the deepest
+     * differing element.
+     */
+    std::string wide = "<Root>";
+    for (int i = 0; i < 200; ++i)
+        wide += "<Row N=\"" + std::to_string(i) + "\"><Cell>v</Cell><Cell>w</Cell></Row>";
+    wide += "</Root>";
+
+    XmlDoc left(wide);
+    XmlDoc right(wide);
+    CHECK_EQ(left.Hash(), right.Hash());
+
+    auto cell = require_nodes(right, "/Root/Row[@N='137']/Cell[2]")[0];
+    cell.parse("<Cell>changed</Cell>");
+    CHECK(!cell.err);
+
+    /*
+     * Cached hashes were invalidated along the mutated path only.
+     */
+    CHECK(left.Hash() != right.Hash());
+    CHECK_EQ(require_nodes(left, "/Root/Row[@N='136']")[0].Hash(),
+             require_nodes(right, "/Root/Row[@N='136']")[0].Hash());
+
+    auto diffs = left.Diff(right);
+    CHECK_EQ(diffs.size(), std::size_t{1});
+    if (!diffs.empty()) {
+        CHECK_EQ(diffs[0].left.GetPath(), std::string("/Root/Row[138]/Cell[2]"));
+        CHECK_EQ(diffs[0].right.XPath<std::string>("."), std::string("changed"));
+    }
+
+    /*
+     * Add, Delete, and undo keep the cached hashes coherent.
+     */
+    auto row = require_nodes(right, "/Root/Row[@N='5']")[0];
+    row.AddChild("<Cell>extra</Cell>");
+    diffs = left.Diff(right);
+    CHECK_EQ(diffs.size(), std::size_t{2});
+
+    require_nodes(right, "/Root/Row[@N='5']/Cell[3]")[0].Delete();
+    require_nodes(right, "/Root/Row[@N='137']/Cell[2]")[0].parse("<Cell>w</Cell>");
+    CHECK_EQ(left.Hash(), right.Hash());
+    CHECK(left.Diff(right).empty());
+
+    const char* path = "/tmp/xmlcls_test_hash.jrnl.xml";
+    right.CreateJournal(path);
+    const uint64_t before = right.Hash();
+
+    require_nodes(right, "/Root/Row[@N='9']")[0].parse("<Row N=\"9\"/>");
+    CHECK(right.Hash() != before);
+
+    right.JRNL->Undo();
+    CHECK(!right.JRNL->err);
+    CHECK_EQ(right.Hash(), before);
+    CHECK(left.Diff(right).empty());
+
+    std::remove(path);
+}
+
+void test_c14n_and_digest()
+{
+    banner("C14N and Digest");
+
+    /*
+     * Attribute order, quoting, empty-element syntax, and comments do not
+     * survive canonicalization.
+     */
+    XmlDoc doc(std::string("<Root b='2'  a=\"1\"><Empty/><!--note--><Text>x &amp; y</Text></Root>"));
+    CHECK(!doc.err);
+
+    const std::string canonical = "<Root a=\"1\" b=\"2\"><Empty></Empty><Text>x &amp; y</Text></Root>";
+    CHECK_EQ(doc.C14N(), canonical);
+    CHECK_EQ(doc.Digest(), std::string("b26a4309ba5a90874065803b09dda657054b525771d7b8293bbd98b5dc6e02b8"));
+    CHECK(!doc.err);
+
+    C14NOptions with_comments;
+    with_comments.comments = true;
+    CHECK(doc.C14N(with_comments).find("<!--note-->") != std::string::npos);
+    CHECK(doc.Digest(with_comments) != doc.Digest());
+
+    XmlDoc same(canonical);
+    XmlDoc changed(std::string("<Root a=\"1\" b=\"3\"><Empty/><Text>x &amp; y</Text></Root>"));
+    CHECK_EQ(same.Digest(), doc.Digest());
+    CHECK(changed.Digest() != doc.Digest());
+
+    /*
+     * Subtrees are canonicalized as document subsets.
+     */
+    XmlDoc ns(std::string("<Root xmlns=\"urn:a\" xmlns:x=\"urn:x\"><Used x:k=\"v\"/><Plain/></Root>"));
+    CHECK(!ns.err);
+    xmlNodePtr plain = xmlDocGetRootElement(ns.doc)->last;
+    XmlNode node(plain);
+
+    CHECK_EQ(node.C14N(), std::string("<Plain xmlns=\"urn:a\" xmlns:x=\"urn:x\"></Plain>"));
+
+    C14NOptions exclusive;
+    exclusive.mode = XML_C14N_EXCLUSIVE_1_0;
+    CHECK_EQ(node.C14N(exclusive), std::string("<Plain xmlns=\"urn:a\"></Plain>"));
+    exclusive.inclusive_prefixes = {"x"};
+    CHECK_EQ(node.C14N(exclusive), std::string("<Plain xmlns=\"urn:a\" xmlns:x=\"urn:x\"></Plain>"));
+    CHECK_EQ(node.Digest().size(), std::size_t{64});
+    CHECK(!node.err);
+
+    /*
+     * Output larger than the libxml2 output buffer is streamed in blocks;
+     * canonical form is a fixed point.
+     */
+    std::string big = "<Root>";
+    for (int i = 0; i < 5000; ++i)
+        big += "<Row N='" + std::to_string(i) + "'><Cell/></Row>";
+    big += "</Root>";
+
+    XmlDoc large(big);
+    std::string text = large.C14N();
+    CHECK(text.size() > 100000);
+    XmlDoc reparsed(text);
+    CHECK_EQ(reparsed.Digest(), large.Digest());
+    CHECK_EQ(reparsed.C14N(), text);
+
+    XmlNode empty;
+    CHECK(empty.Digest().empty());
+    CHECK(empty.err);
+}
+
+void test_parallel_xml()
+{
+    banner("ParallelXML");
+
+    /*
+     * Output matches XML() byte for byte, including nesting, namespaces,
+     * comments, processing instructions, and escaped non-ASCII content.
+     */
+    std::string xml = "<?xml version=\"1.0\"?>\n<!--before--><Root xmlns:p=\"urn:p\" a=\"1\">";
+    for (int i = 0; i < 300; ++i) {
+        xml += "<Row N=\"" + std::to_string(i) + "\" t=\"caf\xc3\xa9\"><p:Cell>x &amp; \xc3\xa9</p:Cell>"
+               "<Mixed>a<b/>c</Mixed><Empty/></Row>";
+        if (i % 50 == 0) xml += "<!-- note " + std::to_string(i) + " --><?pi data?>";
+    }
+    xml += "</Root><!--after-->";
+
+    XmlDoc doc(xml);
+    CHECK(!doc.err);
+    const std::string serial = doc.XML();
+    const uint64_t hash = doc.Hash();
+
+    CHECK_EQ(doc.ParallelXML(4), serial);
+    CHECK_EQ(doc.ParallelXML(3), serial);
+    CHECK_EQ(doc.ParallelXML(1), serial);
+    CHECK(doc.ParallelXML(1000) == serial);
+
+    /*
+     * The tree is intact afterwards.
+     */
+    CHECK_EQ(doc.XML(), serial);
+    CHECK_EQ(doc.Hash(), hash);
+    CHECK_EQ(doc.XPath<int>("count(/Root/Row)"), 300);
+    CHECK_EQ(require_nodes(doc, "/Root/Row[last()]")[0].XPath<std::string>("../@a"), std::string("1"));
+
+    /*
+     * Declared single-byte encodings are honoured.
+     */
+    XmlDoc latin(std::string("<?xml version=\"1.0\" encoding=\"ISO-8859-1\"?><Root><A>caf\xe9</A><B>\xe9</B><C/></Root>"));
+    CHECK(!latin.err);
+    CHECK_EQ(latin.ParallelXML(2), latin.XML());
+
+    /*
+     * Documents that cannot be split fall back to XML().
+     */
+    XmlDoc mixed(std::string("<Root>text<A/><B/></Root>"));
+    XmlDoc single(std::string("<Root><A><B/></A></Root>"));
+    CHECK_EQ(mixed.ParallelXML(4), mixed.XML());
+    CHECK_EQ(single.ParallelXML(4), single.XML());
+}
+
+void test_jid_index()
+{
+    banner("JidIndex");
+
+    JidIndex index;
+    uint64_t key = 0;
+
+    CHECK(JidIndex::Key("00000000000000aa", key));
+    CHECK_EQ(key, uint64_t{0xaa});
+    CHECK_EQ(JidIndex::String(0x0123456789abcdefULL), std::string("0123456789abcdef"));
+    CHECK(!JidIndex::Key("00000000000000AA", key));
+    CHECK(!JidIndex::Key("aa", key));
+    CHECK(!JidIndex::Key("00000000000000ag", key));
+
+    /*
+     * Sequential and random keys, growth across several rehashes, and
+     * reserved null entries.
+     */
+    XmlDoc host(std::string("<Root/>"));
+    xmlNodePtr live = xmlDocGetRootElement(host.doc);
+
+    for (uint64_t k = 0; k < 20000; ++k)
+        index[k * 3] = (k % 2) ? live : nullptr;
+    CHECK_EQ(index.size(), std::size_t{20000});
+    CHECK(index.contains(0));
+    CHECK(index.contains(3 * 19999));
+    CHECK(!index.contains(1));
+    CHECK(index.find(JidIndex::String(3 * 7)) != index.end());
+    CHECK(index.find(JidIndex::String(3 * 7))->second == live);
+    CHECK(index.find(JidIndex::String(3 * 8))->second == nullptr);
+    CHECK(index.find("not-a-jid") == index.end());
+    CHECK(index.at(JidIndex::String(3 * 7)) == live);
+    CHECK(index.at(JidIndex::String(1)) == nullptr);
+    CHECK(index.at("not-a-jid") == nullptr);
+    CHECK_EQ(index.size(), std::size_t{20000});
+
+    auto [it, inserted] = index.emplace(3 * 8, live);
+    CHECK(!inserted);
+    CHECK(it->second == nullptr);
+    it->second = live;
+    CHECK(index[3 * 8] == live);
+
+    /*
+     * Erasure leaves tombstones that do not break later probes.
+     */
+    std::size_t erased = 0;
+    for (uint64_t k = 0; k < 20000; k += 2)
+        erased += index.erase(k * 3);
+    CHECK_EQ(erased, std::size_t{10000});
+    CHECK_EQ(index.size(), std::size_t{10000});
+    CHECK_EQ(index.erase(0), std::size_t{0});
+    CHECK(!index.contains(3 * 8));
+    CHECK(index.contains(3 * 9));
+
+    std::size_t seen = 0;
+    bool all_live = true;
+    for (const auto& [jid, node] : index) {
+        uint64_t k = 0;
+        all_live = all_live && JidIndex::Key(jid, k) && k % 6 == 3 && node == live;
+        ++seen;
+    }
+    CHECK_EQ(seen, std::size_t{10000});
+    CHECK(all_live);
+
+    CHECK(index.emplace(3 * 8, nullptr).second);
+    CHECK_EQ(index.size(), std::size_t{10001});
+
+    index.clear();
+    CHECK(index.empty());
+    CHECK(index.begin() == index.end());
+
+    /*
+     * Journals reject malformed JIDs.
+     */
+    XmlDoc doc(std::string("<Root><A JID=\"NOT-HEX\"/></Root>"));
+    XmlJrnl journal(doc, std::string("<JRNL><Release Number=\"0\" Open=\"\" Close=\"\"/></JRNL>"));
+    CHECK(journal.err);
+    if (journal.err) CHECK(journal.err->msg.find("Malformed JID") != std::string::npos);
+}
+
+void test_jid_cache()
+{
+    banner("cached JID values");
+
+    const char* path = "/tmp/xmlcls_test_jid_cache.jrnl.xml";
+
+    XmlDoc doc(std::string("<Root><A JID=\"00000000000000aa\"/><B JID=\"bad\"/><C/></Root>"));
+    CHECK(!doc.err);
+
+    /*
+     * Existing attributes are parsed once; later reads come from the cache.
+     */
+    XmlNode a = require_nodes(doc, "/Root/A")[0];
+    uint64_t value = 0;
+    CHECK(a.JIDValue(value));
+    CHECK_EQ(value, uint64_t{0xaa});
+    CHECK_EQ(a.JID(), std::string("00000000000000aa"));
+
+    xmlSetProp(a.node, BAD_CAST "JID", BAD_CAST "00000000000000bb");
+    CHECK(a.JIDValue(value));
+    CHECK_EQ(value, uint64_t{0xaa});
+
+    /*
+     * Malformed attributes are reported, not replaced.
+     */
+    XmlNode b = require_nodes(doc, "/Root/B")[0];
+    CHECK(!b.JIDValue(value));
+    CHECK(b.err);
+    CHECK_EQ(b.XPath<std::string>("@JID"), std::string("bad"));
+    require_nodes(doc, "/Root/B")[0].Delete();
+    xmlSetProp(a.node, BAD_CAST "JID", BAD_CAST "00000000000000aa");
+
+    /*
+     * JID assignment, propagation through parse(), and Undo() keep the cache
+     * coherent with the attribute and jid_map.
+     */
+    doc.CreateJournal(path);
+    XmlNode c = require_nodes(doc, "/Root/C")[0];
+    CHECK(c.JIDValue(value));
+    CHECK_EQ(JidIndex::String(value), c.XPath<std::string>("@JID"));
+    CHECK(doc.JRNL->jid_map[value] == c.node);
+
+    c.JID("00000000000000cc");
+    CHECK(c.JIDValue(value));
+    CHECK_EQ(value, uint64_t{0xcc});
+
+    c.parse("<C2/>");
+    CHECK(!c.err);
+    CHECK(c.JIDValue(value));
+    CHECK_EQ(value, uint64_t{0xcc});
+    CHECK(doc.JRNL->jid_map[value] == c.node);
+
+    doc.JRNL->Undo();
+    CHECK(!doc.JRNL->err);
+    XmlNode restored = require_nodes(doc, "/Root/C")[0];
+    CHECK(restored.JIDValue(value));
+    CHECK_EQ(value, uint64_t{0xcc});
+    CHECK(doc.JRNL->jid_map[value] == restored.node);
+
+    std::remove(path);
+}
+
+void test_build_jid_map()
+{
+    banner("XmlJrnl::BuildJIDMap");
+
+    const char* seed = "<JRNL><Release Number=\"0\" Open=\"\" Close=\"\"/></JRNL>";
+
+    auto document = [](int rows, int duplicate_at, int bad_at) {
+        std::string xml = "<Root JID=\"0000000000000001\">";
+        for (int i = 0; i < rows; ++i) {
+            std::string row = JidIndex::String(uint64_t(2 * i + 2));
+            std::string cell = i == duplicate_at ? std::string("0000000000000002")
+                             : i == bad_at ? std::string("bad")
+                             : JidIndex::String(uint64_t(2 * i + 3));
+            xml += "<Row JID=\"" + row + "\"><Plain/><Cell JID=\"" + cell + "\">t</Cell></Row>";
+        }
+        return xml + "</Root>";
+    };
+
+    /*
+     * A parallel walk indexes exactly what a serial one does.
+     */
+    XmlDoc doc(document(33000, -1, -1));    // large enough to bucket by slot
+    XmlJrnl journal(doc, std::string(seed));
+    CHECK(!journal.err);
+    CHECK_EQ(journal.jid_map_stats.jids, std::size_t{66001});
+
+    journal.BuildJIDMap(1);
+    CHECK_EQ(journal.jid_map_stats.threads, 1u);
+    std::map<uint64_t, xmlNodePtr> serial;
+    for (uint64_t k = 1; k <= 66001; ++k) {
+        auto it = journal.jid_map.find(k);
+        if (it != journal.jid_map.end()) serial[k] = it->second;
+    }
+    CHECK_EQ(serial.size(), std::size_t{66001});
+
+    journal.BuildJIDMap(4);
+    CHECK(!journal.err);
+    CHECK_EQ(journal.jid_map_stats.threads, 4u);
+    CHECK_EQ(journal.jid_map.size(), std::size_t{66001});
+    bool same = true;
+    for (auto& [k, node] : serial) same = same && journal.jid_map[k] == node;
+    CHECK(same);
+    CHECK(journal.jid_map[uint64_t{1}] == xmlDocGetRootElement(doc.doc));
+
+    /*
+     * Small documents are walked by the caller alone.
+     */
+    XmlDoc small(document(10, -1, -1));
+    XmlJrnl small_journal(small, std::string(seed));
+    small_journal.BuildJIDMap(4);
+    CHECK_EQ(small_journal.jid_map_stats.threads, 1u);
+    CHECK_EQ(small_journal.jid_map_stats.jids, std::size_t{21});
+
+    /*
+     * A duplicate in a distant run, or a malformed JID deep in the tree, is
+     * still reported.
+     */
+    XmlDoc duplicate(document(33000, 32900, -1));
+    XmlJrnl duplicate_journal(duplicate, std::string(seed));
+    duplicate_journal.BuildJIDMap(4);
+    CHECK(duplicate_journal.err);
+    if (duplicate_journal.err) {
+        CHECK(duplicate_journal.err->msg.find("Duplicate JID") != std::string::npos);
+        CHECK(duplicate_journal.err->data.find("/@JID") != std::string::npos);
+    }
+
+    XmlDoc malformed(document(3000, -1, 1500));
+    XmlJrnl malformed_journal(malformed, std::string(seed));
+    CHECK(malformed_journal.err);
+    if (malformed_journal.err)
+        CHECK_EQ(malformed_journal.err->data, std::string("/Root/Row[1501]/Cell/@JID"));
+}
+
 void test_xmljrnl_constructor_and_active_release()
 {
     banner("XmlJrnl constructor / source DOM / active Release / JID map");
@@ -594,7 +1208,7 @@ void test_journal_delete()
     CHECK(!c.XPath<bool>("./@JID"));
 
     /*
-     * Delete() should assign JIDs to the parent and all siblings/children
+     * Delete() should assign JIDs to the parent and the nearest siblings
      * before LogDelete() records the transaction.
      */
     b.Delete();
@@ -658,14 +1272,14 @@ void test_journal_delete()
     CHECK(doc.JRNL->jid_map.find(b_jid) != doc.JRNL->jid_map.end());
     CHECK(doc.JRNL->jid_map.find(c_jid) != doc.JRNL->jid_map.end());
 
-    CHECK(doc.JRNL->jid_map[root_jid] == root.node);
-    CHECK(doc.JRNL->jid_map[a_jid] == a.node);
-    CHECK(doc.JRNL->jid_map[c_jid] == c.node);
+    CHECK(doc.JRNL->jid_map.at(root_jid) == root.node);
+    CHECK(doc.JRNL->jid_map.at(a_jid) == a.node);
+    CHECK(doc.JRNL->jid_map.at(c_jid) == c.node);
 
     /*
      * Deleted identity remains reserved but has no live source node.
      */
-    CHECK(doc.JRNL->jid_map[b_jid] == nullptr);
+    CHECK(doc.JRNL->jid_map.at(b_jid) == nullptr);
 
     /*
      * Saved XML must contain the deleted logical node, including its JID.
@@ -687,6 +1301,32 @@ void test_journal_delete()
     print_xml("source after journaled Delete(B)", doc);
     print_xml("journal after journaled Delete(B)", doc.JRNL);
 
+    /*
+     * Siblings beyond the immediate neighbours are left without JIDs.
+     */
+    {
+        XmlDoc wide(std::string("<Root><R0/><R1/><R2/><R3/><R4/><R5/></Root>"));
+        wide.CreateJournal(path);
+
+        require_nodes(wide, "/Root/R3")[0].Delete();
+        CHECK(!wide.JRNL->err);
+        CHECK_EQ(wide.XPath<int>("count(//@JID)"), 3);
+        CHECK(wide.XPath<bool>("/Root/@JID"));
+        CHECK(wide.XPath<bool>("/Root/R2/@JID"));
+        CHECK(wide.XPath<bool>("/Root/R4/@JID"));
+
+        require_nodes(wide, "/Root/R0")[0].Delete();
+        CHECK_EQ(wide.XPath<int>("count(//@JID)"), 4);
+        CHECK(!wide.XPath<bool>("/Root/R5/@JID"));
+
+        wide.JRNL->Undo();
+        wide.JRNL->Undo();
+        CHECK(!wide.JRNL->err);
+        CHECK_EQ(wide.XPath<int>("count(/Root/R3/preceding-sibling::*)"), 3);
+        CHECK_EQ(wide.XPath<int>("count(/Root/R0/preceding-sibling::*)"), 0);
+        CHECK_EQ(wide.XPath<int>("count(/Root/*)"), 6);
+    }
+
     std::remove(path);
 }
 
@@ -716,7 +1356,7 @@ void test_journal_undo_delete_middle()
 
     const std::string jid = change.XPath<std::string>("@JID");
     CHECK(!jid.empty());
-    CHECK(doc.JRNL->jid_map[jid] == nullptr);
+    CHECK(doc.JRNL->jid_map.at(jid) == nullptr);
 
     doc.JRNL->Undo(change);
 
@@ -731,7 +1371,7 @@ void test_journal_undo_delete_middle()
     XmlNode restored = doc.XPath<std::vector<XmlNode>>("/Root/B")[0];
 
     CHECK_EQ(restored.XPath<std::string>("@JID"), jid);
-    CHECK(doc.JRNL->jid_map[jid] == restored.node);
+    CHECK(doc.JRNL->jid_map.at(jid) == restored.node);
 
     CHECK_EQ(change.XPath<std::string>("./Reversed/@Value"), std::string("true"));
 
@@ -863,7 +1503,7 @@ void test_journal_undo_delete_parent_conflict()
 
     const std::string parent_jid = b_change.XPath<std::string>("./Parent/@JID");
     CHECK(!parent_jid.empty());
-    CHECK(doc.JRNL->jid_map[parent_jid] != nullptr);
+    CHECK(doc.JRNL->jid_map.at(parent_jid) != nullptr);
 
     /*
      * Second transaction: delete B's parent.
@@ -882,7 +1522,7 @@ void test_journal_undo_delete_parent_conflict()
 
     CHECK_EQ(parent_change.XPath<std::string>("@Type"), std::string("Deletion"));
     CHECK_EQ(parent_change.XPath<std::string>("@JID"), parent_jid);
-    CHECK(doc.JRNL->jid_map[parent_jid] == nullptr);
+    CHECK(doc.JRNL->jid_map.at(parent_jid) == nullptr);
 
     /*
      * Attempt to undo the older B deletion while its required Parent
@@ -911,35 +1551,1838 @@ void test_journal_undo_delete_parent_conflict()
     std::remove(path);
 }
 
-void test_journal_undo_add()
+void test_journal_undo_stack()
 {
-    banner("ActionAdd::Undo");
+    banner("XmlJrnl::Undo() stack");
 
-    const char* path = "/tmp/xmlcls_test_undo_add.jrnl.xml";
+    const char* path = "/tmp/xmlcls_test_undo_stack.jrnl.xml";
 
-    XmlDoc doc(std::string("<Root><A/></Root>"));
+    XmlDoc doc(std::string("<Root><A/><B/><C/></Root>"));
     doc.CreateJournal(path);
 
-    XmlNode root = doc.XPath<std::vector<XmlNode>>("/Root")[0];
-    XmlNode b = root.AddChild("<B>added</B>");
-
-    CHECK(!b.err);
+    require_nodes(doc, "/Root/A")[0].parse("<A1/>");
+    require_nodes(doc, "/Root/B")[0].parse("<B1/>");
+    require_nodes(doc, "/Root/C")[0].parse("<C1/>");
     CHECK(!doc.JRNL->err);
 
-    const std::string jid = b.XPath<std::string>("@JID");
+    auto changes = doc.JRNL->active_release.XPath<std::vector<XmlNode>>("./Change");
+    CHECK_EQ(changes.size(), std::size_t{3});
 
-    XmlNode change = doc.JRNL->active_release.XPath<std::vector<XmlNode>>("./Change[last()]")[0];
+    /*
+     * A change reversed out of order is skipped by later Undo() calls.
+     */
+    doc.JRNL->Undo(changes[1]);
+    CHECK(!doc.JRNL->err);
+    CHECK_EQ(doc.XPath<int>("count(/Root/B)"), 1);
 
-    CHECK_EQ(change.XPath<std::string>("@Type"), std::string("Add"));
-    CHECK_EQ(change.XPath<std::string>("@JID"), jid);
-    CHECK(doc.JRNL->jid_map[jid] == b.node);
+    const char* source_path = "/tmp/xmlcls_test_undo_stack.xml";
+    doc.JRNL->Save(path);
+    doc.Save(source_path);
 
-    doc.JRNL->Undo(change);
+    doc.JRNL->Undo();
+    CHECK(!doc.JRNL->err);
+    CHECK_EQ(doc.XPath<int>("count(/Root/C)"), 1);
+    CHECK_EQ(doc.XPath<int>("count(/Root/A1)"), 1);
 
+    doc.JRNL->Undo();
     CHECK(!doc.JRNL->err);
-    CHECK_EQ(doc.XPath<int>("count(/Root/B)"), 0);
-    CHECK(doc.JRNL->jid_map[jid] == nullptr);
-    CHECK_EQ(change.XPath<std::string>("./Reversed/@Value"), std::string("true"));
+    CHECK_EQ(doc.XPath<int>("count(/Root/A)"), 1);
+
+    const std::string settled = doc.XML();
+    doc.JRNL->Undo();
+    CHECK(!doc.JRNL->err);
+    CHECK_EQ(doc.XML(), settled);
+
+    /*
+     * A reopened journal rebuilds its stacks from the Reversed state.
+     */
+    {
+        XmlDoc again(source_path);
+        again.OpenJournal(path);
+        CHECK(again.JRNL != nullptr);
+        if (again.JRNL) {
+            again.JRNL->Undo();
+            CHECK(!again.JRNL->err);
+            CHECK_EQ(again.XPath<int>("count(/Root/C)"), 1);
+
+            again.JRNL->Undo();
+            CHECK(!again.JRNL->err);
+            CHECK_EQ(again.XPath<int>("count(/Root/A)"), 1);
+            CHECK_EQ(again.XPath<int>("count(/Root/B)"), 1);
+        }
+    }
+
+    std::remove(path);
+    std::remove(source_path);
+}
+
+void test_journal_wal()
+{
+    banner("XmlDoc::OpenJournalWAL / JournalWAL");
+
+    const char* path = "/tmp/xmlcls_test_wal.jrnl";
+    const char* source_path = "/tmp/xmlcls_test_wal.xml";
+    std::remove(path);
+
+    std::string exported;
+    {
+        XmlDoc doc(std::string("<Root><A/><B/><C/></Root>"));
+        doc.OpenJournalWAL(path);
+        CHECK(!doc.err);
+        CHECK(doc.JRNL != nullptr && doc.JRNL->wal != nullptr);
+        if (!doc.JRNL || !doc.JRNL->wal) return;
+
+        require_nodes(doc, "/Root/A")[0].parse("<A1/>");
+        require_nodes(doc, "/Root/B")[0].AddChild("<B1/>");
+        require_nodes(doc, "/Root/C")[0].Delete();
+        doc.JRNL->Undo();
+        CHECK(!doc.JRNL->err);
+        CHECK_EQ(doc.XPath<int>("count(/Root/C)"), 1);
+
+        CHECK_EQ(doc.JRNL->wal->changes, uint64_t{3});
+        CHECK_EQ(doc.JRNL->wal->records, uint64_t{6});  // two seed releases, three changes, one reversal
+
+        exported = doc.JRNL->wal->ExportXML();
+        XmlDoc replayed(exported);
+        auto live = doc.JRNL->XPath<std::vector<XmlNode>>("//Change");
+        auto logged = replayed.XPath<std::vector<XmlNode>>("//Change");
+        CHECK_EQ(logged.size(), live.size());
+        for (size_t i = 0; i < live.size() && i < logged.size(); ++i)
+            CHECK_EQ(logged[i].C14N(), live[i].C14N());
+        doc.Save(source_path);
+    }
+
+    /*
+     * Reopening rebuilds the journal DOM from the log.
+     */
+    {
+        XmlDoc again(source_path);
+        again.OpenJournalWAL(path);
+        CHECK(!again.err);
+        CHECK(again.JRNL != nullptr);
+        if (again.JRNL) {
+            CHECK_EQ(again.JRNL->XML(), exported);
+            CHECK(again.JRNL->rel_no == (std::vector<int>{0, 1}));
+            CHECK_EQ(again.JRNL->XPath<int>("count(//Change[Reversed/@Value='true'])"), 1);
+
+            again.JRNL->Undo();
+            CHECK(!again.JRNL->err);
+            CHECK_EQ(again.XPath<int>("count(/Root/B/B1)"), 0);
+            again.Save(source_path);
+        }
+    }
+
+    /*
+     * The export is an ordinary XML journal.
+     */
+    {
+        JournalWAL log(path);
+        CHECK(!log.err);
+        CHECK_EQ(log.discarded, size_t{0});
+        exported = log.ExportXML();
+
+        XmlDoc source(source_path);
+        XmlDoc xml_journal(exported);
+        CHECK(!xml_journal.err);
+        CHECK_EQ(xml_journal.XPath<int>("count(/JRNL/Release/Release/Change)"), 3);
+        CHECK_EQ(xml_journal.XPath<int>("count(//Change[Reversed/@Value='true'])"), 2);
+        CHECK_EQ(xml_journal.XPath<std::string>("string(//Change[1]/@Type)"), std::string("Modify"));
+    }
+
+    /*
+     * A torn final record is discarded on open; the rest of the log survives.
+     */
+    const auto size = std::filesystem::file_size(path);
+    std::filesystem::resize_file(path, size - 3);
+    {
+        JournalWAL log(path);
+        CHECK(!log.err);
+        CHECK(log.discarded > 0);
+        CHECK_EQ(log.records, uint64_t{6});
+        CHECK_EQ(log.changes, uint64_t{3});
+    }
+    CHECK(std::filesystem::file_size(path) < size - 3);
+
+    /*
+     * A change the log cannot take is reported on the node that made it.
+     */
+    std::remove(path);
+    {
+        XmlDoc doc(std::string("<Root><A/></Root>"));
+        doc.OpenJournalWAL(path);
+        CHECK(doc.JRNL && doc.JRNL->wal);
+        if (!doc.JRNL || !doc.JRNL->wal) return;
+
+        // Swap the log's descriptor for a read-only one so appends fail.
+        const int ro = ::open("/dev/null", O_RDONLY);
+        for (const auto& entry : std::filesystem::directory_iterator("/proc/self/fd")) {
+            std::error_code ec;
+            if (std::filesystem::read_symlink(entry.path(), ec) == path)
+                ::dup2(ro, std::stoi(entry.path().filename().string()));
+        }
+        ::close(ro);
+
+        XmlNode root = require_nodes(doc, "/Root")[0];
+        root.AddChild("<B/>");
+        CHECK(root.err != nullptr);
+        CHECK_EQ(doc.XPath<int>("count(/Root/B)"), 1);
+
+        XmlNode a = require_nodes(doc, "/Root/A")[0];
+        a.parse("<A2/>");
+        CHECK(a.err != nullptr);
+        CHECK_EQ(doc.XPath<int>("count(/Root/A)"), 1);
+    }
+
+    /*
+     * A file that is not a log is refused.
+     */
+    {
+        std::FILE* f = std::fopen(path, "wb");
+        std::fputs("<JRNL/>\n", f);
+        std::fclose(f);
+
+        XmlDoc doc(std::string("<Root/>"));
+        doc.OpenJournalWAL(path);
+        CHECK(doc.err != nullptr);
+        CHECK(doc.JRNL == nullptr);
+    }
+
+    std::remove(path);
+    std::remove(source_path);
+}
+
+void test_journal_compressed_payloads()
+{
+    banner("XmlJrnl::compress_threshold");
+
+    const char* path = "/tmp/xmlcls_test_compressed.jrnl.xml";
+
+    std::string big = "<Big>";
+    for (int i = 0; i < 200; ++i) big += "<Row N=\"" + std::to_string(i) + "\">repeated text</Row>";
+    big += "</Big>";
+
+    XmlDoc doc("<Root>" + big + "<Small/></Root>");
+    doc.CreateJournal(path);
+    doc.JRNL->compress_threshold = 256;
+
+    XmlNode node = require_nodes(doc, "/Root/Big")[0];
+    node.parse("<Big/>");
+    require_nodes(doc, "/Root/Small")[0].Delete();
+    CHECK(!doc.JRNL->err);
+
+    auto changes = doc.JRNL->active_release.XPath<std::vector<XmlNode>>("./Change");
+    CHECK_EQ(changes.size(), std::size_t{2});
+    if (changes.size() != 2) return;
+
+    // The large Modify payload is compressed; the small Deletion payload is not worth it.
+    CHECK_EQ(changes[0].XPath<std::string>("string(Node/@Encoding)"), std::string("zlib+Base64"));
+    CHECK(changes[0].XPath<int>("string-length(Node)") < int(big.size()) / 4);
+    CHECK_EQ(changes[1].XPath<std::string>("string(Node/@Encoding)"), std::string("Base64"));
+
+    doc.JRNL->Undo();
+    doc.JRNL->Undo();
+    CHECK(!doc.JRNL->err);
+    CHECK_EQ(doc.XPath<int>("count(/Root/Big/Row)"), 200);
+    CHECK_EQ(doc.XPath<std::string>("string(/Root/Big/Row[200])"), std::string("repeated text"));
+    CHECK_EQ(doc.XPath<int>("count(/Root/Small)"), 1);
+
+    /*
+     * A damaged compressed payload is reported rather than restored.
+     */
+    XmlNode again = require_nodes(doc, "/Root/Big")[0];
+    again.parse("<Big/>");
+    auto latest = doc.JRNL->active_release.XPath<std::vector<XmlNode>>("./Change[last()]/Node");
+    CHECK_EQ(latest.size(), std::size_t{1});
+    if (latest.size() == 1) {
+        xmlNodeSetContent(latest[0].node, BAD_CAST "AAAA");
+        doc.JRNL->Undo();
+        CHECK(doc.JRNL->err != nullptr);
+        CHECK_EQ(doc.XPath<int>("count(/Root/Big/Row)"), 0);
+
+        // A Size the data could never expand to fails without allocating it.
+        doc.JRNL->err = nullptr;
+        xmlSetProp(latest[0].node, BAD_CAST "Size", BAD_CAST "1000000000000000");
+        doc.JRNL->Undo();
+        CHECK(doc.JRNL->err != nullptr);
+        CHECK_EQ(doc.XPath<int>("count(/Root/Big/Row)"), 0);
+    }
+
+    std::remove(path);
+}
+
+void test_journal_modify_delta()
+{
+    banner("Delta-encoded Modify");
+
+    const char* path = "/tmp/xmlcls_test_delta.jrnl.xml";
+
+    auto rows = [](int attr_at, int text_at, const char* extra) {
+        std::string xml;
+        for (int i = 0; i < 100; ++i)
+            xml += "<Row N=\"" + (i == attr_at ? std::string("x") : std::to_string(i)) + "\"" + extra + ">"
+                   "<V>" + (i == text_at ? "TEXT " : "text ") + std::to_string(i) + "</V></Row>";
+        return xml;
+    };
+
+    XmlDoc doc("<Root><Big>" + rows(-1, -1, "") + "</Big></Root>");
+    doc.CreateJournal(path);
+
+    XmlNode big = require_nodes(doc, "/Root/Big")[0];
+    const std::string big_tag = "<Big JID=\"" + big.JID() + "\">";
+    require_nodes(doc, "/Root")[0].JID();
+    const std::string original = doc.XML();
+
+    auto latest = [&doc] {
+        auto changes = doc.JRNL->active_release.XPath<std::vector<XmlNode>>("./Change[last()]");
+        return changes.empty() ? XmlNode() : changes[0];
+    };
+
+    /*
+     * One attribute deep in a large subtree: the record holds one start tag.
+     */
+    big.parse(big_tag + rows(57, -1, "") + "</Big>");
+    CHECK(!doc.JRNL->err);
+    CHECK_EQ(doc.XPath<int>("count(/Root/Big/Row[@N='x'])"), 1);
+
+    XmlNode change = latest();
+    CHECK(!change.XPath<bool>("./Node"));
+    CHECK_EQ(change.XPath<int>("count(./Delta/*)"), 1);
+    CHECK_EQ(change.XPath<std::string>("string(./Delta/Attrs/@Path)"), std::string("57"));
+    CHECK(change.XPath<int>("string-length(./Delta)") < 64);
+
+    xmlNodePtr live = require_nodes(doc, "/Root/Big")[0].node;
+    doc.JRNL->Undo();
+    CHECK(!doc.JRNL->err);
+    CHECK_EQ(doc.XML(), original);
+    CHECK(require_nodes(doc, "/Root/Big")[0].node == live);  // inverted in place
+    CHECK(doc.JRNL->jid_map.at(big_tag.substr(10, 16)) == live);
+
+    /*
+     * Changed text is restored as the smallest enclosing element.
+     */
+    require_nodes(doc, "/Root/Big")[0].parse(big_tag + rows(-1, 3, "") + "</Big>");
+    CHECK_EQ(latest().XPath<std::string>("string(./Delta/Node/@Path)"), std::string("3/0"));
+    doc.JRNL->Undo();
+    CHECK(!doc.JRNL->err);
+    CHECK_EQ(doc.XML(), original);
+
+    /*
+     * A different element, or a delta no smaller than the node, is a snapshot.
+     */
+    require_nodes(doc, "/Root/Big")[0].parse("<Other/>");
+    CHECK(latest().XPath<bool>("./Node"));
+    CHECK(!latest().XPath<bool>("./Delta"));
+    doc.JRNL->Undo();
+    CHECK_EQ(doc.XML(), original);
+
+    require_nodes(doc, "/Root/Big")[0].parse(big_tag + rows(-1, -1, " M=\"1\"") + "</Big>");
+    CHECK(latest().XPath<bool>("./Node"));
+    doc.JRNL->Undo();
+    CHECK(!doc.JRNL->err);
+    CHECK_EQ(doc.XML(), original);
+
+    /*
+     * A later change inside the node is a conflict for the delta.
+     */
+    require_nodes(doc, "/Root/Big")[0].parse(big_tag + rows(5, -1, "") + "</Big>");
+    XmlNode outer = latest();
+
+    require_nodes(doc, "/Root/Big/Row[1]")[0].parse("<Row N=\"0\"><V>changed</V></Row>");
+    doc.JRNL->Undo(outer);
+    CHECK(doc.JRNL->err && doc.JRNL->err->level == lvl::INFO);
+    CHECK_EQ(doc.XPath<int>("count(/Root/Big/Row[@N='x'])"), 1);
+
+    std::remove(path);
+}
+
+void test_journal_set_attr_text()
+{
+    banner("SetAttr / RemoveAttr / SetText");
+
+    const char* path = "/tmp/xmlcls_test_set_attr.jrnl.xml";
+
+    XmlDoc doc(std::string("<Root><Item Mode=\"a &amp; b\"><Label>old &lt;text&gt;</Label></Item></Root>"));
+    doc.CreateJournal(path);
+
+    XmlNode item = require_nodes(doc, "/Root/Item")[0];
+    XmlNode label = require_nodes(doc, "/Root/Item/Label")[0];
+    item.JID();
+    label.JID();
+    const std::string original = doc.XML();
+
+    auto latest = [&doc] {
+        auto changes = doc.JRNL->active_release.XPath<std::vector<XmlNode>>("./Change[last()]");
+        return changes.empty() ? XmlNode() : changes[0];
+    };
+
+    /*
+     * Each call records one small Change that undoes in place.
+     */
+    item.SetAttr("Mode", "c");
+    CHECK(!item.err);
+    CHECK_EQ(doc.XPath<std::string>("string(/Root/Item/@Mode)"), std::string("c"));
+    CHECK_EQ(latest().XPath<std::string>("string(@Type)"), std::string("SetAttr"));
+    CHECK_EQ(latest().XPath<std::string>("string(./Attr/@Old)"), std::string("a & b"));
+    CHECK(!latest().XPath<bool>("./Node"));
+    doc.JRNL->Undo();
+    CHECK(!doc.JRNL->err);
+    CHECK_EQ(doc.XML(), original);
+
+    item.SetAttr("Count", 42);
+    item.SetAttr("Ratio", 0.5);
+    item.SetAttr("Flag", true);
+    CHECK_EQ(doc.XPath<std::string>("string(/Root/Item/@Count)"), std::string("42"));
+    CHECK_EQ(doc.XPath<std::string>("string(/Root/Item/@Ratio)"), std::string("0.5"));
+    CHECK_EQ(doc.XPath<std::string>("string(/Root/Item/@Flag)"), std::string("true"));
+    CHECK(!latest().XPath<bool>("./Attr/@Old"));
+    doc.JRNL->Undo();
+    doc.JRNL->Undo();
+    doc.JRNL->Undo();
+    CHECK(!doc.JRNL->err);
+    CHECK_EQ(doc.XML(), original);
+
+    item.RemoveAttr("Mode");
+    CHECK(!doc.XPath<bool>("/Root/Item/@Mode"));
+    item.RemoveAttr("Missing");  // nothing to record
+    CHECK_EQ(latest().XPath<std::string>("string(@Type)"), std::string("SetAttr"));
+    doc.JRNL->Undo();
+    CHECK(!doc.JRNL->err);
+    CHECK_EQ(doc.XML(), original);
+
+    label.SetText("new & <text>");
+    CHECK(!label.err);
+    CHECK_EQ(doc.XPath<std::string>("string(/Root/Item/Label)"), std::string("new & <text>"));
+    CHECK_EQ(latest().XPath<std::string>("string(@Type)"), std::string("SetText"));
+    label.SetText(7);
+    CHECK_EQ(doc.XPath<std::string>("string(/Root/Item/Label)"), std::string("7"));
+    doc.JRNL->Undo();
+    doc.JRNL->Undo();
+    CHECK(!doc.JRNL->err);
+    CHECK_EQ(doc.XML(), original);
+
+    /*
+     * The JID attribute and elements with child elements are refused.
+     */
+    const size_t recorded = doc.JRNL->History(item.JID()).size();
+    item.SetAttr("JID", "0000000000000000");
+    CHECK(item.err);
+    item.err = nullptr;
+    item.SetText("flat");
+    CHECK(item.err);
+    item.err = nullptr;
+    CHECK_EQ(doc.JRNL->History(item.JID()).size(), recorded);
+    CHECK_EQ(doc.XML(), original);
+
+    /*
+     * Undoing an earlier edit under a later one is a conflict.
+     */
+    item.SetAttr("Mode", "first");
+    XmlNode first = latest();
+    item.SetAttr("Mode", "second");
+    doc.JRNL->Undo(first);
+    CHECK(doc.JRNL->err && doc.JRNL->err->level == lvl::INFO);
+    CHECK_EQ(doc.XPath<std::string>("string(/Root/Item/@Mode)"), std::string("second"));
+
+    /*
+     * A DTD default is not an attribute of the element.
+     */
+    {
+        XmlDoc dtd(std::string("<!DOCTYPE Root [<!ATTLIST Item Mode CDATA \"d\">]><Root><Item/></Root>"));
+        dtd.CreateJournal(path);
+        XmlNode plain = require_nodes(dtd, "/Root/Item")[0];
+        plain.JID();
+        const std::string before = dtd.XML();
+
+        plain.RemoveAttr("Mode");   // nothing to remove or record
+        CHECK(!plain.err);
+        CHECK_EQ(dtd.XML(), before);
+        CHECK_EQ(dtd.JRNL->XPath<int>("count(//Change)"), 0);
+
+        plain.SetAttr("Mode", "set");
+        CHECK(!dtd.JRNL->XPath<bool>("//Change/Attr/@Old"));
+        dtd.JRNL->Undo();
+        CHECK(!dtd.JRNL->err);
+        CHECK_EQ(dtd.XML(), before);
+    }
+
+    std::remove(path);
+}
+
+void test_journal_move()
+{
+    banner("XmlNode::MoveTo");
+
+    const char* path = "/tmp/xmlcls_test_move.jrnl.xml";
+
+    XmlDoc doc(std::string("<Root><A><X><Deep/></X><Y/></A><B><P/><Q/></B></Root>"));
+    doc.CreateJournal(path);
+
+    auto node = [&doc](const char* xpath) { return require_nodes(doc, xpath)[0]; };
+    auto latest = [&doc] {
+        auto changes = doc.JRNL->active_release.XPath<std::vector<XmlNode>>("./Change[last()]");
+        return changes.empty() ? XmlNode() : changes[0];
+    };
+
+    XmlNode x = node("/Root/A/X");
+    const std::string x_jid = x.JID();
+    const std::string deep_jid = node("/Root/A/X/Deep").JID();
+    xmlNodePtr x_ptr = x.node, deep_ptr = node("/Root/A/X/Deep").node;
+    for (XmlNode& element : require_nodes(doc, "//*")) element.JID();
+    const std::string original = doc.XML();
+
+    /*
+     * The same nodes are relinked and one Move Change records both slots.
+     */
+    XmlNode b = node("/Root/B"), q = node("/Root/B/Q");
+    x.MoveTo(b, &q);
+    CHECK(!x.err);
+    CHECK(!doc.JRNL->err);
+    CHECK_EQ(doc.XPath<std::string>("name(/Root/B/*[2])"), std::string("X"));
+    CHECK(node("/Root/B/X").node == x_ptr);
+    CHECK(node("/Root/B/X/Deep").node == deep_ptr);
+    CHECK(doc.JRNL->jid_map.at(x_jid) == x_ptr);
+    CHECK(doc.JRNL->jid_map.at(deep_jid) == deep_ptr);
+    CHECK_EQ(doc.JRNL->XPath<int>("count(//Change)"), 1);
+
+    XmlNode change = latest();
+    CHECK_EQ(change.XPath<std::string>("string(@Type)"), std::string("Move"));
+    CHECK_EQ(change.XPath<std::string>("string(./From/@After)"), node("/Root/A/Y").JID());
+    CHECK(!change.XPath<bool>("./From/@Before"));
+    CHECK_EQ(change.XPath<std::string>("string(./To/@Parent)"), b.JID());
+    CHECK_EQ(change.XPath<std::string>("string(./To/@Before)"), node("/Root/B/P").JID());
+    CHECK_EQ(change.XPath<std::string>("string(./To/@After)"), q.JID());
+    CHECK(!change.XPath<bool>("./Node"));
+
+    doc.JRNL->Undo();
+    CHECK(!doc.JRNL->err);
+    CHECK_EQ(doc.XML(), original);
+    CHECK(node("/Root/A/X").node == x_ptr);
+
+    /*
+     * Append, insert after, and reorder within one parent all undo exactly.
+     */
+    XmlNode p = node("/Root/B/P"), y = node("/Root/A/Y");
+    x.MoveTo(b);
+    CHECK_EQ(doc.XPath<std::string>("name(/Root/B/*[last()])"), std::string("X"));
+    y.MoveTo(b, nullptr, &p);
+    CHECK_EQ(doc.XPath<std::string>("name(/Root/B/*[2])"), std::string("Y"));
+    CHECK_EQ(doc.XPath<int>("count(/Root/A/*)"), 0);
+    q.MoveTo(b, &p);
+    CHECK_EQ(doc.XPath<std::string>("name(/Root/B/*[1])"), std::string("Q"));
+    doc.JRNL->Undo();
+    doc.JRNL->Undo();
+    doc.JRNL->Undo();
+    CHECK(!doc.JRNL->err);
+    CHECK_EQ(doc.XML(), original);
+
+    /*
+     * Moving the root element or into the node's own subtree is refused.
+     */
+    XmlNode root = node("/Root"), deep = node("/Root/A/X/Deep");
+    const int recorded = doc.JRNL->XPath<int>("count(//Change)");
+    root.MoveTo(b);
+    CHECK(root.err);
+    x.MoveTo(deep);
+    CHECK(x.err);
+    x.err = nullptr;
+    CHECK_EQ(doc.JRNL->XPath<int>("count(//Change)"), recorded);
+    CHECK_EQ(doc.XML(), original);
+
+    /*
+     * Namespace declarations follow a node out of their scope.
+     */
+    {
+        XmlDoc ns(std::string("<Root><A xmlns:n=\"urn:n\"><n:Item/></A><B/></Root>"));
+        XmlNode item = require_nodes(ns, "/Root/A/*")[0], target = require_nodes(ns, "/Root/B")[0];
+        item.MoveTo(target);
+        CHECK(!item.err);
+        CHECK(XmlDoc(ns.XML()).XPath<bool>("/Root/B/*[namespace-uri()='urn:n']"));
+    }
+
+    /*
+     * A filled original slot is a conflict and leaves the node where it is.
+     */
+    x.MoveTo(b);
+    XmlNode move = latest();
+    node("/Root/A/Y").AddBefore("<Z/>");
+    doc.JRNL->Undo(move);
+    CHECK(doc.JRNL->err && doc.JRNL->err->level == lvl::INFO);
+    CHECK(node("/Root/B/X").node == x_ptr);
+
+    std::remove(path);
+}
+
+void test_journal_sequential_jids()
+{
+    banner("XmlJrnl::UseSequentialJIDs");
+
+    const char* path = "/tmp/xmlcls_test_seqjid.jrnl.xml";
+    const char* source_path = "/tmp/xmlcls_test_seqjid.xml";
+    const char* wal_path = "/tmp/xmlcls_test_seqjid.jrnl";
+
+    /*
+     * JIDs are dense and ordered, and NextJID records the reserved block.
+     */
+    XmlDoc doc(std::string("<Root><A/><B/><C/></Root>"));
+    doc.CreateJournal(path);
+    doc.JRNL->jid_block = 4;
+    doc.JRNL->UseSequentialJIDs();
+    CHECK(doc.JRNL->SequentialJIDs());
+
+    CHECK_EQ(require_nodes(doc, "/Root/A")[0].JID(), std::string("0000000000000001"));
+    CHECK_EQ(require_nodes(doc, "/Root/B")[0].JID(), std::string("0000000000000002"));
+    CHECK_EQ(doc.JRNL->XPath<std::string>("string(/JRNL/@NextJID)"), std::string("0000000000000005"));
+
+    require_nodes(doc, "/Root/B")[0].Delete();    // Root and C get 3 and 4
+    require_nodes(doc, "/Root/A")[0].AddChild("<D/>");
+    CHECK_EQ(require_nodes(doc, "/Root/A/D")[0].JID(), std::string("0000000000000005"));
+    CHECK_EQ(doc.JRNL->XPath<std::string>("string(/JRNL/@NextJID)"), std::string("0000000000000009"));
+
+    doc.Save(source_path);
+    doc.JRNL->Save(path);
+
+    /*
+     * A reopened journal resumes above every issued JID, the deleted B's included.
+     */
+    {
+        XmlDoc again(source_path);
+        again.OpenJournal(path);
+        CHECK(again.JRNL && again.JRNL->SequentialJIDs());
+        if (again.JRNL) {
+            again.JRNL->Undo();
+            again.JRNL->Undo();
+            CHECK(!again.JRNL->err);
+            CHECK_EQ(again.XPath<std::string>("string(/Root/B/@JID)"), std::string("0000000000000002"));
+            CHECK_EQ(require_nodes(again, "/Root")[0].AddChild("<E/>").JID(), std::string("0000000000000009"));
+        }
+    }
+
+    /*
+     * Enabling over existing small JIDs continues above them; random JIDs
+     * leave the check on.
+     */
+    {
+        XmlDoc small(std::string("<Root JID=\"0000000000000030\"><A/></Root>"));
+        small.CreateJournal(path);
+        small.JRNL->UseSequentialJIDs();
+        CHECK_EQ(require_nodes(small, "/Root/A")[0].JID(), std::string("0000000000000031"));
+
+        XmlDoc random(std::string("<Root JID=\"f00000000000000f\"><A/></Root>"));
+        random.CreateJournal(path);
+        random.JRNL->UseSequentialJIDs();
+        CHECK_EQ(require_nodes(random, "/Root/A")[0].JID(), std::string("0000000000000001"));
+    }
+
+    /*
+     * Concurrent allocation from per-thread blocks never repeats a value.
+     */
+    {
+        XmlDoc shared(std::string("<Root/>"));
+        shared.CreateJournal(path);
+        shared.JRNL->jid_block = 16;
+        shared.JRNL->UseSequentialJIDs();
+
+        const int threads = 4, each = 5000;
+        std::vector<std::vector<uint64_t>> issued(threads);
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t)
+            workers.emplace_back([&, t] { for (int i = 0; i < each; ++i) issued[t].push_back(shared.JRNL->JIDKey()); });
+        for (auto& worker : workers) worker.join();
+
+        std::set<uint64_t> unique;
+        for (auto& values : issued) unique.insert(values.begin(), values.end());
+        CHECK_EQ(unique.size(), std::size_t(threads * each));
+        CHECK(*unique.rbegin() < uint64_t(threads * each + threads * 16 + 1));
+    }
+
+    /*
+     * A thread alternating between journals keeps a block in each.
+     */
+    {
+        XmlDoc first(std::string("<Root/>")), second(std::string("<Root/>"));
+        first.CreateJournal(path);
+        second.CreateJournal(source_path);
+        for (XmlDoc* d : {&first, &second}) {
+            d->JRNL->jid_block = 4;
+            d->JRNL->UseSequentialJIDs();
+        }
+
+        std::vector<uint64_t> a, b;
+        for (int i = 0; i < 3; ++i) {
+            a.push_back(first.JRNL->JIDKey());
+            b.push_back(second.JRNL->JIDKey());
+        }
+        CHECK(a == (std::vector<uint64_t>{1, 2, 3}));
+        CHECK(b == (std::vector<uint64_t>{1, 2, 3}));
+        CHECK_EQ(first.JRNL->XPath<std::string>("string(/JRNL/@NextJID)"), std::string("0000000000000005"));
+    }
+
+    /*
+     * The counter survives in a write-ahead log.
+     */
+    std::remove(wal_path);
+    {
+        XmlDoc logged(std::string("<Root><A/></Root>"));
+        logged.OpenJournalWAL(wal_path);
+        logged.JRNL->jid_block = 8;
+        logged.JRNL->UseSequentialJIDs();
+        require_nodes(logged, "/Root/A")[0].parse("<A v=\"1\"/>");
+        CHECK(!logged.JRNL->err);
+    }
+    {
+        XmlDoc logged(std::string("<Root><A/></Root>"));
+        logged.OpenJournalWAL(wal_path);
+        CHECK(logged.JRNL && logged.JRNL->SequentialJIDs());
+        if (logged.JRNL)
+            CHECK_EQ(logged.JRNL->JID(), std::string("0000000000000009"));
+    }
+
+    std::remove(wal_path);
+    std::remove(path);
+    std::remove(source_path);
+}
+
+void test_journal_transaction()
+{
+    banner("XmlJrnl::BeginTransaction / Commit / Rollback");
+
+    const char* path = "/tmp/xmlcls_test_transaction.jrnl.xml";
+
+    XmlDoc doc(std::string("<Root><A Mode=\"a\"><X/></A><B/><C>text</C></Root>"));
+    doc.CreateJournal(path);
+
+    auto node = [&doc](const char* xpath) { return require_nodes(doc, xpath)[0]; };
+    for (auto& element : require_nodes(doc, "//*"))
+        element.JID();
+    const std::string original = doc.XML();
+    XmlJrnl& jrnl = *doc.JRNL;
+
+    /*
+     * The group is one Change in the release holding ordinary records.
+     */
+    jrnl.BeginTransaction();
+    CHECK(!jrnl.err);
+    CHECK(jrnl.InTransaction());
+    node("/Root/A").SetAttr("Mode", "b");
+    node("/Root/C").SetText("new");
+    XmlNode b = node("/Root/B");
+    node("/Root/A/X").MoveTo(b);
+    node("/Root/B").AddChild("<Y/>");
+    node("/Root/C").Delete();
+    jrnl.Commit();
+    CHECK(!jrnl.err);
+    CHECK(!jrnl.InTransaction());
+
+    CHECK_EQ(jrnl.active_release.XPath<int>("count(./Change)"), 1);
+    CHECK_EQ(jrnl.active_release.XPath<std::string>("string(./Change/@Type)"), std::string("Transaction"));
+    CHECK_EQ(jrnl.active_release.XPath<int>("count(./Change/Change)"), 5);
+    CHECK_EQ(jrnl.History(node("/Root/A").JID()).size(), size_t{1});
+
+    // Nested records are not undone on their own.
+    auto nested = jrnl.active_release.XPath<std::vector<XmlNode>>("./Change/Change");
+    jrnl.Undo(nested.back());
+    CHECK(jrnl.err);
+    jrnl.err = nullptr;
+    CHECK_EQ(doc.XPath<int>("count(/Root/C)"), 0);
+
+    /*
+     * One Undo() reverses the whole group.
+     */
+    jrnl.Undo();
+    CHECK(!jrnl.err);
+    CHECK_EQ(doc.XML(), original);
+    CHECK_EQ(jrnl.active_release.XPath<int>("count(.//Change[Reversed/@Value='true'])"), 6);
+
+    /*
+     * A later change to a grouped node blocks the whole group; nothing moves.
+     */
+    jrnl.BeginTransaction();
+    node("/Root/A").SetAttr("Mode", "c");
+    node("/Root/A/X").MoveTo(b);
+    jrnl.Commit();
+    XmlNode group = jrnl.active_release.XPath<std::vector<XmlNode>>("./Change[last()]")[0];
+    node("/Root/B/X").SetAttr("Seen", "yes");
+    const std::string before = doc.XML();
+    jrnl.Undo(group);
+    CHECK(jrnl.err && jrnl.err->level == lvl::INFO);
+    jrnl.err = nullptr;
+    CHECK_EQ(doc.XML(), before);
+
+    // An add under a parent whose slot the group restores also conflicts.
+    node("/Root/B/X").RemoveAttr("Seen");
+    jrnl.Undo();  // RemoveAttr
+    jrnl.Undo();  // SetAttr
+    node("/Root/A").AddChild("<Z/>");
+    jrnl.Undo(group);
+    CHECK(jrnl.err && jrnl.err->level == lvl::INFO);
+    jrnl.err = nullptr;
+    jrnl.Undo();  // AddChild
+    jrnl.Undo();  // the group
+    CHECK(!jrnl.err);
+    CHECK_EQ(doc.XML(), original);
+
+    /*
+     * Rollback undoes the open group and leaves no record.
+     */
+    const int recorded = jrnl.XPath<int>("count(//Change)");
+    jrnl.BeginTransaction();
+    node("/Root/B").AddChild("<Tmp/>");
+    node("/Root/A").SetAttr("Mode", "tmp");
+    jrnl.Rollback();
+    CHECK(!jrnl.err);
+    CHECK(!jrnl.InTransaction());
+    CHECK_EQ(doc.XML(), original);
+    CHECK_EQ(jrnl.XPath<int>("count(//Change)"), recorded);
+    CHECK_EQ(jrnl.History(node("/Root/A").JID()).size(), size_t{2});
+
+    // An empty group leaves nothing behind either.
+    jrnl.BeginTransaction();
+    jrnl.Commit();
+    CHECK(!jrnl.err);
+    CHECK_EQ(jrnl.XPath<int>("count(//Change)"), recorded);
+
+    /*
+     * Transactions do not nest, and Undo waits for Commit.
+     */
+    jrnl.BeginTransaction();
+    jrnl.BeginTransaction();
+    CHECK(jrnl.err);
+    jrnl.err = nullptr;
+    node("/Root/A").SetAttr("Mode", "open");
+    jrnl.Undo();
+    CHECK(jrnl.err);
+    jrnl.err = nullptr;
+    jrnl.Commit();
+    jrnl.Undo();
+    CHECK(!jrnl.err);
+    CHECK_EQ(doc.XML(), original);
+
+    jrnl.Commit();
+    CHECK(jrnl.err);
+    jrnl.err = nullptr;
+    std::remove(path);
+
+    /*
+     * A later deletion of a grouped node's ancestor blocks the group up
+     * front, and a group that still fails part way is put back whole.
+     */
+    {
+        XmlDoc tree(std::string("<Root><P><C/></P><Z><Z1/></Z><X/><A/></Root>"));
+        tree.CreateJournal(path);
+        XmlJrnl& log = *tree.JRNL;
+        auto at = [&tree](const char* xpath) { return require_nodes(tree, xpath)[0]; };
+        for (auto& element : require_nodes(tree, "//*"))
+            element.JID();
+
+        log.BeginTransaction();
+        at("/Root/P/C").SetAttr("K", "1");
+        at("/Root/Z").parse(std::string("<Z><Z2/></Z>"));
+        log.Commit();
+        XmlNode grouped = log.active_release.XPath<std::vector<XmlNode>>("./Change[last()]")[0];
+        at("/Root/P").Delete();
+        const std::string deleted = tree.XML();
+
+        log.Undo(grouped);
+        CHECK(log.err && log.err->level == lvl::INFO);
+        log.err = nullptr;
+        CHECK_EQ(tree.XML(), deleted);
+        CHECK_EQ(log.XPath<int>("count(//Change[Reversed/@Value='true'])"), 0);
+
+        log.Undo();   // the deletion
+        log.Undo();   // the group
+        CHECK(!log.err);
+        CHECK_EQ(tree.XPath<int>("count(/Root/P/C[not(@K)])"), 1);
+        CHECK_EQ(tree.XPath<int>("count(/Root/Z/Z1)"), 1);
+
+        // The oldest grouped Change cannot be undone once its payload is damaged.
+        const std::string intact = tree.XML();
+        log.BeginTransaction();
+        at("/Root/X").Delete();
+        at("/Root/A").SetAttr("K", "1");
+        at("/Root/Z/Z1").SetText("t");
+        log.Commit();
+        XmlNode payload = log.active_release.XPath<std::vector<XmlNode>>("./Change[last()]/Change[@Type='Deletion']/Node")[0];
+        xmlSetProp(payload.node, BAD_CAST "Encoding", BAD_CAST "Damaged");
+        const std::string committed = tree.XML();
+        const int reversed = log.XPath<int>("count(//Change[Reversed/@Value='true'])");
+        XmlNode held = at("/Root/Z");
+
+        log.Undo();
+        CHECK(log.err);
+        log.err = nullptr;
+        CHECK_EQ(tree.XML(), committed);
+        CHECK_EQ(log.XPath<int>("count(//Change[Reversed/@Value='true'])"), reversed);
+        // Put back in place: handles taken beforehand still name live nodes.
+        CHECK(held.node == at("/Root/Z").node);
+        CHECK_EQ(held.XPath<std::string>("./Z1"), std::string("t"));
+
+        xmlSetProp(payload.node, BAD_CAST "Encoding", BAD_CAST "Base64");
+        log.Undo();
+        CHECK(!log.err);
+        CHECK_EQ(tree.XML(), intact);
+
+        // Rollback keeps a group it cannot undo, unchanged, as a committed one.
+        log.BeginTransaction();
+        at("/Root/X").Delete();
+        at("/Root/A").SetAttr("K", "2");
+        payload = log.active_release.XPath<std::vector<XmlNode>>("./Change[last()]/Change[@Type='Deletion']/Node")[0];
+        xmlSetProp(payload.node, BAD_CAST "Encoding", BAD_CAST "Damaged");
+        const std::string open = tree.XML();
+        log.Rollback();
+        CHECK(log.err);
+        log.err = nullptr;
+        CHECK(!log.InTransaction());
+        CHECK_EQ(tree.XML(), open);
+
+        xmlSetProp(payload.node, BAD_CAST "Encoding", BAD_CAST "Base64");
+        log.Undo();
+        CHECK(!log.err);
+        CHECK_EQ(tree.XML(), intact);
+    }
+    std::remove(path);
+
+    /*
+     * The log holds one record per group and replays its reversal.
+     */
+    const char* wal_path = "/tmp/xmlcls_test_transaction.jrnl";
+    const char* source_path = "/tmp/xmlcls_test_transaction.xml";
+    std::remove(wal_path);
+    {
+        XmlDoc logged(std::string("<Root><A/><B/></Root>"));
+        logged.OpenJournalWAL(wal_path);
+        CHECK(logged.JRNL && logged.JRNL->wal);
+        if (!logged.JRNL || !logged.JRNL->wal) return;
+
+        logged.JRNL->BeginTransaction();
+        require_nodes(logged, "/Root/A")[0].SetAttr("K", "1");
+        require_nodes(logged, "/Root/B")[0].AddChild("<B1/>");
+        logged.JRNL->Commit();
+        CHECK_EQ(logged.JRNL->wal->changes, uint64_t{1});
+
+        logged.JRNL->BeginTransaction();
+        require_nodes(logged, "/Root/A")[0].SetAttr("K", "2");
+        logged.JRNL->Commit();
+        logged.JRNL->Undo();
+        CHECK(!logged.JRNL->err);
+        CHECK_EQ(logged.JRNL->wal->changes, uint64_t{2});
+        logged.Save(source_path);
+    }
+    {
+        XmlDoc again(source_path);
+        again.OpenJournalWAL(wal_path);
+        CHECK(!again.err);
+        CHECK(again.JRNL != nullptr);
+        if (again.JRNL) {
+            CHECK_EQ(again.JRNL->XPath<int>("count(//Change[@Type='Transaction']/Change)"), 3);
+            CHECK_EQ(again.JRNL->XPath<int>("count(//Change[Reversed/@Value='true'])"), 2);
+            again.JRNL->Undo();
+            CHECK(!again.JRNL->err);
+            CHECK_EQ(again.XPath<int>("count(/Root/A/@K)"), 0);
+            CHECK_EQ(again.XPath<int>("count(/Root/B/B1)"), 0);
+        }
+    }
+    std::remove(wal_path);
+    std::remove(source_path);
+}
+
+void test_journal_compact()
+{
+    banner("XmlJrnl::Compact");
+
+    const char* path = "/tmp/xmlcls_test_compact.jrnl.xml";
+
+    XmlDoc doc(std::string("<Root><A><P/></A><B/><C><Big>payload</Big></C><D/></Root>"));
+    doc.CreateJournal(path);
+    XmlJrnl& jrnl = *doc.JRNL;
+
+    auto node = [&doc](const char* xpath) { return require_nodes(doc, xpath)[0]; };
+    for (auto& element : require_nodes(doc, "//*"))
+        element.JID();
+    const std::string original = doc.XML();
+
+    /*
+     * Release 0.1: a Modify run, and an Add and a Deletion that were undone.
+     */
+    node("/Root/A").parse("<A><P/><Q/></A>");
+    node("/Root/A").parse("<A><P/><Q/><R/></A>");
+    node("/Root/A").parse("<A><S/></A>");
+    CHECK(!jrnl.active_release.XPath<bool>("./Change/Delta"));
+
+    // A change inside D between its Modifies keeps them apart.
+    node("/Root/D").parse("<D><E/></D>");
+    node("/Root/D/E").SetAttr("Mode", "x");
+    node("/Root/D").parse("<D><F/></D>");
+    node("/Root/B").AddChild("<T/>");
+    jrnl.Undo();
+    node("/Root/C").Delete();
+    jrnl.Undo();
+    CHECK(!jrnl.err);
+
+    jrnl.CloseRelease();
+    jrnl.OpenRelease();
+    node("/Root/B").SetAttr("K", "1");
+    jrnl.CloseRelease();
+    jrnl.OpenRelease();
+    node("/Root/B").SetAttr("K", "2");
+    CHECK(jrnl.rel_no == (std::vector<int>{0, 3}));
+
+    jrnl.BeginTransaction();
+    jrnl.Compact();
+    CHECK(jrnl.err);
+    jrnl.err = nullptr;
+    jrnl.Rollback();
+    CHECK_EQ(jrnl.compact_stats.dropped, size_t{0});
+
+    jrnl.Compact();
+    CHECK(!jrnl.err);
+    const CompactStats& stats = jrnl.compact_stats;
+    CHECK_EQ(stats.dropped, size_t{2});
+    CHECK_EQ(stats.releases, size_t{1});
+    CHECK_EQ(stats.merged, size_t{2});
+    CHECK(stats.reclaimed() > 0);
+    CHECK_EQ(stats.bytes_after, jrnl.XML().size());
+
+    /*
+     * Releases 0.1 and 0.2 are one checkpoint; the open release is untouched.
+     */
+    CHECK_EQ(jrnl.XPath<int>("count(//Release)"), 3);
+    CHECK_EQ(jrnl.XPath<std::string>("string(/JRNL/Release/Release[1]/@Checkpoint)"), std::string("2"));
+    CHECK_EQ(jrnl.XPath<int>("count(/JRNL/Release/Release[1]/Change)"), 5);
+    CHECK_EQ(jrnl.XPath<int>("count(//Change[Reversed/@Value='true'])"), 0);
+    CHECK_EQ(jrnl.History(node("/Root/A").JID()).size(), size_t{1});
+    CHECK_EQ(jrnl.History(node("/Root/B").JID()).size(), size_t{2});
+
+    /*
+     * Every remaining undo still works; the merged Modify restores the state
+     * before the whole run.
+     */
+    jrnl.Undo();
+    CHECK(!jrnl.err);
+    CHECK_EQ(doc.XPath<std::string>("string(/Root/B/@K)"), std::string("1"));
+    auto checkpoint = jrnl.XPath<std::vector<XmlNode>>("/JRNL/Release/Release[1]/Change");
+    jrnl.Undo(std::vector<XmlNode>(checkpoint.begin(), checkpoint.end()));
+    CHECK(!jrnl.err);
+    CHECK_EQ(doc.XML(), original);
+
+    // A second pass drops what was just undone and leaves one checkpoint.
+    jrnl.Compact();
+    CHECK(!jrnl.err);
+    CHECK_EQ(jrnl.compact_stats.dropped, size_t{6});
+    CHECK_EQ(jrnl.XPath<int>("count(//Change)"), 0);
+    CHECK_EQ(jrnl.XPath<std::string>("string(/JRNL/Release/Release[1]/@Checkpoint)"), std::string("2"));
+    std::remove(path);
+
+    /*
+     * With a write-ahead log the log is rewritten and keeps recording.
+     */
+    const char* wal_path = "/tmp/xmlcls_test_compact.jrnl";
+    const char* source_path = "/tmp/xmlcls_test_compact.xml";
+    std::remove(wal_path);
+    std::string compacted;
+    {
+        XmlDoc logged("<Root><A/><B/><C><Big>" + std::string(4096, 'x') + "</Big></C></Root>");
+        logged.OpenJournalWAL(wal_path);
+        CHECK(logged.JRNL && logged.JRNL->wal);
+        if (!logged.JRNL || !logged.JRNL->wal) return;
+        XmlJrnl& log = *logged.JRNL;
+
+        require_nodes(logged, "/Root/A")[0].SetAttr("K", "1");
+        require_nodes(logged, "/Root/B")[0].SetAttr("K", "2");
+        require_nodes(logged, "/Root/C/Big")[0].Delete();
+        log.Undo();
+        const uint64_t records = log.wal->records;
+
+        log.Compact();
+        CHECK(!log.err);
+        CHECK_EQ(log.compact_stats.dropped, size_t{1});
+        CHECK(log.wal->records < records);
+        CHECK(log.compact_stats.reclaimed() > 4000);
+        CHECK_EQ(log.compact_stats.bytes_after, log.wal->Size());
+
+        log.Undo();
+        CHECK(!log.err);
+        require_nodes(logged, "/Root/C")[0].SetAttr("K", "3");
+        compacted = log.XML();
+        logged.Save(source_path);
+    }
+    {
+        XmlDoc again(source_path);
+        again.OpenJournalWAL(wal_path);
+        CHECK(!again.err);
+        CHECK(again.JRNL != nullptr);
+        if (again.JRNL) {
+            CHECK_EQ(again.JRNL->XPath<int>("count(//Change)"), 3);
+            CHECK_EQ(again.JRNL->XPath<int>("count(//Change[Reversed/@Value='true'])"), 1);
+            again.JRNL->Undo();
+            again.JRNL->Undo();
+            CHECK(!again.JRNL->err);
+            CHECK_EQ(again.XPath<int>("count(/Root/*/@K)"), 0);
+        }
+    }
+    std::remove(wal_path);
+    std::remove(source_path);
+}
+
+void test_journal_replay()
+{
+    banner("XmlJrnl::ReplayTo / Snapshot");
+
+    const char* path = "/tmp/xmlcls_test_replay.jrnl.xml";
+
+    XmlDoc doc(std::string("<Root><A/><B/><C><Big>payload</Big></C></Root>"));
+    doc.CreateJournal(path);
+    XmlJrnl& jrnl = *doc.JRNL;
+    auto node = [&doc](const char* xpath) { return require_nodes(doc, xpath)[0]; };
+
+    for (auto& element : require_nodes(doc, "//*"))
+        element.JID();
+
+    auto replayed = [&jrnl](std::vector<int> release) {
+        OwnedXmlDoc state = jrnl.ReplayTo(release);
+        return state ? state->XML() : std::string();
+    };
+
+    /*
+     * Three releases of mixed Changes; the live document is the last state.
+     */
+    node("/Root/A").SetAttr("V", "1");
+    node("/Root/B").AddChild("<B1/>");
+    const std::string state1 = doc.XML();
+
+    jrnl.CloseRelease();
+    jrnl.OpenRelease();
+    node("/Root/A").SetAttr("V", "2");
+    node("/Root/C").Delete();
+    const std::string state2 = doc.XML();
+    jrnl.Snapshot();
+    CHECK(!jrnl.err);
+
+    jrnl.CloseRelease();
+    jrnl.OpenRelease();
+    node("/Root/A").parse("<A V=\"3\"><X/></A>");
+    node("/Root/B").AddChild("<B2/>");
+    XmlNode a = node("/Root/A");
+    node("/Root/B/B1").MoveTo(a);
+    const std::string state3 = doc.XML();
+
+    CHECK_EQ(replayed({0, 3}), state3);
+    CHECK_EQ(jrnl.replay_stats.reversed, size_t{0});
+    CHECK(!jrnl.replay_stats.from_snapshot);
+
+    CHECK_EQ(replayed({0, 2}), state2);
+    CHECK(jrnl.replay_stats.from_snapshot);
+    CHECK_EQ(jrnl.replay_stats.reversed, size_t{0});
+
+    CHECK_EQ(replayed({0, 1}), state1);
+    CHECK(jrnl.replay_stats.from_snapshot);
+    CHECK_EQ(jrnl.replay_stats.reversed, size_t{2});
+    CHECK(!jrnl.err);
+    CHECK_EQ(doc.XML(), state3);
+
+    // An unknown release is an error.
+    CHECK(jrnl.ReplayTo({0, 9}) == nullptr);
+    CHECK(jrnl.err);
+    jrnl.err = nullptr;
+
+    /*
+     * Undoing a Change the snapshot includes discards it; later undos do not.
+     */
+    jrnl.Undo();
+    CHECK_EQ(replayed({0, 1}), state1);
+    CHECK(jrnl.replay_stats.from_snapshot);
+
+    auto deletion = jrnl.XPath<std::vector<XmlNode>>("//Release[@Number='2']/Change[@Type='Deletion']");
+    CHECK_EQ(deletion.size(), size_t{1});
+    if (!deletion.empty()) jrnl.Undo(deletion[0]);
+    CHECK(!jrnl.err);
+    CHECK_EQ(replayed({0, 1}), state1);
+    CHECK(!jrnl.replay_stats.from_snapshot);
+    CHECK_EQ(jrnl.replay_stats.reversed, size_t{3});
+    std::remove(path);
+
+    /*
+     * A Change undone after its release closed was applied at the release's
+     * end, and its record cannot give it back.
+     */
+    {
+        XmlDoc audited(std::string("<Root><A/></Root>"));
+        audited.CreateJournal(path);
+        XmlJrnl& log = *audited.JRNL;
+        require_nodes(audited, "/Root/A")[0].SetAttr("V", "1");
+        XmlNode change = log.active_release.XPath<std::vector<XmlNode>>("./Change[last()]")[0];
+        log.CloseRelease();
+        log.OpenRelease();
+        log.Undo(change);
+        CHECK(!log.err);
+
+        CHECK(log.ReplayTo({0, 1}) == nullptr);
+        CHECK(log.err && log.err->level == lvl::ERR);
+        log.err = nullptr;
+        CHECK(log.ReplayTo({0, 2}) != nullptr);
+        CHECK(!log.err);
+    }
+    std::remove(path);
+
+    /*
+     * Automatic snapshots bound the work to the Changes since the nearest one.
+     */
+    {
+        XmlDoc periodic(std::string("<Root><A/><B/></Root>"));
+        periodic.CreateJournal(path);
+        XmlJrnl& log = *periodic.JRNL;
+        log.snapshot_every = 1;
+        for (auto& element : require_nodes(periodic, "//*"))
+            element.JID();
+
+        require_nodes(periodic, "/Root/A")[0].SetAttr("V", "1");
+        require_nodes(periodic, "/Root/A")[0].SetAttr("V", "2");
+        const std::string first = periodic.XML();
+        log.CloseRelease();
+        log.OpenRelease();
+        require_nodes(periodic, "/Root/B")[0].AddChild("<B1/>");
+        require_nodes(periodic, "/Root/B")[0].SetAttr("V", "3");
+        require_nodes(periodic, "/Root/B")[0].SetAttr("V", "4");
+
+        OwnedXmlDoc state = log.ReplayTo({0, 1});
+        CHECK(state != nullptr);
+        if (state) CHECK_EQ(state->XML(), first);
+        CHECK(log.replay_stats.from_snapshot);
+        CHECK_EQ(log.replay_stats.reversed, size_t{1});
+
+        // Over the cap the oldest go; release 0.1 replays from the snapshot
+        // taken with V=5, undoing B1, V=3, and V=4.
+        log.max_snapshots = 2;
+        require_nodes(periodic, "/Root/B")[0].SetAttr("V", "5");
+        require_nodes(periodic, "/Root/B")[0].SetAttr("V", "6");
+        state = log.ReplayTo({0, 1});
+        CHECK(state != nullptr);
+        if (state) CHECK_EQ(state->XML(), first);
+        CHECK(log.replay_stats.from_snapshot);
+        CHECK_EQ(log.replay_stats.reversed, size_t{3});
+    }
+    std::remove(path);
+}
+
+void test_journal_history()
+{
+    banner("XmlJrnl::History");
+
+    const char* path = "/tmp/xmlcls_test_history.jrnl.xml";
+
+    XmlDoc doc(std::string("<Root><A/><B/></Root>"));
+    doc.CreateJournal(path);
+
+    XmlNode a = require_nodes(doc, "/Root/A")[0];
+    a.parse("<A v=\"1\"/>");
+    a.parse("<A v=\"2\"/>");
+    XmlNode c = a.AddChild("<C/>");
+    require_nodes(doc, "/Root/B")[0].parse("<B v=\"1\"/>");
+    CHECK(!doc.JRNL->err);
+
+    /*
+     * History matches a full journal scan, in recording order.
+     */
+    const std::string a_jid = a.JID();
+    auto history = doc.JRNL->History(a_jid);
+    auto scanned = doc.JRNL->XPath<std::vector<XmlNode>>("//Change[@JID='" + a_jid + "']");
+    CHECK_EQ(history.size(), std::size_t{2});
+    CHECK_EQ(history.size(), scanned.size());
+    for (std::size_t i = 0; i < history.size() && i < scanned.size(); ++i)
+        CHECK(history[i].node == scanned[i].node);
+
+    auto c_history = doc.JRNL->History(c.JID());
+    CHECK_EQ(c_history.size(), std::size_t{1});
+    if (!c_history.empty())
+        CHECK_EQ(c_history[0].XPath<std::string>("@Type"), std::string("Add"));
+
+    uint64_t key = 0;
+    CHECK(a.JIDValue(key));
+    CHECK_EQ(doc.JRNL->History(key).size(), std::size_t{2});
+    CHECK(doc.JRNL->History("0000000000000000").empty());
+    CHECK(doc.JRNL->History("not-a-jid").empty());
+
+    /*
+     * Reversed changes remain part of the history.
+     */
+    doc.JRNL->Undo();
+    CHECK(!doc.JRNL->err);
+    CHECK_EQ(doc.JRNL->History(a_jid).size(), std::size_t{2});
+
+    /*
+     * The index is rebuilt when a journal is reopened.
+     */
+    doc.JRNL->Save(path);
+    XmlJrnl reopened(doc, path);
+    CHECK(!reopened.err);
+    CHECK_EQ(reopened.History(a_jid).size(), std::size_t{2});
+    CHECK_EQ(reopened.History(c.JID()).size(), std::size_t{1});
+
+    std::remove(path);
+}
+
+void test_journal_undo_add()
+{
+    banner("ActionAdd::Undo");
+
+    const char* path = "/tmp/xmlcls_test_undo_add.jrnl.xml";
+
+    XmlDoc doc(std::string("<Root><A/></Root>"));
+    doc.CreateJournal(path);
+
+    XmlNode root = doc.XPath<std::vector<XmlNode>>("/Root")[0];
+    XmlNode b = root.AddChild("<B>added</B>");
+
+    CHECK(!b.err);
+    CHECK(!doc.JRNL->err);
+
+    const std::string jid = b.XPath<std::string>("@JID");
+
+    XmlNode change = doc.JRNL->active_release.XPath<std::vector<XmlNode>>("./Change[last()]")[0];
+
+    CHECK_EQ(change.XPath<std::string>("@Type"), std::string("Add"));
+    CHECK_EQ(change.XPath<std::string>("@JID"), jid);
+    CHECK(doc.JRNL->jid_map.at(jid) == b.node);
+
+    doc.JRNL->Undo(change);
+
+    CHECK(!doc.JRNL->err);
+    CHECK_EQ(doc.XPath<int>("count(/Root/B)"), 0);
+    CHECK(doc.JRNL->jid_map.at(jid) == nullptr);
+    CHECK_EQ(change.XPath<std::string>("./Reversed/@Value"), std::string("true"));
+
+    std::remove(path);
+}
+
+void test_journal_releases()
+{
+    banner("XmlJrnl release index");
+
+    const char* wal_path = "/tmp/xmlcls_test_releases.jrnl";
+    const char* source_path = "/tmp/xmlcls_test_releases.xml";
+    std::remove(wal_path);
+    size_t indexed = 0;
+    {
+        XmlDoc doc(std::string("<Root><A/><B/></Root>"));
+        doc.OpenJournalWAL(wal_path);
+        CHECK(doc.JRNL && doc.JRNL->wal);
+        if (!doc.JRNL || !doc.JRNL->wal) return;
+        XmlJrnl& jrnl = *doc.JRNL;
+        XmlNode a = require_nodes(doc, "/Root/A")[0], b = require_nodes(doc, "/Root/B")[0];
+
+        CHECK_EQ(jrnl.releases.size(), size_t{2});
+        const ReleaseInfo* first = jrnl.FindRelease({0, 1});
+        CHECK(first != nullptr);
+        if (!first) return;
+        CHECK(first->close.empty());
+        CHECK(first->node == jrnl.active_release.node);
+
+        a.SetAttr("K", "1");
+        b.SetAttr("K", "1");
+        CHECK_EQ(first->changes, size_t{2});
+
+        /*
+         * Releases open inside the active one and close back to their parent.
+         */
+        jrnl.CloseRelease();
+        CHECK(jrnl.rel_no == (std::vector<int>{0}));
+        CHECK(!first->close.empty());
+        jrnl.OpenRelease();
+        CHECK(jrnl.rel_no == (std::vector<int>{0, 2}));
+        jrnl.OpenRelease();
+        CHECK(jrnl.rel_no == (std::vector<int>{0, 2, 1}));
+        a.SetAttr("K", "2");
+        jrnl.CloseRelease();
+        CHECK(jrnl.rel_no == (std::vector<int>{0, 2}));
+
+        // A Transaction counts once, and releases stay put while it is open.
+        jrnl.BeginTransaction();
+        a.SetAttr("K", "3");
+        b.SetAttr("K", "3");
+        jrnl.OpenRelease();
+        CHECK(jrnl.err);
+        jrnl.err = nullptr;
+        jrnl.CloseRelease();
+        CHECK(jrnl.err);
+        jrnl.err = nullptr;
+        jrnl.Commit();
+        CHECK(!jrnl.err);
+
+        const ReleaseInfo* second = jrnl.FindRelease({0, 2});
+        const ReleaseInfo* nested = jrnl.FindRelease({0, 2, 1});
+        CHECK(second && nested);
+        if (!second || !nested) return;
+        CHECK_EQ(second->changes, size_t{1});
+        CHECK_EQ(nested->changes, size_t{1});
+        CHECK(nested->parent == second);
+        CHECK_EQ(second->children.size(), size_t{1});
+
+        auto changes = jrnl.ReleaseChanges({0, 2});
+        CHECK_EQ(changes.size(), size_t{1});
+        if (!changes.empty()) CHECK_EQ(changes[0].XPath<std::string>("string(@Type)"), std::string("Transaction"));
+        CHECK_EQ(jrnl.ReleaseChanges({0, 1}).size(), size_t{2});
+        jrnl.ReleaseChanges({0, 9});
+        CHECK(jrnl.err);
+        jrnl.err = nullptr;
+
+        jrnl.CloseRelease();
+        CHECK(jrnl.rel_no == (std::vector<int>{0}));
+        jrnl.CloseRelease();
+        CHECK(jrnl.err);
+        jrnl.err = nullptr;
+        jrnl.OpenRelease();
+        CHECK(jrnl.rel_no == (std::vector<int>{0, 3}));
+        CHECK(!jrnl.err);
+        indexed = jrnl.releases.size();
+        doc.Save(source_path);
+    }
+
+    /*
+     * Closes are logged, so reopening rebuilds the same release tree.
+     */
+    {
+        XmlDoc again(source_path);
+        again.OpenJournalWAL(wal_path);
+        CHECK(again.JRNL != nullptr);
+        if (!again.JRNL) return;
+        XmlJrnl& jrnl = *again.JRNL;
+        CHECK(!jrnl.err);
+        CHECK(jrnl.rel_no == (std::vector<int>{0, 3}));
+        CHECK_EQ(jrnl.releases.size(), indexed);
+        const ReleaseInfo* nested = jrnl.FindRelease({0, 2, 1});
+        CHECK(nested && !nested->close.empty());
+        if (jrnl.FindRelease({0, 2})) CHECK_EQ(jrnl.FindRelease({0, 2})->changes, size_t{1});
+        CHECK_EQ(jrnl.XPath<int>("count(//Release[@Close=''])"), 2);
+
+        jrnl.Compact();
+        CHECK(!jrnl.err);
+        CHECK(jrnl.rel_no == (std::vector<int>{0, 3}));
+        indexed = jrnl.releases.size();
+    }
+    {
+        XmlDoc third(source_path);
+        third.OpenJournalWAL(wal_path);
+        CHECK(third.JRNL && !third.JRNL->err);
+        if (third.JRNL) {
+            CHECK(third.JRNL->rel_no == (std::vector<int>{0, 3}));
+            CHECK_EQ(third.JRNL->releases.size(), indexed);
+            CHECK_EQ(third.JRNL->XPath<int>("count(//Release[@Close=''])"), 2);
+        }
+    }
+    std::remove(wal_path);
+    std::remove(source_path);
+}
+
+void test_journal_undo_release()
+{
+    banner("XmlJrnl::UndoRelease");
+
+    const char* path = "/tmp/xmlcls_test_undo_release.jrnl.xml";
+
+    XmlDoc doc(std::string("<Root><A/><B/><C><C1/></C><D>text</D></Root>"));
+    doc.CreateJournal(path);
+    XmlJrnl& jrnl = *doc.JRNL;
+    auto node = [&doc](const char* xpath) { return require_nodes(doc, xpath)[0]; };
+    for (auto& element : require_nodes(doc, "//*"))
+        element.JID();
+
+    node("/Root/A").SetAttr("V", "0");
+    const std::string state1 = doc.XML();
+
+    /*
+     * Release 0.2 mixes in-place edits, an Add, a Deletion, a Transaction,
+     * and a nested release; undoing it restores the end of Release 0.1.
+     */
+    jrnl.CloseRelease();
+    jrnl.OpenRelease();
+    node("/Root/A").SetAttr("V", "1");
+    node("/Root/B").AddChild("<B1/>");
+    node("/Root/C").Delete();
+    jrnl.BeginTransaction();
+    node("/Root/D").SetAttr("K", "x");
+    node("/Root/D").SetText("changed");
+    jrnl.Commit();
+    jrnl.OpenRelease();
+    node("/Root/A").SetAttr("V", "2");
+    node("/Root/B/B1").SetAttr("N", "1");
+    jrnl.CloseRelease();
+    jrnl.CloseRelease();
+    jrnl.OpenRelease();
+    CHECK(jrnl.rel_no == (std::vector<int>{0, 3}));
+    CHECK(!jrnl.err);
+
+    jrnl.UndoRelease({0, 2});
+    CHECK(!jrnl.err);
+    CHECK_EQ(jrnl.release_undo.changes, size_t{6});
+    CHECK(jrnl.release_undo.groups >= 1 && jrnl.release_undo.groups < jrnl.release_undo.changes);
+    CHECK(jrnl.release_undo.conflicts.empty());
+    CHECK_EQ(doc.XML(), state1);
+    CHECK_EQ(jrnl.XPath<int>("count(/JRNL/Release/Release[@Number='2']//Change[Reversed/@Value='false'])"), 0);
+
+    // Nothing is left to undo; an unknown release or an open transaction is refused.
+    jrnl.UndoRelease({0, 2});
+    CHECK(!jrnl.err);
+    CHECK_EQ(jrnl.release_undo.changes, size_t{0});
+    jrnl.UndoRelease({0, 7});
+    CHECK(jrnl.err && jrnl.err->level == lvl::ERR);
+    jrnl.err = nullptr;
+    jrnl.BeginTransaction();
+    jrnl.UndoRelease({0, 1});
+    CHECK(jrnl.err);
+    jrnl.err = nullptr;
+    jrnl.Rollback();
+    std::remove(path);
+
+    /*
+     * Every conflict is reported up front and nothing is changed.
+     */
+    XmlDoc other(std::string("<Root><A/><B/><C><C1/></C></Root>"));
+    other.CreateJournal(path);
+    XmlJrnl& log = *other.JRNL;
+    auto at = [&other](const char* xpath) { return require_nodes(other, xpath)[0]; };
+    for (auto& element : require_nodes(other, "//*"))
+        element.JID();
+    const std::string original = other.XML();
+
+    at("/Root/A").SetAttr("V", "1");
+    at("/Root/B").AddChild("<B1/>");
+    at("/Root/C/C1").SetAttr("W", "1");
+    log.CloseRelease();
+    log.OpenRelease();
+    at("/Root/A").SetAttr("V", "2");
+    at("/Root/B/B1").SetAttr("N", "1");
+    at("/Root/C").Delete();
+    const std::string blocked = other.XML();
+
+    log.UndoRelease({0, 1});
+    CHECK(log.err && log.err->level == lvl::INFO);
+    log.err = nullptr;
+    CHECK_EQ(log.release_undo.conflicts.size(), size_t{3});
+    CHECK_EQ(other.XML(), blocked);
+    CHECK_EQ(log.XPath<int>("count(//Change[Reversed/@Value='true'])"), 0);
+    for (const ReleaseConflict& conflict : log.release_undo.conflicts) {
+        CHECK(conflict.change.node != nullptr);
+        CHECK(conflict.cause.node != nullptr);
+        CHECK(!conflict.reason.empty());
+    }
+    if (log.release_undo.conflicts.size() == 3)
+        CHECK(log.release_undo.conflicts[2].reason.find("no longer available") != std::string::npos);
+
+    // Undoing the later release first clears the way.
+    log.UndoRelease({0, 2});
+    CHECK(!log.err);
+    log.UndoRelease({0, 1});
+    CHECK(!log.err);
+    CHECK_EQ(other.XML(), original);
+    std::remove(path);
+
+    /*
+     * A node whose ancestor is gone blocks the release even when a newer
+     * Change in it restores some other node, and a release that still
+     * fails part way is put back whole, with nothing logged.
+     */
+    const char* wal_path = "/tmp/xmlcls_test_undo_release.jrnl";
+    std::remove(wal_path);
+    {
+        XmlDoc tree(std::string("<Root><P><C/></P><Z><Z1/></Z><X/><A/></Root>"));
+        tree.OpenJournalWAL(wal_path);
+        CHECK(tree.JRNL && tree.JRNL->wal);
+        if (!tree.JRNL || !tree.JRNL->wal) return;
+        XmlJrnl& wal_log = *tree.JRNL;
+        auto in = [&tree](const char* xpath) { return require_nodes(tree, xpath)[0]; };
+        for (auto& element : require_nodes(tree, "//*"))
+            element.JID();
+
+        wal_log.CloseRelease();
+        wal_log.OpenRelease();
+        in("/Root/P/C").SetAttr("K", "1");
+        in("/Root/Z").parse(std::string("<Z><Z2/></Z>"));
+        wal_log.CloseRelease();
+        wal_log.OpenRelease();
+        in("/Root/P").Delete();
+        const std::string deleted = tree.XML();
+
+        wal_log.UndoRelease({0, 2});
+        CHECK(wal_log.err && wal_log.err->level == lvl::INFO);
+        wal_log.err = nullptr;
+        CHECK_EQ(wal_log.release_undo.conflicts.size(), size_t{1});
+        CHECK_EQ(tree.XML(), deleted);
+        CHECK_EQ(wal_log.XPath<int>("count(//Change[Reversed/@Value='true'])"), 0);
+
+        wal_log.CloseRelease();
+        wal_log.OpenRelease();
+        const std::string before = tree.XML();
+        in("/Root/X").Delete();
+        in("/Root/A").SetAttr("K", "1");
+        XmlNode payload = wal_log.active_release.XPath<std::vector<XmlNode>>("./Change[@Type='Deletion']/Node")[0];
+        xmlSetProp(payload.node, BAD_CAST "Encoding", BAD_CAST "Damaged");
+        const std::string changed = tree.XML();
+        const uint64_t records = wal_log.wal->records;
+
+        wal_log.UndoRelease({0, 4});
+        CHECK(wal_log.err);
+        wal_log.err = nullptr;
+        CHECK_EQ(tree.XML(), changed);
+        CHECK_EQ(wal_log.XPath<int>("count(//Change[Reversed/@Value='true'])"), 0);
+        CHECK_EQ(wal_log.wal->records, records);
+
+        xmlSetProp(payload.node, BAD_CAST "Encoding", BAD_CAST "Base64");
+        wal_log.UndoRelease({0, 4});
+        CHECK(!wal_log.err);
+        CHECK_EQ(tree.XML(), before);
+        CHECK_EQ(wal_log.wal->records, records + 2);
+    }
+    std::remove(wal_path);
+
+    /*
+     * parse() drops the JIDs of the subtree it replaces: a Change to a node
+     * inside it is blocked, and a rollback brings the node back first.
+     */
+    {
+        XmlDoc tree(std::string("<Root><C><C1/></C></Root>"));
+        tree.CreateJournal(path);
+        XmlJrnl& parsed = *tree.JRNL;
+        auto in = [&tree](const char* xpath) { return require_nodes(tree, xpath)[0]; };
+        for (auto& element : require_nodes(tree, "//*"))
+            element.JID();
+        const std::string plain = tree.XML();
+
+        in("/Root/C/C1").SetAttr("W", "1");
+        parsed.CloseRelease();
+        parsed.OpenRelease();
+        in("/Root/C").parse(std::string("<C><C1/></C>"));
+        const std::string replaced = tree.XML();
+
+        parsed.UndoRelease({0, 1});
+        CHECK(parsed.err && parsed.err->level == lvl::INFO);
+        parsed.err = nullptr;
+        CHECK_EQ(parsed.release_undo.conflicts.size(), size_t{1});
+        CHECK_EQ(tree.XML(), replaced);
+
+        parsed.Undo();   // the parse()
+        CHECK(!parsed.err);
+        parsed.UndoRelease({0, 1});
+        CHECK(!parsed.err);
+        CHECK_EQ(tree.XML(), plain);
+
+        parsed.BeginTransaction();
+        in("/Root/C/C1").SetAttr("W", "2");
+        in("/Root/C").parse(std::string("<C><C1/></C>"));
+        parsed.Rollback();
+        CHECK(!parsed.err);
+        CHECK_EQ(tree.XML(), plain);
+    }
+    std::remove(path);
+}
+
+void test_journal_timeline()
+{
+    banner("XmlJrnl Seq/TimeNs index");
+
+    const char* path = "/tmp/xmlcls_test_timeline.jrnl.xml";
+
+    XmlDoc doc(std::string("<Root><A/><B/></Root>"));
+    doc.CreateJournal(path);
+    XmlJrnl& jrnl = *doc.JRNL;
+    XmlNode a = require_nodes(doc, "/Root/A")[0], b = require_nodes(doc, "/Root/B")[0];
+    CHECK_EQ(jrnl.LastSeq(), uint64_t{0});
+
+    auto time_ns = [](XmlNode change) {
+        return std::strtoll(change.XPath<std::string>("string(@TimeNs)").c_str(), nullptr, 10);
+    };
+
+    for (int i = 1; i <= 4; ++i) {
+        a.SetAttr("V", i);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    CHECK_EQ(jrnl.LastSeq(), uint64_t{4});
+
+    auto all = jrnl.ChangesSince(0);
+    CHECK_EQ(all.size(), size_t{4});
+    if (all.size() != 4) return;
+    for (size_t i = 0; i < all.size(); ++i)
+        CHECK_EQ(all[i].XPath<std::string>("string(@Seq)"), std::to_string(i + 1));
+    CHECK(time_ns(all[0]) < time_ns(all[1]) && time_ns(all[2]) < time_ns(all[3]));
+
+    /*
+     * Sequence and time windows are half-open binary searches.
+     */
+    auto since = jrnl.ChangesSince(2);
+    CHECK_EQ(since.size(), size_t{2});
+    if (since.size() == 2) CHECK(since[0].node == all[2].node);
+    CHECK(jrnl.ChangesSince(4).empty());
+
+    auto window = jrnl.ChangesBetween(time_ns(all[1]), time_ns(all[3]));
+    CHECK_EQ(window.size(), size_t{2});
+    if (window.size() == 2) CHECK(window[0].node == all[1].node && window[1].node == all[2].node);
+    CHECK(jrnl.ChangesBetween(time_ns(all[3]) + 1, INT64_MAX).empty());
+    CHECK(jrnl.ChangesBetween(time_ns(all[3]), time_ns(all[0])).empty());
+
+    // A Transaction is one entry; a rolled-back one leaves none, and undo keeps entries.
+    jrnl.BeginTransaction();
+    a.SetAttr("V", 5);
+    b.SetAttr("V", 5);
+    jrnl.Commit();
+    jrnl.BeginTransaction();
+    b.SetAttr("V", 6);
+    jrnl.Rollback();
+    b.SetAttr("W", 1);
+    jrnl.Undo();
+    CHECK(!jrnl.err);
+    since = jrnl.ChangesSince(4);
+    CHECK_EQ(since.size(), size_t{2});
+    if (since.size() == 2) {
+        CHECK_EQ(since[0].XPath<std::string>("string(@Type)"), std::string("Transaction"));
+        CHECK_EQ(since[0].XPath<std::string>("string(@Seq)"), std::string("5"));
+        CHECK_EQ(since[1].XPath<std::string>("string(@Seq)"), std::string("10"));
+    }
+    CHECK_EQ(jrnl.LastSeq(), uint64_t{10});
+
+    /*
+     * A reopened journal rebuilds the index and numbers on from the last Seq.
+     * Changes recorded without Seq are numbered in document order and timed
+     * from their TimeStamp.
+     */
+    xmlNodePtr first = all[0].node;
+    xmlUnsetProp(first, BAD_CAST "Seq");
+    xmlUnsetProp(first, BAD_CAST "TimeNs");
+    xmlSetProp(first, BAD_CAST "TimeStamp", BAD_CAST "2020-01-01T00:00:01Z");
+    jrnl.Save(path);
+    {
+        XmlJrnl reopened(doc, path);
+        CHECK(!reopened.err);
+        CHECK_EQ(reopened.LastSeq(), uint64_t{10});
+        CHECK_EQ(reopened.ChangesSince(0).size(), size_t{6});
+        auto early = reopened.ChangesBetween(0, int64_t(1577836802) * 1000000000);
+        CHECK_EQ(early.size(), size_t{1});
+        CHECK_EQ(reopened.ChangesSince(9).size(), size_t{1});
+    }
+    std::remove(path);
+}
+
+void test_journal_writer()
+{
+    banner("XmlJrnl concurrent recording");
+
+    const char* path = "/tmp/xmlcls_test_writer.jrnl.xml";
+    const int threads = 4, edits = 50;
+
+    std::string xml = "<Root>";
+    for (int t = 0; t < threads; ++t)
+        xml += "<S" + std::to_string(t) + " V=\"0\"><E V=\"0\">x</E><Gone/></S" + std::to_string(t) + ">";
+    xml += "</Root>";
+
+    XmlDoc doc(xml);
+    doc.CreateJournal(path);
+    XmlJrnl& jrnl = *doc.JRNL;
+
+    // Every element gets its JID up front.
+    jrnl.StartWriter();
+    CHECK(!jrnl.err);
+    CHECK(jrnl.Concurrent());
+    CHECK_EQ(doc.XPath<double>("count(//*[not(@JID)])"), 0.0);
+    const std::string original = doc.XML();
+
+    // Transactions are refused while the writer runs.
+    jrnl.BeginTransaction();
+    CHECK(jrnl.err && !jrnl.InTransaction());
+    jrnl.err = nullptr;
+
+    // XPath contexts are per document, so the nodes are found beforehand.
+    std::vector<XmlNode> subtrees = require_nodes(doc, "/Root/*");
+    std::vector<XmlNode> texts = require_nodes(doc, "/Root/*/E");
+    std::vector<XmlNode> doomed = require_nodes(doc, "/Root/*/Gone");
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t)
+        workers.emplace_back([&, t] {
+            XmlNode subtree = subtrees[t], e = texts[t], gone = doomed[t];
+            for (int i = 1; i <= edits; ++i) {
+                subtree.SetAttr("V", i);
+                if (i % 5 == 0) e.SetText(std::to_string(i));
+            }
+            gone.Delete();
+        });
+    for (auto& worker : workers) worker.join();
+
+    jrnl.Flush();
+    CHECK(!jrnl.err);
+
+    /*
+     * Every Change is in the journal once, in Seq order, and each thread's
+     * own changes keep the order it made them in.
+     */
+    const size_t per_thread = edits + edits / 5 + 1;
+    auto all = jrnl.ChangesSince(0);
+    CHECK_EQ(all.size(), threads * per_thread);
+    CHECK_EQ(jrnl.LastSeq(), uint64_t(threads * per_thread));
+    CHECK_EQ(jrnl.XPath<double>("count(//Release/Change)"), double(threads * per_thread));
+    bool ordered = true;
+    for (size_t i = 0; i < all.size(); ++i)
+        ordered = ordered && all[i].XPath<std::string>("string(@Seq)") == std::to_string(i + 1);
+    CHECK(ordered);
+    CHECK_EQ(jrnl.FindRelease(jrnl.rel_no)->changes, threads * per_thread);
+
+    XmlNode s0 = require_nodes(doc, "/Root/S0")[0];
+    auto history = jrnl.History(s0.JID());
+    CHECK_EQ(history.size(), size_t(edits));
+    bool in_order = true;
+    for (size_t i = 1; i < history.size(); ++i)
+        in_order = in_order && history[i - 1].XPath<double>("number(@Seq)") < history[i].XPath<double>("number(@Seq)");
+    CHECK(in_order);
+    CHECK_EQ(s0.XPath<std::string>("string(@V)"), std::to_string(edits));
+
+    // Undo runs newest first across all threads and restores the original.
+    for (size_t i = 0; i < all.size() && !jrnl.err; ++i) jrnl.Undo();
+    CHECK(!jrnl.err);
+    CHECK_EQ(doc.XML(), original);
+
+    /*
+     * Stopping the writer returns to sequential recording.
+     */
+    jrnl.StopWriter();
+    CHECK(!jrnl.Concurrent());
+    s0.SetAttr("V", "after");
+    CHECK_EQ(jrnl.LastSeq(), uint64_t(threads * per_thread + 1));
+    CHECK_EQ(jrnl.ChangesSince(threads * per_thread).size(), size_t{1});
+    jrnl.BeginTransaction();
+    CHECK(!jrnl.err && jrnl.InTransaction());
+    jrnl.Rollback();
+
+    /*
+     * Sequential JIDs: the writer persists NextJID for blocks reserved by
+     * the recording threads, and each reservation reaches the journal.
+     */
+    const char* seq_path = "/tmp/xmlcls_test_writer_seq.jrnl.xml";
+    {
+        XmlDoc seq(xml);
+        seq.CreateJournal(seq_path);
+        XmlJrnl& sj = *seq.JRNL;
+        sj.jid_block = 2;
+        sj.UseSequentialJIDs();
+        sj.StartWriter();
+        CHECK(!sj.err);
+
+        std::vector<XmlNode> parents = require_nodes(seq, "/Root/*");
+        std::vector<std::thread> adders;
+        for (int t = 0; t < threads; ++t)
+            adders.emplace_back([&, t] {
+                XmlNode parent = parents[t];
+                for (int i = 0; i < 10; ++i) parent.AddChild("<N/>");
+            });
+        for (auto& adder : adders) adder.join();
+
+        sj.Flush();
+        CHECK(!sj.err);
+        CHECK_EQ(seq.XPath<double>("count(//N[@JID])"), double(threads * 10));
+
+        std::string next = sj.XPath<std::string>("string(/JRNL/@NextJID)");
+        std::string highest;
+        for (XmlNode& n : require_nodes(seq, "//*[@JID]"))
+            highest = std::max(highest, n.XPath<std::string>("string(@JID)"));
+        CHECK(!next.empty() && highest < next);
+        sj.StopWriter();
+    }
+    std::remove(seq_path);
 
     std::remove(path);
 }
@@ -955,6 +3398,15 @@ int main()
     test_parse_replace_node();
     test_delete_node();
     test_save_and_reload();
+    test_save_async();
+    test_dirty_tracking();
+    test_autosave();
+    test_merkle_hash_and_diff();
+    test_c14n_and_digest();
+    test_parallel_xml();
+    test_jid_index();
+    test_jid_cache();
+    test_build_jid_map();
     test_xmljrnl_constructor_and_active_release();
     test_journal_log_modify_jid();
     test_journal_aware_mutations();
@@ -966,6 +3418,21 @@ int main()
     test_journal_undo_delete_only_child();
     test_journal_undo_delete_parent_conflict();
     test_journal_undo_add();
+    test_journal_history();
+    test_journal_undo_stack();
+    test_journal_wal();
+    test_journal_compressed_payloads();
+    test_journal_modify_delta();
+    test_journal_set_attr_text();
+    test_journal_move();
+    test_journal_sequential_jids();
+    test_journal_transaction();
+    test_journal_compact();
+    test_journal_replay();
+    test_journal_releases();
+    test_journal_undo_release();
+    test_journal_timeline();
+    test_journal_writer();
 
     xmlCleanupParser();
 